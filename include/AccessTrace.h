@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Types.h"
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace motioncam {
+
+// Traces of what applications ask a mount for, so their access patterns can be replayed
+// against VirtualFileSystemImpl_MCRAW outside a live session. The file starts with a header
+// holding the render options of the mount, followed by records in little endian: paths are
+// written once and referred to by id, accesses are a fixed 38 bytes.
+
+enum class TraceOp : uint8_t {
+    Read = 0,
+    GetAttr = 1,    // Metadata of a file, getattr/lookup or ProjFS placeholder info
+};
+
+struct TraceRecord {
+    TraceOp op = TraceOp::Read;
+    uint64_t timeUs = 0;    // When the request came in, since the trace started
+    uint32_t latencyUs = 0; // Until it was replied to
+    uint32_t thread = 0;    // Small id of the thread that made the request
+    std::string path;
+    uint64_t offset = 0;
+    uint32_t length = 0;
+    int32_t result = 0;     // Bytes read, or negative on error
+};
+
+class TraceWriter {
+public:
+    // A request that has not been replied to yet
+    struct Event {
+        TraceOp op;
+        std::string path;
+        uint64_t offset;
+        uint32_t length;
+        uint64_t startUs;
+        uint32_t thread;
+    };
+
+    // Throws if the file can't be created
+    TraceWriter(const std::string& path, FileRenderOptions options, int draftScale);
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    // Call when the request comes in, on the thread that got it
+    Event begin(TraceOp op, const std::string& path, uint64_t offset = 0, uint32_t length = 0);
+
+    // Call when the request is replied to, from any thread
+    void end(const Event& event, int32_t result);
+
+private:
+    void flush();
+
+private:
+    const std::chrono::steady_clock::time_point mStart;
+    std::mutex mMutex;
+    std::ofstream mFile;
+    std::vector<char> mBuffer;
+    std::unordered_map<std::string, uint32_t> mPaths;
+    std::unordered_map<std::thread::id, uint32_t> mThreads;
+};
+
+class TraceReader {
+public:
+    // Throws if the file can't be read or isn't a trace
+    explicit TraceReader(const std::string& path);
+
+    FileRenderOptions options() const { return mOptions; }
+    int draftScale() const { return mDraftScale; }
+
+    // Returns false at the end of the trace. Throws if the trace is corrupt
+    bool next(TraceRecord& record);
+
+private:
+    std::ifstream mFile;
+    FileRenderOptions mOptions;
+    int mDraftScale;
+    std::vector<std::string> mPaths;
+};
+
+// Traces are opt-in: when MOTIONCAM_FS_TRACE_DIR is set, mounts write a trace named after the
+// clip to that folder. Returns nullptr when tracing is off or the trace can't be created
+std::unique_ptr<TraceWriter> createTrace(const std::string& name, FileRenderOptions options, int draftScale);
+
+} // namespace motioncam
@@ -1,22 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
-#include <memory>
-#include <bw64/bw64.hpp>
-
-namespace bw64 {
-    class Bw64Writer;
-}
 
 namespace motioncam {
-    class AudioWriter {
-    public:
-        AudioWriter(std::vector<uint8_t>& output, int numChannels, int sampleRate, int fpsNum, int fpsDen);
-
-        void write(const std::vector<int16_t>& data, int numFrames);
-        
-    private:
-        const int mFd;
-        std::unique_ptr<bw64::Bw64Writer> mWriter;
-    };
+    // Everything in front of the samples of a 16 bit PCM BW64 file holding numFrames frames.
+    // The samples follow the header directly, so the file can be served without building it
+    std::vector<uint8_t> getAudioHeader(int numChannels, int sampleRate, int fpsNum, int fpsDen, uint64_t numFrames);
 }
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+namespace motioncam {
+namespace bitpacking {
+
+enum class SimdLevel {
+    None,
+    SSE41,
+    AVX2,
+    NEON
+};
+
+// The best SIMD version of the packers the CPU supports, the one pack() uses
+SimdLevel getSimdLevel();
+
+// Pixels and bytes in each group the packers write, rows are padded to whole groups
+std::pair<uint32_t, uint32_t> getPackedGroup(unsigned short encodeBits);
+
+// Packs 16 bit pixels into encodeBits per pixel, most significant bit first. The source
+// rows must be padded to a whole number of groups. Uses SIMD when the CPU supports it.
+void pack(const uint16_t* src, uint8_t* dst, uint32_t width, uint32_t height, unsigned short encodeBits);
+
+// Same as pack() with the given SIMD version, which must be supported by the CPU. Depths the
+// version doesn't handle are packed by packScalar(). Lets tests check each version
+void pack(const uint16_t* src, uint8_t* dst, uint32_t width, uint32_t height, unsigned short encodeBits, SimdLevel level);
+
+// Plain C++ version of pack(), the fallback and the reference for the SIMD versions
+void packScalar(const uint16_t* src, uint8_t* dst, uint32_t width, uint32_t height, unsigned short encodeBits);
+
+} // namespace bitpacking
+} // namespace motioncam
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace motioncam {
+
+// Keeps the memory of released buffers around for the next buffer of about the same size,
+// frames of a clip all have the same few sizes, so most of them end up reusing memory that is
+// already mapped instead of going back to the allocator. Buffers are handed out as shared
+// pointers that return to the pool when the last reference goes, wherever that happens, e.g.
+// when the cache evicts a frame. Buffers that outlive the pool are freed as usual.
+template<typename T>
+class BufferPool {
+public:
+    using Buffer = std::shared_ptr<std::vector<T>>;
+
+    // Keeps at most maxBytes of released buffers
+    explicit BufferPool(size_t maxBytes) : mState(std::make_shared<State>(maxBytes)) {}
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Returns a buffer of size elements, value initialised like a new vector
+    Buffer get(size_t size) {
+        auto buffer = getEmpty(size);
+        buffer->resize(size);
+
+        return buffer;
+    }
+
+    // Returns an empty buffer that holds at least capacity elements before it has to grow
+    Buffer getEmpty(size_t capacity) {
+        const size_t sizeClass = getSizeClass(capacity, true);
+
+        std::unique_ptr<std::vector<T>> buffer = mState->take(sizeClass);
+
+        if(!buffer) {
+            buffer = std::make_unique<std::vector<T>>();
+            buffer->reserve(sizeClass);
+        }
+
+        return Buffer(buffer.release(), [state = std::weak_ptr<State>(mState)](std::vector<T>* released) {
+            std::unique_ptr<std::vector<T>> owned(released);
+
+            if(auto pool = state.lock())
+                pool->recycle(std::move(owned));
+        });
+    }
+
+    // Bytes held by released buffers
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+
+        return mState->bytes;
+    }
+
+private:
+    // Small buffers are cheap to allocate and not worth keeping
+    static constexpr size_t MIN_POOLED_BYTES = 64 * 1024;
+
+    // Sizes are rounded up to one of eight steps between powers of two, so a buffer is at
+    // most an eighth larger than asked for. Rounds down for released buffers, so a buffer
+    // only goes back to a class it is large enough for.
+    static size_t getSizeClass(size_t size, bool roundUp) {
+        if(size * sizeof(T) < MIN_POOLED_BYTES)
+            return size;
+
+        int bits = 0;
+        while((size >> bits) > 1)
+            ++bits;
+
+        const size_t step = static_cast<size_t>(1) << (bits - 3);
+
+        return roundUp ? (size + step - 1) / step * step : size / step * step;
+    }
+
+    struct State {
+        explicit State(size_t maxBytes) : maxBytes(maxBytes), bytes(0) {}
+
+        std::unique_ptr<std::vector<T>> take(size_t sizeClass) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto it = buffers.find(sizeClass);
+            if(it == buffers.end() || it->second.empty())
+                return nullptr;
+
+            auto buffer = std::move(it->second.back());
+            it->second.pop_back();
+
+            bytes -= buffer->capacity() * sizeof(T);
+
+            return buffer;
+        }
+
+        void recycle(std::unique_ptr<std::vector<T>> buffer) {
+            const size_t bufferBytes = buffer->capacity() * sizeof(T);
+
+            if(bufferBytes < MIN_POOLED_BYTES)
+                return;
+
+            buffer->clear();
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if(bytes + bufferBytes > maxBytes)
+                return;
+
+            buffers[getSizeClass(buffer->capacity(), false)].push_back(std::move(buffer));
+            bytes += bufferBytes;
+        }
+
+        const size_t maxBytes;
+        size_t bytes;
+        std::unordered_map<size_t, std::vector<std::unique_ptr<std::vector<T>>>> buffers; // By size class
+        mutable std::mutex mutex;
+    };
+
+    std::shared_ptr<State> mState;
+};
+
+} // namespace motioncam
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <nlohmann/json.hpp>
+#include <memory>
 #include <vector>
 #include <string>
 #include <array>
@@ -15,6 +16,9 @@ enum class ScreenOrientation : int {
     INVALID
 };
 
+// Gains of each of the 4 channels, lensShadingMapHeight x lensShadingMapWidth
+using LensShadingMap = std::vector<std::vector<float>>;
+
 struct CameraFrameMetadata {
     std::array<float, 3> asShotNeutral;
     int compressionType;
@@ -27,7 +31,7 @@ struct CameraFrameMetadata {
     bool isBinned;
     bool isCompressed;
     int iso;
-    std::vector<std::vector<float>> lensShadingMap;
+    std::shared_ptr<const LensShadingMap> lensShadingMap;   // Null when the frame has none
     int lensShadingMapHeight;
     int lensShadingMapWidth;
     bool needRemosaic;
@@ -46,6 +50,10 @@ struct CameraFrameMetadata {
     static CameraFrameMetadata parse(const std::string& jsonString);
     static CameraFrameMetadata parse(const nlohmann::json& j);
     static CameraFrameMetadata limitedParse(const nlohmann::json& j);
+
+    // Only the fields DNGs are rendered from. Reuses previousShadingMap if the frame's map is the
+    // same, which it usually is from one frame to the next
+    static CameraFrameMetadata renderParse(const nlohmann::json& j, const std::shared_ptr<const LensShadingMap>& previousShadingMap);
 };
 
 }
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace motioncam {
+
+// Lets whoever asked for some work tell the code doing it that they have gone away, e.g. a
+// read that the OS cancelled. Shared between the two sides with a std::shared_ptr.
+class CancellationToken {
+public:
+    CancellationToken() : mCancelled(false) {}
+
+    CancellationToken(const CancellationToken&) = delete;
+    CancellationToken& operator=(const CancellationToken&) = delete;
+
+    void cancel() {
+        std::vector<std::function<void()>> callbacks;
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            if(mCancelled)
+                return;
+
+            mCancelled = true;
+            callbacks.swap(mCallbacks);
+        }
+
+        // The callbacks may drop the last reference to the token, so leave the members alone
+        for(const auto& callback : callbacks)
+            callback();
+    }
+
+    bool isCancelled() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        return mCancelled;
+    }
+
+    // Calls callback once when the token is cancelled, straight away if it already is
+    void onCancel(std::function<void()> callback) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            if(!mCancelled) {
+                mCallbacks.push_back(std::move(callback));
+                return;
+            }
+        }
+
+        callback();
+    }
+
+private:
+    mutable std::mutex mMutex;
+    bool mCancelled;
+    std::vector<std::function<void()>> mCallbacks;
+};
+
+} // namespace motioncam
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Types.h"
+
+namespace motioncam {
+
+// Everything we learn about a clip at mount time, kept in a sidecar file so that
+// mounting the same clip again doesn't have to scan it. The index is tied to the
+// size and modification time of the source file and ignored when they change.
+class ClipIndex {
+public:
+    ClipIndex(const std::string& indexPath, const std::string& srcPath);
+
+    // Loads the index from disk, returns false if there is none or it is out of date
+    bool load();
+
+    // Writes the index to disk, errors are logged and otherwise ignored
+    void save();
+
+    void setClip(
+        const std::vector<int64_t>& frames,
+        float medianFrameRate,
+        float averageFrameRate,
+        const nlohmann::json& containerMetadata,
+        const nlohmann::json& firstFrameMetadata);
+
+    // Sorted frame timestamps
+    const std::vector<int64_t>& getFrames() const { return mFrames; }
+    float getMedianFrameRate() const { return mMedianFrameRate; }
+    float getAverageFrameRate() const { return mAverageFrameRate; }
+    const nlohmann::json& getContainerMetadata() const { return mContainerMetadata; }
+    const nlohmann::json& getFirstFrameMetadata() const { return mFirstFrameMetadata; }
+
+    std::optional<double> getBaselineExposure() const;
+    void setBaselineExposure(double value);
+
+    std::optional<DngLayout> getDngLayout(const RenderSettings& settings) const;
+    void setDngLayout(const RenderSettings& settings, const DngLayout& layout);
+
+    std::optional<AudioTrack> getAudioTrack() const;
+    void setAudioTrack(const AudioTrack& track);
+
+    // Where the samples of the audio track are kept, as 16 bit PCM
+    std::string getAudioPath() const;
+
+private:
+    const std::string mIndexPath;
+    const std::string mSrcPath;
+    std::vector<int64_t> mFrames;
+    float mMedianFrameRate;
+    float mAverageFrameRate;
+    nlohmann::json mContainerMetadata;
+    nlohmann::json mFirstFrameMetadata;
+    std::optional<double> mBaselineExposure;
+    std::map<std::string, DngLayout> mDngLayouts;
+    std::optional<AudioTrack> mAudioTrack;
+    mutable std::mutex mMutex;
+};
+
+} // namespace motioncam
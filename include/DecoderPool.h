@@ -0,0 +1,57 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace motioncam {
+
+class Decoder;
+
+// Decoders of one clip, shared by every thread that reads it. A decoder is not thread safe, so
+// each one is lent to a single thread at a time and returned to the pool when the lease goes
+// away. The pool only opens a decoder when all the others are in use, so it holds at most as
+// many as there were concurrent readers, and closes them all when the last reference to it goes.
+class DecoderPool {
+public:
+    class Lease {
+    public:
+        Lease(Lease&& other) noexcept;
+        ~Lease();
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease& operator=(Lease&&) = delete;
+
+        Decoder& operator*() const { return *mDecoder; }
+        Decoder* operator->() const { return mDecoder.get(); }
+
+    private:
+        friend class DecoderPool;
+
+        Lease(DecoderPool& pool, std::unique_ptr<Decoder> decoder);
+
+        DecoderPool* mPool;
+        std::unique_ptr<Decoder> mDecoder;
+    };
+
+    explicit DecoderPool(const std::string& path);
+    ~DecoderPool();
+
+    DecoderPool(const DecoderPool&) = delete;
+    DecoderPool& operator=(const DecoderPool&) = delete;
+
+    // Throws if a new decoder has to be opened and that fails
+    Lease acquire();
+
+private:
+    void release(std::unique_ptr<Decoder> decoder);
+
+private:
+    const std::string mPath;
+    std::vector<std::unique_ptr<Decoder>> mIdle;
+    std::mutex mMutex;
+};
+
+} // namespace motioncam
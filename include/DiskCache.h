@@ -0,0 +1,64 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Types.h"
+
+namespace BS {
+class thread_pool;
+}
+
+namespace motioncam {
+
+template<typename T>
+class BufferPool;
+
+// Second cache tier for rendered frames. Frames evicted from the memory cache are written
+// to files under a folder in the background, and read back on a memory cache miss instead
+// of being rendered again. The folder is bounded in size, oldest files go first.
+class DiskCache : public std::enable_shared_from_this<DiskCache> {
+public:
+    // Frames read back are allocated from bufferPool when one is given, it has to outlive the cache
+    DiskCache(const std::string& path, size_t maxSize, BS::thread_pool& ioThreadPool, BufferPool<char>* bufferPool = nullptr);
+
+    // Returns nullptr if the frame is not on disk or the file is damaged
+    std::shared_ptr<std::vector<char>> get(const CacheKey& key);
+
+    // Queues the frame to be written to disk
+    void put(const CacheKey& key, std::shared_ptr<std::vector<char>> value);
+
+    size_t size() const;
+    size_t capacity() const { return mMaxSize; }
+    const std::string& path() const { return mPath; }
+
+private:
+    struct FileItem {
+        std::list<std::string>::iterator position;
+        size_t size;
+    };
+
+    void scan();
+    void write(const std::string& name, const std::string& keyString, const std::vector<char>& value);
+    void add(const std::string& name, size_t size);
+    void remove(const std::string& name);
+    void trim();
+
+    const std::string mPath;
+    const size_t mMaxSize;
+    BS::thread_pool& mIoThreadPool;
+    BufferPool<char>* mBufferPool;
+    std::list<std::string> mFiles; // Most recently used at the front
+    std::unordered_map<std::string, FileItem> mFileMap;
+    std::unordered_set<std::string> mPendingWrites;
+    size_t mCurrentSize;
+    size_t mPendingBytes;
+    mutable std::mutex mMutex;
+};
+
+} // namespace motioncam
@@ -4,6 +4,7 @@
 #include <optional>
 
 #include "Types.h"
+#include "Metrics.h"
 
 namespace motioncam {
 
@@ -22,6 +23,18 @@ struct FileInfo {
     int height;
 };
 
+struct HydrationProgress {
+    size_t hydratedFiles;   // Including the ones that were already on disk
+    size_t totalFiles;
+    uint64_t bytesWritten;  // Written to disk for the hydration, since the mount
+    bool running;
+};
+
+enum class StorageType {
+    SolidState,
+    Rotational // Hard drives and network shares, where parallel reads mostly add seeking
+};
+
 class IFuseFileSystem {
 public:
     virtual ~IFuseFileSystem() = default;
@@ -33,6 +46,26 @@ public:
     virtual void unmount(MountId mountId) = 0;
     virtual void updateOptions(MountId mountId, const RenderSettings& settings) = 0;
     virtual std::optional<FileInfo> getFileInfo(MountId mountId) = 0;
+    virtual std::optional<MetricsSnapshot> getMetrics(MountId mountId) = 0;
+
+    // Keep frames evicted from the memory cache in a folder, an empty path or zero size turns it off
+    virtual void setDiskCache(const std::string& path, size_t maxSize) = 0;
+
+    // Resize the memory cache, zero restores the default size
+    virtual void setCacheSize(size_t maxSize) = 0;
+
+    // Resize the cache of decoded frames, which lets DNGs be rendered again under new settings
+    // without decoding them. Zero restores the default size
+    virtual void setRawFrameCacheSize(size_t maxSize) = 0;
+
+    // Resize the thread pools, zero picks a size from the number of cores and the storage type
+    virtual void setThreadPoolSizes(int ioThreads, int processingThreads, StorageType storageType) = 0;
+
+    // Write every file of the mount to disk in the background instead of when it is first read,
+    // backing off while applications read from the mount. Returns false if the file system
+    // doesn't keep the files it serves on disk
+    virtual bool setPreHydrate(MountId mountId, bool enabled) = 0;
+    virtual std::optional<HydrationProgress> getHydrationProgress(MountId mountId) = 0;
 
 protected:
     IFuseFileSystem() = default;
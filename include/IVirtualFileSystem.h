@@ -1,14 +1,19 @@
 #pragma once
 
 #include "Types.h"
+#include "CancellationToken.h"
 
-#include <optional>
+#include <memory>
 #include <string>
 #include <vector>
 #include <functional>
 
 namespace motioncam {
 
+// Called for each listed entry with the offset to continue the listing after it.
+// Return false to stop the listing
+using ListVisitor = std::function<bool(const Entry& entry, size_t nextOffset)>;
+
 class IVirtualFileSystem {
 public:
     virtual ~IVirtualFileSystem() = default;
@@ -16,15 +21,25 @@ public:
     IVirtualFileSystem(const IVirtualFileSystem&) = delete;
     IVirtualFileSystem& operator=(const IVirtualFileSystem&) = delete;
 
-    virtual std::vector<Entry> listFiles(const std::string& filter) const = 0;
-    virtual std::optional<Entry> findEntry(const std::string& fullPath) const = 0;
+    // Visits the entries of a folder ("" for the root) matching the filter ('*' and '?' wildcards)
+    // starting at offset, in the order they should be presented to the file system. Returns the
+    // offset of the first entry not consumed. The visitor must not call back into the file system,
+    // and the entry it is given may be replaced by updateOptions() once the listing is done
+    virtual size_t listFiles(const std::string& directory, const std::string& filter, size_t offset, const ListVisitor& visitor) const = 0;
+    // Returns the entry, or nullptr if there is none. Entries never change, updateOptions()
+    // replaces them with new ones and the one returned stays valid for as long as it is held
+    virtual std::shared_ptr<const Entry> findEntry(const std::string& fullPath) const = 0;
+    // Returns the number of bytes read, or 0 if result will be called once the data is ready.
+    // Cancelling the token makes a pending read finish with an error and drops work queued
+    // for it that nobody else is waiting for
     virtual int readFile(
         const Entry& entry,
         const size_t pos,
         const size_t len,
         void* dst,
         std::function<void(size_t, int)> result,
-        bool async) = 0;
+        bool async,
+        std::shared_ptr<CancellationToken> cancel = nullptr) = 0;
 
     virtual void updateOptions(const RenderSettings& settings) = 0;
 
@@ -1,170 +1,429 @@
 #pragma once
 
+#include <algorithm>
+#include <string>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
-#include <list>
+#include <deque>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <functional>
 #include <memory>
 
+#include "DiskCache.h"
 #include "Types.h"
 
 #include <spdlog/spdlog.h>
 
 namespace motioncam {
 
+// Approximate LRU cache. Keys are spread over shards that each have their own lock, so
+// readers of different keys don't contend and a hit only needs a shared lock. Recency is
+// tracked with a referenced bit per entry and entries are evicted in second chance (CLOCK)
+// order against a single size budget for the whole cache. Every source, i.e. mounted clip, is
+// entitled to an equal share of the budget, entries of sources within their share are passed
+// over while others are above theirs. Evicted entries are handed to the disk cache when one is set.
 class LRUCache {
 public:
-    explicit LRUCache(size_t maxSize) : mMaxSize(maxSize), mCurrentSize(0) {}
-
-    // Get value from cache, returns nullptr if not found
-    // If another thread is already processing the same key, this thread will wait
-    std::shared_ptr<std::vector<char>> get(const Entry& key, std::chrono::milliseconds timeout = std::chrono::seconds(2)) {
-        std::unique_lock<std::mutex> lock(mMutex);
-
-        // Wait if another thread is currently processing this key, with timeout
-        bool success = mCondition.wait_for(lock, timeout, [this, &key] {
-            return mInProgress.find(key) == mInProgress.end();
-        });
-
-        if (!success) {
-            // Timeout occurred - another thread is taking too long
-            spdlog::warn("Timeout waiting for key to be processed by another thread");
-            return nullptr;
+    explicit LRUCache(size_t maxSize, size_t numShards = 16) :
+        mShards(numShards > 0 ? numShards : 1),
+        mMaxSize(maxSize),
+        mCurrentSize(0),
+        mNextId(0),
+        mNextWaitId(0),
+        mEvictions(0),
+        mEvictedBytes(0) {}
+
+    using LoadCallback = std::function<void(std::shared_ptr<std::vector<char>>)>;
+
+    // Returns the cached value if there is one. Otherwise onLoaded is called with the value once
+    // the key has been loaded, or with nullptr if loading it failed. Every caller for a key shares
+    // the same load: startLoad is only set for the first one, which then has to load the key and
+    // call put() or markLoadFailed(). waitId, if set, identifies the wait for cancelWait().
+    std::shared_ptr<std::vector<char>> get(
+        const CacheKey& key, LoadCallback onLoaded, bool& startLoad, uint64_t* waitId = nullptr)
+    {
+        auto& shard = getShard(key);
+
+        startLoad = false;
+
+        // Fast path, most reads are for frames we already have
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+
+            auto it = shard.items.find(key);
+            if (it != shard.items.end()) {
+                it->second.referenced.store(true, std::memory_order_relaxed);
+                return it->second.value;
+            }
         }
 
-        auto it = mCacheMap.find(key);
-        if (it == mCacheMap.end()) {
-            // Cache miss - mark as in progress so other threads wait
-            mInProgress.insert(key);
-            lock.unlock();
-
-            // Notify that this key is now being processed
-            // (Other threads will wait in the condition above)
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
 
-            // Return nullptr to indicate cache miss
-            // The caller should handle loading the data and calling put()
-            return nullptr;
+        auto it = shard.items.find(key);
+        if (it != shard.items.end()) {
+            it->second.referenced.store(true, std::memory_order_relaxed);
+            return it->second.value;
         }
 
-        // Cache hit, move to front of list (most recently used)
-        mCacheList.splice(mCacheList.begin(), mCacheList, it->second);
+        auto [inFlight, inserted] = shard.inProgress.try_emplace(key);
+
+        const uint64_t id = ++mNextWaitId;
 
-        return it->second->second;
+        inFlight->second.push_back({ id, std::move(onLoaded) });
+        startLoad = inserted;
+
+        if (waitId)
+            *waitId = id;
+
+        return nullptr;
     }
 
-    // Add or update value in cache
-    void put(const Entry& key, std::shared_ptr<std::vector<char>> value) {
-        std::lock_guard<std::mutex> lock(mMutex);
+    // Mark key as in progress if it is neither cached nor being loaded by another thread.
+    // Returns false if there is nothing for the caller to do
+    bool reserve(const CacheKey& key) {
+        auto& shard = getShard(key);
 
-        size_t valueSize = value->size();
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
 
-        // Check if key already exists in cache
-        auto it = mCacheMap.find(key);
+        if (shard.items.find(key) != shard.items.end() || shard.inProgress.find(key) != shard.inProgress.end())
+            return false;
 
-        if (it != mCacheMap.end()) {
-            // Update value
-            size_t oldSize = it->second->second->size();
-            mCurrentSize -= oldSize;
-            mCurrentSize += valueSize;
+        shard.inProgress.try_emplace(key);
 
-            // Move to front and update
-            mCacheList.splice(mCacheList.begin(), mCacheList, it->second);
-            it->second->second = value;
-        }
-        else {
-            // New entry
-
-            // If adding this would exceed max size, remove older entries
-            while (!mCacheList.empty() && (mCurrentSize + valueSize > mMaxSize)) {
-                auto last = mCacheList.back();
-                mCurrentSize -= last.second->size();
-                mCacheMap.erase(last.first);
-                mCacheList.pop_back();
+        return true;
+    }
+
+    // Stops waiting for a key, for callers that have gone away. Returns true if the callback was
+    // removed and will never be called, false if it has been called or is about to be
+    bool cancelWait(const CacheKey& key, uint64_t waitId) {
+        auto& shard = getShard(key);
+
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+        auto it = shard.inProgress.find(key);
+        if (it == shard.inProgress.end())
+            return false;
+
+        auto& waiters = it->second;
+
+        for (auto waiter = waiters.begin(); waiter != waiters.end(); ++waiter) {
+            if (waiter->id == waitId) {
+                waiters.erase(waiter);
+                return true;
             }
+        }
+
+        return false;
+    }
+
+    // Gives up a load started with get() or reserve() that no one is waiting for. Returns false
+    // when there are callers waiting for the key, the load has to go ahead then
+    bool cancelLoad(const CacheKey& key) {
+        auto& shard = getShard(key);
+
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+        auto it = shard.inProgress.find(key);
+        if (it != shard.inProgress.end() && !it->second.empty())
+            return false;
+
+        if (it != shard.inProgress.end())
+            shard.inProgress.erase(it);
+
+        return true;
+    }
+
+    // Add or update value in cache
+    void put(const CacheKey& key, std::shared_ptr<std::vector<char>> value) {
+        auto& shard = getShard(key);
+
+        const size_t valueSize = value->size();
+        uint64_t newId = 0;
+        std::vector<LoadCallback> callbacks;
+
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+            callbacks = finishLoad(shard, key);
 
             // If the single item is too large for the cache, don't add it
-            if (valueSize > mMaxSize) {
-                // Remove from in-progress set and notify waiting threads
-                mInProgress.erase(key);
-                mCondition.notify_all();
+            if (valueSize > mMaxSize.load()) {
+                lock.unlock();
+                notify(callbacks, value);
                 return;
             }
 
-            // Add new entry
-            mCacheList.emplace_front(key, value);
-            mCacheMap[key] = mCacheList.begin();
+            auto [it, inserted] = shard.items.try_emplace(key);
+
+            if (inserted) {
+                newId = ++mNextId;
+                it->second.id = newId;
+            }
+            else {
+                mCurrentSize -= it->second.value->size();
+                removeUsage(key.source, it->second.value->size());
+                it->second.referenced.store(true, std::memory_order_relaxed);
+            }
+
+            it->second.value = value;
             mCurrentSize += valueSize;
+            addUsage(key.source, valueSize);
         }
 
-        // Remove from in-progress set and notify waiting threads
-        mInProgress.erase(key);
-        mCondition.notify_all();
+        notify(callbacks, value);
 
-        spdlog::debug("Cache size is {} bytes", mCurrentSize);
+        std::lock_guard<std::mutex> lock(mEvictionMutex);
+
+        if (newId != 0)
+            mEvictionQueue.emplace_back(key, newId);
+
+        evict();
+
+        spdlog::debug("Cache size is {} bytes", mCurrentSize.load());
     }
 
     // Remove an entry from the cache
-    void remove(const Entry& key) {
-        std::lock_guard<std::mutex> lock(mMutex);
+    void remove(const CacheKey& key) {
+        auto& shard = getShard(key);
 
-        auto it = mCacheMap.find(key);
+        std::vector<LoadCallback> callbacks;
 
-        if (it != mCacheMap.end()) {
-            mCurrentSize -= it->second->second->size();
-            mCacheList.erase(it->second);
-            mCacheMap.erase(it);
-        }
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+            auto it = shard.items.find(key);
+            if (it != shard.items.end()) {
+                mCurrentSize -= it->second.value->size();
+                removeUsage(key.source, it->second.value->size());
+                shard.items.erase(it);
+            }
 
-        // Also remove from in-progress set if present and notify
-        if (mInProgress.erase(key) > 0) {
-            mCondition.notify_all();
+            // A load in progress is abandoned too
+            callbacks = finishLoad(shard, key);
         }
+
+        notify(callbacks, nullptr);
     }
 
     // Clear the cache
     void clear() {
-        std::lock_guard<std::mutex> lock(mMutex);
+        std::vector<LoadCallback> callbacks;
+
+        {
+            std::lock_guard<std::mutex> evictionLock(mEvictionMutex);
+
+            for (auto& shard : mShards) {
+                std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+                for (auto& item : shard.items) {
+                    mCurrentSize -= item.second.value->size();
+                    removeUsage(item.first.source, item.second.value->size());
+                }
 
-        mCacheMap.clear();
-        mCacheList.clear();
-        mInProgress.clear();
-        mCurrentSize = 0;
-        mCondition.notify_all();
+                shard.items.clear();
+
+                for (auto& inFlight : shard.inProgress) {
+                    for (auto& waiter : inFlight.second)
+                        callbacks.push_back(std::move(waiter.callback));
+                }
+
+                shard.inProgress.clear();
+            }
+
+            mEvictionQueue.clear();
+        }
+
+        notify(callbacks, nullptr);
     }
 
     // Get current size
     size_t size() const {
-        std::lock_guard<std::mutex> lock(mMutex);
+        return mCurrentSize.load();
+    }
+
+    // Bytes cached for one source
+    size_t usage(const std::string& source) {
+        std::lock_guard<std::mutex> lock(mUsageMutex);
+
+        auto it = mUsage.find(source);
 
-        return mCurrentSize;
+        return it == mUsage.end() ? 0 : it->second;
     }
 
+    // Entries evicted so far, and their size
+    uint64_t evictions() const { return mEvictions.load(); }
+    uint64_t evictedBytes() const { return mEvictedBytes.load(); }
+
     // Get maximum size
     size_t capacity() const {
-        return mMaxSize;
+        return mMaxSize.load();
+    }
+
+    // Change the maximum size, entries are evicted straight away if the cache shrinks
+    void setCapacity(size_t maxSize) {
+        mMaxSize = maxSize;
+
+        std::lock_guard<std::mutex> lock(mEvictionMutex);
+
+        evict();
+    }
+
+    // Set the disk cache that evicted entries are written to, nullptr to stop writing them
+    void setDiskCache(std::shared_ptr<DiskCache> diskCache) {
+        std::atomic_store(&mDiskCache, std::move(diskCache));
+    }
+
+    std::shared_ptr<DiskCache> getDiskCache() const {
+        return std::atomic_load(&mDiskCache);
     }
 
     // Method to mark that processing for a key has failed
-    // This should be called if the caller gets nullptr from get() but fails to load the data
-    void markLoadFailed(const Entry& key) {
-        std::lock_guard<std::mutex> lock(mMutex);
-        mInProgress.erase(key);
-        mCondition.notify_all();
+    // This should be called if the caller was told to load the key by get() or reserve() but fails.
+    // Everyone waiting for the key gets nullptr
+    void markLoadFailed(const CacheKey& key) {
+        auto& shard = getShard(key);
+
+        std::vector<LoadCallback> callbacks;
+
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+            callbacks = finishLoad(shard, key);
+        }
+
+        notify(callbacks, nullptr);
     }
 
 private:
-    using CacheItem = std::pair<Entry, std::shared_ptr<std::vector<char>>>;
-    using CacheList = std::list<CacheItem>;
-    using CacheMap = std::unordered_map<Entry, typename CacheList::iterator, Entry::Hash>;
-
-    CacheList mCacheList; // List of cache entries, most recently used at the front
-    CacheMap mCacheMap;   // Map from key to list iterator
-    std::unordered_set<Entry, Entry::Hash> mInProgress; // Set of keys currently being processed
-    size_t mMaxSize;      // Maximum cache size in bytes
-    size_t mCurrentSize;  // Current cache size in bytes
-    mutable std::mutex mMutex; // Mutex for thread safety
-    mutable std::condition_variable mCondition; // Condition variable for waiting
+    struct CacheItem {
+        std::shared_ptr<std::vector<char>> value;
+        std::atomic<bool> referenced{false}; // Set on every hit, cleared when the clock hand passes
+        uint64_t id = 0;                     // Tells apart re-inserted keys in the eviction queue
+    };
+
+    struct Waiter {
+        uint64_t id;
+        LoadCallback callback;
+    };
+
+    struct Shard {
+        std::unordered_map<CacheKey, CacheItem, CacheKey::Hash> items;
+        std::unordered_map<CacheKey, std::vector<Waiter>, CacheKey::Hash> inProgress; // Callers waiting for each load
+        mutable std::shared_mutex mutex;
+    };
+
+    Shard& getShard(const CacheKey& key) {
+        return mShards[CacheKey::Hash{}(key) % mShards.size()];
+    }
+
+    // Called with the shard locked, the callbacks are for the caller to call once it is unlocked
+    std::vector<LoadCallback> finishLoad(Shard& shard, const CacheKey& key) {
+        auto it = shard.inProgress.find(key);
+        if (it == shard.inProgress.end())
+            return {};
+
+        std::vector<LoadCallback> callbacks;
+        callbacks.reserve(it->second.size());
+
+        for (auto& waiter : it->second)
+            callbacks.push_back(std::move(waiter.callback));
+
+        shard.inProgress.erase(it);
+
+        return callbacks;
+    }
+
+    void addUsage(const std::string& source, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mUsageMutex);
+
+        mUsage[source] += bytes;
+    }
+
+    void removeUsage(const std::string& source, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mUsageMutex);
+
+        auto it = mUsage.find(source);
+        if (it == mUsage.end())
+            return;
+
+        it->second -= (std::min)(it->second, bytes);
+
+        if (it->second == 0)
+            mUsage.erase(it);
+    }
+
+    // True when the source holds no more than its share of the cache. Only asked while the cache
+    // is over budget, so then another source is above its share and can give up entries instead
+    bool isWithinShare(const std::string& source) {
+        std::lock_guard<std::mutex> lock(mUsageMutex);
+
+        if (mUsage.size() < 2)
+            return false;
+
+        auto it = mUsage.find(source);
+
+        return it != mUsage.end() && it->second <= mMaxSize.load() / mUsage.size();
+    }
+
+    static void notify(const std::vector<LoadCallback>& callbacks, const std::shared_ptr<std::vector<char>>& value) {
+        for (const auto& callback : callbacks)
+            callback(value);
+    }
+
+    // Called with mEvictionMutex held. Entries that were hit since the clock hand last passed
+    // them get a second chance and go to the back of the queue.
+    void evict() {
+        auto diskCache = getDiskCache();
+        size_t remainingChecks = 2 * mEvictionQueue.size();
+
+        while (mCurrentSize.load() > mMaxSize.load() && !mEvictionQueue.empty() && remainingChecks-- > 0) {
+            auto [key, id] = std::move(mEvictionQueue.front());
+            mEvictionQueue.pop_front();
+
+            auto& shard = getShard(key);
+
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+            auto it = shard.items.find(key);
+            if (it == shard.items.end() || it->second.id != id)
+                continue; // Removed since it was queued
+
+            if (isWithinShare(key.source) || it->second.referenced.exchange(false, std::memory_order_relaxed)) {
+                lock.unlock();
+                mEvictionQueue.emplace_back(std::move(key), id);
+                continue;
+            }
+
+            auto value = std::move(it->second.value);
+
+            mCurrentSize -= value->size();
+            removeUsage(key.source, value->size());
+            shard.items.erase(it);
+
+            ++mEvictions;
+            mEvictedBytes += value->size();
+
+            lock.unlock();
+
+            if (diskCache)
+                diskCache->put(key, std::move(value));
+        }
+    }
+
+    std::vector<Shard> mShards;
+    std::deque<std::pair<CacheKey, uint64_t>> mEvictionQueue; // Insertion order of cached entries
+    std::mutex mEvictionMutex;         // Protects the eviction queue
+    std::unordered_map<std::string, size_t> mUsage; // Bytes cached for each source
+    std::mutex mUsageMutex;            // Protects mUsage, taken last
+    std::atomic<size_t> mMaxSize;      // Maximum cache size in bytes
+    std::atomic<size_t> mCurrentSize;  // Current cache size in bytes
+    std::atomic<uint64_t> mNextId;
+    std::atomic<uint64_t> mNextWaitId;
+    std::atomic<uint64_t> mEvictions;
+    std::atomic<uint64_t> mEvictedBytes;
+    std::shared_ptr<DiskCache> mDiskCache;
 };
 
 }
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace motioncam {
+namespace lj92 {
+
+// Encodes a tileWidth x tileHeight tile of a CFA image as lossless JPEG (predictor 1), the way
+// DNG stores it: two interleaved components of tileWidth / 2 columns, so each pixel is predicted
+// from its neighbour of the same colour. src points at the top left pixel of the tile and holds
+// width x height pixels, the rest of the tile repeats the nearest pixels of the same colour.
+void encodeTile(
+    const uint16_t* src,
+    size_t stride,
+    uint32_t width,
+    uint32_t height,
+    uint32_t tileWidth,
+    uint32_t tileHeight,
+    unsigned short bits,
+    std::vector<uint8_t>& dst);
+
+// Turns the header of a little endian DNG with a single strip into the header of a DNG made of
+// tiles of the given sizes, which follow the header in order. The image IFD is copied to the end
+// of the header with the strip tags swapped for tile tags, the original is left unused.
+std::shared_ptr<std::vector<char>> getTiledDngHeader(
+    const std::vector<char>& header, uint32_t tileWidth, uint32_t tileHeight, const std::vector<size_t>& tileSizes);
+
+} // namespace lj92
+} // namespace motioncam
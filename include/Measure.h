@@ -4,12 +4,16 @@
 #include <string>
 #include <spdlog/spdlog.h>
 
+#include "Metrics.h"
+
 namespace motioncam {
 
+// Logs how long the scope took, and records it in histogram when given one
 class Measure {
 public:
-    explicit Measure(const std::string& name)
+    explicit Measure(const std::string& name, Histogram* histogram = nullptr)
         : mName(name)
+        , mHistogram(histogram)
         , mStart(std::chrono::high_resolution_clock::now()) {
     }
 
@@ -17,6 +21,9 @@ public:
         const auto end = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - mStart).count();
 
+        if(mHistogram)
+            mHistogram->record(static_cast<uint64_t>(duration));
+
         spdlog::debug("{}: {} ms", mName, duration / 1000.0);
     }
 
@@ -28,6 +35,7 @@ public:
 
 private:
     std::string mName;
+    Histogram* mHistogram;
     std::chrono::time_point<std::chrono::high_resolution_clock> mStart;
 };
 
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace motioncam {
+
+struct HistogramSummary {
+    uint64_t count = 0;
+    double meanMs = 0;
+    double p50Ms = 0;
+    double p95Ms = 0;
+    double p99Ms = 0;
+    double maxMs = 0;
+};
+
+// Durations in power of two buckets of microseconds, cheap enough to record every frame from
+// any thread. Percentiles are the upper bound of the bucket they fall in.
+class Histogram {
+public:
+    Histogram();
+
+    void record(uint64_t us);
+
+    HistogramSummary summarise() const;
+
+private:
+    static constexpr int NUM_BUCKETS = 32; // The last one holds everything over ~35 minutes
+
+    std::array<std::atomic<uint64_t>, NUM_BUCKETS> mBuckets;
+    std::atomic<uint64_t> mCount;
+    std::atomic<uint64_t> mTotalUs;
+    std::atomic<uint64_t> mMaxUs;
+};
+
+// Counters of one mount, updated as frames are read and rendered
+struct Metrics {
+    std::atomic<uint64_t> cacheHits{0};
+    std::atomic<uint64_t> cacheMisses{0};
+    std::atomic<uint64_t> cacheWaits{0};      // Reads that joined a render already in flight
+    std::atomic<uint64_t> cancelledWaits{0};  // Reads the OS gave up on before the frame was ready
+    std::atomic<uint64_t> failedReads{0};
+    std::atomic<uint64_t> diskCacheHits{0};
+    std::atomic<uint64_t> rawFrameHits{0};    // Renders that found the frame decoded already
+    std::atomic<uint64_t> bytesServed{0};
+
+    Histogram readWait;     // How long reads of frames that weren't cached waited
+    Histogram decode;
+    Histogram preprocess;
+    Histogram encode;       // Bit packing or lossless compression
+    Histogram generateDng;  // The whole DNG, including the other stages but decoding
+};
+
+// Metrics of a mount at one point in time, with the state of what it shares with other mounts
+struct MetricsSnapshot {
+    int64_t timeMs = 0;     // Steady clock, for rates between snapshots
+
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t cacheWaits = 0;
+    uint64_t cancelledWaits = 0;
+    uint64_t failedReads = 0;
+    uint64_t diskCacheHits = 0;
+    uint64_t rawFrameHits = 0;
+    uint64_t bytesServed = 0;
+    size_t cachedBytes = 0;  // Of the memory cache, held by this mount
+
+    HistogramSummary readWait;
+    HistogramSummary decode;
+    HistogramSummary preprocess;
+    HistogramSummary encode;
+    HistogramSummary generateDng;
+
+    // Shared by all mounts
+    uint64_t cacheEvictions = 0;
+    uint64_t cacheEvictedBytes = 0;
+    size_t cacheSize = 0;
+    size_t cacheCapacity = 0;
+    size_t rawFrameCacheSize = 0;
+    size_t rawFrameCacheCapacity = 0;
+    size_t ioTasksQueued = 0;
+    size_t ioTasksRunning = 0;
+    size_t processingTasksQueued = 0;
+    size_t processingTasksRunning = 0;
+};
+
+// Fills in the counters of the mount, leaves the shared state alone
+void snapshotMetrics(const Metrics& metrics, MetricsSnapshot& snapshot);
+
+std::string metricsToJson(const MetricsSnapshot& snapshot);
+
+// One "metric,value" line per value, with a header line
+std::string metricsToCsv(const MetricsSnapshot& snapshot);
+
+} // namespace motioncam
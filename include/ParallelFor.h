@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+namespace BS {
+class thread_pool;
+}
+
+namespace motioncam {
+
+// Calls func(begin, end) for bands of up to bandSize items covering [0, count). Threads of the pool
+// that are idle help out, if the pool has work queued everything runs on the calling thread. The
+// calling thread only ever waits for bands that are already running, so it is safe to call this from
+// a task running on the same pool. Exceptions thrown by func are rethrown on the calling thread.
+void parallelFor(
+    BS::thread_pool* threadPool,
+    size_t count,
+    size_t bandSize,
+    const std::function<void(size_t, size_t)>& func);
+
+} // namespace motioncam
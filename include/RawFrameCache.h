@@ -0,0 +1,91 @@
+#pragma once
+
+#include "CameraMetadata.h"
+#include "CameraFrameMetadata.h"
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace motioncam {
+
+// A frame as it comes out of the decoder, before it is rendered to a DNG
+struct RawFrame {
+    std::shared_ptr<const CameraConfiguration> cameraConfiguration;    // Of the clip, shared by all its frames
+    CameraFrameMetadata metadata;
+    std::shared_ptr<std::vector<uint8_t>> data;
+};
+
+// Decoded frames by clip and timestamp, the tier below the DNG cache. DNGs rendered from the
+// same frame with different settings, e.g. after the options of a mount changed or a frame and
+// its proxy, then only decode it once. Shared by all mounts, the least recently used frames go
+// first once the frames are over the size. A frame that is being decoded is waited for rather
+// than decoded again.
+class RawFrameCache {
+public:
+    using Loader = std::function<std::shared_ptr<const RawFrame>()>;
+
+    // Keeps at most maxBytes of decoded pixels, zero keeps none
+    explicit RawFrameCache(size_t maxBytes);
+
+    RawFrameCache(const RawFrameCache&) = delete;
+    RawFrameCache& operator=(const RawFrameCache&) = delete;
+
+    // Returns the frame, calling load on this thread if no one else has it or is loading it.
+    // Rethrows whatever load threw, to everyone waiting for that frame
+    std::shared_ptr<const RawFrame> get(const std::string& source, int64_t timestamp, const Loader& load);
+
+    // Forgets the frames of a clip, frames still in use stay alive with their users
+    void clear(const std::string& source);
+
+    // Evicts frames straight away if they no longer fit
+    void setCapacity(size_t maxBytes);
+
+    size_t capacity() const;
+
+    // Bytes held by frames that are loaded
+    size_t size() const;
+
+private:
+    struct Key {
+        std::string source;
+        int64_t timestamp;
+
+        bool operator==(const Key& other) const {
+            return timestamp == other.timestamp && source == other.source;
+        }
+
+        struct Hash {
+            size_t operator()(const Key& key) const {
+                size_t hash = std::hash<int64_t>{}(key.timestamp);
+
+                hash ^= std::hash<std::string>{}(key.source) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+
+                return hash;
+            }
+        };
+    };
+
+    struct Slot {
+        std::shared_future<std::shared_ptr<const RawFrame>> frame;
+        uint64_t id;        // Tells a slot apart from one that replaced it after clear()
+        uint64_t lastUse;
+        size_t bytes;       // Zero until loaded
+    };
+
+    void evict();
+
+private:
+    size_t mMaxBytes;
+    mutable std::mutex mMutex;
+    std::unordered_map<Key, Slot, Key::Hash> mFrames;
+    size_t mBytes;
+    uint64_t mClock;
+};
+
+} // namespace motioncam
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace BS {
+class thread_pool;
+}
+
+namespace motioncam {
+
+enum class Priority : int {
+    Foreground = 0, // Someone is waiting for the result
+    Prefetch        // Only wanted in case someone asks for it later
+};
+
+// Queues jobs in front of a thread pool, so the pool only ever has as many of them as it has
+// threads. Foreground jobs start before prefetches, and jobs only start while the memory the
+// running ones hold stays under a limit. A job is asked whether it should still run just before
+// it starts, so jobs whose requesters have gone away are dropped without reaching the pool.
+// Jobs belong to sessions, one per mounted clip, and of the jobs waiting at a priority the one
+// whose session holds the fewest started jobs goes first, so a busy clip can't starve the others.
+class Scheduler {
+public:
+    // Holds the memory of a job. Kept by the job until it no longer needs the memory, which
+    // may be after the job itself has returned, e.g. when it handed the data to another pool
+    class Reservation {
+    public:
+        ~Reservation();
+
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+
+    private:
+        friend class Scheduler;
+
+        Reservation(Scheduler& scheduler, uint64_t session, size_t bytes);
+
+        Scheduler& mScheduler;
+        const uint64_t mSession;
+        const size_t mBytes;
+    };
+
+    using Task = std::function<void(std::shared_ptr<Reservation>)>;
+
+    // Returns true to drop the job. Called without the scheduler locked, a job that is dropped
+    // never runs, so it has to clean up after itself
+    using DropCheck = std::function<bool()>;
+
+    Scheduler(BS::thread_pool& threadPool, size_t maxBytes);
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Returns an id for a new session, no jobs have to be submitted for it to go away again
+    uint64_t newSession();
+
+    // Queues task to run on the pool with bytes of memory reserved for it. A job larger than
+    // the limit still runs on its own. Jobs are told apart by tag, for prioritise()
+    void submit(uint64_t session, uint64_t tag, Priority priority, size_t bytes, DropCheck shouldDrop, Task task);
+
+    // Moves a queued prefetch with the tag to the foreground queue, when someone starts
+    // waiting for it
+    void prioritise(uint64_t tag);
+
+    // Waits for every queued and running job to finish or be dropped
+    void wait();
+
+    // Waits for the jobs of one session, and for their reservations to be released
+    void wait(uint64_t session);
+
+private:
+    struct Job {
+        uint64_t session;
+        uint64_t tag;
+        size_t bytes;
+        DropCheck shouldDrop;
+        Task task;
+    };
+
+    struct Session {
+        size_t queued = 0;
+        size_t starting = 0;
+        size_t running = 0;
+        size_t reserved = 0;
+    };
+
+    void pump();
+    void release(uint64_t session, size_t bytes);
+    void finishJob(uint64_t session);
+
+    // Called with the scheduler locked
+    std::deque<Job>::iterator pickJob(std::deque<Job>& queue);
+    void updateSession(uint64_t session, const std::function<void(Session&)>& update);
+
+private:
+    BS::thread_pool& mThreadPool;
+    const size_t mMaxBytes;
+    std::array<std::deque<Job>, 2> mQueues; // By priority
+    size_t mBytesInFlight;
+    size_t mRunning;     // Jobs on the pool
+    size_t mStarting;    // Jobs taken off the queue that are being checked or submitted
+    size_t mReserved;    // Reservations not yet released
+    size_t mPumping;     // Calls to pump() made by jobs that are finishing
+    std::unordered_map<uint64_t, Session> mSessions; // Sessions with jobs or reservations
+    uint64_t mNextSession;
+    std::mutex mMutex;
+    std::condition_variable mIdle;
+};
+
+} // namespace motioncam
@@ -14,12 +14,18 @@ enum EntryType : int {
     INVALID_ENTRY = -1
 };
 
+// Source frame of an entry
+struct FrameRef {
+    int64_t timestamp;
+    int64_t index;  // Position of the frame in the clip
+};
+
 struct Entry {
     EntryType type;
     std::vector<std::string> pathParts;
     std::string name;
     size_t size;
-    std::variant<int64_t> userData;
+    std::variant<int64_t, FrameRef> userData;
 
     // Custom hash function for Entry
     struct Hash {
@@ -76,6 +82,8 @@ enum FileRenderOptions : unsigned int {
     RENDER_OPT_CAMMODEL_OVERRIDE            = 1 << 8,
     RENDER_OPT_LOG_TRANSFORM                = 1 << 9,
     RENDER_OPT_INTERPRET_AS_QUAD_BAYER      = 1 << 10,
+    RENDER_OPT_LOSSLESS_COMPRESSION         = 1 << 11,
+    RENDER_OPT_PROXY_FOLDER                 = 1 << 12,    // Draft-scale copies of the frames in proxy/
 };
 
 // Overload bitwise OR operator
@@ -143,6 +151,12 @@ static std::string optionsToString(FileRenderOptions options) {
     if (options & RENDER_OPT_INTERPRET_AS_QUAD_BAYER) {
         flags.push_back("INTERPRET_AS_QUAD_BAYER");
     }
+    if (options & RENDER_OPT_LOSSLESS_COMPRESSION) {
+        flags.push_back("LOSSLESS_COMPRESSION");
+    }
+    if (options & RENDER_OPT_PROXY_FOLDER) {
+        flags.push_back("PROXY_FOLDER");
+    }
     
     std::string result;
     for (size_t i = 0; i < flags.size(); ++i) {
@@ -252,6 +266,26 @@ inline std::string cfrTargetToString(const CFRTarget& target) {
     }
 }
 
+// Where the pixel data is in a generated DNG. It is always a single strip at the end of the
+// file, everything before it only depends on the frame metadata. Compressed DNGs are at most
+// size bytes and come without a strip, any bytes past their end read as zero.
+struct DngLayout {
+    size_t size = 0;
+    size_t stripOffset = 0;
+    size_t stripSize = 0;
+
+    bool operator==(const DngLayout& other) const {
+        return size == other.size && stripOffset == other.stripOffset && stripSize == other.stripSize;
+    }
+};
+
+// Audio of a clip, synced to the first frame. numFrames is 0 for clips without audio
+struct AudioTrack {
+    int numChannels = 0;
+    int sampleRate = 0;
+    uint64_t numFrames = 0;
+};
+
 struct RenderSettings {
     FileRenderOptions options;
     int draftScale;
@@ -321,6 +355,58 @@ struct RenderSettings {
         , exposureCompensation(expComp)
         , quadBayerOption(quadBayer)
     {}
+
+    // Hash of everything that affects the rendered output
+    struct Hash {
+        size_t operator()(const RenderSettings& settings) const {
+            size_t hash = std::hash<unsigned int>{}(static_cast<unsigned int>(settings.options));
+
+            auto combine = [&hash](size_t value) {
+                hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+            };
+
+            combine(std::hash<int>{}(settings.draftScale));
+            combine(std::hash<int>{}(static_cast<int>(settings.cfrTarget.mode)));
+            combine(std::hash<float>{}(settings.cfrTarget.customValue));
+            combine(std::hash<std::string>{}(settings.cropTarget));
+            combine(std::hash<std::string>{}(settings.cameraModel));
+            combine(std::hash<std::string>{}(settings.levels));
+            combine(std::hash<int>{}(static_cast<int>(settings.logTransform)));
+            combine(std::hash<std::string>{}(settings.exposureCompensation));
+            combine(std::hash<int>{}(static_cast<int>(settings.quadBayerOption)));
+
+            return hash;
+        }
+    };
+};
+
+// Identifies a rendered file in the cache. The cache is shared by all mounts, so the key
+// includes the clip and the settings the file was rendered with.
+struct CacheKey {
+    std::string source;
+    uint64_t sourceSize;        // When the source was mounted, these tell a clip
+    int64_t sourceModified;     // replaced at the same path apart from the old one
+    size_t settingsHash;
+    Entry entry;
+
+    struct Hash {
+        size_t operator()(const CacheKey& key) const {
+            size_t hash = Entry::Hash{}(key.entry);
+
+            hash ^= std::hash<std::string>{}(key.source) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+            hash ^= key.settingsHash + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+
+            return hash;
+        }
+    };
+
+    bool operator==(const CacheKey& other) const {
+        return settingsHash == other.settingsHash &&
+               entry == other.entry &&
+               source == other.source &&
+               sourceSize == other.sourceSize &&
+               sourceModified == other.sourceModified;
+    }
 };
 
 } // namespace
@@ -10,11 +10,20 @@
 
 #include "Types.h"
 
+namespace BS {
+class thread_pool;
+}
+
 namespace motioncam {
 
 struct CameraFrameMetadata;
 struct CameraConfiguration;
 
+struct Metrics;
+
+template<typename T>
+class BufferPool;
+
 namespace utils {
 
 class vectorbuf : public std::streambuf {
@@ -155,13 +164,39 @@ public:
     }
 };
 
+// Idle threads of threadPool, if given, help with the pixel processing. The DNG and the
+// scratch memory come from bufferPool when one is given. The time each stage takes is recorded
+// in metrics when given
 std::shared_ptr<std::vector<char>> generateDng(
-    std::vector<uint8_t>& data,
+    const std::vector<uint8_t>& data,
     const CameraFrameMetadata& metadata,
     const CameraConfiguration& cameraConfiguration,
     float recordingFps,
     int frameNumber,
     double baselineExpValue,
+    const RenderSettings& settings,
+    BS::thread_pool* threadPool = nullptr,
+    BufferPool<char>* bufferPool = nullptr,
+    Metrics* metrics = nullptr
+);
+
+// The part of the DNG generateDng() produces for a frame that comes before the pixel data,
+// computed from its metadata alone. Appending the pixel data gives the complete file.
+std::shared_ptr<std::vector<char>> generateDngHeader(
+    const CameraFrameMetadata& metadata,
+    const CameraConfiguration& cameraConfiguration,
+    float recordingFps,
+    int frameNumber,
+    double baselineExpValue,
+    const RenderSettings& settings,
+    DngLayout& outLayout
+);
+
+// Layout of the DNGs generateDng() produces for a clip, computed without the pixel data
+DngLayout getDngLayout(
+    const CameraFrameMetadata& metadata,
+    const CameraConfiguration& cameraConfiguration,
+    float recordingFps,
     const RenderSettings& settings
 );
 
@@ -2,6 +2,18 @@
 
 #include <IVirtualFileSystem.h>
 #include <IFuseFileSystem.h>
+#include <CameraMetadata.h>
+#include <CameraFrameMetadata.h>
+#include <Scheduler.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 
 namespace BS {
 class thread_pool;
@@ -9,8 +21,12 @@ class thread_pool;
 
 namespace motioncam {
 
-class Decoder;
+class DecoderPool;
+template<typename T>
+class BufferPool;
 class LRUCache;
+class ClipIndex;
+class RawFrameCache;
 
 class VirtualFileSystemImpl_MCRAW : public IVirtualFileSystem
 {
@@ -19,14 +35,20 @@ public:
         BS::thread_pool& ioThreadPool,
         BS::thread_pool& processingThreadPool,
         LRUCache& lruCache,
+        LRUCache& headerCache,
+        RawFrameCache& rawFrameCache,
+        BufferPool<char>& bufferPool,
+        BufferPool<uint8_t>& frameBufferPool,
+        Scheduler& frameScheduler,
         const RenderSettings& settings,
         const std::string& file,
-        const std::string& baseName);
+        const std::string& baseName,
+        const std::string& indexPath = "");
 
     ~VirtualFileSystemImpl_MCRAW();
 
-    std::vector<Entry> listFiles(const std::string& filter = "") const override;
-    std::optional<Entry> findEntry(const std::string& fullPath) const override;
+    size_t listFiles(const std::string& directory, const std::string& filter, size_t offset, const ListVisitor& visitor) const override;
+    std::shared_ptr<const Entry> findEntry(const std::string& fullPath) const override;
 
     int readFile(
         const Entry& entry,
@@ -34,13 +56,64 @@ public:
         const size_t len,
         void* dst,
         std::function<void(size_t, int)> result,
-        bool async=true) override;
+        bool async=true,
+        std::shared_ptr<CancellationToken> cancel = nullptr) override;
 
     void updateOptions(const RenderSettings& settings) override;
     FileInfo getFileInfo() const;
 
+    // Counters of this mount, the shared cache and pool state is left for the caller
+    MetricsSnapshot getMetrics() const;
+
+    // Maximum number of frames to read ahead during sequential playback
+    void setMaxPrefetchFrames(int frames);
+
 private:
-    void init(FileRenderOptions options);
+    using FrameCallback = std::function<void(std::shared_ptr<std::vector<char>>)>;
+
+    int readEntry(
+        const Entry& entry,
+        const size_t pos,
+        const size_t len,
+        void* dst,
+        std::function<void(size_t, int)> result,
+        bool async,
+        std::shared_ptr<CancellationToken> cancel);
+
+    void loadClip();
+    void loadAudio();
+    // Called with mEntriesMutex held exclusively
+    void init(const RenderSettings& settings);
+    void startBaselineExposureScan(const std::vector<int64_t>& frames);
+
+    CameraFrameMetadata parseFrameMetadata(const nlohmann::json& metadata);
+
+    float getTargetFps(const RenderSettings& settings) const;
+    DngLayout getDngLayout(const RenderSettings& settings, float fps) const;
+    void updateAudioHeader();
+
+    // Frames in the proxy folder are rendered as drafts, the rest with the settings of the mount
+    RenderSettings getRenderSettings(const RenderSettings& settings, bool proxy = false) const;
+    RenderSettings getRenderSettings(const Entry& entry) const;
+    bool isProxy(const Entry& entry) const;
+    CacheKey getCacheKey(const Entry& entry, const RenderSettings& settings) const;
+
+    void renderFrame(
+        const Entry& entry,
+        const CacheKey& key,
+        const RenderSettings& settings,
+        Priority priority,
+        FrameCallback onComplete,
+        std::function<bool()> isCancelled = nullptr);
+
+    void renderHeader(
+        const Entry& entry,
+        const CacheKey& key,
+        const RenderSettings& settings,
+        FrameCallback onComplete);
+
+    void updatePrefetch(const Entry& entry);
+    int getPrefetchDepth(size_t frameSize) const;
 
     size_t generateFrame(
         const Entry& entry,
@@ -48,8 +121,21 @@ private:
         const size_t len,
         void* dst,
         std::function<void(size_t, int)> result,
+        bool async,
+        std::shared_ptr<CancellationToken> cancel);
+
+    size_t generateHeader(
+        const Entry& entry,
+        const CacheKey& key,
+        const RenderSettings& settings,
+        const size_t pos,
+        const size_t len,
+        void* dst,
+        std::function<void(size_t, int)> result,
         bool async);
 
+    size_t readAudioSamples(uint64_t pos, size_t len, char* dst);
+
     size_t generateAudio(
         const Entry& entry,
         const size_t pos,
@@ -60,22 +146,39 @@ private:
 
 private:
     LRUCache& mCache;
+    LRUCache& mHeaderCache;                  // DNG headers for media scans, shared with the other mounts
+    RawFrameCache& mRawFrames;               // Decoded frames, shared with the other mounts
+    BufferPool<char>& mBufferPool;
     BS::thread_pool& mIoThreadPool;
     BS::thread_pool& mProcessingThreadPool;
+    Scheduler& mFrameScheduler;              // Shared with the other mounts
+    const uint64_t mSchedulerSession;
     const std::string mSrcPath;
+    uint64_t mSrcSize;                       // Of the clip when it was mounted, for the cache keys
+    int64_t mSrcModified;
     const std::string mBaseName;
-    size_t mTypicalDngSize;
-    std::vector<Entry> mFiles;
-    std::vector<uint8_t> mAudioFile;
-    int mDraftScale;
-    CFRTarget mCFRTarget;
-    std::string mCropTarget;
-    std::string mCameraModel;
-    std::string mLevels;
-    LogTransformMode mLogTransform;
-    std::string mExposureCompensation;
-    QuadBayerMode mQuadBayerOption;
-    FileRenderOptions mOptions;
+    std::shared_ptr<ClipIndex> mIndex;
+    std::shared_ptr<DecoderPool> mDecoders;  // Shared with the tasks reading the clip
+    BufferPool<uint8_t>& mFrameBuffers;      // Decoded frames, shared with the other mounts
+    std::atomic<size_t> mDecodedFrameSize;   // Of the last frame, to size the next buffer
+    std::vector<int64_t> mFrames;
+    std::shared_ptr<const CameraConfiguration> mCameraConfig;  // Parsed once, shared with the frames
+    CameraFrameMetadata mFirstFrameMetadata;
+    std::shared_ptr<const LensShadingMap> mLastShadingMap;  // Reused by the next frame if it has the same map
+    std::mutex mShadingMapMutex;
+    DngLayout mDngLayout;
+    DngLayout mProxyLayout;
+    std::vector<std::shared_ptr<const Entry>> mFiles;
+    std::unordered_map<std::string, size_t> mEntryIndex;
+    std::unordered_map<std::string, std::pair<size_t, size_t>> mDirectories;  // Range of mFiles in each folder
+    AudioTrack mAudioTrack;
+    std::vector<uint8_t> mAudioHeader;
+    std::pair<int, int> mAudioFpsFraction;
+    std::string mAudioPath;              // Samples on disk, when empty they are in mAudioSamples
+    std::vector<int16_t> mAudioSamples;
+    std::ifstream mAudioStream;
+    std::mutex mAudioMutex;
+    std::shared_ptr<const RenderSettings> mSettings;  // Replaced as a whole, use std::atomic_load/atomic_store
     float mFps;
     float mMedFps;
     float mAvgFps;
@@ -84,8 +187,35 @@ private:
     int mDuplicatedFrames;
     int mWidth;
     int mHeight;
-    double mBaselineExpValue;
+    std::shared_future<double> mBaselineExpValue;
+    std::shared_ptr<std::atomic<bool>> mCancelBaselineScan;
+    size_t mFirstFrameEntry;
+    size_t mFirstProxyEntry;
+    size_t mNumFrameEntries;
+    std::vector<int> mFirstFrameNumbers;    // Of each frame of the clip, -1 if the frame rate conversion dropped it
+
+    // Guards the entries and what init() derives from the settings: the frame rate, layouts,
+    // audio header and baseline exposure. Readers share it, init() holds it on its own
+    mutable std::shared_mutex mEntriesMutex;
+
+    // Prefetch state, the frames and their proxies are read ahead of on their own
+    struct PrefetchState {
+        int lastFrameNumber = -1;
+        int sequentialReads = 0;
+        int prefetchEnd = 0;
+        std::atomic<uint64_t> generation{0};    // Bumped when the reader jumps somewhere else
+    };
+
+    int mMaxPrefetchFrames;
+    PrefetchState mFramePrefetch;
+    PrefetchState mProxyPrefetch;
+    int mPendingPrefetches;
+    int mPendingHeaders;                    // Header renders in flight, they use the mount too
+    std::atomic<uint64_t> mPrefetchGeneration;
+    std::condition_variable mPrefetchCondition;
     std::mutex mMutex;
+
+    Metrics mMetrics;
 };
 
 } // namespace motioncam
@@ -2,6 +2,7 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 
 #include "IFuseFileSystem.h"
 
@@ -13,6 +14,10 @@ namespace motioncam {
 
 struct Session;
 class LRUCache;
+class RawFrameCache;
+class Scheduler;
+template<typename T>
+class BufferPool;
 
 class FuseFileSystemImpl_MacOs : public IFuseFileSystem
 {
@@ -30,13 +35,26 @@ public:
         MountId mountId,
         const RenderSettings& settings) override;
     std::optional<FileInfo> getFileInfo(MountId mountId) override;
+    std::optional<MetricsSnapshot> getMetrics(MountId mountId) override;
+    void setDiskCache(const std::string& path, size_t maxSize) override;
+    void setCacheSize(size_t maxSize) override;
+    void setRawFrameCacheSize(size_t maxSize) override;
+    void setThreadPoolSizes(int ioThreads, int processingThreads, StorageType storageType) override;
+    bool setPreHydrate(MountId mountId, bool enabled) override;
+    std::optional<HydrationProgress> getHydrationProgress(MountId mountId) override;
 
 private:
     MountId mNextMountId;
     std::map<MountId, std::unique_ptr<Session>> mMountedFiles;
+    std::mutex mMountMutex; // Clips may be mounted from several threads at once
     std::unique_ptr<BS::thread_pool> mIoThreadPool;
     std::unique_ptr<BS::thread_pool> mProcessingThreadPool;
+    std::unique_ptr<Scheduler> mFrameScheduler;    // Shares the IO pool between the mounts
+    std::unique_ptr<BufferPool<char>> mBufferPool; // Outlives the cache, which holds its buffers
+    std::unique_ptr<BufferPool<uint8_t>> mFrameBufferPool; // Decoded frames of all mounts, outlives the raw frame cache
     std::unique_ptr<LRUCache> mCache;
+    std::unique_ptr<LRUCache> mHeaderCache;
+    std::unique_ptr<RawFrameCache> mRawFrameCache;
 };
 
 } // namespace motioncam
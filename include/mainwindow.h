@@ -6,6 +6,8 @@
 #include <QMainWindow>
 #include <QList>
 #include <QString>
+#include <QStringList>
+#include <QThreadPool>
 
 namespace motioncam {
     struct MountedFile {
@@ -78,18 +80,26 @@ private slots:
     void playFile(const QString& path);
     void openMountedDirectory(QWidget* fileWidget);
     void removeFile(QWidget* fileWidget);
+    void exportStats(QWidget* fileWidget);
+    void onFileMounted(QWidget* fileWidget, const QString& filePath, motioncam::MountId mountId, const QString& error);
 
 private:
     void saveSettings();
     void restoreSettings();
     void updateUi();
     void updateFpsLabels();
+    void updateStatsLabels();
+    void updateDiskCache();
+    void updatePerformanceSettings();
 
 private:
     Ui::MainWindow *ui;
     std::unique_ptr<motioncam::IFuseFileSystem> mFuseFilesystem;
     QList<motioncam::MountedFile> mMountedFiles;
+    QStringList mPendingMounts;     // Clips still being scanned
+    QThreadPool mMountThreadPool;
     QString mCacheRootFolder;
+    int mDiskCacheSizeGb;
     int mDraftQuality;
     std::string mCFRTarget;
     std::string mCropTarget;    
@@ -8,63 +8,55 @@
 
 namespace motioncam {
 
-struct DirEntry {
-    std::wstring FileName;
-    bool IsDirectory;
-    INT64 FileSize;
-};
-
+// Tracks the state of a single ProjFS directory enumeration. Entries are streamed straight from the
+// virtual file system, which lists them in the order PrjFileNameCompare() expects, so all we need
+// to remember between GetDirEnum callbacks is the search expression and where we stopped.
 class DirInfo {
 
 public:
 
-    // Constructs a new empty DirInfo, initializing it with the name of the directory it represents.
+    // Constructs a new DirInfo, initializing it with the name of the directory it represents.
     DirInfo(PCWSTR FilePathName);
 
-    // Adds a DirEntry to the list using the given name.  The entry gets marked as a directory.
-    void FillDirEntry(LPCWSTR DirName);
-
-    // Adds a DirEntry to the list, using the given name and size.  The entry gets marked as a file.
-    void FillFileEntry(LPCWSTR FileName, INT64 FileSize);
+    // Captures the search expression. ProjFS only guarantees it is passed on the first callback of an
+    // enumeration (or after a restart), so it has to be kept for the rest of the enumeration.
+    void SetSearchExpression(PCWSTR SearchExpression);
 
-    // Sorts the entries in the DirInfo object and marks the object as being fully populated.
-    void SortEntriesAndMarkFilled();
+    // Returns true if the search expression has been captured.
+    bool HasSearchExpression();
 
-    // Returns true if the DirInfo object has been populated with entries.
-    bool EntriesFilled();
+    // Returns true if the file name matches the captured search expression.
+    bool Matches(PCWSTR FileName);
 
-    // Returns true if CurrentBasicInfo() and CurrentFileName() will return valid values. 
-    bool CurrentIsValid();
+    // Returns the offset of the next entry to return to ProjFS.
+    size_t NextOffset();
 
-    // Returns a PRJ_FILE_BASIC_INFO populated with the information for the current item.
-    PRJ_FILE_BASIC_INFO CurrentBasicInfo();
+    // Sets the offset of the next entry to return to ProjFS.
+    void SetNextOffset(size_t Offset);
 
-    // Returns the file name for the current item.
-    PCWSTR CurrentFileName();
+    // Converts a UTF-8 file name into a buffer owned by this DirInfo. The returned pointer is only
+    // valid until the next call, which lets us fill entries without allocating for each one.
+    PCWSTR ConvertFileName(const std::string& FileName);
 
-    // Moves the internal index to the next DirEntry item.  Returns false if there are no more items.
-    bool MoveNext();
-
-    // Deletes all the DirEntry items in the DirInfo object.
+    // Restarts the enumeration from the first entry.
     void Reset();
 
 private:
 
-    // Adds a DirEntry to the list, using the given name, size.  Allows the caller to specify whether
-    // it should be marked as a directory or not.
-    void FillItemEntry(LPCWSTR FileName, INT64 FileSize, bool IsDirectory);
-
     // Stores the name of the directory this DirInfo represents.
     std::wstring _filePathName;
 
-    // The index of the item in _entries that CurrentBasicInfo() and CurrentFileName() will return.
-    int _currIndex;
+    // The search expression captured on the first callback.
+    std::wstring _searchExpression;
+
+    // Marks whether or not the search expression has been captured.
+    bool _hasSearchExpression;
 
-    // Marks whether or not this DirInfo has been filled with entries.
-    bool _entriesFilled;
+    // The offset of the entry the next GetDirEnum callback will start from.
+    size_t _nextOffset;
 
-    // The list of entries in the directory this DirInfo represents.
-    std::vector<DirEntry> _entries;
+    // Scratch buffer used to convert file names.
+    std::vector<wchar_t> _nameBuffer;
 };
 
 }
@@ -0,0 +1,211 @@
+#include "AccessTrace.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <stdexcept>
+
+namespace motioncam {
+
+namespace {
+    constexpr char MAGIC[] = { 'M', 'C', 'F', 'S', 'T', 'R', 'C' };
+    constexpr uint8_t VERSION = 1;
+
+    constexpr uint8_t PATH_RECORD = 0;
+    constexpr uint8_t ACCESS_RECORD = 1;
+
+    constexpr size_t FLUSH_SIZE = 64 * 1024;
+
+    template<typename T>
+    void put(std::vector<char>& buffer, T value) {
+        for(size_t i = 0; i < sizeof(T); ++i)
+            buffer.push_back(static_cast<char>((static_cast<uint64_t>(value) >> (8 * i)) & 0xFF));
+    }
+
+    template<typename T>
+    T get(std::ifstream& file) {
+        unsigned char bytes[sizeof(T)];
+
+        if(!file.read(reinterpret_cast<char*>(bytes), sizeof(T)))
+            throw std::runtime_error("Truncated trace");
+
+        uint64_t value = 0;
+        for(size_t i = 0; i < sizeof(T); ++i)
+            value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+
+        return static_cast<T>(value);
+    }
+}
+
+TraceWriter::TraceWriter(const std::string& path, FileRenderOptions options, int draftScale) :
+    mStart(std::chrono::steady_clock::now()),
+    mFile(path, std::ios::binary | std::ios::trunc) {
+
+    if(!mFile)
+        throw std::runtime_error("Failed to create trace " + path);
+
+    mBuffer.insert(mBuffer.end(), std::begin(MAGIC), std::end(MAGIC));
+    put<uint8_t>(mBuffer, VERSION);
+    put<uint32_t>(mBuffer, static_cast<uint32_t>(options));
+    put<int32_t>(mBuffer, draftScale);
+}
+
+TraceWriter::~TraceWriter() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    flush();
+}
+
+TraceWriter::Event TraceWriter::begin(TraceOp op, const std::string& path, uint64_t offset, uint32_t length) {
+    const auto startUs = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mStart).count());
+
+    uint32_t thread;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto [it, inserted] = mThreads.try_emplace(std::this_thread::get_id(), static_cast<uint32_t>(mThreads.size()));
+        thread = it->second;
+    }
+
+    return Event{ op, path, offset, length, startUs, thread };
+}
+
+void TraceWriter::end(const Event& event, int32_t result) {
+    const auto nowUs = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mStart).count());
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto [path, inserted] = mPaths.try_emplace(event.path, static_cast<uint32_t>(mPaths.size()));
+
+    if(inserted) {
+        const auto len = static_cast<uint16_t>((std::min)(event.path.size(), static_cast<size_t>(UINT16_MAX)));
+
+        put<uint8_t>(mBuffer, PATH_RECORD);
+        put<uint32_t>(mBuffer, path->second);
+        put<uint16_t>(mBuffer, len);
+        mBuffer.insert(mBuffer.end(), event.path.begin(), event.path.begin() + len);
+    }
+
+    put<uint8_t>(mBuffer, ACCESS_RECORD);
+    put<uint8_t>(mBuffer, static_cast<uint8_t>(event.op));
+    put<uint64_t>(mBuffer, event.startUs);
+    put<uint32_t>(mBuffer, static_cast<uint32_t>((std::min)(nowUs - event.startUs, static_cast<uint64_t>(UINT32_MAX))));
+    put<uint32_t>(mBuffer, event.thread);
+    put<uint32_t>(mBuffer, path->second);
+    put<uint64_t>(mBuffer, event.offset);
+    put<uint32_t>(mBuffer, event.length);
+    put<int32_t>(mBuffer, result);
+
+    if(mBuffer.size() >= FLUSH_SIZE)
+        flush();
+}
+
+void TraceWriter::flush() {
+    if(mBuffer.empty())
+        return;
+
+    if(!mFile.write(mBuffer.data(), static_cast<std::streamsize>(mBuffer.size())))
+        spdlog::warn("Failed to write trace");
+
+    mBuffer.clear();
+}
+
+TraceReader::TraceReader(const std::string& path) :
+    mFile(path, std::ios::binary),
+    mOptions(RENDER_OPT_NONE),
+    mDraftScale(1) {
+
+    if(!mFile)
+        throw std::runtime_error("Failed to open trace " + path);
+
+    char magic[sizeof(MAGIC)];
+
+    if(!mFile.read(magic, sizeof(magic)) || !std::equal(std::begin(MAGIC), std::end(MAGIC), magic))
+        throw std::runtime_error(path + " is not a trace");
+
+    const auto version = get<uint8_t>(mFile);
+    if(version != VERSION)
+        throw std::runtime_error("Unsupported trace version " + std::to_string(version));
+
+    mOptions = static_cast<FileRenderOptions>(get<uint32_t>(mFile));
+    mDraftScale = get<int32_t>(mFile);
+}
+
+bool TraceReader::next(TraceRecord& record) {
+    for(;;) {
+        const int type = mFile.get();
+        if(type == std::char_traits<char>::eof())
+            return false;
+
+        if(type == PATH_RECORD) {
+            const auto id = get<uint32_t>(mFile);
+            const auto len = get<uint16_t>(mFile);
+
+            std::string path(len, '\0');
+            if(!mFile.read(path.data(), len))
+                throw std::runtime_error("Truncated trace");
+
+            if(id >= mPaths.size())
+                mPaths.resize(id + 1);
+
+            mPaths[id] = std::move(path);
+        }
+        else if(type == ACCESS_RECORD) {
+            record.op = static_cast<TraceOp>(get<uint8_t>(mFile));
+            record.timeUs = get<uint64_t>(mFile);
+            record.latencyUs = get<uint32_t>(mFile);
+            record.thread = get<uint32_t>(mFile);
+
+            const auto pathId = get<uint32_t>(mFile);
+            if(pathId >= mPaths.size())
+                throw std::runtime_error("Trace refers to an unknown path");
+
+            record.path = mPaths[pathId];
+            record.offset = get<uint64_t>(mFile);
+            record.length = get<uint32_t>(mFile);
+            record.result = get<int32_t>(mFile);
+
+            return true;
+        }
+        else {
+            throw std::runtime_error("Corrupt trace");
+        }
+    }
+}
+
+std::unique_ptr<TraceWriter> createTrace(const std::string& name, FileRenderOptions options, int draftScale) {
+    const char* dir = std::getenv("MOTIONCAM_FS_TRACE_DIR");
+    if(!dir || !*dir)
+        return nullptr;
+
+    // One trace per mount, a new one every time it is mounted
+    char timestamp[32];
+    const auto now = std::time(nullptr);
+
+    std::strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", std::localtime(&now));
+
+    const auto path = (std::filesystem::path(dir) / (name + "-" + timestamp + ".mctrace")).string();
+
+    try {
+        std::filesystem::create_directories(dir);
+
+        auto trace = std::make_unique<TraceWriter>(path, options, draftScale);
+
+        spdlog::info("Tracing accesses to {}", path);
+
+        return trace;
+    }
+    catch(std::exception& e) {
+        spdlog::error("Not tracing {} (error: {})", name, e.what());
+    }
+
+    return nullptr;
+}
+
+} // namespace motioncam
@@ -1,5 +1,11 @@
 #include "AudioWriter.h"
 
+#include <bw64/bw64.hpp>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
 namespace motioncam {
     namespace {
         constexpr auto PROJECT = "RAW Video";
@@ -78,18 +84,52 @@ namespace motioncam {
         return std::make_shared<bw64::iXmlChunk>(metadata);
     }
 
-    AudioWriter::AudioWriter(std::vector<uint8_t>& output, int numChannels, int sampleRate, int fpsNum, int fpsDen) : mFd(-1) {
+    static void writeU32(std::vector<uint8_t>& data, size_t offset, uint32_t value) {
+        for(int i = 0; i < 4; ++i)
+            data[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+
+    static void writeU64(std::vector<uint8_t>& data, size_t offset, uint64_t value) {
+        writeU32(data, offset, static_cast<uint32_t>(value));
+        writeU32(data, offset + 4, static_cast<uint32_t>(value >> 32));
+    }
+
+    std::vector<uint8_t> getAudioHeader(int numChannels, int sampleRate, int fpsNum, int fpsDen, uint64_t numFrames) {
         if(numChannels <= 0 || sampleRate <= 0)
             throw std::runtime_error("Invalid format");
 
         std::vector<std::shared_ptr<bw64::Chunk>> additionalChunks;
         additionalChunks.push_back(CreateMetadata(fpsNum, fpsDen));
 
-        mWriter = std::unique_ptr<bw64::Bw64Writer>(new bw64::Bw64Writer(
-                output, numChannels, sampleRate, 16, additionalChunks));
-    }
+        std::vector<uint8_t> header;
+
+        // An empty file, the writer leaves the data chunk last
+        {
+            bw64::Bw64Writer writer(header, numChannels, sampleRate, 16, additionalChunks);
+        }
+
+        // Fill in the sizes the samples would have given it
+        const uint64_t dataSize = numFrames * numChannels * sizeof(int16_t);
+        const uint64_t riffSize = header.size() - 8 + dataSize;
+
+        if(riffSize > UINT32_MAX) {
+            // The JUNK chunk after the RIFF header becomes the ds64 chunk with the 64 bit sizes
+            constexpr size_t DS64_OFFSET = 12;
+
+            writeU32(header, 0, bw64::utils::fourCC("BW64"));
+            writeU32(header, 4, UINT32_MAX);
+            writeU32(header, DS64_OFFSET, bw64::utils::fourCC("ds64"));
+            writeU64(header, DS64_OFFSET + 8, riffSize);
+            writeU64(header, DS64_OFFSET + 16, dataSize);
+            writeU64(header, DS64_OFFSET + 24, 0);
+            writeU32(header, DS64_OFFSET + 32, 0);
+            writeU32(header, header.size() - 4, UINT32_MAX);
+        }
+        else {
+            writeU32(header, 4, static_cast<uint32_t>(riffSize));
+            writeU32(header, header.size() - 4, static_cast<uint32_t>(dataSize));
+        }
 
-    void AudioWriter::write(const std::vector<int16_t>& data, int numFrames) {
-        mWriter->write(data.data(), numFrames);
+        return header;
     }
 }
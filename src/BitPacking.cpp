@@ -0,0 +1,496 @@
+#include "BitPacking.h"
+
+#include <spdlog/spdlog.h>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define MOTIONCAM_X86 1
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define MOTIONCAM_NEON 1
+    #include <arm_neon.h>
+#endif
+
+// GCC and Clang only emit SSE4/AVX2 instructions in functions that ask for them, MSVC always does
+#if defined(MOTIONCAM_X86) && (defined(__GNUC__) || defined(__clang__))
+    #define TARGET_SSE41 __attribute__((target("sse4.1")))
+    #define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+    #define TARGET_SSE41
+    #define TARGET_AVX2
+#endif
+
+namespace motioncam {
+namespace bitpacking {
+
+namespace {
+    void encodeTo10Bit(
+        const uint16_t* srcPtr,
+        uint8_t* dstPtr,
+        uint32_t width,
+        uint32_t height)
+    {
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x+=4) {
+                const uint16_t p0 = srcPtr[0];
+                const uint16_t p1 = srcPtr[1];
+                const uint16_t p2 = srcPtr[2];
+                const uint16_t p3 = srcPtr[3];
+
+                dstPtr[0] = p0 >> 2;
+                dstPtr[1] = ((p0 & 0x03) << 6) | (p1 >> 4);
+                dstPtr[2] = ((p1 & 0x0F) << 4) | (p2 >> 6);
+                dstPtr[3] = ((p2 & 0x3F) << 2) | (p3 >> 8);
+                dstPtr[4] = p3 & 0xFF;
+
+                srcPtr += 4;
+                dstPtr += 5;
+            }
+        }
+    }
+
+    void encodeTo12Bit(
+        const uint16_t* srcPtr,
+        uint8_t* dstPtr,
+        uint32_t width,
+        uint32_t height)
+    {
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x+=2) {
+                const uint16_t p0 = srcPtr[0];
+                const uint16_t p1 = srcPtr[1];
+
+                dstPtr[0] = p0 >> 4;
+                dstPtr[1] = ((p0 & 0x0F) << 4) | (p1 >> 8);
+                dstPtr[2] = p1 & 0xFF;
+
+                srcPtr += 2;
+                dstPtr += 3;
+            }
+        }
+    }
+
+    void encodeTo14Bit(
+        const uint16_t* srcPtr,
+        uint8_t* dstPtr,
+        uint32_t width,
+        uint32_t height)
+    {
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x+=4) {
+                const uint16_t p0 = srcPtr[0];
+                const uint16_t p1 = srcPtr[1];
+                const uint16_t p2 = srcPtr[2];
+                const uint16_t p3 = srcPtr[3];
+
+                dstPtr[0] = p0 >> 6;
+                dstPtr[1] = ((p0 & 0x3F) << 2) | (p1 >> 12);
+                dstPtr[2] = (p1 >> 4) & 0xFF;
+                dstPtr[3] = ((p1 & 0x0F) << 4) | (p2 >> 10);
+                dstPtr[4] = (p2 >> 2) & 0xFF;
+                dstPtr[5] = ((p2 & 0x03) << 6) | (p3 >> 8);
+                dstPtr[6] = p3 & 0xFF;
+
+                srcPtr += 4;
+                dstPtr += 7;
+            }
+        }
+    }
+
+    void encodeTo8Bit(
+        const uint16_t* srcPtr,
+        uint8_t* dstPtr,
+        uint32_t width,
+        uint32_t height)
+    {
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x++) {
+                const uint16_t p0 = srcPtr[0];
+                // Store lower 8 bits directly
+                dstPtr[0] = p0 & 0xFF;
+
+                srcPtr += 1;
+                dstPtr += 1;
+            }
+        }
+    }
+
+    void encodeTo6Bit(
+        const uint16_t* srcPtr,
+        uint8_t* dstPtr,
+        uint32_t width,
+        uint32_t height)
+    {
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x+=4) {
+                const uint16_t p0 = srcPtr[0];
+                const uint16_t p1 = srcPtr[1];
+                const uint16_t p2 = srcPtr[2];
+                const uint16_t p3 = srcPtr[3];
+
+                // Pack 4 pixels (6 bits each) into 3 bytes - use lower 6 bits
+                const uint8_t v0 = p0 & 0x3F;
+                const uint8_t v1 = p1 & 0x3F;
+                const uint8_t v2 = p2 & 0x3F;
+                const uint8_t v3 = p3 & 0x3F;
+
+                dstPtr[0] = (v0 << 2) | (v1 >> 4);
+                dstPtr[1] = ((v1 & 0x0F) << 4) | (v2 >> 2);
+                dstPtr[2] = ((v2 & 0x03) << 6) | v3;
+
+                srcPtr += 4;
+                dstPtr += 3;
+            }
+        }
+    }
+
+    void encodeTo4Bit(
+        const uint16_t* srcPtr,
+        uint8_t* dstPtr,
+        uint32_t width,
+        uint32_t height)
+    {
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x+=2) {
+                const uint16_t p0 = srcPtr[0];
+                const uint16_t p1 = srcPtr[1];
+
+                // Pack 2 pixels (4 bits each) into 1 byte - use lower 4 bits
+                const uint8_t v0 = p0 & 0x0F;
+                const uint8_t v1 = p1 & 0x0F;
+
+                dstPtr[0] = (v0 << 4) | v1;
+
+                srcPtr += 2;
+                dstPtr += 1;
+            }
+        }
+    }
+
+    void encodeTo2Bit(
+        const uint16_t* srcPtr,
+        uint8_t* dstPtr,
+        uint32_t width,
+        uint32_t height)
+    {
+        for(int y = 0; y < height; y++) {
+            for(int x = 0; x < width; x+=4) {
+                const uint16_t p0 = srcPtr[0];
+                const uint16_t p1 = srcPtr[1];
+                const uint16_t p2 = srcPtr[2];
+                const uint16_t p3 = srcPtr[3];
+
+                // Try different bit order: p3 in bits 1-0, p2 in bits 3-2, p1 in bits 5-4, p0 in bits 7-6
+                dstPtr[0] = ((p0 & 0x03) << 6) | 
+                           ((p1 & 0x03) << 4) | 
+                           ((p2 & 0x03) << 2) | 
+                           (p3 & 0x03);
+
+                srcPtr += 4;
+                dstPtr += 1;
+            }
+        }
+    }
+
+    //
+    // The vectorised packers handle 8, 10, 12 and 14 bits, the other depths are rare enough to
+    // stay scalar. Each step takes 8 pixels and writes encodeBits bytes, the same as the scalar
+    // version. Neighbouring pixels are merged into 32 bit lanes (p0 << bits | p1), for 10 and 14
+    // bits the lanes are merged again into 64 bit lanes, then a byte shuffle picks out the packed
+    // bytes most significant first. Stores are always 16 bytes wide, the bytes past the packed
+    // ones get overwritten by the next step so the loops stop 16 bytes short of the end.
+    //
+
+    // Byte shuffles, -1 clears the byte
+    alignas(16) constexpr int8_t SHUFFLE_8[16]  = { 0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1 };
+    alignas(16) constexpr int8_t SHUFFLE_10[16] = { 4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1 };
+    alignas(16) constexpr int8_t SHUFFLE_12[16] = { 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 };
+    alignas(16) constexpr int8_t SHUFFLE_14[16] = { 6, 5, 4, 3, 2, 1, 0, 14, 13, 12, 11, 10, 9, 8, -1, -1 };
+
+    template<int Bits>
+    constexpr const int8_t* getShuffle() {
+        if constexpr(Bits == 8)
+            return SHUFFLE_8;
+        else if constexpr(Bits == 10)
+            return SHUFFLE_10;
+        else if constexpr(Bits == 12)
+            return SHUFFLE_12;
+        else
+            return SHUFFLE_14;
+    }
+
+#if defined(MOTIONCAM_X86)
+    SimdLevel detectSimdLevel() {
+    #if defined(_MSC_VER)
+        int info[4];
+
+        __cpuid(info, 0);
+        const int maxLeaf = info[0];
+
+        __cpuid(info, 1);
+        const bool sse41 = (info[2] & (1 << 19)) != 0;
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+
+        bool avx2 = false;
+
+        // The OS also has to save the YMM registers
+        if(maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6) {
+            __cpuidex(info, 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+        }
+    #else
+        __builtin_cpu_init();
+
+        const bool sse41 = __builtin_cpu_supports("sse4.1");
+        const bool avx2 = __builtin_cpu_supports("avx2");
+    #endif
+
+        if(avx2)
+            return SimdLevel::AVX2;
+        if(sse41)
+            return SimdLevel::SSE41;
+
+        return SimdLevel::None;
+    }
+
+    template<int Bits>
+    TARGET_SSE41 size_t packSSE41(const uint16_t* src, uint8_t* dst, size_t numPixels, size_t dstSize) {
+        const __m128i shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>(getShuffle<Bits>()));
+        const __m128i valueMask = _mm_set1_epi16((1 << Bits) - 1);
+        const __m128i lowMask32 = _mm_set1_epi32(0xFFFF);
+        const __m128i lowMask64 = _mm_set1_epi64x(0xFFFFFFFF);
+
+        size_t i = 0;
+        size_t o = 0;
+
+        for(; i + 8 <= numPixels && o + 16 <= dstSize; i += 8, o += Bits) {
+            __m128i p = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), valueMask);
+
+            if constexpr(Bits != 8) {
+                p = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, lowMask32), Bits), _mm_srli_epi32(p, 16));
+
+                if constexpr(Bits != 12)
+                    p = _mm_or_si128(_mm_slli_epi64(_mm_and_si128(p, lowMask64), 2 * Bits), _mm_srli_epi64(p, 32));
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + o), _mm_shuffle_epi8(p, shuffle));
+        }
+
+        return i;
+    }
+
+    // Same as packSSE41() on 16 pixels at a time, the shuffle works within each 128 bit half
+    template<int Bits>
+    TARGET_AVX2 size_t packAVX2(const uint16_t* src, uint8_t* dst, size_t numPixels, size_t dstSize) {
+        const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(getShuffle<Bits>())));
+        const __m256i valueMask = _mm256_set1_epi16((1 << Bits) - 1);
+        const __m256i lowMask32 = _mm256_set1_epi32(0xFFFF);
+        const __m256i lowMask64 = _mm256_set1_epi64x(0xFFFFFFFF);
+
+        size_t i = 0;
+        size_t o = 0;
+
+        for(; i + 16 <= numPixels && o + Bits + 16 <= dstSize; i += 16, o += 2 * Bits) {
+            __m256i p = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)), valueMask);
+
+            if constexpr(Bits != 8) {
+                p = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, lowMask32), Bits), _mm256_srli_epi32(p, 16));
+
+                if constexpr(Bits != 12)
+                    p = _mm256_or_si256(_mm256_slli_epi64(_mm256_and_si256(p, lowMask64), 2 * Bits), _mm256_srli_epi64(p, 32));
+            }
+
+            p = _mm256_shuffle_epi8(p, shuffle);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + o), _mm256_castsi256_si128(p));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + o + Bits), _mm256_extracti128_si256(p, 1));
+        }
+
+        return i;
+    }
+#elif defined(MOTIONCAM_NEON)
+    SimdLevel detectSimdLevel() {
+        // Always there on 64 bit ARM
+        return SimdLevel::NEON;
+    }
+
+    template<int Bits>
+    size_t packNEON(const uint16_t* src, uint8_t* dst, size_t numPixels, size_t dstSize) {
+        const uint8x16_t shuffle = vld1q_u8(reinterpret_cast<const uint8_t*>(getShuffle<Bits>()));
+        const uint16x8_t valueMask = vdupq_n_u16((1 << Bits) - 1);
+        const uint32x4_t lowMask32 = vdupq_n_u32(0xFFFF);
+        const uint64x2_t lowMask64 = vdupq_n_u64(0xFFFFFFFF);
+
+        size_t i = 0;
+        size_t o = 0;
+
+        for(; i + 8 <= numPixels && o + 16 <= dstSize; i += 8, o += Bits) {
+            const uint16x8_t p = vandq_u16(vld1q_u16(src + i), valueMask);
+            uint8x16_t bytes;
+
+            if constexpr(Bits == 8) {
+                bytes = vreinterpretq_u8_u16(p);
+            }
+            else {
+                const uint32x4_t x = vreinterpretq_u32_u16(p);
+                const uint32x4_t pairs = vorrq_u32(vshlq_n_u32(vandq_u32(x, lowMask32), Bits), vshrq_n_u32(x, 16));
+
+                if constexpr(Bits == 12) {
+                    bytes = vreinterpretq_u8_u32(pairs);
+                }
+                else {
+                    const uint64x2_t y = vreinterpretq_u64_u32(pairs);
+                    bytes = vreinterpretq_u8_u64(vorrq_u64(vshlq_n_u64(vandq_u64(y, lowMask64), 2 * Bits), vshrq_n_u64(y, 32)));
+                }
+            }
+
+            vst1q_u8(dst + o, vqtbl1q_u8(bytes, shuffle));
+        }
+
+        return i;
+    }
+#else
+    SimdLevel detectSimdLevel() {
+        return SimdLevel::None;
+    }
+#endif
+
+    const char* getSimdName(SimdLevel level) {
+        switch(level) {
+        case SimdLevel::SSE41:  return "SSE4.1";
+        case SimdLevel::AVX2:   return "AVX2";
+        case SimdLevel::NEON:   return "NEON";
+        default:                return "none";
+        }
+    }
+
+    // Returns how many pixels were packed, the caller packs the rest
+    size_t packVectorised(const uint16_t* src, uint8_t* dst, size_t numPixels, size_t dstSize, unsigned short encodeBits, SimdLevel level) {
+#if defined(MOTIONCAM_X86)
+        switch(level) {
+        case SimdLevel::AVX2:
+            switch(encodeBits) {
+            case 8:     return packAVX2<8>(src, dst, numPixels, dstSize);
+            case 10:    return packAVX2<10>(src, dst, numPixels, dstSize);
+            case 12:    return packAVX2<12>(src, dst, numPixels, dstSize);
+            case 14:    return packAVX2<14>(src, dst, numPixels, dstSize);
+            default:    return 0;
+            }
+
+        case SimdLevel::SSE41:
+            switch(encodeBits) {
+            case 8:     return packSSE41<8>(src, dst, numPixels, dstSize);
+            case 10:    return packSSE41<10>(src, dst, numPixels, dstSize);
+            case 12:    return packSSE41<12>(src, dst, numPixels, dstSize);
+            case 14:    return packSSE41<14>(src, dst, numPixels, dstSize);
+            default:    return 0;
+            }
+
+        default:
+            return 0;
+        }
+#elif defined(MOTIONCAM_NEON)
+        if(level != SimdLevel::NEON)
+            return 0;
+
+        switch(encodeBits) {
+        case 8:     return packNEON<8>(src, dst, numPixels, dstSize);
+        case 10:    return packNEON<10>(src, dst, numPixels, dstSize);
+        case 12:    return packNEON<12>(src, dst, numPixels, dstSize);
+        case 14:    return packNEON<14>(src, dst, numPixels, dstSize);
+        default:    return 0;
+        }
+#else
+        return 0;
+#endif
+    }
+}
+
+SimdLevel getSimdLevel() {
+    static const SimdLevel level = [] {
+        const auto detected = detectSimdLevel();
+        spdlog::info("Bit packing SIMD support: {}", getSimdName(detected));
+        return detected;
+    }();
+
+    return level;
+}
+
+std::pair<uint32_t, uint32_t> getPackedGroup(unsigned short encodeBits) {
+    switch(encodeBits) {
+    case 2:     return { 4, 1 };
+    case 4:     return { 2, 1 };
+    case 6:     return { 4, 3 };
+    case 8:     return { 1, 1 };
+    case 10:    return { 4, 5 };
+    case 12:    return { 2, 3 };
+    case 14:    return { 4, 7 };
+    default:    return { 1, 2 };
+    }
+}
+
+void packScalar(const uint16_t* src, uint8_t* dst, uint32_t width, uint32_t height, unsigned short encodeBits) {
+    switch(encodeBits) {
+    case 2:
+        encodeTo2Bit(src, dst, width, height);
+        break;
+    case 4:
+        encodeTo4Bit(src, dst, width, height);
+        break;
+    case 6:
+        encodeTo6Bit(src, dst, width, height);
+        break;
+    case 8:
+        encodeTo8Bit(src, dst, width, height);
+        break;
+    case 10:
+        encodeTo10Bit(src, dst, width, height);
+        break;
+    case 12:
+        encodeTo12Bit(src, dst, width, height);
+        break;
+    case 14:
+        encodeTo14Bit(src, dst, width, height);
+        break;
+    default:
+        std::memcpy(dst, src, sizeof(uint16_t) * width * height);
+        break;
+    }
+}
+
+void pack(const uint16_t* src, uint8_t* dst, uint32_t width, uint32_t height, unsigned short encodeBits) {
+    pack(src, dst, width, height, encodeBits, getSimdLevel());
+}
+
+void pack(const uint16_t* src, uint8_t* dst, uint32_t width, uint32_t height, unsigned short encodeBits, SimdLevel level) {
+    const auto [groupPixels, groupBytes] = getPackedGroup(encodeBits);
+
+    // Rows are padded to whole groups, so the image packs the same as one long row
+    const size_t numPixels = static_cast<size_t>((width + groupPixels - 1) / groupPixels) * groupPixels * height;
+    const size_t dstSize = numPixels / groupPixels * groupBytes;
+
+    const size_t packed = packVectorised(src, dst, numPixels, dstSize, encodeBits, level);
+
+    if(packed == 0) {
+        packScalar(src, dst, width, height, encodeBits);
+        return;
+    }
+
+    // The last few pixels
+    if(packed < numPixels) {
+        packScalar(
+            src + packed,
+            dst + packed / groupPixels * groupBytes,
+            static_cast<uint32_t>(numPixels - packed),
+            1,
+            encodeBits);
+    }
+}
+
+} // namespace bitpacking
+} // namespace motioncam
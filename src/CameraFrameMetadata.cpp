@@ -4,6 +4,70 @@ using json = nlohmann::json;
 
 namespace motioncam {
 
+namespace {
+    std::shared_ptr<const LensShadingMap> parseShadingMap(const json& j) {
+        auto it = j.find("lensShadingMap");
+        if (it == j.end() || !it->is_array())
+            return nullptr;
+
+        auto shadingMap = std::make_shared<LensShadingMap>();
+        shadingMap->reserve(it->size()); // Should be 4 channels
+
+        for (const auto& channel : *it) {
+            if (!channel.is_array())
+                continue;
+
+            // Parse 1D array for this channel
+            std::vector<float> channelData1D;
+            channelData1D.reserve(channel.size());
+
+            for (const auto& value : channel)
+                channelData1D.push_back(value.get<float>());
+
+            shadingMap->emplace_back(std::move(channelData1D));
+        }
+
+        return shadingMap;
+    }
+
+    // True if the map in j has the same values as shadingMap, without building it
+    bool isSameShadingMap(const json& j, const LensShadingMap& shadingMap) {
+        auto it = j.find("lensShadingMap");
+        if (it == j.end() || !it->is_array())
+            return false;
+
+        size_t c = 0;
+
+        for (const auto& channel : *it) {
+            if (!channel.is_array())
+                continue;
+
+            if (c >= shadingMap.size() || channel.size() != shadingMap[c].size())
+                return false;
+
+            const auto& values = shadingMap[c++];
+            size_t i = 0;
+
+            for (const auto& value : channel) {
+                if (value.get<float>() != values[i++])
+                    return false;
+            }
+        }
+
+        return c == shadingMap.size();
+    }
+
+    template<size_t N, typename T>
+    void parseArray(const json& j, const char* name, std::array<T, N>& dst) {
+        auto it = j.find(name);
+        if (it == j.end() || !it->is_array())
+            return;
+
+        for (size_t i = 0; i < N && i < it->size(); ++i)
+            dst[i] = (*it)[i].get<T>();
+    }
+}
+
 CameraFrameMetadata CameraFrameMetadata::parse(const json& j) {
     CameraFrameMetadata frame;
 
@@ -24,24 +88,7 @@ CameraFrameMetadata CameraFrameMetadata::parse(const json& j) {
     }
 
     // Parse lens shading map (4 channels x height x width)
-    if (j.contains("lensShadingMap") && j["lensShadingMap"].is_array()) {
-        auto shadingMapArray = j["lensShadingMap"];
-        frame.lensShadingMap.reserve(shadingMapArray.size()); // Should be 4 channels
-
-        for (const auto& channel : shadingMapArray) {
-            if (!channel.is_array())
-                continue;
-
-            // Parse 1D array for this channel
-            std::vector<float> channelData1D;
-            channelData1D.reserve(channel.size());
-
-            for (const auto& value : channel)
-                channelData1D.push_back(value.get<float>());
-
-            frame.lensShadingMap.emplace_back(channelData1D);
-        }
-    }
+    frame.lensShadingMap = parseShadingMap(j);
 
     if (j.contains("noiseProfile") && j["noiseProfile"].is_array()) {
         auto noiseArray = j["noiseProfile"];
@@ -87,6 +134,32 @@ CameraFrameMetadata CameraFrameMetadata::limitedParse(const json& j) {
     return frame;
 }
 
+CameraFrameMetadata CameraFrameMetadata::renderParse(const json& j, const std::shared_ptr<const LensShadingMap>& previousShadingMap) {
+    CameraFrameMetadata frame{};
+
+    parseArray(j, "asShotNeutral", frame.asShotNeutral);
+    parseArray(j, "dynamicBlackLevel", frame.dynamicBlackLevel);
+
+    if (previousShadingMap && isSameShadingMap(j, *previousShadingMap))
+        frame.lensShadingMap = previousShadingMap;
+    else
+        frame.lensShadingMap = parseShadingMap(j);
+
+    frame.dynamicWhiteLevel = j.value("dynamicWhiteLevel", 0.0);
+    frame.exposureTime = j.value("exposureTime", 0.0);
+    frame.height = j.value("height", 0);
+    frame.iso = j.value("iso", 0);
+    frame.lensShadingMapHeight = j.value("lensShadingMapHeight", 0);
+    frame.lensShadingMapWidth = j.value("lensShadingMapWidth", 0);
+    frame.needRemosaic = j.value("needRemosaic", false);
+    frame.orientation = static_cast<ScreenOrientation>(j.value("orientation", ScreenOrientation::INVALID));
+    frame.originalHeight = j.value("originalHeight", 0);
+    frame.originalWidth = j.value("originalWidth", 0);
+    frame.width = j.value("width", 0);
+
+    return frame;
+}
+
 CameraFrameMetadata CameraFrameMetadata::parse(const std::string& jsonString) {
     json j = json::parse(jsonString);
     return parse(j);
@@ -0,0 +1,219 @@
+#include "ClipIndex.h"
+
+#include <boost/filesystem.hpp>
+#include <spdlog/spdlog.h>
+
+#include <fstream>
+
+namespace motioncam {
+
+namespace {
+    // Increment when the layout of the index or the way DNG sizes are calculated changes
+    constexpr int INDEX_VERSION = 2;
+
+    struct SourceInfo {
+        uint64_t size;
+        int64_t modified;
+    };
+
+    std::optional<SourceInfo> getSourceInfo(const std::string& srcPath) {
+        boost::system::error_code ec;
+
+        auto size = boost::filesystem::file_size(srcPath, ec);
+        if(ec)
+            return std::nullopt;
+
+        auto modified = boost::filesystem::last_write_time(srcPath, ec);
+        if(ec)
+            return std::nullopt;
+
+        return SourceInfo{ static_cast<uint64_t>(size), static_cast<int64_t>(modified) };
+    }
+
+    // Only the settings that change the layout of the DNG are part of the key
+    std::string getSettingsKey(const RenderSettings& settings) {
+        return
+            std::to_string(static_cast<unsigned int>(settings.options)) + "|" +
+            std::to_string(settings.draftScale) + "|" +
+            settings.cropTarget + "|" +
+            settings.cameraModel + "|" +
+            settings.levels + "|" +
+            logTransformModeToString(settings.logTransform) + "|" +
+            quadBayerModeToString(settings.quadBayerOption);
+    }
+}
+
+ClipIndex::ClipIndex(const std::string& indexPath, const std::string& srcPath) :
+    mIndexPath(indexPath),
+    mSrcPath(srcPath),
+    mMedianFrameRate(0),
+    mAverageFrameRate(0) {
+}
+
+bool ClipIndex::load() {
+    auto sourceInfo = getSourceInfo(mSrcPath);
+    if(!sourceInfo)
+        return false;
+
+    std::ifstream file(mIndexPath, std::ios::binary);
+    if(!file)
+        return false;
+
+    try {
+        auto j = nlohmann::json::parse(file);
+
+        if(j.at("version").get<int>() != INDEX_VERSION ||
+           j.at("sourceSize").get<uint64_t>() != sourceInfo->size ||
+           j.at("sourceModified").get<int64_t>() != sourceInfo->modified)
+        {
+            spdlog::info("Ignoring out of date index {}", mIndexPath);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        mFrames = j.at("frames").get<std::vector<int64_t>>();
+        mMedianFrameRate = j.at("medianFrameRate").get<float>();
+        mAverageFrameRate = j.at("averageFrameRate").get<float>();
+        mContainerMetadata = j.at("containerMetadata");
+        mFirstFrameMetadata = j.at("firstFrameMetadata");
+
+        if(j.contains("baselineExposure"))
+            mBaselineExposure = j["baselineExposure"].get<double>();
+
+        if(j.contains("audio")) {
+            const auto& audio = j["audio"];
+
+            mAudioTrack = AudioTrack{
+                audio.at("numChannels").get<int>(), audio.at("sampleRate").get<int>(), audio.at("numFrames").get<uint64_t>() };
+        }
+
+        for(const auto& [settingsKey, layout] : j.at("dngLayouts").items())
+            mDngLayouts[settingsKey] = DngLayout{
+                layout.at("size").get<size_t>(), layout.at("stripOffset").get<size_t>(), layout.at("stripSize").get<size_t>() };
+    }
+    catch(nlohmann::json::exception& e) {
+        spdlog::warn("Failed to read index {} (error: {})", mIndexPath, e.what());
+        return false;
+    }
+
+    return !mFrames.empty();
+}
+
+void ClipIndex::save() {
+    auto sourceInfo = getSourceInfo(mSrcPath);
+    if(!sourceInfo)
+        return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    nlohmann::json j;
+
+    j["version"] = INDEX_VERSION;
+    j["sourceSize"] = sourceInfo->size;
+    j["sourceModified"] = sourceInfo->modified;
+    j["frames"] = mFrames;
+    j["medianFrameRate"] = mMedianFrameRate;
+    j["averageFrameRate"] = mAverageFrameRate;
+    j["containerMetadata"] = mContainerMetadata;
+    j["firstFrameMetadata"] = mFirstFrameMetadata;
+    j["dngLayouts"] = nlohmann::json::object();
+
+    for(const auto& [settingsKey, layout] : mDngLayouts)
+        j["dngLayouts"][settingsKey] = { { "size", layout.size }, { "stripOffset", layout.stripOffset }, { "stripSize", layout.stripSize } };
+
+    if(mBaselineExposure)
+        j["baselineExposure"] = *mBaselineExposure;
+
+    if(mAudioTrack)
+        j["audio"] = {
+            { "numChannels", mAudioTrack->numChannels },
+            { "sampleRate", mAudioTrack->sampleRate },
+            { "numFrames", mAudioTrack->numFrames } };
+
+    // Write to a temporary file first so a crash never leaves a partial index behind
+    const auto tmpPath = mIndexPath + ".tmp";
+
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if(!file) {
+            spdlog::warn("Failed to write index {}", mIndexPath);
+            return;
+        }
+
+        file << j.dump();
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::rename(tmpPath, mIndexPath, ec);
+
+    if(ec) {
+        spdlog::warn("Failed to write index {} (error: {})", mIndexPath, ec.message());
+        boost::filesystem::remove(tmpPath, ec);
+    }
+}
+
+void ClipIndex::setClip(
+    const std::vector<int64_t>& frames,
+    float medianFrameRate,
+    float averageFrameRate,
+    const nlohmann::json& containerMetadata,
+    const nlohmann::json& firstFrameMetadata)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mFrames = frames;
+    mMedianFrameRate = medianFrameRate;
+    mAverageFrameRate = averageFrameRate;
+    mContainerMetadata = containerMetadata;
+    mFirstFrameMetadata = firstFrameMetadata;
+    mBaselineExposure.reset();
+    mDngLayouts.clear();
+    mAudioTrack.reset();
+}
+
+std::optional<double> ClipIndex::getBaselineExposure() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mBaselineExposure;
+}
+
+void ClipIndex::setBaselineExposure(double value) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mBaselineExposure = value;
+}
+
+std::optional<DngLayout> ClipIndex::getDngLayout(const RenderSettings& settings) const {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mDngLayouts.find(getSettingsKey(settings));
+    if(it == mDngLayouts.end())
+        return std::nullopt;
+
+    return it->second;
+}
+
+void ClipIndex::setDngLayout(const RenderSettings& settings, const DngLayout& layout) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mDngLayouts[getSettingsKey(settings)] = layout;
+}
+
+std::optional<AudioTrack> ClipIndex::getAudioTrack() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mAudioTrack;
+}
+
+void ClipIndex::setAudioTrack(const AudioTrack& track) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mAudioTrack = track;
+}
+
+std::string ClipIndex::getAudioPath() const {
+    return boost::filesystem::path(mIndexPath).replace_extension(".pcm").string();
+}
+
+} // namespace motioncam
@@ -0,0 +1,47 @@
+#include "DecoderPool.h"
+
+#include <motioncam/Decoder.hpp>
+
+namespace motioncam {
+
+DecoderPool::Lease::Lease(DecoderPool& pool, std::unique_ptr<Decoder> decoder) :
+    mPool(&pool), mDecoder(std::move(decoder)) {
+}
+
+DecoderPool::Lease::Lease(Lease&& other) noexcept :
+    mPool(other.mPool), mDecoder(std::move(other.mDecoder)) {
+}
+
+DecoderPool::Lease::~Lease() {
+    if(mDecoder)
+        mPool->release(std::move(mDecoder));
+}
+
+DecoderPool::DecoderPool(const std::string& path) : mPath(path) {
+}
+
+DecoderPool::~DecoderPool() = default;
+
+DecoderPool::Lease DecoderPool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if(!mIdle.empty()) {
+            auto decoder = std::move(mIdle.back());
+            mIdle.pop_back();
+
+            return Lease(*this, std::move(decoder));
+        }
+    }
+
+    // Opened without the lock, this reads the container index
+    return Lease(*this, std::make_unique<Decoder>(mPath));
+}
+
+void DecoderPool::release(std::unique_ptr<Decoder> decoder) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mIdle.push_back(std::move(decoder));
+}
+
+} // namespace motioncam
@@ -0,0 +1,290 @@
+#include "DiskCache.h"
+#include "BufferPool.h"
+
+#include <BS_thread_pool.hpp>
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <tuple>
+
+namespace fs = boost::filesystem;
+
+namespace motioncam {
+
+namespace {
+    constexpr uint32_t FILE_MAGIC = 0x4d434443; // "MCDC"
+    constexpr uint32_t FILE_VERSION = 2; // Increment when the layout of generated DNGs changes
+    constexpr auto FILE_EXTENSION = ".dngcache";
+
+    // Frames waiting to be written hold on to their memory, stop queueing beyond this
+    constexpr size_t MAX_PENDING_BYTES = 512 * 1024 * 1024;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t keySize;
+        uint32_t crc;
+        uint64_t dataSize;
+    };
+
+    // Files outlive the session, the size and modification time of the clip tell a clip that was
+    // replaced at the same path apart from the one the frames were rendered from
+    std::string getKeyString(const CacheKey& key) {
+        return
+            key.source + "\n" +
+            std::to_string(key.sourceSize) + "\n" +
+            std::to_string(key.sourceModified) + "\n" +
+            std::to_string(key.settingsHash) + "\n" +
+            key.entry.getFullPath().generic_string();
+    }
+
+    std::string getFileName(const std::string& keyString) {
+        std::ostringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0') << std::hash<std::string>{}(keyString) << FILE_EXTENSION;
+
+        return name.str();
+    }
+
+    uint32_t getChecksum(const char* data, size_t size) {
+        boost::crc_32_type crc;
+        crc.process_bytes(data, size);
+
+        return crc.checksum();
+    }
+}
+
+DiskCache::DiskCache(const std::string& path, size_t maxSize, BS::thread_pool& ioThreadPool, BufferPool<char>* bufferPool) :
+    mPath(path),
+    mMaxSize(maxSize),
+    mIoThreadPool(ioThreadPool),
+    mBufferPool(bufferPool),
+    mCurrentSize(0),
+    mPendingBytes(0)
+{
+    scan();
+}
+
+void DiskCache::scan() {
+    boost::system::error_code ec;
+
+    fs::create_directories(mPath, ec);
+    if(ec) {
+        spdlog::error("Failed to create disk cache {} (error: {})", mPath, ec.message());
+        return;
+    }
+
+    // Pick up files from previous sessions, newest first
+    std::vector<std::tuple<std::time_t, std::string, size_t>> files;
+
+    for(fs::directory_iterator it(mPath, ec), end; !ec && it != end; it.increment(ec)) {
+        const auto& filePath = it->path();
+
+        if(!fs::is_regular_file(filePath, ec))
+            continue;
+
+        if(filePath.extension() != FILE_EXTENSION) {
+            // Partially written file
+            if(filePath.extension() == ".tmp")
+                fs::remove(filePath, ec);
+            continue;
+        }
+
+        files.emplace_back(fs::last_write_time(filePath, ec), filePath.filename().string(), fs::file_size(filePath, ec));
+    }
+
+    std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) {
+        return std::get<0>(a) > std::get<0>(b);
+    });
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for(const auto& [modified, name, size] : files) {
+        mFiles.push_back(name);
+        mFileMap[name] = FileItem{ std::prev(mFiles.end()), size };
+        mCurrentSize += size;
+    }
+
+    trim();
+
+    spdlog::info("Disk cache {} has {} frames ({} bytes)", mPath, mFileMap.size(), mCurrentSize);
+}
+
+std::shared_ptr<std::vector<char>> DiskCache::get(const CacheKey& key) {
+    const auto keyString = getKeyString(key);
+    const auto name = getFileName(keyString);
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto it = mFileMap.find(name);
+        if(it == mFileMap.end())
+            return nullptr;
+
+        mFiles.splice(mFiles.begin(), mFiles, it->second.position);
+    }
+
+    const auto filePath = fs::path(mPath) / name;
+
+    boost::system::error_code ec;
+    const auto fileSize = fs::file_size(filePath, ec);
+
+    std::ifstream file(filePath.string(), std::ios::binary);
+
+    FileHeader header;
+    std::string storedKey;
+
+    // The sizes in the header must add up to the file before anything is allocated from them
+    if(!ec &&
+       file.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+       header.magic == FILE_MAGIC &&
+       header.version == FILE_VERSION &&
+       header.keySize == keyString.size() &&
+       fileSize >= sizeof(header) + header.keySize &&
+       header.dataSize == fileSize - sizeof(header) - header.keySize)
+    {
+        storedKey.resize(header.keySize);
+        file.read(storedKey.data(), storedKey.size());
+
+        // Different frame with the same file name, leave it alone
+        if(file && storedKey != keyString)
+            return nullptr;
+
+        auto data = mBufferPool ? mBufferPool->get(header.dataSize) : std::make_shared<std::vector<char>>(header.dataSize);
+
+        if(file.read(data->data(), data->size()) && getChecksum(data->data(), data->size()) == header.crc)
+            return data;
+    }
+
+    spdlog::warn("Removing damaged disk cache file {}", name);
+
+    file.close();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    remove(name);
+
+    return nullptr;
+}
+
+void DiskCache::put(const CacheKey& key, std::shared_ptr<std::vector<char>> value) {
+    if(!value || value->size() > mMaxSize)
+        return;
+
+    auto keyString = getKeyString(key);
+    auto name = getFileName(keyString);
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if(mFileMap.find(name) != mFileMap.end() || mPendingWrites.find(name) != mPendingWrites.end())
+            return;
+
+        if(mPendingBytes + value->size() > MAX_PENDING_BYTES)
+            return;
+
+        mPendingWrites.insert(name);
+        mPendingBytes += value->size();
+    }
+
+    mIoThreadPool.detach_task([self = shared_from_this(), name = std::move(name), keyString = std::move(keyString), value]() {
+        self->write(name, keyString, *value);
+
+        std::lock_guard<std::mutex> lock(self->mMutex);
+
+        self->mPendingWrites.erase(name);
+        self->mPendingBytes -= value->size();
+    });
+}
+
+void DiskCache::write(const std::string& name, const std::string& keyString, const std::vector<char>& value) {
+    const auto filePath = fs::path(mPath) / name;
+    const auto tmpPath = fs::path(mPath) / (name + ".tmp");
+
+    FileHeader header;
+
+    header.magic = FILE_MAGIC;
+    header.version = FILE_VERSION;
+    header.keySize = static_cast<uint32_t>(keyString.size());
+    header.crc = getChecksum(value.data(), value.size());
+    header.dataSize = value.size();
+
+    {
+        std::ofstream file(tmpPath.string(), std::ios::binary | std::ios::trunc);
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(keyString.data(), keyString.size());
+        file.write(value.data(), value.size());
+
+        if(!file) {
+            spdlog::warn("Failed to write disk cache file {}", name);
+
+            file.close();
+
+            boost::system::error_code ec;
+            fs::remove(tmpPath, ec);
+            return;
+        }
+    }
+
+    boost::system::error_code ec;
+    fs::rename(tmpPath, filePath, ec);
+
+    if(ec) {
+        spdlog::warn("Failed to write disk cache file {} (error: {})", name, ec.message());
+        fs::remove(tmpPath, ec);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    add(name, sizeof(header) + keyString.size() + value.size());
+    trim();
+}
+
+size_t DiskCache::size() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mCurrentSize;
+}
+
+// Called with mMutex held
+void DiskCache::add(const std::string& name, size_t size) {
+    auto it = mFileMap.find(name);
+    if(it != mFileMap.end()) {
+        mCurrentSize -= it->second.size;
+        mFiles.erase(it->second.position);
+        mFileMap.erase(it);
+    }
+
+    mFiles.push_front(name);
+    mFileMap[name] = FileItem{ mFiles.begin(), size };
+    mCurrentSize += size;
+}
+
+// Called with mMutex held
+void DiskCache::remove(const std::string& name) {
+    auto it = mFileMap.find(name);
+    if(it == mFileMap.end())
+        return;
+
+    mCurrentSize -= it->second.size;
+    mFiles.erase(it->second.position);
+    mFileMap.erase(it);
+
+    boost::system::error_code ec;
+    fs::remove(fs::path(mPath) / name, ec);
+}
+
+// Called with mMutex held
+void DiskCache::trim() {
+    while(mCurrentSize > mMaxSize && !mFiles.empty()) {
+        const auto name = mFiles.back();
+        remove(name);
+    }
+}
+
+} // namespace motioncam
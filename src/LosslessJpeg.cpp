@@ -0,0 +1,447 @@
+#include "LosslessJpeg.h"
+
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <stdexcept>
+
+namespace motioncam {
+namespace lj92 {
+
+namespace {
+    // Difference categories 0-16, the number of bits in the difference
+    constexpr int NUM_CATEGORIES = 17;
+    constexpr int MAX_CODE_LENGTH = 16;
+
+    constexpr uint8_t MARKER_SOI = 0xD8;
+    constexpr uint8_t MARKER_EOI = 0xD9;
+    constexpr uint8_t MARKER_SOF3 = 0xC3;
+    constexpr uint8_t MARKER_DHT = 0xC4;
+    constexpr uint8_t MARKER_SOS = 0xDA;
+
+    constexpr uint16_t TIFF_TAG_COMPRESSION = 259;
+    constexpr uint16_t TIFF_TAG_STRIP_OFFSETS = 273;
+    constexpr uint16_t TIFF_TAG_ROWS_PER_STRIP = 278;
+    constexpr uint16_t TIFF_TAG_STRIP_BYTE_COUNTS = 279;
+    constexpr uint16_t TIFF_TAG_TILE_WIDTH = 322;
+    constexpr uint16_t TIFF_TAG_TILE_LENGTH = 323;
+    constexpr uint16_t TIFF_TAG_TILE_OFFSETS = 324;
+    constexpr uint16_t TIFF_TAG_TILE_BYTE_COUNTS = 325;
+    constexpr uint16_t TIFF_TYPE_SHORT = 3;
+    constexpr uint16_t TIFF_TYPE_LONG = 4;
+    constexpr uint16_t TIFF_COMPRESSION_LOSSLESS_JPEG = 7;
+
+    struct HuffmanTable {
+        std::array<uint8_t, MAX_CODE_LENGTH + 1> counts{}; // Number of codes of each length
+        std::vector<uint8_t> symbols;                      // In order of code length
+        std::array<uint16_t, NUM_CATEGORIES> codes{};
+        std::array<uint8_t, NUM_CATEGORIES> lengths{};
+    };
+
+    uint8_t getCategory(int diff) {
+        unsigned int value = diff < 0 ? -diff : diff;
+        uint8_t category = 0;
+
+        while(value) {
+            ++category;
+            value >>= 1;
+        }
+
+        return category;
+    }
+
+    // Optimal code lengths limited to 16 bits, as in annex K.2 of the JPEG spec
+    HuffmanTable getHuffmanTable(const std::array<uint32_t, NUM_CATEGORIES>& histogram) {
+        constexpr int NUM_SYMBOLS = NUM_CATEGORIES + 1;
+
+        // The extra symbol takes the all ones code, which JPEG does not allow
+        std::array<uint64_t, NUM_SYMBOLS> freq;
+        std::array<int, NUM_SYMBOLS> codeSize{};
+        std::array<int, NUM_SYMBOLS> others;
+
+        for(int i = 0; i < NUM_CATEGORIES; ++i)
+            freq[i] = histogram[i];
+
+        freq[NUM_CATEGORIES] = 1;
+        others.fill(-1);
+
+        for(;;) {
+            int c1 = -1;
+            int c2 = -1;
+
+            for(int i = 0; i < NUM_SYMBOLS; ++i) {
+                if(freq[i] && (c1 < 0 || freq[i] <= freq[c1]))
+                    c1 = i;
+            }
+
+            for(int i = 0; i < NUM_SYMBOLS; ++i) {
+                if(freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+                    c2 = i;
+            }
+
+            if(c2 < 0)
+                break;
+
+            freq[c1] += freq[c2];
+            freq[c2] = 0;
+
+            ++codeSize[c1];
+            while(others[c1] >= 0) {
+                c1 = others[c1];
+                ++codeSize[c1];
+            }
+
+            others[c1] = c2;
+
+            ++codeSize[c2];
+            while(others[c2] >= 0) {
+                c2 = others[c2];
+                ++codeSize[c2];
+            }
+        }
+
+        std::array<int, NUM_SYMBOLS + 1> bits{};
+
+        for(int i = 0; i < NUM_SYMBOLS; ++i) {
+            if(codeSize[i])
+                ++bits[codeSize[i]];
+        }
+
+        // Move codes that are too long up the tree
+        for(int i = NUM_SYMBOLS; i > MAX_CODE_LENGTH; --i) {
+            while(bits[i] > 0) {
+                int j = i - 2;
+                while(bits[j] == 0)
+                    --j;
+
+                bits[i] -= 2;
+                bits[i - 1] += 1;
+                bits[j + 1] += 2;
+                bits[j] -= 1;
+            }
+        }
+
+        // Drop the extra symbol, it has one of the longest codes
+        int longest = MAX_CODE_LENGTH;
+        while(bits[longest] == 0)
+            --longest;
+
+        --bits[longest];
+
+        HuffmanTable table;
+
+        for(int length = 1; length <= NUM_SYMBOLS; ++length) {
+            for(int i = 0; i < NUM_CATEGORIES; ++i) {
+                if(codeSize[i] == length)
+                    table.symbols.push_back(static_cast<uint8_t>(i));
+            }
+        }
+
+        // Assign codes in order of length (annex C)
+        uint16_t code = 0;
+        size_t symbol = 0;
+
+        for(int length = 1; length <= MAX_CODE_LENGTH; ++length) {
+            table.counts[length] = static_cast<uint8_t>(bits[length]);
+
+            for(int i = 0; i < bits[length]; ++i) {
+                const auto category = table.symbols[symbol++];
+
+                table.codes[category] = code++;
+                table.lengths[category] = static_cast<uint8_t>(length);
+            }
+
+            code <<= 1;
+        }
+
+        return table;
+    }
+
+    class BitWriter {
+    public:
+        explicit BitWriter(std::vector<uint8_t>& dst) : mDst(dst), mBuffer(0), mBits(0) {
+        }
+
+        void write(uint32_t value, int numBits) {
+            mBuffer = (mBuffer << numBits) | (value & ((1u << numBits) - 1));
+            mBits += numBits;
+
+            while(mBits >= 8) {
+                mBits -= 8;
+
+                const auto byte = static_cast<uint8_t>(mBuffer >> mBits);
+                mDst.push_back(byte);
+
+                // Keep 0xFF from being read as a marker
+                if(byte == 0xFF)
+                    mDst.push_back(0);
+            }
+        }
+
+        // Pads the last byte with ones
+        void flush() {
+            if(mBits > 0)
+                write(0xFF, 8 - mBits);
+        }
+
+    private:
+        std::vector<uint8_t>& mDst;
+        uint64_t mBuffer;
+        int mBits;
+    };
+
+    void writeMarker(std::vector<uint8_t>& dst, uint8_t marker) {
+        dst.push_back(0xFF);
+        dst.push_back(marker);
+    }
+
+    void writeU16(std::vector<uint8_t>& dst, uint32_t value) {
+        dst.push_back(static_cast<uint8_t>(value >> 8));
+        dst.push_back(static_cast<uint8_t>(value & 0xFF));
+    }
+
+    // Pixels past the end of the image repeat the last pixel of the same colour
+    uint32_t clampToImage(uint32_t i, uint32_t size) {
+        if(i < size)
+            return i;
+
+        return size >= 2 ? size - 2 + ((i - size) & 1) : size - 1;
+    }
+
+    // The DNGs we write are little endian, unlike JPEG
+    uint16_t readTiffU16(const std::vector<char>& data, size_t pos) {
+        if(pos + 2 > data.size())
+            throw std::runtime_error("Invalid DNG layout");
+
+        return static_cast<uint16_t>(
+            static_cast<uint8_t>(data[pos]) | (static_cast<uint8_t>(data[pos + 1]) << 8));
+    }
+
+    uint32_t readTiffU32(const std::vector<char>& data, size_t pos) {
+        return static_cast<uint32_t>(readTiffU16(data, pos)) | (static_cast<uint32_t>(readTiffU16(data, pos + 2)) << 16);
+    }
+
+    void writeTiffU16(std::vector<char>& data, size_t pos, uint16_t value) {
+        data[pos]     = static_cast<char>(value & 0xFF);
+        data[pos + 1] = static_cast<char>((value >> 8) & 0xFF);
+    }
+
+    void writeTiffU32(std::vector<char>& data, size_t pos, uint32_t value) {
+        writeTiffU16(data, pos, static_cast<uint16_t>(value & 0xFFFF));
+        writeTiffU16(data, pos + 2, static_cast<uint16_t>(value >> 16));
+    }
+
+    std::array<char, 12> getIfdEntry(uint16_t tag, uint16_t type, uint32_t count, uint32_t value) {
+        std::vector<char> entry(12);
+
+        writeTiffU16(entry, 0, tag);
+        writeTiffU16(entry, 2, type);
+        writeTiffU32(entry, 4, count);
+
+        if(type == TIFF_TYPE_SHORT)
+            writeTiffU16(entry, 8, static_cast<uint16_t>(value));
+        else
+            writeTiffU32(entry, 8, value);
+
+        std::array<char, 12> result;
+        std::copy(entry.begin(), entry.end(), result.begin());
+
+        return result;
+    }
+}
+
+void encodeTile(
+    const uint16_t* src,
+    size_t stride,
+    uint32_t width,
+    uint32_t height,
+    uint32_t tileWidth,
+    uint32_t tileHeight,
+    unsigned short bits,
+    std::vector<uint8_t>& dst)
+{
+    if(width == 0 || height == 0 || tileWidth < 2 || (tileWidth & 1) || tileHeight == 0 || bits < 2 || bits > 16)
+        throw std::runtime_error("Invalid lossless JPEG tile");
+
+    // Differences of the whole tile, so the Huffman table can be fitted to them before writing
+    thread_local std::vector<int32_t> diffs;
+    thread_local std::vector<uint8_t> categories;
+    thread_local std::vector<uint16_t> rows;
+
+    diffs.resize(static_cast<size_t>(tileWidth) * tileHeight);
+    categories.resize(diffs.size());
+    rows.resize(2 * static_cast<size_t>(tileWidth));
+
+    std::array<uint32_t, NUM_CATEGORIES> histogram{};
+
+    uint16_t* row = rows.data();
+    uint16_t* prevRow = rows.data() + tileWidth;
+
+    for(uint32_t y = 0; y < tileHeight; ++y) {
+        const uint16_t* srcRow = src + clampToImage(y, height) * stride;
+
+        for(uint32_t x = 0; x < tileWidth; ++x)
+            row[x] = srcRow[clampToImage(x, width)];
+
+        int32_t* rowDiffs = diffs.data() + static_cast<size_t>(y) * tileWidth;
+        uint8_t* rowCategories = categories.data() + static_cast<size_t>(y) * tileWidth;
+
+        // The first pixel of each colour is predicted from the row above, or the middle of the range
+        for(uint32_t x = 0; x < 2; ++x) {
+            const int predicted = y == 0 ? 1 << (bits - 1) : prevRow[x];
+            rowDiffs[x] = static_cast<int16_t>(static_cast<uint16_t>(row[x] - predicted));
+        }
+
+        for(uint32_t x = 2; x < tileWidth; ++x)
+            rowDiffs[x] = static_cast<int16_t>(static_cast<uint16_t>(row[x] - row[x - 2]));
+
+        for(uint32_t x = 0; x < tileWidth; ++x) {
+            rowCategories[x] = getCategory(rowDiffs[x]);
+            ++histogram[rowCategories[x]];
+        }
+
+        std::swap(row, prevRow);
+    }
+
+    const auto table = getHuffmanTable(histogram);
+
+    dst.clear();
+    dst.reserve(diffs.size() * 2);
+
+    writeMarker(dst, MARKER_SOI);
+
+    writeMarker(dst, MARKER_DHT);
+    writeU16(dst, static_cast<uint32_t>(2 + 1 + MAX_CODE_LENGTH + table.symbols.size()));
+    dst.push_back(0x00); // DC table 0
+    dst.insert(dst.end(), table.counts.begin() + 1, table.counts.end());
+    dst.insert(dst.end(), table.symbols.begin(), table.symbols.end());
+
+    writeMarker(dst, MARKER_SOF3);
+    writeU16(dst, 8 + 3 * 2);
+    dst.push_back(static_cast<uint8_t>(bits));
+    writeU16(dst, tileHeight);
+    writeU16(dst, tileWidth / 2);
+    dst.push_back(2);
+    for(uint8_t component = 1; component <= 2; ++component) {
+        dst.push_back(component);
+        dst.push_back(0x11); // No subsampling
+        dst.push_back(0);
+    }
+
+    writeMarker(dst, MARKER_SOS);
+    writeU16(dst, 6 + 2 * 2);
+    dst.push_back(2);
+    for(uint8_t component = 1; component <= 2; ++component) {
+        dst.push_back(component);
+        dst.push_back(0x00); // Huffman table 0
+    }
+    dst.push_back(1); // Predictor Ra
+    dst.push_back(0);
+    dst.push_back(0); // No point transform
+
+    BitWriter writer(dst);
+
+    for(size_t i = 0; i < diffs.size(); ++i) {
+        const int diff = diffs[i];
+        const int category = categories[i];
+
+        writer.write(table.codes[category], table.lengths[category]);
+
+        // Category 16 (a difference of 32768) has no extra bits
+        if(category > 0 && category < 16)
+            writer.write(static_cast<uint32_t>(diff < 0 ? diff - 1 : diff), category);
+    }
+
+    writer.flush();
+
+    writeMarker(dst, MARKER_EOI);
+}
+
+std::shared_ptr<std::vector<char>> getTiledDngHeader(
+    const std::vector<char>& header, uint32_t tileWidth, uint32_t tileHeight, const std::vector<size_t>& tileSizes)
+{
+    const uint32_t ifdOffset = readTiffU32(header, 4);
+    const uint16_t numEntries = readTiffU16(header, ifdOffset);
+
+    std::vector<std::pair<uint16_t, std::array<char, 12>>> entries;
+    bool hasStrip = false;
+
+    for(uint16_t i = 0; i < numEntries; ++i) {
+        const size_t entryPos = ifdOffset + 2 + i * 12;
+        const uint16_t tag = readTiffU16(header, entryPos);
+
+        if(tag == TIFF_TAG_STRIP_OFFSETS || tag == TIFF_TAG_STRIP_BYTE_COUNTS || tag == TIFF_TAG_ROWS_PER_STRIP) {
+            hasStrip = hasStrip || tag == TIFF_TAG_STRIP_OFFSETS;
+            continue;
+        }
+
+        if(tag == TIFF_TAG_COMPRESSION) {
+            entries.emplace_back(tag, getIfdEntry(tag, TIFF_TYPE_SHORT, 1, TIFF_COMPRESSION_LOSSLESS_JPEG));
+            continue;
+        }
+
+        std::array<char, 12> entry;
+        std::copy(header.begin() + entryPos, header.begin() + entryPos + 12, entry.begin());
+
+        entries.emplace_back(tag, entry);
+    }
+
+    // The strip has to be in the first IFD for it to be replaced
+    if(!hasStrip)
+        throw std::runtime_error("Invalid DNG layout");
+
+    const uint32_t nextIfd = readTiffU32(header, ifdOffset + 2 + numEntries * 12);
+
+    const size_t numTiles = tileSizes.size();
+    const size_t newIfdOffset = header.size();
+    const size_t newNumEntries = entries.size() + 4;
+    const size_t tileOffsetsPos = newIfdOffset + 2 + newNumEntries * 12 + 4;
+    const size_t tileSizesPos = tileOffsetsPos + numTiles * 4;
+    const size_t dataOffset = tileSizesPos + numTiles * 4;
+    const size_t dataSize = std::accumulate(tileSizes.begin(), tileSizes.end(), static_cast<size_t>(0));
+
+    if(numTiles == 0 || dataOffset + dataSize > UINT32_MAX)
+        throw std::runtime_error("Invalid DNG layout");
+
+    // Single values are stored in the entry itself
+    const auto tileOffsets = static_cast<uint32_t>(numTiles == 1 ? dataOffset : tileOffsetsPos);
+    const auto tileByteCounts = static_cast<uint32_t>(numTiles == 1 ? tileSizes[0] : tileSizesPos);
+    const auto count = static_cast<uint32_t>(numTiles);
+
+    entries.emplace_back(TIFF_TAG_TILE_WIDTH, getIfdEntry(TIFF_TAG_TILE_WIDTH, TIFF_TYPE_LONG, 1, tileWidth));
+    entries.emplace_back(TIFF_TAG_TILE_LENGTH, getIfdEntry(TIFF_TAG_TILE_LENGTH, TIFF_TYPE_LONG, 1, tileHeight));
+    entries.emplace_back(TIFF_TAG_TILE_OFFSETS, getIfdEntry(TIFF_TAG_TILE_OFFSETS, TIFF_TYPE_LONG, count, tileOffsets));
+    entries.emplace_back(TIFF_TAG_TILE_BYTE_COUNTS, getIfdEntry(TIFF_TAG_TILE_BYTE_COUNTS, TIFF_TYPE_LONG, count, tileByteCounts));
+
+    // TIFF wants the entries sorted by tag
+    std::stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+
+    auto dng = std::make_shared<std::vector<char>>(header);
+
+    dng->resize(dataOffset, 0);
+
+    writeTiffU16(*dng, newIfdOffset, static_cast<uint16_t>(newNumEntries));
+
+    for(size_t i = 0; i < entries.size(); ++i)
+        std::copy(entries[i].second.begin(), entries[i].second.end(), dng->begin() + newIfdOffset + 2 + i * 12);
+
+    writeTiffU32(*dng, newIfdOffset + 2 + newNumEntries * 12, nextIfd);
+
+    size_t tileOffset = dataOffset;
+
+    for(size_t i = 0; i < numTiles; ++i) {
+        writeTiffU32(*dng, tileOffsetsPos + i * 4, static_cast<uint32_t>(tileOffset));
+        writeTiffU32(*dng, tileSizesPos + i * 4, static_cast<uint32_t>(tileSizes[i]));
+
+        tileOffset += tileSizes[i];
+    }
+
+    writeTiffU32(*dng, 4, static_cast<uint32_t>(newIfdOffset));
+
+    return dng;
+}
+
+} // namespace lj92
+} // namespace motioncam
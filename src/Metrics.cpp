@@ -0,0 +1,212 @@
+#include "Metrics.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+namespace motioncam {
+
+namespace {
+    int getBucket(uint64_t us) {
+        int bucket = 0;
+        while(us > 1 && bucket < 31) {
+            us >>= 1;
+            ++bucket;
+        }
+
+        return bucket;
+    }
+
+    nlohmann::json toJson(const HistogramSummary& summary) {
+        return {
+            { "count", summary.count },
+            { "meanMs", summary.meanMs },
+            { "p50Ms", summary.p50Ms },
+            { "p95Ms", summary.p95Ms },
+            { "p99Ms", summary.p99Ms },
+            { "maxMs", summary.maxMs }
+        };
+    }
+
+    // Flattens the snapshot into name/value pairs, histograms as <name>.<field>
+    std::vector<std::pair<std::string, double>> getValues(const MetricsSnapshot& s) {
+        std::vector<std::pair<std::string, double>> values = {
+            { "timeMs", static_cast<double>(s.timeMs) },
+            { "cacheHits", static_cast<double>(s.cacheHits) },
+            { "cacheMisses", static_cast<double>(s.cacheMisses) },
+            { "cacheWaits", static_cast<double>(s.cacheWaits) },
+            { "cancelledWaits", static_cast<double>(s.cancelledWaits) },
+            { "failedReads", static_cast<double>(s.failedReads) },
+            { "diskCacheHits", static_cast<double>(s.diskCacheHits) },
+            { "rawFrameHits", static_cast<double>(s.rawFrameHits) },
+            { "bytesServed", static_cast<double>(s.bytesServed) },
+            { "cachedBytes", static_cast<double>(s.cachedBytes) },
+            { "cacheEvictions", static_cast<double>(s.cacheEvictions) },
+            { "cacheEvictedBytes", static_cast<double>(s.cacheEvictedBytes) },
+            { "cacheSize", static_cast<double>(s.cacheSize) },
+            { "cacheCapacity", static_cast<double>(s.cacheCapacity) },
+            { "rawFrameCacheSize", static_cast<double>(s.rawFrameCacheSize) },
+            { "rawFrameCacheCapacity", static_cast<double>(s.rawFrameCacheCapacity) },
+            { "ioTasksQueued", static_cast<double>(s.ioTasksQueued) },
+            { "ioTasksRunning", static_cast<double>(s.ioTasksRunning) },
+            { "processingTasksQueued", static_cast<double>(s.processingTasksQueued) },
+            { "processingTasksRunning", static_cast<double>(s.processingTasksRunning) }
+        };
+
+        const std::pair<const char*, const HistogramSummary*> histograms[] = {
+            { "readWait", &s.readWait },
+            { "decode", &s.decode },
+            { "preprocess", &s.preprocess },
+            { "encode", &s.encode },
+            { "generateDng", &s.generateDng }
+        };
+
+        for(const auto& [name, h] : histograms) {
+            const std::string prefix(name);
+
+            values.emplace_back(prefix + ".count", static_cast<double>(h->count));
+            values.emplace_back(prefix + ".meanMs", h->meanMs);
+            values.emplace_back(prefix + ".p50Ms", h->p50Ms);
+            values.emplace_back(prefix + ".p95Ms", h->p95Ms);
+            values.emplace_back(prefix + ".p99Ms", h->p99Ms);
+            values.emplace_back(prefix + ".maxMs", h->maxMs);
+        }
+
+        return values;
+    }
+}
+
+Histogram::Histogram() : mCount(0), mTotalUs(0), mMaxUs(0) {
+    for(auto& bucket : mBuckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+void Histogram::record(uint64_t us) {
+    mBuckets[getBucket(us)].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mTotalUs.fetch_add(us, std::memory_order_relaxed);
+
+    auto max = mMaxUs.load(std::memory_order_relaxed);
+    while(us > max && !mMaxUs.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+}
+
+HistogramSummary Histogram::summarise() const {
+    std::array<uint64_t, NUM_BUCKETS> counts;
+    uint64_t count = 0;
+
+    for(int i = 0; i < NUM_BUCKETS; ++i) {
+        counts[i] = mBuckets[i].load(std::memory_order_relaxed);
+        count += counts[i];
+    }
+
+    HistogramSummary summary;
+
+    summary.count = count;
+    if(count == 0)
+        return summary;
+
+    const double maxMs = mMaxUs.load(std::memory_order_relaxed) / 1000.0;
+
+    auto percentile = [&](double p) {
+        const auto rank = static_cast<uint64_t>(p * (count - 1));
+        uint64_t seen = 0;
+
+        for(int i = 0; i < NUM_BUCKETS; ++i) {
+            seen += counts[i];
+
+            if(seen > rank)
+                return (std::min)(static_cast<double>(uint64_t(2) << i) / 1000.0, maxMs);
+        }
+
+        return maxMs;
+    };
+
+    summary.meanMs = mTotalUs.load(std::memory_order_relaxed) / 1000.0 / count;
+    summary.p50Ms = percentile(0.50);
+    summary.p95Ms = percentile(0.95);
+    summary.p99Ms = percentile(0.99);
+    summary.maxMs = maxMs;
+
+    return summary;
+}
+
+void snapshotMetrics(const Metrics& metrics, MetricsSnapshot& snapshot) {
+    snapshot.timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    snapshot.cacheHits = metrics.cacheHits.load();
+    snapshot.cacheMisses = metrics.cacheMisses.load();
+    snapshot.cacheWaits = metrics.cacheWaits.load();
+    snapshot.cancelledWaits = metrics.cancelledWaits.load();
+    snapshot.failedReads = metrics.failedReads.load();
+    snapshot.diskCacheHits = metrics.diskCacheHits.load();
+    snapshot.rawFrameHits = metrics.rawFrameHits.load();
+    snapshot.bytesServed = metrics.bytesServed.load();
+
+    snapshot.readWait = metrics.readWait.summarise();
+    snapshot.decode = metrics.decode.summarise();
+    snapshot.preprocess = metrics.preprocess.summarise();
+    snapshot.encode = metrics.encode.summarise();
+    snapshot.generateDng = metrics.generateDng.summarise();
+}
+
+std::string metricsToJson(const MetricsSnapshot& s) {
+    nlohmann::json j;
+
+    j["timeMs"] = s.timeMs;
+
+    j["cache"] = {
+        { "hits", s.cacheHits },
+        { "misses", s.cacheMisses },
+        { "waits", s.cacheWaits },
+        { "cancelledWaits", s.cancelledWaits },
+        { "failedReads", s.failedReads },
+        { "diskCacheHits", s.diskCacheHits },
+        { "cachedBytes", s.cachedBytes },
+        { "evictions", s.cacheEvictions },
+        { "evictedBytes", s.cacheEvictedBytes },
+        { "size", s.cacheSize },
+        { "capacity", s.cacheCapacity }
+    };
+
+    j["rawFrameCache"] = {
+        { "hits", s.rawFrameHits },
+        { "size", s.rawFrameCacheSize },
+        { "capacity", s.rawFrameCacheCapacity }
+    };
+
+    j["bytesServed"] = s.bytesServed;
+
+    j["latency"] = {
+        { "readWait", toJson(s.readWait) },
+        { "decode", toJson(s.decode) },
+        { "preprocess", toJson(s.preprocess) },
+        { "encode", toJson(s.encode) },
+        { "generateDng", toJson(s.generateDng) }
+    };
+
+    j["threadPools"] = {
+        { "io", { { "queued", s.ioTasksQueued }, { "running", s.ioTasksRunning } } },
+        { "processing", { { "queued", s.processingTasksQueued }, { "running", s.processingTasksRunning } } }
+    };
+
+    return j.dump(2);
+}
+
+std::string metricsToCsv(const MetricsSnapshot& snapshot) {
+    std::ostringstream csv;
+
+    csv.precision(15); // Counters stay exact
+    csv << "metric,value\n";
+
+    for(const auto& [name, value] : getValues(snapshot))
+        csv << name << "," << value << "\n";
+
+    return csv.str();
+}
+
+} // namespace motioncam
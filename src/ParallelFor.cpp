@@ -0,0 +1,120 @@
+#include "ParallelFor.h"
+
+#include <BS_thread_pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+
+namespace motioncam {
+
+namespace {
+    // Shared with the helper tasks, which may only get to run after parallelFor() returned
+    struct Bands {
+        const std::function<void(size_t, size_t)>* func;
+        size_t count;
+        size_t bandSize;
+        size_t numBands;
+        std::atomic<size_t> next{0};
+
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t completed = 0;
+        std::exception_ptr error;
+    };
+
+    void runBands(Bands& bands) {
+        size_t finished = 0;
+        std::exception_ptr error;
+
+        for(;;) {
+            const size_t band = bands.next.fetch_add(1);
+            if(band >= bands.numBands)
+                break;
+
+            const size_t begin = band * bands.bandSize;
+            const size_t end = std::min(begin + bands.bandSize, bands.count);
+
+            if(!error) {
+                try {
+                    (*bands.func)(begin, end);
+                }
+                catch(...) {
+                    error = std::current_exception();
+                }
+            }
+
+            ++finished;
+        }
+
+        // Late helpers leave func alone, it may be gone already
+        if(finished == 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(bands.mutex);
+
+        bands.completed += finished;
+
+        if(error && !bands.error)
+            bands.error = error;
+
+        if(bands.completed == bands.numBands)
+            bands.done.notify_all();
+    }
+}
+
+void parallelFor(
+    BS::thread_pool* threadPool,
+    size_t count,
+    size_t bandSize,
+    const std::function<void(size_t, size_t)>& func)
+{
+    if(count == 0)
+        return;
+
+    bandSize = std::max<size_t>(bandSize, 1);
+
+    const size_t numBands = (count + bandSize - 1) / bandSize;
+
+    // Helpers queued behind other work would start too late to be of use, so only count idle threads
+    size_t numHelpers = 0;
+
+    if(threadPool && numBands > 1 && threadPool->get_tasks_queued() == 0) {
+        const size_t numThreads = threadPool->get_thread_count();
+        const size_t numRunning = threadPool->get_tasks_running();
+
+        numHelpers = std::min(numBands - 1, numThreads > numRunning ? numThreads - numRunning : 0);
+    }
+
+    if(numHelpers == 0) {
+        func(0, count);
+        return;
+    }
+
+    auto bands = std::make_shared<Bands>();
+
+    bands->func = &func;
+    bands->count = count;
+    bands->bandSize = bandSize;
+    bands->numBands = numBands;
+
+    for(size_t i = 0; i < numHelpers; i++) {
+        threadPool->detach_task([bands]() {
+            runBands(*bands);
+        });
+    }
+
+    runBands(*bands);
+
+    std::unique_lock<std::mutex> lock(bands->mutex);
+
+    bands->done.wait(lock, [&bands]() { return bands->completed == bands->numBands; });
+
+    if(bands->error)
+        std::rethrow_exception(bands->error);
+}
+
+} // namespace motioncam
@@ -0,0 +1,126 @@
+#include "RawFrameCache.h"
+
+namespace motioncam {
+
+RawFrameCache::RawFrameCache(size_t maxBytes) : mMaxBytes(maxBytes), mBytes(0), mClock(0) {
+}
+
+std::shared_ptr<const RawFrame> RawFrameCache::get(const std::string& source, int64_t timestamp, const Loader& load) {
+    const Key key{ source, timestamp };
+
+    std::promise<std::shared_ptr<const RawFrame>> promise;
+    std::shared_future<std::shared_ptr<const RawFrame>> pending;
+    uint64_t id = 0;
+    bool keep = false;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        keep = mMaxBytes > 0;
+
+        auto it = mFrames.find(key);
+        if(it != mFrames.end()) {
+            it->second.lastUse = ++mClock;
+            pending = it->second.frame;
+        }
+        else if(keep) {
+            id = ++mClock;
+            mFrames.emplace(key, Slot{ promise.get_future().share(), id, id, 0 });
+        }
+    }
+
+    // Loaded, or being loaded by someone else
+    if(pending.valid())
+        return pending.get();
+
+    // Nothing would be kept, load outside the lock so readers don't wait on each other
+    if(!keep)
+        return load();
+
+    std::shared_ptr<const RawFrame> frame;
+
+    try {
+        frame = load();
+    }
+    catch(...) {
+        promise.set_exception(std::current_exception());
+
+        // Let the next reader try again
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto it = mFrames.find(key);
+        if(it != mFrames.end() && it->second.id == id)
+            mFrames.erase(it);
+
+        throw;
+    }
+
+    promise.set_value(frame);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mFrames.find(key);
+    if(it != mFrames.end() && it->second.id == id) {
+        it->second.bytes = frame && frame->data ? frame->data->size() : 0;
+        mBytes += it->second.bytes;
+
+        evict();
+    }
+
+    return frame;
+}
+
+void RawFrameCache::evict() {
+    // Least recently used first. Frames are large, even a big cache holds a few hundred at
+    // most, so a scan is fine
+    while(mBytes > mMaxBytes) {
+        auto oldest = mFrames.end();
+
+        for(auto it = mFrames.begin(); it != mFrames.end(); ++it) {
+            if(it->second.bytes > 0 && (oldest == mFrames.end() || it->second.lastUse < oldest->second.lastUse))
+                oldest = it;
+        }
+
+        if(oldest == mFrames.end())
+            break;
+
+        mBytes -= oldest->second.bytes;
+        mFrames.erase(oldest);
+    }
+}
+
+void RawFrameCache::clear(const std::string& source) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for(auto it = mFrames.begin(); it != mFrames.end();) {
+        if(it->first.source == source) {
+            mBytes -= it->second.bytes;
+            it = mFrames.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void RawFrameCache::setCapacity(size_t maxBytes) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mMaxBytes = maxBytes;
+
+    evict();
+}
+
+size_t RawFrameCache::capacity() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mMaxBytes;
+}
+
+size_t RawFrameCache::size() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mBytes;
+}
+
+} // namespace motioncam
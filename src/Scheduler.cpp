@@ -0,0 +1,223 @@
+#include "Scheduler.h"
+
+#include <BS_thread_pool.hpp>
+
+#include <algorithm>
+#include <limits>
+
+namespace motioncam {
+
+Scheduler::Reservation::Reservation(Scheduler& scheduler, uint64_t session, size_t bytes) :
+    mScheduler(scheduler), mSession(session), mBytes(bytes) {
+}
+
+Scheduler::Reservation::~Reservation() {
+    mScheduler.release(mSession, mBytes);
+}
+
+Scheduler::Scheduler(BS::thread_pool& threadPool, size_t maxBytes) :
+    mThreadPool(threadPool),
+    mMaxBytes(maxBytes),
+    mBytesInFlight(0),
+    mRunning(0),
+    mStarting(0),
+    mReserved(0),
+    mPumping(0),
+    mNextSession(0) {
+}
+
+Scheduler::~Scheduler() {
+    wait();
+}
+
+uint64_t Scheduler::newSession() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return ++mNextSession;
+}
+
+void Scheduler::submit(uint64_t session, uint64_t tag, Priority priority, size_t bytes, DropCheck shouldDrop, Task task) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        mQueues[static_cast<int>(priority)].push_back({ session, tag, bytes, std::move(shouldDrop), std::move(task) });
+        ++mSessions[session].queued;
+    }
+
+    pump();
+}
+
+void Scheduler::prioritise(uint64_t tag) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto& prefetches = mQueues[static_cast<int>(Priority::Prefetch)];
+        auto& foreground = mQueues[static_cast<int>(Priority::Foreground)];
+
+        auto it = std::find_if(prefetches.begin(), prefetches.end(), [tag](const Job& job) { return job.tag == tag; });
+        if(it == prefetches.end())
+            return;
+
+        foreground.push_back(std::move(*it));
+        prefetches.erase(it);
+    }
+
+    pump();
+}
+
+void Scheduler::wait() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    mIdle.wait(lock, [this] {
+        return mRunning == 0 && mStarting == 0 && mReserved == 0 && mPumping == 0 &&
+            std::all_of(mQueues.begin(), mQueues.end(), [](const std::deque<Job>& queue) { return queue.empty(); });
+    });
+}
+
+void Scheduler::wait(uint64_t session) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    mIdle.wait(lock, [this, session] { return mSessions.find(session) == mSessions.end(); });
+}
+
+std::deque<Scheduler::Job>::iterator Scheduler::pickJob(std::deque<Job>& queue) {
+    auto best = queue.begin();
+    size_t bestStarted = std::numeric_limits<size_t>::max();
+
+    for(auto it = queue.begin(); it != queue.end(); ++it) {
+        const auto& session = mSessions[it->session];
+        const size_t started = session.starting + session.reserved;
+
+        // Oldest job of the least busy session
+        if(started < bestStarted) {
+            best = it;
+            bestStarted = started;
+
+            if(started == 0)
+                break;
+        }
+    }
+
+    return best;
+}
+
+void Scheduler::updateSession(uint64_t session, const std::function<void(Session&)>& update) {
+    auto it = mSessions.find(session);
+    if(it == mSessions.end())
+        return;
+
+    update(it->second);
+
+    const auto& s = it->second;
+
+    if(s.queued == 0 && s.starting == 0 && s.running == 0 && s.reserved == 0)
+        mSessions.erase(it);
+}
+
+void Scheduler::pump() {
+    const size_t maxRunning = (std::max)(static_cast<size_t>(1), static_cast<size_t>(mThreadPool.get_thread_count()));
+
+    for(;;) {
+        Job job;
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            if(mRunning + mStarting >= maxRunning)
+                return;
+
+            auto queue = std::find_if(mQueues.begin(), mQueues.end(), [](const std::deque<Job>& q) { return !q.empty(); });
+            if(queue == mQueues.end())
+                return;
+
+            auto next = pickJob(*queue);
+
+            // Something always gets to run, so a job larger than the limit doesn't get stuck
+            if(mBytesInFlight > 0 && mBytesInFlight + next->bytes > mMaxBytes)
+                return;
+
+            job = std::move(*next);
+            queue->erase(next);
+
+            mBytesInFlight += job.bytes;
+            ++mStarting;
+
+            auto& session = mSessions[job.session];
+            --session.queued;
+            ++session.starting;
+        }
+
+        if(job.shouldDrop && job.shouldDrop()) {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            mBytesInFlight -= job.bytes;
+            --mStarting;
+
+            updateSession(job.session, [](Session& s) { --s.starting; });
+
+            mIdle.notify_all();
+            continue;
+        }
+
+        std::shared_ptr<Reservation> reservation(new Reservation(*this, job.session, job.bytes));
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            --mStarting;
+            ++mRunning;
+            ++mReserved;
+
+            auto& session = mSessions[job.session];
+            --session.starting;
+            ++session.running;
+            ++session.reserved;
+        }
+
+        mThreadPool.detach_task([this, session = job.session, task = std::move(job.task), reservation = std::move(reservation)]() mutable {
+            task(std::move(reservation));
+            finishJob(session);
+        });
+    }
+}
+
+void Scheduler::release(uint64_t session, size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        mBytesInFlight -= bytes;
+
+        // wait() can't return until we are done pumping
+        ++mPumping;
+        --mReserved;
+
+        updateSession(session, [](Session& s) { --s.reserved; });
+    }
+
+    pump();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    --mPumping;
+    mIdle.notify_all();
+}
+
+void Scheduler::finishJob(uint64_t session) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        ++mPumping;
+        --mRunning;
+
+        updateSession(session, [](Session& s) { --s.running; });
+    }
+
+    pump();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    --mPumping;
+    mIdle.notify_all();
+}
+
+} // namespace motioncam
@@ -1,14 +1,19 @@
 #include "Utils.h"
+#include "BitPacking.h"
+#include "BufferPool.h"
+#include "LosslessJpeg.h"
 #include "Measure.h"
+#include "ParallelFor.h"
 
 #include "CameraFrameMetadata.h"
 #include "CameraMetadata.h"
 
 #include <algorithm>
 #include <cmath>
-
-#include <boost/iostreams/stream.hpp>
-#include <boost/iostreams/device/back_inserter.hpp>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <numeric>
 
 #define TINY_DNG_WRITER_IMPLEMENTATION 1
 
@@ -203,274 +208,8 @@ namespace {
             }
         }       // For every position in the shading map, divide gain by the minimum value of the four channels
     }       
-
-    inline float getShadingMapValue(
-        float x, float y, int channel, const std::vector<std::vector<float>>& lensShadingMap, int lensShadingMapWidth, int lensShadingMapHeight)
-    {
-        // Clamp input coordinates to [0, 1] range
-        x = std::max(0.0f, std::min(1.0f, x));
-        y = std::max(0.0f, std::min(1.0f, y));
-
-        // Convert normalized coordinates to map coordinates
-        const float mapX = x * (lensShadingMapWidth - 1);
-        const float mapY = y * (lensShadingMapHeight - 1);
-
-        // Get integer coordinates for the four surrounding pixels
-        const int x0 = static_cast<int>(std::floor(mapX));
-        const int y0 = static_cast<int>(std::floor(mapY));
-        const int x1 = std::min(x0 + 1, lensShadingMapWidth - 1);
-        const int y1 = std::min(y0 + 1, lensShadingMapHeight - 1);
-
-        // Calculate interpolation weights
-        const float wx = mapX - x0;  // Weight for x-direction interpolation
-        const float wy = mapY - y0;  // Weight for y-direction interpolation
-
-        // Get the four surrounding pixel values
-        const float val00 = lensShadingMap[channel][y0*lensShadingMapWidth+x0];  // Top-left
-        const float val01 = lensShadingMap[channel][y0*lensShadingMapWidth+x1];  // Top-right
-        const float val10 = lensShadingMap[channel][y1*lensShadingMapWidth+x0];  // Bottom-left
-        const float val11 = lensShadingMap[channel][y1*lensShadingMapWidth+x1];  // Bottom-right
-
-        // Perform bilinear interpolation
-        const float valTop = val00 * (1.0f - wx) + val01 * wx;     // Interpolation at y0
-        const float valBottom = val10 * (1.0f - wx) + val11 * wx;  // Interpolation at y1
-
-        // Then interpolate along y-axis
-        return valTop * (1.0f - wy) + valBottom * wy;
-    }
-}
-
-void encodeTo10Bit(
-    std::vector<uint8_t>& data,
-    uint32_t& width,
-    uint32_t& height)
-{
-    Measure m("encodeTo10Bit");
-
-    uint16_t* srcPtr = reinterpret_cast<uint16_t*>(data.data());
-    uint8_t* dstPtr = data.data();
-
-    for(int y = 0; y < height; y++) {
-        for(int x = 0; x < width; x+=4) {
-            const uint16_t p0 = srcPtr[0];
-            const uint16_t p1 = srcPtr[1];
-            const uint16_t p2 = srcPtr[2];
-            const uint16_t p3 = srcPtr[3];
-
-            dstPtr[0] = p0 >> 2;
-            dstPtr[1] = ((p0 & 0x03) << 6) | (p1 >> 4);
-            dstPtr[2] = ((p1 & 0x0F) << 4) | (p2 >> 6);
-            dstPtr[3] = ((p2 & 0x3F) << 2) | (p3 >> 8);
-            dstPtr[4] = p3 & 0xFF;
-
-            srcPtr += 4;
-            dstPtr += 5;
-        }
-    }
-
-    // Resize to fit new data
-    auto newSize = dstPtr - data.data();
-
-    data.resize(newSize);
-}
-
-void encodeTo12Bit(
-    std::vector<uint8_t>& data,
-    uint32_t& width,
-    uint32_t& height)
-{
-    Measure m("encodeTo12Bit");
-
-    uint16_t* srcPtr = reinterpret_cast<uint16_t*>(data.data());
-    uint8_t* dstPtr = data.data();
-
-    for(int y = 0; y < height; y++) {
-        for(int x = 0; x < width; x+=2) {
-            const uint16_t p0 = srcPtr[0];
-            const uint16_t p1 = srcPtr[1];
-
-            dstPtr[0] = p0 >> 4;
-            dstPtr[1] = ((p0 & 0x0F) << 4) | (p1 >> 8);
-            dstPtr[2] = p1 & 0xFF;
-
-            srcPtr += 2;
-            dstPtr += 3;
-        }
-    }
-    // Resize to fit new data
-    auto newSize = dstPtr - data.data();
-
-    data.resize(newSize);
-}
-
-void encodeTo14Bit(
-    std::vector<uint8_t>& data,
-    uint32_t& width,
-    uint32_t& height)
-{
-    Measure m("encodeTo14Bit");
-
-    uint16_t* srcPtr = reinterpret_cast<uint16_t*>(data.data());
-    uint8_t* dstPtr = data.data();
-
-    for(int y = 0; y < height; y++) {
-        for(int x = 0; x < width; x+=4) {
-            const uint16_t p0 = srcPtr[0];
-            const uint16_t p1 = srcPtr[1];
-            const uint16_t p2 = srcPtr[2];
-            const uint16_t p3 = srcPtr[3];
-
-            dstPtr[0] = p0 >> 6;
-            dstPtr[1] = ((p0 & 0x3F) << 2) | (p1 >> 12);
-            dstPtr[2] = (p1 >> 4) & 0xFF;
-            dstPtr[3] = ((p1 & 0x0F) << 4) | (p2 >> 10);
-            dstPtr[4] = (p2 >> 2) & 0xFF;
-            dstPtr[5] = ((p2 & 0x03) << 6) | (p3 >> 8);
-            dstPtr[6] = p3 & 0xFF;
-
-            srcPtr += 4;
-            dstPtr += 7;
-        }
-    }
-
-    // Resize to fit new data
-    auto newSize = dstPtr - data.data();
-
-    data.resize(newSize);
-}
-
-void encodeTo8Bit(
-    std::vector<uint8_t>& data,
-    uint32_t& width,
-    uint32_t& height)
-{
-    Measure m("encodeTo8Bit");
-
-    uint16_t* srcPtr = reinterpret_cast<uint16_t*>(data.data());
-    uint8_t* dstPtr = data.data();
-
-    for(int y = 0; y < height; y++) {
-        for(int x = 0; x < width; x++) {
-            const uint16_t p0 = srcPtr[0];
-            // Store lower 8 bits directly
-            dstPtr[0] = p0 & 0xFF;
-
-            srcPtr += 1;
-            dstPtr += 1;
-        }
-    }
-
-    // Resize to fit new data
-    auto newSize = dstPtr - data.data();
-
-    data.resize(newSize);
 }
 
-void encodeTo6Bit(
-    std::vector<uint8_t>& data,
-    uint32_t& width,
-    uint32_t& height)
-{
-    Measure m("encodeTo6Bit");
-
-    uint16_t* srcPtr = reinterpret_cast<uint16_t*>(data.data());
-    uint8_t* dstPtr = data.data();
-
-    for(int y = 0; y < height; y++) {
-        for(int x = 0; x < width; x+=4) {
-            const uint16_t p0 = srcPtr[0];
-            const uint16_t p1 = srcPtr[1];
-            const uint16_t p2 = srcPtr[2];
-            const uint16_t p3 = srcPtr[3];
-
-            // Pack 4 pixels (6 bits each) into 3 bytes - use lower 6 bits
-            const uint8_t v0 = p0 & 0x3F;
-            const uint8_t v1 = p1 & 0x3F;
-            const uint8_t v2 = p2 & 0x3F;
-            const uint8_t v3 = p3 & 0x3F;
-
-            dstPtr[0] = (v0 << 2) | (v1 >> 4);
-            dstPtr[1] = ((v1 & 0x0F) << 4) | (v2 >> 2);
-            dstPtr[2] = ((v2 & 0x03) << 6) | v3;
-
-            srcPtr += 4;
-            dstPtr += 3;
-        }
-    }
-
-    // Resize to fit new data
-    auto newSize = dstPtr - data.data();
-
-    data.resize(newSize);
-}
-
-void encodeTo4Bit(
-    std::vector<uint8_t>& data,
-    uint32_t& width,
-    uint32_t& height)
-{
-    Measure m("encodeTo4Bit");
-
-    uint16_t* srcPtr = reinterpret_cast<uint16_t*>(data.data());
-    uint8_t* dstPtr = data.data();
-
-    for(int y = 0; y < height; y++) {
-        for(int x = 0; x < width; x+=2) {
-            const uint16_t p0 = srcPtr[0];
-            const uint16_t p1 = srcPtr[1];
-
-            // Pack 2 pixels (4 bits each) into 1 byte - use lower 4 bits
-            const uint8_t v0 = p0 & 0x0F;
-            const uint8_t v1 = p1 & 0x0F;
-
-            dstPtr[0] = (v0 << 4) | v1;
-
-            srcPtr += 2;
-            dstPtr += 1;
-        }
-    }
-
-    // Resize to fit new data
-    auto newSize = dstPtr - data.data();
-
-    data.resize(newSize);
-}
-
-void encodeTo2Bit(
-    std::vector<uint8_t>& data,
-    uint32_t& width,
-    uint32_t& height)
-{
-    Measure m("encodeTo2Bit");
-
-    uint16_t* srcPtr = reinterpret_cast<uint16_t*>(data.data());
-    uint8_t* dstPtr = data.data();
-
-    for(int y = 0; y < height; y++) {
-        for(int x = 0; x < width; x+=4) {
-            const uint16_t p0 = srcPtr[0];
-            const uint16_t p1 = srcPtr[1];
-            const uint16_t p2 = srcPtr[2];
-            const uint16_t p3 = srcPtr[3];
-
-            // Try different bit order: p3 in bits 1-0, p2 in bits 3-2, p1 in bits 5-4, p0 in bits 7-6
-            dstPtr[0] = ((p0 & 0x03) << 6) | 
-                       ((p1 & 0x03) << 4) | 
-                       ((p2 & 0x03) << 2) | 
-                       (p3 & 0x03);
-
-            srcPtr += 4;
-            dstPtr += 1;
-        }
-    }
-
-    // Resize to fit new data
-    auto newSize = dstPtr - data.data();
-
-    data.resize(newSize);
-}
-
-
 tinydngwriter::OpcodeList createLensShadingOpcodeList(
     const CameraFrameMetadata& metadata,
     uint32_t imageWidth,
@@ -480,7 +219,7 @@ tinydngwriter::OpcodeList createLensShadingOpcodeList(
 {
     tinydngwriter::OpcodeList opcodeList;
     
-    if (metadata.lensShadingMap.empty() || 
+    if (!metadata.lensShadingMap || metadata.lensShadingMap->empty() || 
         metadata.lensShadingMapWidth <= 0 || 
         metadata.lensShadingMapHeight <= 0) {
         return opcodeList; // Return empty list if no shading map
@@ -499,7 +238,8 @@ tinydngwriter::OpcodeList createLensShadingOpcodeList(
     // Apply starting from plane 0
     gainParams.plane = 0;
     // Determine number of planes available in the shading map (expect 4 for Bayer)
-    unsigned int availablePlanes = static_cast<unsigned int>(metadata.lensShadingMap.size());
+    const auto& lensShadingMap = *metadata.lensShadingMap;
+    unsigned int availablePlanes = static_cast<unsigned int>(lensShadingMap.size());
     if (availablePlanes == 0) availablePlanes = 1;
     if (availablePlanes >= 4) {
         gainParams.planes = 4;
@@ -539,19 +279,19 @@ tinydngwriter::OpcodeList createLensShadingOpcodeList(
     gainParams.map_planes = gainParams.planes;
     
     // Fill gain data in plane-major, row-major order
-    if (!metadata.lensShadingMap.empty() && !metadata.lensShadingMap[0].empty()) {
+    if (!lensShadingMap[0].empty()) {
         const size_t perPlaneSize = static_cast<size_t>(mapPointsV) * static_cast<size_t>(mapPointsH);
         const size_t expectedSize = perPlaneSize * static_cast<size_t>(gainParams.map_planes);
         gainParams.gain_data.reserve(expectedSize);
 
         for (unsigned int p = 0; p < gainParams.map_planes; ++p) {
-            const unsigned int srcPlane = (p < metadata.lensShadingMap.size()) ? p : 0;
+            const unsigned int srcPlane = (p < lensShadingMap.size()) ? p : 0;
             for (unsigned int v = 0; v < mapPointsV; ++v) {
                 for (unsigned int h = 0; h < mapPointsH; ++h) {
                     const size_t index = static_cast<size_t>(v) * mapPointsH + h;
                     float gain = 1.0f;
-                    if (index < metadata.lensShadingMap[srcPlane].size()) {
-                        gain = metadata.lensShadingMap[srcPlane][index];
+                    if (index < lensShadingMap[srcPlane].size()) {
+                        gain = lensShadingMap[srcPlane][index];
                         if (!std::isfinite(gain) || gain <= 0.0f) {
                             gain = 1.0f;
                         } else if (gain > 16.0f) {
@@ -572,10 +312,36 @@ tinydngwriter::OpcodeList createLensShadingOpcodeList(
     return opcodeList;
 }
 
-std::tuple<std::vector<uint8_t>, std::array<unsigned short, 4>, unsigned short, tinydngwriter::OpcodeList> preprocessData(
-    std::vector<uint8_t>& data,
-    uint32_t& inOutWidth,
-    uint32_t& inOutHeight,
+struct PreprocessParams {
+    uint32_t srcWidth;
+    uint32_t srcHeight;
+    uint32_t width;
+    uint32_t height;
+    uint32_t scale;
+    uint32_t cfaSize;
+    int left;
+    int top;
+    std::array<float, 4> srcBlackLevel;
+    float srcWhiteLevel;
+    std::array<float, 4> dstBlackLevel;
+    float dstWhiteLevel;
+    std::array<float, 4> linear;
+    float shadingMapScaleX;
+    float shadingMapScaleY;
+    std::vector<std::vector<float>> lensShadingMap;
+    int lensShadingMapWidth;
+    int lensShadingMapHeight;
+    std::array<uint8_t, 4> cfa;
+    bool applyShadingMap;
+    bool debugShadingMap;
+    LogTransformMode logTransform;
+    tinydngwriter::OpcodeList opcodeList2;
+};
+
+// Everything preprocessData() needs that can be derived from the frame metadata alone
+PreprocessParams getPreprocessParams(
+    uint32_t inOutWidth,
+    uint32_t inOutHeight,
     const CameraFrameMetadata& metadata,
     const CameraConfiguration& cameraConfiguration,
     const std::array<uint8_t, 4>& cfa,
@@ -697,7 +463,7 @@ std::tuple<std::vector<uint8_t>, std::array<unsigned short, 4>, unsigned short,
     auto dstWhiteLevel = srcWhiteLevel;
 
     // Calculate shading map offsets
-    auto lensShadingMap = metadata.lensShadingMap;
+    auto lensShadingMap = metadata.lensShadingMap ? *metadata.lensShadingMap : LensShadingMap();
 
     const int fullWidth = metadata.originalWidth;
     const int fullHeight = metadata.originalHeight;
@@ -781,298 +547,491 @@ std::tuple<std::vector<uint8_t>, std::array<unsigned short, 4>, unsigned short,
         opcodeList2 = createLensShadingOpcodeList(metadata, inOutWidth, inOutHeight, left, top);
     }
 
-    //
-    // Preprocess data
-    //
-
-    uint32_t originalWidth = inOutWidth;
-    uint32_t dstOffset = 0;
-
-    // Reinterpret the input data as uint16_t for reading
-    uint16_t* srcData = reinterpret_cast<uint16_t*>(data.data());
-
-    // Process the image by copying and packing 2x2 Bayer blocks
-    std::array<float, 16> shadingMapVals;
-    shadingMapVals.fill(1.0f);
-    std::vector<uint8_t> dst;
-    dst.resize(sizeof(uint16_t) * newWidth * newHeight);
-    uint16_t* dstData = reinterpret_cast<uint16_t*>(dst.data());
-
-    for (auto y = 0; y < newHeight; y += 2 * (scale < 2 ? cfaSize : 1)) {
-        for (auto x = 0; x < newWidth; x += 2 * (scale < 2 ? cfaSize : 1)) {
-            // Get the source coordinates (scaled)
-            uint32_t srcY = y * scale;
-            uint32_t srcX = x * scale;            
- 
-            if (cfaSize < 2 | scale > 1) {
-                std::array<uint16_t, 4> s;
-                if (cfaSize == 2 && scale == 2) {                    
-                    s[0] = srcData[srcY * originalWidth + srcX] + srcData[srcY * originalWidth + srcX + 1] + srcData[(srcY + 1) * originalWidth + srcX] + srcData[(srcY + 1) * originalWidth + srcX + 1];
-                    s[1] = srcData[srcY * originalWidth + srcX + 2] + srcData[srcY * originalWidth + srcX + 3] + srcData[(srcY + 1) * originalWidth + srcX + 2] + srcData[(srcY + 1) * originalWidth + srcX + 3];
-                    s[2] = srcData[(srcY + 2) * originalWidth + srcX] + srcData[(srcY + 2) * originalWidth + srcX + 1] + srcData[(srcY + 3) * originalWidth + srcX] + srcData[(srcY + 3) * originalWidth + srcX + 1];
-                    s[3] = srcData[(srcY + 2) * originalWidth + srcX + 2] + srcData[(srcY + 2) * originalWidth + srcX + 3] + srcData[(srcY + 3) * originalWidth + srcX + 2] + srcData[(srcY + 3) * originalWidth + srcX + 3];
-                } else {
-                    s[0] = srcData[srcY * originalWidth + srcX];
-                    s[1] = srcData[srcY * originalWidth + srcX + cfaSize];
-                    s[2] = srcData[(srcY + cfaSize) * originalWidth + srcX];
-                    s[3] = srcData[(srcY + cfaSize) * originalWidth + srcX + cfaSize];
-                }                
-                
-                if(applyShadingMap) {                              
-                    // Calculate position in shading map     
-                    shadingMapVals[0] = getShadingMapValue((srcX + left) * shadingMapScaleX, (srcY + top) * shadingMapScaleY, cfa[0], lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[1] = getShadingMapValue((srcX + left + scale) * shadingMapScaleX, (srcY + top) * shadingMapScaleY, cfa[1], lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[2] = getShadingMapValue((srcX + left) * shadingMapScaleX, (srcY + top + scale) * shadingMapScaleY, cfa[2], lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[3] = getShadingMapValue((srcX + left + scale) * shadingMapScaleX, (srcY + top + scale) * shadingMapScaleY, cfa[3], lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
+    PreprocessParams params;
+
+    params.srcWidth = inOutWidth;
+    params.srcHeight = inOutHeight;
+    params.width = newWidth;
+    params.height = newHeight;
+    params.scale = scale;
+    params.cfaSize = cfaSize;
+    params.left = left;
+    params.top = top;
+    params.srcBlackLevel = srcBlackLevel;
+    params.srcWhiteLevel = srcWhiteLevel;
+    params.dstBlackLevel = dstBlackLevel;
+    params.dstWhiteLevel = dstWhiteLevel;
+    params.linear = linear;
+    params.shadingMapScaleX = shadingMapScaleX;
+    params.shadingMapScaleY = shadingMapScaleY;
+    params.lensShadingMap = std::move(lensShadingMap);
+    params.lensShadingMapWidth = metadata.lensShadingMapWidth;
+    params.lensShadingMapHeight = metadata.lensShadingMapHeight;
+    params.cfa = cfa;
+    params.applyShadingMap = applyShadingMap;
+    params.debugShadingMap = debugShadingMap;
+    params.logTransform = logTransform;
+    params.opcodeList2 = std::move(opcodeList2);
+
+    return params;
+}
+
+namespace {
+    // Kept for a few clips, frames of a clip usually share their levels
+    constexpr size_t MAX_LOG_CURVES = 8;
+
+    // Rows handed to a thread at a time when a frame is split up
+    constexpr size_t PREPROCESS_BAND_ROWS = 64;
+    constexpr size_t PACK_BAND_ROWS = 128;
+
+    // One axis of the bilinear shading map lookup
+    struct ShadingTap {
+        int i0;
+        int i1;
+        float w;
+    };
+
+    ShadingTap getShadingTap(float v, int size) {
+        // Clamp input coordinate to [0, 1] range and convert to map coordinates
+        v = std::max(0.0f, std::min(1.0f, v));
+
+        const float m = v * (size - 1);
+        const int i0 = static_cast<int>(std::floor(m));
+
+        return { i0, std::min(i0 + 1, size - 1), m - i0 };
+    }
+
+    // Shading map lookups for each output column and row, so that only the interpolation is left per pixel
+    struct ShadingTaps {
+        std::vector<ShadingTap> columns;
+        std::vector<ShadingTap> rows;
+    };
+
+    // Where the shading map is sampled for an output pixel. Quad Bayer blocks sample the second
+    // 2x2 block of each 4x4 block two pixels further along, same as the original block loop.
+    uint32_t getShadingPosition(uint32_t v, uint32_t scale, bool quadBlocks) {
+        if(quadBlocks)
+            return v + ((v & 2) ? 2 : 0);
+
+        return v * scale;
+    }
+
+    ShadingTaps getShadingTaps(const PreprocessParams& params, bool quadBlocks) {
+        ShadingTaps taps;
+
+        taps.columns.resize(params.width);
+        taps.rows.resize(params.height);
+
+        for(uint32_t x = 0; x < params.width; x++) {
+            const uint32_t pos = getShadingPosition(x, params.scale, quadBlocks) + params.left;
+            taps.columns[x] = getShadingTap(pos * params.shadingMapScaleX, params.lensShadingMapWidth);
+        }
+
+        for(uint32_t y = 0; y < params.height; y++) {
+            const uint32_t pos = getShadingPosition(y, params.scale, quadBlocks) + params.top;
+
+            auto tap = getShadingTap(pos * params.shadingMapScaleY, params.lensShadingMapHeight);
+
+            // Rows are only used as offsets into the map
+            tap.i0 *= params.lensShadingMapWidth;
+            tap.i1 *= params.lensShadingMapWidth;
+
+            taps.rows[y] = tap;
+        }
+
+        return taps;
+    }
+
+    // Log encoded output for each level index and integer input value, without the dither
+    struct LogCurve {
+        std::array<float, 4> linear;
+        std::array<float, 4> srcBlackLevel;
+        float dstWhiteLevel;
+        std::array<std::vector<float>, 4> values;
+    };
+
+    inline float getLogValue(float v) {
+        // Apply log2 transform that preserves black and white levels as identity points
+        return std::log2(1.0f + 60.0f * std::max(0.0f, v)) / std::log2(61.0f);
+    }
+
+    std::shared_ptr<const LogCurve> getLogCurve(const PreprocessParams& params) {
+        static std::mutex mutex;
+        static std::list<std::shared_ptr<const LogCurve>> curves; // Most recently used at the front
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for(auto it = curves.begin(); it != curves.end(); ++it) {
+                const auto& curve = **it;
+
+                if(curve.linear == params.linear &&
+                   curve.srcBlackLevel == params.srcBlackLevel &&
+                   curve.dstWhiteLevel == params.dstWhiteLevel)
+                {
+                    curves.splice(curves.begin(), curves, it);
+                    return curves.front();
                 }
+            }
+        }
+
+        auto curve = std::make_shared<LogCurve>();
+
+        curve->linear = params.linear;
+        curve->srcBlackLevel = params.srcBlackLevel;
+        curve->dstWhiteLevel = params.dstWhiteLevel;
+
+        // Values above the white level are rare enough to compute on the fly
+        const size_t size = static_cast<size_t>(std::clamp(params.srcWhiteLevel + 1.0f, 1.0f, 65536.0f));
+
+        for(int i = 0; i < 4; i++) {
+            auto& values = curve->values[i];
+
+            values.resize(size);
+
+            for(size_t v = 0; v < size; v++)
+                values[v] = getLogValue(params.linear[i] * (static_cast<uint16_t>(v) - params.srcBlackLevel[i])) * params.dstWhiteLevel;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        curves.push_front(curve);
+        if(curves.size() > MAX_LOG_CURVES)
+            curves.pop_back();
+
+        return curve;
+    }
+
+    // The seed uses the pixel positions the original 2x2 and 4x4 block loops used, so the dither doesn't change
+    inline float getDither(uint32_t x, uint32_t y, bool quadBlocks) {
+        if(quadBlocks) {
+            const uint32_t block = ((y >> 1) & 1) * 2 + ((x >> 1) & 1);
+
+            x = (x & ~3u) + (x & 1);
+            y = (y & ~3u) + block * 2 + (y & 1);
+        }
+
+        uint32_t seed = (x * 1664525 + y * 1013904223) ^ 0xdeadbeef; // Create unique seed for each pixel using its position
+        // Apply multiple hash iterations to improve randomness
+        seed ^= seed >> 16; seed *= 0x85ebca6b; seed ^= seed >> 13; seed *= 0xc2b2ae35; seed ^= seed >> 16;
+        // Generate triangular dither: sum of two uniform random values
+        const float r1 = (seed & 0xffff) / 65535.0f;
+        const float r2 = ((seed >> 16) & 0xffff) / 65535.0f;
+        // Triangular distribution: r1 + r2 - 1, range [-1, 1] Scale down for subtle dithering appropriate for log encoding
+        return (r1 + r2 - 1.0f) * 0.5f;
+    }
+
+    // Per column copies of the levels for even and odd rows, so the row loops don't need lookups
+    struct RowLevels {
+        std::array<std::vector<float>, 2> linear;
+        std::array<std::vector<float>, 2> srcBlackLevel;
+        std::array<std::vector<float>, 2> dstBlackLevel;
+        std::array<std::vector<float>, 2> dstRange;
+    };
+
+    RowLevels getRowLevels(const PreprocessParams& params) {
+        RowLevels levels;
+
+        for(uint32_t parity = 0; parity < 2; parity++) {
+            levels.linear[parity].resize(params.width);
+            levels.srcBlackLevel[parity].resize(params.width);
+            levels.dstBlackLevel[parity].resize(params.width);
+            levels.dstRange[parity].resize(params.width);
+
+            for(uint32_t x = 0; x < params.width; x++) {
+                const uint32_t i = parity * 2 + (x & 1);
+
+                levels.linear[parity][x] = params.linear[i];
+                levels.srcBlackLevel[parity][x] = params.srcBlackLevel[i];
+                levels.dstBlackLevel[parity][x] = params.dstBlackLevel[i];
+                levels.dstRange[parity][x] = params.dstWhiteLevel - params.dstBlackLevel[i];
+            }
+        }
+
+        return levels;
+    }
 
-                std::array<float, 4> p;
-
-                if(debugShadingMap) {
-                    for (int i = 0; i < 4; i++)
-                        p[i] = std::max(0.0f, linear[i] * (srcWhiteLevel - srcBlackLevel[i]) * shadingMapVals[i]) * (dstWhiteLevel - dstBlackLevel[i]);
-                } else if (logTransform == LogTransformMode::Disabled) {               // Linearize and (maybe) apply shading map
-                    for (int i = 0; i < 4; i++)
-                        p[i] = std::max(0.0f, linear[i] * (s[i] - srcBlackLevel[i]) * shadingMapVals[i]) * (dstWhiteLevel - dstBlackLevel[i]);
-                } else {                                
-                    std::array<float, 4> dither; // Apply logarithmic tone mapping with triangular dithering. Generate improved triangular dither with better randomization                                    
-                    for (int i = 0; i < 4; i++) { // Use different seeds for each pixel in the 2x2 block to avoid correlation                    
-                        uint32_t seed = ((x + (i & 1)) * 1664525 + (y + (i >> 1)) * 1013904223) ^ 0xdeadbeef; // Create unique seed for each pixel using position and pixel index
-                        // Apply multiple hash iterations to improve randomness
-                        seed ^= seed >> 16; seed *= 0x85ebca6b; seed ^= seed >> 13; seed *= 0xc2b2ae35; seed ^= seed >> 16;                    
-                        // Generate triangular dither: sum of two uniform random values
-                        float r1 = (seed & 0xffff) / 65535.0f; float r2 = ((seed >> 16) & 0xffff) / 65535.0f;                    
-                        // Triangular distribution: r1 + r2 - 1, range [-1, 1] Scale down for subtle dithering appropriate for log encoding
-                        dither[i] = (r1 + r2 - 1.0f) * 0.5f;
-                        // Apply log2 transform that preserves black and white levels as identity points
-                        float logValue = std::log2(1.0f + 60.0f * std::max(0.0f, linear[i] * (s[i] - srcBlackLevel[i]) * shadingMapVals[i])) / std::log2(61.0f);                  
-                        p[i] = (logValue) * dstWhiteLevel + dither[i]; // Scale by dstWhiteLevel to match what the linearization table expects
+    // How the source is read for each output pixel
+    enum class SourceLayout {
+        Bayer,          // Full size, as is
+        QuadBlocks,     // Quad Bayer at full size, copied in 4x4 blocks
+        Binned,         // Quad Bayer at half size, the 2x2 blocks of each colour summed
+        Decimated       // One CFA pair for every scale pixels
+    };
+
+    // What happens to the linear values before they are rounded
+    enum class ToneMode {
+        Linear,
+        DebugShadingMap,    // The shading map applied to a white image
+        Log
+    };
+
+    // Where finished rows go, as 16 bit pixels or packed to encodeBits per pixel
+    struct RowOutput {
+        uint16_t* pixels;           // stride pixels per row, when not packing
+        size_t stride;              // The pixels past width are zeroed
+        uint8_t* packed;            // packedRowSize bytes per row, when packing
+        size_t packedRowSize;
+        uint32_t paddedWidth;       // Rows are packed in whole groups
+        unsigned short encodeBits;
+    };
+
+    using RowKernel = void (*)(
+        const uint16_t*, const PreprocessParams&, const RowLevels&, const ShadingTaps*, const LogCurve*, const RowOutput&, uint32_t, uint32_t);
+
+    // Processes output rows [rowBegin, rowEnd) of preprocessData(), each row only depends on the source image.
+    // Each combination of options is its own instantiation, so all that is left per row is a few simple
+    // loops without branches that the compiler can vectorise. Packed rows are packed while still in cache.
+    template<SourceLayout LAYOUT, bool SHADING, ToneMode TONE>
+    void preprocessRows(
+        const uint16_t* srcData,
+        const PreprocessParams& params,
+        const RowLevels& levels,
+        const ShadingTaps* shadingTaps,
+        const LogCurve* logCurve,
+        const RowOutput& output,
+        uint32_t rowBegin,
+        uint32_t rowEnd)
+    {
+        constexpr bool quadBlocks = LAYOUT == SourceLayout::QuadBlocks;
+        constexpr bool fullSize = LAYOUT == SourceLayout::Bayer || LAYOUT == SourceLayout::QuadBlocks;
+        constexpr bool readInput = TONE != ToneMode::DebugShadingMap;
+
+        const uint32_t width = params.width;
+        const uint32_t srcWidth = params.srcWidth;
+        const uint32_t scale = params.scale;
+        const uint32_t cfaSize = params.cfaSize;
+        const float srcWhiteLevel = params.srcWhiteLevel;
+        const float dstWhiteLevel = params.dstWhiteLevel;
+        const auto& cfa = params.cfa;
+
+        // Full size rows are read in place
+        std::vector<uint16_t> input(readInput && !fullSize ? width : 0);
+        std::vector<float> gain(SHADING ? width : 0);
+        std::vector<float> values(width);
+
+        // Rows to be packed are rounded into here first, the padding stays zero
+        std::vector<uint16_t> packRow(output.packed ? output.paddedWidth : 0);
+
+        for(uint32_t y = rowBegin; y < rowEnd; y++) {
+            // Level index of the even columns, odd columns use the next one
+            const uint32_t level = (y & 1) * 2;
+
+            const uint16_t* in = input.data();
+
+            if constexpr(readInput && fullSize) {
+                in = srcData + static_cast<size_t>(y) * srcWidth;
+            }
+            else if constexpr(readInput) {
+                const uint32_t srcY = (y & ~1u) * scale + (y & 1) * cfaSize;
+                const uint16_t* row0 = srcData + static_cast<size_t>(srcY) * srcWidth;
+
+                if constexpr(LAYOUT == SourceLayout::Binned) {
+                    const uint16_t* row1 = row0 + srcWidth;
+
+                    for(uint32_t x = 0; x < width; x++) {
+                        const uint32_t srcX = x * 2;
+                        input[x] = static_cast<uint16_t>(row0[srcX] + row0[srcX + 1] + row1[srcX] + row1[srcX + 1]);
                     }
-                }            
-                
-                for (int i = 0; i < 4; i++)
-                    s[i] = std::clamp(std::round((p[i] + dstBlackLevel[i])), 0.f, dstWhiteLevel);
+                }
+                else {
+                    // One CFA pair per block of scale columns, the pair is next to each other in the
+                    // source so both come from the same cache line. Width is a multiple of 4
+                    const uint16_t* pair = row0;
+                    const size_t pairStride = static_cast<size_t>(scale) * 2;
+
+                    for(uint32_t x = 0; x < width; x += 2, pair += pairStride) {
+                        input[x] = pair[0];
+                        input[x + 1] = pair[cfaSize];
+                    }
+                }
+            }
 
-                // Copy the 2x2 Bayer block
-                dstData[dstOffset]                 = static_cast<unsigned short>(s[0]);
-                dstData[dstOffset + 1]             = static_cast<unsigned short>(s[1]);
-                dstData[dstOffset + newWidth]      = static_cast<unsigned short>(s[2]);
-                dstData[dstOffset + newWidth + 1]  = static_cast<unsigned short>(s[3]);
+            if constexpr(SHADING) {
+                const auto& mapRow = shadingTaps->rows[y];
+                const uint32_t block = ((y >> 1) & 1) * 2;
 
-                dstOffset += 2;
-            } else {
-                std::array<uint16_t, 16> s = {                
-                    srcData[srcY * originalWidth + srcX], srcData[srcY * originalWidth + srcX + 1], srcData[(srcY + 1) * originalWidth + srcX], srcData[(srcY + 1) * originalWidth + srcX + 1],
-                    srcData[srcY * originalWidth + srcX + 2], srcData[srcY * originalWidth + srcX + 3], srcData[(srcY + 1) * originalWidth + srcX + 2], srcData[(srcY + 1) * originalWidth + srcX + 3],
-                    srcData[(srcY + 2) * originalWidth + srcX], srcData[(srcY + 2) * originalWidth + srcX + 1], srcData[(srcY + 3) * originalWidth + srcX], srcData[(srcY + 3) * originalWidth + srcX + 1],
-                    srcData[(srcY + 2) * originalWidth + srcX + 2], srcData[(srcY + 2) * originalWidth + srcX + 3], srcData[(srcY + 3) * originalWidth + srcX + 2], srcData[(srcY + 3) * originalWidth + srcX + 3]
-                };
-
-                if(applyShadingMap) { 
-                    // Calculate position in shading map     
-                    shadingMapVals[0] = getShadingMapValue((srcX + left) * shadingMapScaleX, (srcY + top) * shadingMapScaleY, 0, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[1] = getShadingMapValue((srcX + left + 1) * shadingMapScaleX, (srcY + top) * shadingMapScaleY, 0, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[2] = getShadingMapValue((srcX + left) * shadingMapScaleX, (srcY + top + 1) * shadingMapScaleY, 0, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[3] = getShadingMapValue((srcX + left + 1) * shadingMapScaleX, (srcY + top + 1) * shadingMapScaleY, 0, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[4] = getShadingMapValue((srcX + left + cfaSize * 2) * shadingMapScaleX, (srcY + top) * shadingMapScaleY, 1, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[5] = getShadingMapValue((srcX + left + cfaSize * 2 + 1) * shadingMapScaleX, (srcY + top) * shadingMapScaleY, 1, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[6] = getShadingMapValue((srcX + left + cfaSize * 2) * shadingMapScaleX, (srcY + top + 1) * shadingMapScaleY, 1, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[7] = getShadingMapValue((srcX + left + cfaSize * 2 + 1) * shadingMapScaleX, (srcY + top + 1) * shadingMapScaleY, 1, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[8] = getShadingMapValue((srcX + left) * shadingMapScaleX, (srcY + top + cfaSize * 2) * shadingMapScaleY, 2, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[9] = getShadingMapValue((srcX + left + 1) * shadingMapScaleX, (srcY + top + cfaSize * 2) * shadingMapScaleY, 2, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[10] = getShadingMapValue((srcX + left) * shadingMapScaleX, (srcY + top + cfaSize * 2 + 1) * shadingMapScaleY, 2, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[11] = getShadingMapValue((srcX + left + 1) * shadingMapScaleX, (srcY + top + cfaSize * 2 + 1) * shadingMapScaleY, 2, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[12] = getShadingMapValue((srcX + left + cfaSize * 2) * shadingMapScaleX, (srcY + top + cfaSize * 2) * shadingMapScaleY, 3, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[13] = getShadingMapValue((srcX + left + cfaSize * 2 + 1) * shadingMapScaleX, (srcY + top + cfaSize * 2) * shadingMapScaleY, 3, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[14] = getShadingMapValue((srcX + left + cfaSize * 2) * shadingMapScaleX, (srcY + top + cfaSize * 2 + 1) * shadingMapScaleY, 3, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
-                    shadingMapVals[15] = getShadingMapValue((srcX + left + cfaSize * 2 + 1) * shadingMapScaleX, (srcY + top + cfaSize * 2 + 1) * shadingMapScaleY, 3, lensShadingMap, metadata.lensShadingMapWidth, metadata.lensShadingMapHeight);
+                for(uint32_t x = 0; x < width; x++) {
+                    const int channel = quadBlocks ? block + ((x >> 1) & 1) : cfa[level + (x & 1)];
+                    const float* map = params.lensShadingMap[channel].data();
+                    const auto& mapColumn = shadingTaps->columns[x];
+
+                    // Perform bilinear interpolation
+                    const float valTop = map[mapRow.i0 + mapColumn.i0] * (1.0f - mapColumn.w) + map[mapRow.i0 + mapColumn.i1] * mapColumn.w;
+                    const float valBottom = map[mapRow.i1 + mapColumn.i0] * (1.0f - mapColumn.w) + map[mapRow.i1 + mapColumn.i1] * mapColumn.w;
+
+                    gain[x] = valTop * (1.0f - mapRow.w) + valBottom * mapRow.w;
                 }
+            }
 
-                std::array<float, 16> p;
+            // Levels of each column in the row, they alternate between two values
+            const float* rowLinear = levels.linear[y & 1].data();
+            const float* rowSrcBlackLevel = levels.srcBlackLevel[y & 1].data();
+            const float* rowDstBlackLevel = levels.dstBlackLevel[y & 1].data();
+            const float* rowDstRange = levels.dstRange[y & 1].data();
 
-                for (int i = 0; i < 16; i++)
-                    p[i] = linear[i%4] * (s[i] - srcBlackLevel[i%4]) * shadingMapVals[i];
+            float* out = values.data();
 
-                std::array<float, 48> d;
+            // Linearize and (maybe) apply shading map
+            if constexpr(TONE == ToneMode::DebugShadingMap) {
+                for(uint32_t x = 0; x < width; x++)
+                    out[x] = rowLinear[x] * (srcWhiteLevel - rowSrcBlackLevel[x]);
+            }
+            else {
+                for(uint32_t x = 0; x < width; x++)
+                    out[x] = rowLinear[x] * (in[x] - rowSrcBlackLevel[x]);
+            }
 
-                std::array<float, 16> r;
+            if constexpr(SHADING) {
+                const float* g = gain.data();
 
-                /*if(cfaSize > 1 && (quadBayerOption == "Remosaic" || quadBayerOption == "Demosaic only")) {
-                    // Quad Bayer demosaic - simplified bilinear interpolation
-                    // p[16] contains 4x4 Quad Bayer block, d[48] will contain 16 RGB pixels
-                    
-                    // Simple bilinear interpolation for Quad Bayer and remosaic to normal Bayer
-                    for(int py = 0; py < 4; py++) {
-                        for(int px = 0; px < 4; px++) {
-                            int idx = py * 4 + px;
-                            int outIdx = idx * 3;
-                            
-                            // Determine which color this pixel is based on CFA pattern
-                            // For Quad Bayer, each 2x2 block has the same color
-                            int cfaIdx = ((py / 2) % 2) * 2 + ((px / 2) % 2);
-                            int color = cfa[cfaIdx];
-                            
-                            float red = 0, green = 0, blue = 0;
-                            
-                            if(color == 0) { // Red pixel
-                                red = p[idx];
-                                // Interpolate green from neighbors
-                                float gSum = 0; int gCount = 0;
-                                if(px > 0 && cfa[(((py / 2) % 2)) * 2 + (((px-1) / 2) % 2)] == 1) { gSum += p[idx-1]; gCount++; }
-                                if(px < 3 && cfa[(((py / 2) % 2)) * 2 + (((px+1) / 2) % 2)] == 1) { gSum += p[idx+1]; gCount++; }
-                                if(py > 0 && cfa[(((py-1) / 2) % 2) * 2 + ((px / 2) % 2)] == 1) { gSum += p[idx-4]; gCount++; }
-                                if(py < 3 && cfa[(((py+1) / 2) % 2) * 2 + ((px / 2) % 2)] == 1) { gSum += p[idx+4]; gCount++; }
-                                green = gCount > 0 ? gSum / gCount : p[idx];
-                                // Interpolate blue from diagonals
-                                float bSum = 0; int bCount = 0;
-                                if(px > 0 && py > 0 && cfa[(((py-1) / 2) % 2) * 2 + (((px-1) / 2) % 2)] == 2) { bSum += p[idx-5]; bCount++; }
-                                if(px < 3 && py > 0 && cfa[(((py-1) / 2) % 2) * 2 + (((px+1) / 2) % 2)] == 2) { bSum += p[idx-3]; bCount++; }
-                                if(px > 0 && py < 3 && cfa[(((py+1) / 2) % 2) * 2 + (((px-1) / 2) % 2)] == 2) { bSum += p[idx+3]; bCount++; }
-                                if(px < 3 && py < 3 && cfa[(((py+1) / 2) % 2) * 2 + (((px+1) / 2) % 2)] == 2) { bSum += p[idx+5]; bCount++; }
-                                blue = bCount > 0 ? bSum / bCount : p[idx];
-                            }
-                            else if(color == 1) { // Green pixel
-                                green = p[idx];
-                                // Interpolate red and blue from neighbors
-                                float rSum = 0, bSum = 0; int rCount = 0, bCount = 0;
-                                if(px > 0) { 
-                                    int c = cfa[(((py / 2) % 2)) * 2 + (((px-1) / 2) % 2)];
-                                    if(c == 0) { rSum += p[idx-1]; rCount++; }
-                                    else if(c == 2) { bSum += p[idx-1]; bCount++; }
-                                }
-                                if(px < 3) {
-                                    int c = cfa[(((py / 2) % 2)) * 2 + (((px+1) / 2) % 2)];
-                                    if(c == 0) { rSum += p[idx+1]; rCount++; }
-                                    else if(c == 2) { bSum += p[idx+1]; bCount++; }
-                                }
-                                if(py > 0) {
-                                    int c = cfa[(((py-1) / 2) % 2) * 2 + ((px / 2) % 2)];
-                                    if(c == 0) { rSum += p[idx-4]; rCount++; }
-                                    else if(c == 2) { bSum += p[idx-4]; bCount++; }
-                                }
-                                if(py < 3) {
-                                    int c = cfa[(((py+1) / 2) % 2) * 2 + ((px / 2) % 2)];
-                                    if(c == 0) { rSum += p[idx+4]; rCount++; }
-                                    else if(c == 2) { bSum += p[idx+4]; bCount++; }
-                                }
-                                red = rCount > 0 ? rSum / rCount : p[idx];
-                                blue = bCount > 0 ? bSum / bCount : p[idx];
-                            }
-                            else { // Blue pixel
-                                blue = p[idx];
-                                // Interpolate green from neighbors
-                                float gSum = 0; int gCount = 0;
-                                if(px > 0 && cfa[(((py / 2) % 2)) * 2 + (((px-1) / 2) % 2)] == 1) { gSum += p[idx-1]; gCount++; }
-                                if(px < 3 && cfa[(((py / 2) % 2)) * 2 + (((px+1) / 2) % 2)] == 1) { gSum += p[idx+1]; gCount++; }
-                                if(py > 0 && cfa[(((py-1) / 2) % 2) * 2 + ((px / 2) % 2)] == 1) { gSum += p[idx-4]; gCount++; }
-                                if(py < 3 && cfa[(((py+1) / 2) % 2) * 2 + ((px / 2) % 2)] == 1) { gSum += p[idx+4]; gCount++; }
-                                green = gCount > 0 ? gSum / gCount : p[idx];
-                                // Interpolate red from diagonals
-                                float rSum = 0; int rCount = 0;
-                                if(px > 0 && py > 0 && cfa[(((py-1) / 2) % 2) * 2 + (((px-1) / 2) % 2)] == 0) { rSum += p[idx-5]; rCount++; }
-                                if(px < 3 && py > 0 && cfa[(((py-1) / 2) % 2) * 2 + (((px+1) / 2) % 2)] == 0) { rSum += p[idx-3]; rCount++; }
-                                if(px > 0 && py < 3 && cfa[(((py+1) / 2) % 2) * 2 + (((px-1) / 2) % 2)] == 0) { rSum += p[idx+3]; rCount++; }
-                                if(px < 3 && py < 3 && cfa[(((py+1) / 2) % 2) * 2 + (((px+1) / 2) % 2)] == 0) { rSum += p[idx+5]; rCount++; }
-                                red = rCount > 0 ? rSum / rCount : p[idx];
-                            }
-                            
-                            // Store demosaiced RGB
-                            d[outIdx] = red;
-                            d[outIdx + 1] = green;
-                            d[outIdx + 2] = blue;
-                            
-                            // Remosaic to normal Bayer - extract appropriate channel based on normal Bayer CFA pattern
-                            int bayerCfaIdx = (py % 2) * 2 + (px % 2);
-                            int bayerColor = cfa[bayerCfaIdx];
-                            
-                            //if(bayerColor == 0) { // Red position in normal Bayer
-                                r[idx] = red;
-                            //}
-                            //else if(bayerColor == 1) { // Green position in normal Bayer
-                                //r[idx] = green;
-                            //}
-                            //else { // Blue position in normal Bayer
-                              //  r[idx] = blue;
-                            //}
-                        }
-                    }
-                    p = r;
-                }*/
-
-
-                if (logTransform == LogTransformMode::Disabled) {               // Linearize and (maybe) apply shading map
-                    for (int i = 0; i < 16; i++)
-                        p[i] = std::max(0.0f, p[i] * (dstWhiteLevel - dstBlackLevel[i%4]));
-                } else {                                
-                    std::array<float, 16> dither; // Apply logarithmic tone mapping with triangular dithering. Generate improved triangular dither with better randomization                                    
-                    for (int i = 0; i < 16; i++) { // Use different seeds for each pixel in the 2x2 block to avoid correlation                    
-                        uint32_t seed = ((x + (i & 1)) * 1664525 + (y + (i >> 1)) * 1013904223) ^ 0xdeadbeef; // Create unique seed for each pixel using position and pixel index
-                        // Apply multiple hash iterations to improve randomness
-                        seed ^= seed >> 16; seed *= 0x85ebca6b; seed ^= seed >> 13; seed *= 0xc2b2ae35; seed ^= seed >> 16;                    
-                        // Generate triangular dither: sum of two uniform random values
-                        float r1 = (seed & 0xffff) / 65535.0f; float r2 = ((seed >> 16) & 0xffff) / 65535.0f;                    
-                        // Triangular distribution: r1 + r2 - 1, range [-1, 1] Scale down for subtle dithering appropriate for log encoding
-                        dither[i] = (r1 + r2 - 1.0f) * 0.5f;
-                        // Apply log2 transform that preserves black and white levels as identity points
-                        float logValue = std::log2(1.0f + 60.0f * std::max(0.0f, p[i])) / std::log2(61.0f);                  
-                        p[i] = (logValue) * dstWhiteLevel + dither[i]; // Scale by dstWhiteLevel to match what the linearization table expects
+                for(uint32_t x = 0; x < width; x++)
+                    out[x] *= g[x];
+            }
+
+            if constexpr(TONE != ToneMode::Log) {
+                for(uint32_t x = 0; x < width; x++)
+                    out[x] = std::max(0.0f, out[x]) * rowDstRange[x];
+            }
+            else {
+                // Apply logarithmic tone mapping with triangular dithering, scaled by dstWhiteLevel to match
+                // what the linearization table expects. Without the shading map the curve only depends on
+                // the input value, so it is looked up
+                if constexpr(!SHADING) {
+                    const float* curves[2] = { logCurve->values[level].data(), logCurve->values[level + 1].data() };
+                    const size_t curveSize = logCurve->values[level].size();
+
+                    for(uint32_t x = 0; x < width; x++) {
+                        const uint16_t v = in[x];
+                        out[x] = v < curveSize ? curves[x & 1][v] : getLogValue(out[x]) * dstWhiteLevel;
                     }
-                }            
+                }
+                else {
+                    for(uint32_t x = 0; x < width; x++)
+                        out[x] = getLogValue(out[x]) * dstWhiteLevel;
+                }
 
-                for (int i = 0; i < 16; i++)
-                    s[i] = std::clamp(std::round((p[i] + dstBlackLevel[i%4])), 0.f, dstWhiteLevel);
-                    
-                dstData[dstOffset]                      = static_cast<unsigned short>(s[0]); 
-                dstData[dstOffset + 1]                  = static_cast<unsigned short>(s[1]);
-                dstData[dstOffset + newWidth]           = static_cast<unsigned short>(s[2]);
-                dstData[dstOffset + newWidth + 1]       = static_cast<unsigned short>(s[3]);
-                dstData[dstOffset + 2]                  = static_cast<unsigned short>(s[4]); 
-                dstData[dstOffset + 3]                  = static_cast<unsigned short>(s[5]);
-                dstData[dstOffset + newWidth + 2]       = static_cast<unsigned short>(s[6]);
-                dstData[dstOffset + newWidth + 3]       = static_cast<unsigned short>(s[7]);
-                dstData[dstOffset + newWidth * 2]       = static_cast<unsigned short>(s[8]); 
-                dstData[dstOffset + newWidth * 2 + 1]   = static_cast<unsigned short>(s[9]);
-                dstData[dstOffset + newWidth * 3]       = static_cast<unsigned short>(s[10]);
-                dstData[dstOffset + newWidth * 3 + 1]   = static_cast<unsigned short>(s[11]);
-                dstData[dstOffset + newWidth * 2 + 2]   = static_cast<unsigned short>(s[12]); 
-                dstData[dstOffset + newWidth * 2 + 3]   = static_cast<unsigned short>(s[13]);
-                dstData[dstOffset + newWidth * 3 + 2]   = static_cast<unsigned short>(s[14]);
-                dstData[dstOffset + newWidth * 3 + 3]   = static_cast<unsigned short>(s[15]);
-                              
-                dstOffset += 2 * cfaSize;
-            }            
+                for(uint32_t x = 0; x < width; x++)
+                    out[x] += getDither(x, y, quadBlocks);
+            }
+
+            uint16_t* dstRow = output.packed ? packRow.data() : output.pixels + static_cast<size_t>(y) * output.stride;
+
+            // Same as rounding then clamping, without std::round() which doesn't vectorise
+            for(uint32_t x = 0; x < width; x++) {
+                const float v = std::clamp(out[x] + rowDstBlackLevel[x], 0.f, dstWhiteLevel);
+                const uint32_t r = static_cast<uint32_t>(v);
+
+                dstRow[x] = static_cast<unsigned short>(r + (v - r >= 0.5f ? 1 : 0));
+            }
+
+            if(output.packed)
+                bitpacking::pack(dstRow, output.packed + static_cast<size_t>(y) * output.packedRowSize, width, 1, output.encodeBits);
+            else
+                std::fill(dstRow + width, dstRow + output.stride, static_cast<uint16_t>(0));
+        }
+    }
+
+    template<SourceLayout LAYOUT, bool SHADING>
+    RowKernel getRowKernel(ToneMode tone) {
+        switch(tone) {
+        case ToneMode::DebugShadingMap: return &preprocessRows<LAYOUT, SHADING, ToneMode::DebugShadingMap>;
+        case ToneMode::Log:             return &preprocessRows<LAYOUT, SHADING, ToneMode::Log>;
+        default:                        return &preprocessRows<LAYOUT, SHADING, ToneMode::Linear>;
         }
-        dstOffset += newWidth * (cfaSize == 2 && scale == 1 ? 3 : 1);
     }
 
-    // Update dimensions
-    inOutWidth = newWidth;
-    inOutHeight = newHeight;
+    template<SourceLayout LAYOUT>
+    RowKernel getRowKernel(bool shading, ToneMode tone) {
+        return shading ? getRowKernel<LAYOUT, true>(tone) : getRowKernel<LAYOUT, false>(tone);
+    }
+
+    // Picks the kernel for the settings of a frame, once per frame
+    RowKernel getRowKernel(const PreprocessParams& params, bool shading) {
+        // Quad Bayer at full size is copied in 4x4 blocks, everything else in 2x2 blocks of (binned) pixels
+        const bool quadBlocks = params.cfaSize == 2 && params.scale == 1;
+
+        // The debug view has no use for the log curve. It doesn't apply to 4x4 blocks
+        ToneMode tone = ToneMode::Linear;
+
+        if(params.debugShadingMap && !quadBlocks)
+            tone = ToneMode::DebugShadingMap;
+        else if(params.logTransform != LogTransformMode::Disabled)
+            tone = ToneMode::Log;
+
+        if(params.scale == 1)
+            return quadBlocks ? getRowKernel<SourceLayout::QuadBlocks>(shading, tone) : getRowKernel<SourceLayout::Bayer>(shading, tone);
+
+        if(params.cfaSize == 2 && params.scale == 2)
+            return getRowKernel<SourceLayout::Binned>(shading, tone);
+
+        return getRowKernel<SourceLayout::Decimated>(shading, tone);
+    }
+
+    // Runs the kernel of the frame over its rows, in bands of rows spread over the idle threads of threadPool
+    void preprocessFrame(const std::vector<uint8_t>& data, const PreprocessParams& params, const RowOutput& output, BS::thread_pool* threadPool) {
+        const bool quadBlocks = params.cfaSize == 2 && params.scale == 1;
+        const bool applyShadingMap = params.applyShadingMap && params.lensShadingMap.size() >= 4;
+
+        const auto levels = getRowLevels(params);
+        const auto kernel = getRowKernel(params, applyShadingMap);
+
+        ShadingTaps shadingTaps;
+        if(applyShadingMap)
+            shadingTaps = getShadingTaps(params, quadBlocks);
+
+        // Without the shading map the log curve only depends on the input value
+        std::shared_ptr<const LogCurve> logCurve;
+        if(params.logTransform != LogTransformMode::Disabled && !applyShadingMap)
+            logCurve = getLogCurve(params);
+
+        parallelFor(threadPool, params.height, PREPROCESS_BAND_ROWS, [&](size_t begin, size_t end) {
+            kernel(
+                reinterpret_cast<const uint16_t*>(data.data()),
+                params,
+                levels,
+                applyShadingMap ? &shadingTaps : nullptr,
+                logCurve.get(),
+                output,
+                static_cast<uint32_t>(begin),
+                static_cast<uint32_t>(end));
+        });
+    }
+}
 
-    std::array<unsigned short, 4> blackLevelResult;
+// Writes width * height 16 bit pixels to dst with rows stride pixels apart, in bands of rows spread
+// over the idle threads of threadPool
+void preprocessData(
+    const std::vector<uint8_t>& data, const PreprocessParams& params, uint16_t* dstData, size_t stride, BS::thread_pool* threadPool)
+{
+    preprocessFrame(data, params, RowOutput{ dstData, stride, nullptr, 0, 0, 16 }, threadPool);
+}
 
-    for(auto i = 0; i < dstBlackLevel.size(); ++i)
-        blackLevelResult[i] = static_cast<unsigned short>(std::round(dstBlackLevel[i]));
+// Same as preprocessData() followed by bitpacking::pack(), without the 16 bit frame in between.
+// Writes rows padded to whole groups of encodeBits pixels
+void preprocessAndPack(
+    const std::vector<uint8_t>& data, const PreprocessParams& params, unsigned short encodeBits, uint8_t* dst, BS::thread_pool* threadPool)
+{
+    const auto [groupPixels, groupBytes] = bitpacking::getPackedGroup(encodeBits);
+    const uint32_t paddedWidth = (params.width + groupPixels - 1) / groupPixels * groupPixels;
 
-    return std::make_tuple(dst, blackLevelResult, static_cast<unsigned short>(dstWhiteLevel), opcodeList2);
+    preprocessFrame(data, params, RowOutput{ nullptr, 0, dst, paddedWidth / groupPixels * groupBytes, paddedWidth, encodeBits }, threadPool);
 }
 
-std::shared_ptr<std::vector<char>> generateDng(
-    std::vector<uint8_t>& data,
+struct DngParams {
+    PreprocessParams preprocess;
+    std::array<unsigned short, 4> blackLevel;
+    unsigned short whiteLevel;
+    unsigned short encodeBits;
+    bool interpretAsQuadBayer;
+};
+
+DngParams getDngParams(
     const CameraFrameMetadata& metadata,
     const CameraConfiguration& cameraConfiguration,
-    float recordingFps,
-    int frameNumber,
-    double baselineExpValue,
     const RenderSettings& settings)
 {
-    Measure m("generateDng");
-
-    unsigned int width = metadata.width;
-    unsigned int height = metadata.height;
-
     std::array<uint8_t, 4> cfa;
-    std::array<uint8_t, 16> qcfa;
 
     if(cameraConfiguration.sensorArrangement == "rggb")
         cfa = { 0, 1, 1, 2 };
@@ -1098,9 +1057,10 @@ std::shared_ptr<std::vector<char>> generateDng(
     if(!(settings.options & RENDER_OPT_CROPPING))// || width != metadata.originalWidth || height != metadata.originalHeight)
         cropTarget = "0x0";
 
-    auto [processedData, dstBlackLevel, dstWhiteLevel, opcodeList2] = utils::preprocessData(
-        data,
-        width, height,
+    DngParams params;
+
+    params.preprocess = getPreprocessParams(
+        metadata.width, metadata.height,
         metadata,
         cameraConfiguration,
         cfa,
@@ -1113,43 +1073,59 @@ std::shared_ptr<std::vector<char>> generateDng(
         true  // includeOpcode = true to generate lens shading opcode when not applied to image
     );
 
-    spdlog::debug("New black level {},{},{},{} and white level {}",
-                  dstBlackLevel[0], dstBlackLevel[1], dstBlackLevel[2], dstBlackLevel[3], dstWhiteLevel);
+    for(auto i = 0; i < params.blackLevel.size(); ++i)
+        params.blackLevel[i] = static_cast<unsigned short>(std::round(params.preprocess.dstBlackLevel[i]));
+
+    params.whiteLevel = static_cast<unsigned short>(params.preprocess.dstWhiteLevel);
+    params.interpretAsQuadBayer = interpretAsQuadBayer;
 
     // Encode to reduce size in container
-    auto encodeBits = bitsNeeded(dstWhiteLevel);
+    const auto bits = bitsNeeded(params.whiteLevel);
+
+    if(bits <= 2)
+        params.encodeBits = 2;
+    else if(bits <= 4)
+        params.encodeBits = 4;
+    else if(bits <= 6)
+        params.encodeBits = 6;
+    else if(bits <= 8)
+        params.encodeBits = 8;
+    else if(bits <= 10)
+        params.encodeBits = 10;
+    else if(bits <= 12)
+        params.encodeBits = 12;
+    else if(bits <= 14)
+        params.encodeBits = 14;
+    else
+        params.encodeBits = 16;
 
-    if(encodeBits <= 2) {
-        utils::encodeTo2Bit(processedData, width, height);
-        encodeBits = 2;
-    }
-    else if(encodeBits <= 4) {
-        utils::encodeTo4Bit(processedData, width, height);
-        encodeBits = 4;
-    }
-    else if(encodeBits <= 6) {
-        utils::encodeTo6Bit(processedData, width, height);
-        encodeBits = 6;
-    }
-    else if(encodeBits <= 8) {
-        utils::encodeTo8Bit(processedData, width, height);
-        encodeBits = 8;
-    }
-    else if(encodeBits <= 10) {
-        utils::encodeTo10Bit(processedData, width, height);
-        encodeBits = 10;
-    }
-    else if(encodeBits <= 12) {
-        utils::encodeTo12Bit(processedData, width, height);
-        encodeBits = 12;
-    }
-    else if(encodeBits <= 14) {
-        utils::encodeTo14Bit(processedData, width, height);
-        encodeBits = 14;
-    }
-    else {
-        encodeBits = 16;
-    }
+    return params;
+}
+
+std::shared_ptr<std::vector<char>> writeDng(
+    const uint8_t* imageData,
+    size_t imageSize,
+    const DngParams& params,
+    const CameraFrameMetadata& metadata,
+    const CameraConfiguration& cameraConfiguration,
+    float recordingFps,
+    int frameNumber,
+    double baselineExpValue,
+    const RenderSettings& settings)
+{
+    const unsigned int width = params.preprocess.width;
+    const unsigned int height = params.preprocess.height;
+    const auto& cfa = params.preprocess.cfa;
+    const bool applyShadingMap = params.preprocess.applyShadingMap;
+    const bool normalizeExposure = settings.options & RENDER_OPT_NORMALIZE_EXPOSURE;
+    const bool interpretAsQuadBayer = params.interpretAsQuadBayer;
+    const unsigned short encodeBits = params.encodeBits;
+    const auto& opcodeList2 = params.preprocess.opcodeList2;
+
+    auto dstBlackLevel = params.blackLevel;
+    auto dstWhiteLevel = params.whiteLevel;
+
+    std::array<uint8_t, 16> qcfa;
 
     // Create first frame
     tinydngwriter::DNGImage dng;
@@ -1157,7 +1133,7 @@ std::shared_ptr<std::vector<char>> generateDng(
     dng.SetBigEndian(false);
     dng.SetDNGVersion(1, 4, 0, 0);
     dng.SetDNGBackwardVersion(1, 1, 0, 0);
-    dng.SetImageData(reinterpret_cast<const unsigned char*>(processedData.data()), processedData.size());
+    dng.SetImageData(reinterpret_cast<const unsigned char*>(imageData), imageSize);
     dng.SetImageWidth(width);
     dng.SetImageLength(height);
     dng.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
@@ -1371,7 +1347,7 @@ std::shared_ptr<std::vector<char>> generateDng(
     auto output = std::make_shared<std::vector<char>>();
 
     // Reserve enough to fit the data
-    output->reserve(width*height*sizeof(uint16_t) + 512*1024);
+    output->reserve(imageSize + 512*1024);
 
     utils::vector_ostream stream(*output);
 
@@ -1380,6 +1356,376 @@ std::shared_ptr<std::vector<char>> generateDng(
     return output;
 }
 
+namespace {
+    constexpr uint16_t TIFF_TAG_STRIP_OFFSETS = 273;
+    constexpr uint16_t TIFF_TAG_STRIP_BYTE_COUNTS = 279;
+    constexpr uint16_t TIFF_TYPE_SHORT = 3;
+    constexpr int MAX_IFD_DEPTH = 4;
+
+    // Size of the strip the DNG header is written around, see getDngHeader()
+    constexpr size_t PLACEHOLDER_STRIP_SIZE = 4;
+
+    // Lossless JPEG tiles, a multiple of 16 as TIFF requires
+    constexpr uint32_t COMPRESSED_TILE_SIZE = 256;
+
+    // writeDng() always writes little endian files
+    uint16_t readU16(const std::vector<char>& data, size_t pos) {
+        if(pos + 2 > data.size())
+            throw std::runtime_error("Invalid DNG layout");
+
+        return static_cast<uint16_t>(
+            static_cast<uint8_t>(data[pos]) | (static_cast<uint8_t>(data[pos + 1]) << 8));
+    }
+
+    uint32_t readU32(const std::vector<char>& data, size_t pos) {
+        return static_cast<uint32_t>(readU16(data, pos)) | (static_cast<uint32_t>(readU16(data, pos + 2)) << 16);
+    }
+
+    void writeU16(std::vector<char>& data, size_t pos, uint16_t value) {
+        data[pos]     = static_cast<char>(value & 0xFF);
+        data[pos + 1] = static_cast<char>((value >> 8) & 0xFF);
+    }
+
+    void writeU32(std::vector<char>& data, size_t pos, uint32_t value) {
+        writeU16(data, pos, static_cast<uint16_t>(value & 0xFFFF));
+        writeU16(data, pos + 2, static_cast<uint16_t>(value >> 16));
+    }
+
+    size_t getTiffTypeSize(uint16_t type) {
+        switch(type) {
+        case 1: case 2: case 6: case 7:     return 1; // BYTE, ASCII, SBYTE, UNDEFINED
+        case 3: case 8:                     return 2; // SHORT, SSHORT
+        case 4: case 9: case 11: case 13:   return 4; // LONG, SLONG, FLOAT, IFD
+        case 5: case 10: case 12:           return 8; // RATIONAL, SRATIONAL, DOUBLE
+        default:                            return 0;
+        }
+    }
+
+    bool isSubIfdTag(uint16_t tag) {
+        return tag == 330 || tag == 34665 || tag == 34853 || tag == 40965; // SubIFDs, EXIF, GPS, Interop
+    }
+
+    struct StripTags {
+        size_t offsetPos = 0;
+        size_t countPos = 0;
+        uint16_t offsetType = 0;
+        uint16_t countType = 0;
+    };
+
+    // Finds every field in the IFD at ifdOffset, and the IFDs it links to, that holds an offset into the file
+    void findOffsetFields(const std::vector<char>& dng, uint32_t ifdOffset, std::vector<size_t>& offsetFields, StripTags& strip, int depth) {
+        if(depth > MAX_IFD_DEPTH)
+            throw std::runtime_error("Invalid DNG layout");
+
+        const uint16_t numEntries = readU16(dng, ifdOffset);
+
+        for(uint16_t i = 0; i < numEntries; ++i) {
+            const size_t entryPos = ifdOffset + 2 + i * 12;
+            const uint16_t tag = readU16(dng, entryPos);
+            const uint16_t type = readU16(dng, entryPos + 2);
+            const uint32_t count = readU32(dng, entryPos + 4);
+            const size_t valuePos = entryPos + 8;
+            const size_t valueSize = getTiffTypeSize(type) * count;
+
+            if(tag == TIFF_TAG_STRIP_OFFSETS || tag == TIFF_TAG_STRIP_BYTE_COUNTS) {
+                // We always write a single strip
+                if(count != 1)
+                    throw std::runtime_error("Invalid DNG layout");
+
+                if(tag == TIFF_TAG_STRIP_OFFSETS) {
+                    strip.offsetPos = valuePos;
+                    strip.offsetType = type;
+                }
+                else {
+                    strip.countPos = valuePos;
+                    strip.countType = type;
+                }
+            }
+            else if(isSubIfdTag(tag)) {
+                const size_t arrayPos = valueSize > 4 ? readU32(dng, valuePos) : valuePos;
+
+                if(valueSize > 4)
+                    offsetFields.push_back(valuePos);
+
+                for(uint32_t j = 0; j < count; ++j) {
+                    offsetFields.push_back(arrayPos + j * 4);
+                    findOffsetFields(dng, readU32(dng, arrayPos + j * 4), offsetFields, strip, depth + 1);
+                }
+            }
+            else if(valueSize > 4) {
+                offsetFields.push_back(valuePos);
+            }
+        }
+
+        const size_t nextIfdPos = ifdOffset + 2 + numEntries * 12;
+        const uint32_t nextIfd = readU32(dng, nextIfdPos);
+
+        if(nextIfd != 0) {
+            offsetFields.push_back(nextIfdPos);
+            findOffsetFields(dng, nextIfd, offsetFields, strip, depth + 1);
+        }
+    }
+
+    size_t getImageSize(const DngParams& params) {
+        const auto [groupPixels, groupBytes] = bitpacking::getPackedGroup(params.encodeBits);
+        const size_t groupsPerRow = (params.preprocess.width + groupPixels - 1) / groupPixels;
+
+        return groupsPerRow * groupBytes * params.preprocess.height;
+    }
+
+    // Everything in the DNG except the pixel data. The DNG is written around a placeholder strip,
+    // which is then cut out and its offset pointed at the end of the header, so the pixels can be
+    // appended to the header to get the complete file.
+    std::shared_ptr<std::vector<char>> getDngHeader(
+        const DngParams& params,
+        size_t imageSize,
+        const CameraFrameMetadata& metadata,
+        const CameraConfiguration& cameraConfiguration,
+        float recordingFps,
+        int frameNumber,
+        double baselineExpValue,
+        const RenderSettings& settings,
+        DngLayout& outLayout)
+    {
+        std::vector<uint8_t> placeholder(PLACEHOLDER_STRIP_SIZE);
+
+        auto dng = writeDng(
+            placeholder.data(), placeholder.size(), params, metadata, cameraConfiguration, recordingFps, frameNumber, baselineExpValue, settings);
+
+        if(readU16(*dng, 0) != 0x4949)
+            throw std::runtime_error("Invalid DNG layout");
+
+        std::vector<size_t> offsetFields{ 4 };
+        StripTags strip;
+
+        findOffsetFields(*dng, readU32(*dng, 4), offsetFields, strip, 0);
+
+        if(strip.offsetPos == 0 || strip.countPos == 0)
+            throw std::runtime_error("Invalid DNG layout");
+
+        const size_t stripOffset =
+            strip.offsetType == TIFF_TYPE_SHORT ? readU16(*dng, strip.offsetPos) : readU32(*dng, strip.offsetPos);
+        const size_t stripEnd = stripOffset + placeholder.size();
+
+        if(stripEnd > dng->size())
+            throw std::runtime_error("Invalid DNG layout");
+
+        // Keep the strip word aligned
+        const size_t headerSize = (dng->size() - placeholder.size() + 3) & ~static_cast<size_t>(3);
+
+        if(strip.offsetType == TIFF_TYPE_SHORT || strip.countType == TIFF_TYPE_SHORT || imageSize > UINT32_MAX)
+            throw std::runtime_error("Invalid DNG layout");
+
+        for(auto pos : offsetFields) {
+            const auto offset = readU32(*dng, pos);
+            if(offset >= stripEnd)
+                writeU32(*dng, pos, static_cast<uint32_t>(offset - placeholder.size()));
+        }
+
+        writeU32(*dng, strip.offsetPos, static_cast<uint32_t>(headerSize));
+        writeU32(*dng, strip.countPos, static_cast<uint32_t>(imageSize));
+
+        dng->erase(dng->begin() + stripOffset, dng->begin() + stripEnd);
+        dng->resize(headerSize, 0);
+
+        outLayout.stripOffset = headerSize;
+        outLayout.stripSize = imageSize;
+        outLayout.size = headerSize + imageSize;
+
+        return dng;
+    }
+
+    // Compresses the pixels into lossless JPEG tiles, or returns nullptr when that would not fit in maxSize
+    std::shared_ptr<std::vector<char>> getCompressedDng(
+        const uint16_t* pixels,
+        size_t stride,
+        const DngParams& params,
+        const std::vector<char>& header,
+        size_t maxSize,
+        BS::thread_pool* threadPool)
+    {
+        const uint32_t width = params.preprocess.width;
+        const uint32_t height = params.preprocess.height;
+        const uint32_t tilesAcross = (width + COMPRESSED_TILE_SIZE - 1) / COMPRESSED_TILE_SIZE;
+        const uint32_t tilesDown = (height + COMPRESSED_TILE_SIZE - 1) / COMPRESSED_TILE_SIZE;
+
+        std::vector<std::vector<uint8_t>> tiles(static_cast<size_t>(tilesAcross) * tilesDown);
+
+        parallelFor(threadPool, tiles.size(), 1, [&](size_t begin, size_t end) {
+            for(size_t i = begin; i < end; ++i) {
+                const uint32_t x = static_cast<uint32_t>(i % tilesAcross) * COMPRESSED_TILE_SIZE;
+                const uint32_t y = static_cast<uint32_t>(i / tilesAcross) * COMPRESSED_TILE_SIZE;
+
+                lj92::encodeTile(
+                    pixels + y * stride + x,
+                    stride,
+                    (std::min)(COMPRESSED_TILE_SIZE, width - x),
+                    (std::min)(COMPRESSED_TILE_SIZE, height - y),
+                    COMPRESSED_TILE_SIZE,
+                    COMPRESSED_TILE_SIZE,
+                    params.encodeBits,
+                    tiles[i]);
+            }
+        });
+
+        std::vector<size_t> tileSizes;
+        tileSizes.reserve(tiles.size());
+
+        for(const auto& tile : tiles)
+            tileSizes.push_back(tile.size());
+
+        auto dng = lj92::getTiledDngHeader(header, COMPRESSED_TILE_SIZE, COMPRESSED_TILE_SIZE, tileSizes);
+
+        const size_t dataSize = std::accumulate(tileSizes.begin(), tileSizes.end(), static_cast<size_t>(0));
+        if(dng->size() + dataSize > maxSize)
+            return nullptr;
+
+        dng->reserve(dng->size() + dataSize);
+
+        for(const auto& tile : tiles)
+            dng->insert(dng->end(), tile.begin(), tile.end());
+
+        return dng;
+    }
+}
+
+std::shared_ptr<std::vector<char>> generateDng(
+    const std::vector<uint8_t>& data,
+    const CameraFrameMetadata& metadata,
+    const CameraConfiguration& cameraConfiguration,
+    float recordingFps,
+    int frameNumber,
+    double baselineExpValue,
+    const RenderSettings& settings,
+    BS::thread_pool* threadPool,
+    BufferPool<char>* bufferPool,
+    Metrics* metrics)
+{
+    Measure m("generateDng", metrics ? &metrics->generateDng : nullptr);
+
+    auto newBuffer = [bufferPool](size_t size) {
+        return bufferPool ? bufferPool->get(size) : std::make_shared<std::vector<char>>(size);
+    };
+
+    const auto params = getDngParams(metadata, cameraConfiguration, settings);
+    const auto width = params.preprocess.width;
+    const auto height = params.preprocess.height;
+
+    spdlog::debug("New black level {},{},{},{} and white level {}",
+                  params.blackLevel[0], params.blackLevel[1], params.blackLevel[2], params.blackLevel[3], params.whiteLevel);
+
+    // The layout is known up front, so the pixels are written straight to where they go in the file.
+    // Compressed frames use the uncompressed size as their limit.
+    DngLayout layout;
+
+    auto header = getDngHeader(
+        params, getImageSize(params), metadata, cameraConfiguration, recordingFps, frameNumber, baselineExpValue, settings, layout);
+
+    const bool compress = settings.options & RENDER_OPT_LOSSLESS_COMPRESSION;
+
+    // Uncompressed rows are packed as they are done, straight into the file
+    if(!compress) {
+        auto dng = newBuffer(layout.size);
+
+        std::copy(header->begin(), header->end(), dng->begin());
+
+        auto* strip = reinterpret_cast<uint8_t*>(dng->data() + layout.stripOffset);
+
+        Measure p("preprocessData", metrics ? &metrics->preprocess : nullptr);
+
+        if(params.encodeBits == 16)
+            utils::preprocessData(data, params.preprocess, reinterpret_cast<uint16_t*>(strip), width, threadPool);
+        else
+            utils::preprocessAndPack(data, params.preprocess, params.encodeBits, strip, threadPool);
+
+        return dng;
+    }
+
+    // Packers read whole groups, so rows are padded to a multiple of the group size
+    const auto [groupPixels, groupBytes] = bitpacking::getPackedGroup(params.encodeBits);
+    const size_t paddedWidth = (width + groupPixels - 1) / groupPixels * groupPixels;
+    const size_t packedRowSize = paddedWidth / groupPixels * groupBytes;
+
+    auto pixelData = newBuffer(paddedWidth * height * sizeof(uint16_t));
+    auto* pixels = reinterpret_cast<uint16_t*>(pixelData->data());
+
+    {
+        Measure p("preprocessData", metrics ? &metrics->preprocess : nullptr);
+
+        utils::preprocessData(data, params.preprocess, pixels, paddedWidth, threadPool);
+    }
+
+    // Compressed frames are never larger than uncompressed ones, so every frame fits the size
+    // given in the file listing. Noise that does not compress is written uncompressed.
+    std::shared_ptr<std::vector<char>> dng;
+
+    {
+        Measure e("compress", metrics ? &metrics->encode : nullptr);
+
+        dng = getCompressedDng(pixels, paddedWidth, params, *header, layout.size, threadPool);
+    }
+
+    if(dng)
+        return dng;
+
+    spdlog::debug("Frame {} does not compress, writing it uncompressed", frameNumber);
+
+    dng = newBuffer(layout.size);
+
+    std::copy(header->begin(), header->end(), dng->begin());
+
+    auto* strip = reinterpret_cast<uint8_t*>(dng->data() + layout.stripOffset);
+
+    Measure e("pack", metrics ? &metrics->encode : nullptr);
+
+    parallelFor(threadPool, height, PACK_BAND_ROWS, [&](size_t begin, size_t end) {
+        bitpacking::pack(
+            pixels + begin * paddedWidth,
+            strip + begin * packedRowSize,
+            width,
+            static_cast<uint32_t>(end - begin),
+            params.encodeBits);
+    });
+
+    return dng;
+}
+
+std::shared_ptr<std::vector<char>> generateDngHeader(
+    const CameraFrameMetadata& metadata,
+    const CameraConfiguration& cameraConfiguration,
+    float recordingFps,
+    int frameNumber,
+    double baselineExpValue,
+    const RenderSettings& settings,
+    DngLayout& outLayout)
+{
+    const auto params = getDngParams(metadata, cameraConfiguration, settings);
+
+    return getDngHeader(
+        params, getImageSize(params), metadata, cameraConfiguration, recordingFps, frameNumber, baselineExpValue, settings, outLayout);
+}
+
+DngLayout getDngLayout(
+    const CameraFrameMetadata& metadata,
+    const CameraConfiguration& cameraConfiguration,
+    float recordingFps,
+    const RenderSettings& settings)
+{
+    // Every tag has a fixed size for a given set of metadata and settings, so this is the
+    // layout of every frame in the clip
+    DngLayout layout;
+
+    generateDngHeader(metadata, cameraConfiguration, recordingFps, 0, 1.0, settings, layout);
+
+    // The tiles of compressed frames depend on the pixels, only the size limit is known
+    if(settings.options & RENDER_OPT_LOSSLESS_COMPRESSION) {
+        layout.stripOffset = 0;
+        layout.stripSize = 0;
+    }
+
+    return layout;
+}
+
 int gcd(int a, int b) {
     while (b != 0) {
         int temp = b;
@@ -4,6 +4,11 @@
 #include "Utils.h"
 #include "AudioWriter.h"
 #include "LRUCache.h"
+#include "ClipIndex.h"
+#include "DecoderPool.h"
+#include "BufferPool.h"
+#include "Measure.h"
+#include "RawFrameCache.h"
 
 #include <motioncam/Decoder.hpp>
 
@@ -16,13 +21,33 @@
 #include <audiofile/AudioFile.h>
 
 #include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <future>
+#include <limits>
 #include <sstream>
-#include <tuple>
+#include <utility>
 
 namespace motioncam {
 
 namespace {
 
+    constexpr int DEFAULT_PREFETCH_FRAMES = 8;
+
+    // Reads that move forward by at most this many frames are treated as sequential
+    constexpr int SEQUENTIAL_READ_WINDOW = 4;
+
+    // Number of sequential reads before we start reading ahead
+    constexpr int SEQUENTIAL_READS_BEFORE_PREFETCH = 2;
+
+    // Smallest number of frames each baseline exposure scan task is given
+    constexpr size_t MIN_FRAMES_PER_SCAN_CHUNK = 64;
+
+    constexpr const char* PROXY_FOLDER = "proxy";
+
+    // Used for proxies when the mount doesn't have a draft scale of its own, the smallest the UI offers
+    constexpr int DEFAULT_PROXY_SCALE = 2;
+
 #ifdef _WIN32
     constexpr std::string_view DESKTOP_INI = R"([.ShellClassInfo]
 ConfirmFileOp=0
@@ -139,60 +164,116 @@ IconSize=16
         return oss.str();
     }
 
-    void syncAudio(Timestamp videoTimestamp, std::vector<AudioChunk>& audioChunks, int sampleRate, int numChannels) {
+    // Number of frames to drop from the start of the audio to line it up with the video, or to
+    // add as silence if it is negative
+    int64_t getAudioSyncFrames(Timestamp videoTimestamp, Timestamp audioTimestamp, int sampleRate) {
         // Calculate drift between the video and audio
-        auto audioVideoDriftMs = (audioChunks[0].first - videoTimestamp) * 1e-6f;
+        const auto audioVideoDriftMs = (audioTimestamp - videoTimestamp) * 1e-6f;
         if(std::abs(audioVideoDriftMs) > 1000) {
             spdlog::warn("Audio drift too large, not syncing audio");
-            return;
+            return 0;
         }
 
-        if(audioVideoDriftMs > 0) {
-            // Calculate how many audio frames to remove
-            int audioFramesToRemove = static_cast<int>(std::round(audioVideoDriftMs * sampleRate / 1000));
-            int samplesToRemove = audioFramesToRemove * numChannels;
+        return static_cast<int64_t>(std::round(audioVideoDriftMs * sampleRate / 1000));
+    }
 
-            // Remove samples from the beginning of audio chunks
-            int samplesRemoved = 0;
-            auto it = audioChunks.begin();
+    size_t copyData(const std::vector<char>& data, size_t pos, size_t len, void* dst) {
+        if(pos >= data.size())
+            return 0;
 
-            while(it != audioChunks.end() && samplesRemoved < samplesToRemove) {
-                int remainingSamplesToRemove = samplesToRemove - samplesRemoved;
+        const size_t actualLen = (std::min)(len, data.size() - pos);
 
-                if(it->second.size() <= remainingSamplesToRemove) {
-                    // Remove entire chunk
-                    samplesRemoved += it->second.size();
-                    it = audioChunks.erase(it);
-                }
-                else {
-                    // Trim partial chunk from the beginning
-                    it->second.erase(it->second.begin(), it->second.begin() + remainingSamplesToRemove);
+        std::memcpy(dst, data.data() + pos, actualLen);
 
-                    // Update timestamp for the trimmed chunk
-                    it->first += static_cast<Timestamp>(remainingSamplesToRemove * 1000 / sampleRate);
-                    break;
-                }
-            }
-        }
-        else {
-            // Otherwise video starts before audio, add silence
-            auto silenceDuration = -audioVideoDriftMs; // Make positive
+        return actualLen;
+    }
+
+    // Compressed frames can be shorter than the size they are listed with, the rest reads as zero
+    size_t copyFrameData(const std::vector<char>& data, size_t fileSize, size_t pos, size_t len, void* dst) {
+        const size_t end = (std::max)(data.size(), fileSize);
+        if(pos >= end)
+            return 0;
+
+        const size_t actualLen = (std::min)(len, end - pos);
+        const size_t copied = copyData(data, pos, actualLen, dst);
+
+        std::memset(static_cast<char*>(dst) + copied, 0, actualLen - copied);
+
+        return actualLen;
+    }
 
-            int silenceFrames = static_cast<int>(std::round(silenceDuration * sampleRate / 1000));
-            int silenceSamples = silenceFrames * numChannels;
+    std::string normalizePath(const std::string& path) {
+        // FUSE passes "/name", ProjFS passes "name" or "dir\\name"
+        const auto start = path.find_first_not_of("/\\");
+        if(start == std::string::npos)
+            return {};
 
-            // Create silence chunk at the beginning
-            std::vector<int16_t> silenceData(silenceSamples, 0);
-            AudioChunk silenceChunk = std::make_pair(videoTimestamp, silenceData);
+        std::string result = path.substr(start);
+        std::replace(result.begin(), result.end(), '\\', '/');
 
-            // Insert silence at the beginning
-            audioChunks.insert(audioChunks.begin(), silenceChunk);
+        return result;
+    }
+
+    inline char toUpperAscii(char c) {
+        return (c >= 'a' && c <= 'z') ? static_cast<char>(c - 'a' + 'A') : c;
+    }
 
-            // Update timestamps of existing chunks
-            for(auto it = audioChunks.begin() + 1; it != audioChunks.end(); ++it) {
-                it->first += silenceDuration;
+    // Case insensitive ordering, which is how ProjFS expects directory listings to be sorted
+    bool fileNameLess(const std::string& a, const std::string& b) {
+        return std::lexicographical_compare(
+            a.begin(), a.end(), b.begin(), b.end(),
+            [](char x, char y) {
+                return static_cast<unsigned char>(toUpperAscii(x)) < static_cast<unsigned char>(toUpperAscii(y));
+            });
+    }
+
+    // Case insensitive match supporting '*' and '?' wildcards
+    bool matchesFilter(const std::string& name, const std::string& filter) {
+        size_t n = 0, f = 0;
+        size_t starPos = std::string::npos, matchPos = 0;
+
+        while(n < name.size()) {
+            if(f < filter.size() && (filter[f] == '?' || toUpperAscii(filter[f]) == toUpperAscii(name[n]))) {
+                ++n;
+                ++f;
+            }
+            else if(f < filter.size() && filter[f] == '*') {
+                starPos = f++;
+                matchPos = n;
+            }
+            else if(starPos != std::string::npos) {
+                f = starPos + 1;
+                n = ++matchPos;
+            }
+            else {
+                return false;
             }
         }
+
+        while(f < filter.size() && filter[f] == '*')
+            ++f;
+
+        return f == filter.size();
+    }
+
+    int getFrameNumberFromFilename(const std::string& name) {
+        // Frames are named <base>-<zero padded frame number>.dng
+        const auto end = name.rfind('.');
+        if(end == std::string::npos)
+            return -1;
+
+        auto start = end;
+        while(start > 0 && std::isdigit(static_cast<unsigned char>(name[start - 1])))
+            --start;
+
+        if(start == end)
+            return -1;
+
+        int frameNumber = 0;
+        for(auto i = start; i < end; ++i)
+            frameNumber = frameNumber * 10 + (name[i] - '0');
+
+        return frameNumber;
     }
 
     int getScaleFromOptions(FileRenderOptions options, int draftScale) {
@@ -201,21 +282,53 @@ IconSize=16
 
         return 1;
     }
+
+    // Draft mounts are small enough already, they don't get proxies
+    bool hasProxies(FileRenderOptions options) {
+        return (options & RENDER_OPT_PROXY_FOLDER) && !(options & RENDER_OPT_DRAFT);
+    }
+
+    // Folders first by their path, then the entries in them, so each folder is one range
+    bool entryLess(const Entry& a, const Entry& b) {
+        if(std::lexicographical_compare(a.pathParts.begin(), a.pathParts.end(), b.pathParts.begin(), b.pathParts.end(), fileNameLess))
+            return true;
+
+        if(std::lexicographical_compare(b.pathParts.begin(), b.pathParts.end(), a.pathParts.begin(), a.pathParts.end(), fileNameLess))
+            return false;
+
+        return fileNameLess(a.name, b.name);
+    }
 }
 
 VirtualFileSystemImpl_MCRAW::VirtualFileSystemImpl_MCRAW(
         BS::thread_pool& ioThreadPool,
         BS::thread_pool& processingThreadPool,
         LRUCache& lruCache,
+        LRUCache& headerCache,
+        RawFrameCache& rawFrameCache,
+        BufferPool<char>& bufferPool,
+        BufferPool<uint8_t>& frameBufferPool,
+        Scheduler& frameScheduler,
         const RenderSettings& settings,
         const std::string& file,
-        const std::string& baseName) :
+        const std::string& baseName,
+        const std::string& indexPath) :
         mCache(lruCache),
+        mHeaderCache(headerCache),
+        mRawFrames(rawFrameCache),
+        mBufferPool(bufferPool),
         mIoThreadPool(ioThreadPool),
         mProcessingThreadPool(processingThreadPool),
+        mFrameScheduler(frameScheduler),
+        mSchedulerSession(frameScheduler.newSession()),
         mSrcPath(file),
+        mSrcSize(0),
+        mSrcModified(0),
         mBaseName(baseName),
-        mTypicalDngSize(0),
+        mIndex(indexPath.empty() ? nullptr : std::make_shared<ClipIndex>(indexPath, file)),
+        mDecoders(std::make_shared<DecoderPool>(file)),
+        mFrameBuffers(frameBufferPool),
+        mDecodedFrameSize(0),
         mFps(0),
         mMedFps(0),
         mAvgFps(0),
@@ -224,176 +337,439 @@ VirtualFileSystemImpl_MCRAW::VirtualFileSystemImpl_MCRAW(
         mDuplicatedFrames(0),
         mWidth(0),
         mHeight(0),
-        mDraftScale(settings.draftScale),
-        mCFRTarget(settings.cfrTarget),
-        mCropTarget(settings.cropTarget),
-        mCameraModel(settings.cameraModel),
-        mLevels(settings.levels),
-        mLogTransform(settings.logTransform),
-        mExposureCompensation(settings.exposureCompensation),
-        mQuadBayerOption(settings.quadBayerOption),
-        mOptions(settings.options) {
-    
-    Decoder decoder(mSrcPath);
-    auto frames = decoder.getFrames();
-    std::sort(frames.begin(), frames.end());
-    if(frames.empty())
-        return;
-    mBaselineExpValue = std::numeric_limits<double>::max();
-    for(const auto& frame : frames) {
-        nlohmann::json metadata;
-        decoder.loadFrameMetadata(frame, metadata);
-        const auto& cameraFrameMetadata = CameraFrameMetadata::limitedParse(metadata);
-        mBaselineExpValue = std::min(mBaselineExpValue, cameraFrameMetadata.iso * cameraFrameMetadata.exposureTime);
-    }
-    this->init(mOptions);
+        mFirstFrameEntry(0),
+        mFirstProxyEntry(0),
+        mNumFrameEntries(0),
+        mMaxPrefetchFrames(DEFAULT_PREFETCH_FRAMES),
+        mPendingPrefetches(0),
+        mPendingHeaders(0),
+        mPrefetchGeneration(0),
+        mCancelBaselineScan(std::make_shared<std::atomic<bool>>(false)),
+        mSettings(std::make_shared<const RenderSettings>(settings)) {
+
+    // Once per mount, every cache key carries them and the clip may be on a network share
+    boost::system::error_code ec;
+
+    const auto size = boost::filesystem::file_size(file, ec);
+    if(!ec)
+        mSrcSize = static_cast<uint64_t>(size);
+
+    const auto modified = boost::filesystem::last_write_time(file, ec);
+    if(!ec)
+        mSrcModified = static_cast<int64_t>(modified);
+
+    this->loadClip();
+    this->loadAudio();
+
+    std::unique_lock<std::shared_mutex> lock(mEntriesMutex);
+    this->init(settings);
 }
 
 VirtualFileSystemImpl_MCRAW::~VirtualFileSystemImpl_MCRAW() {
     spdlog::info("Destroying VirtualFileSystemImpl_MCRAW({})", mSrcPath);
+
+    // Cancel any queued prefetches and wait for the ones in flight
+    ++mPrefetchGeneration;
+    *mCancelBaselineScan = true;
+
+    mFrameScheduler.wait(mSchedulerSession);
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPrefetchCondition.wait(lock, [this] { return mPendingPrefetches == 0 && mPendingHeaders == 0; });
+
+    mRawFrames.clear(mSrcPath);
 }
 
-void VirtualFileSystemImpl_MCRAW::init(FileRenderOptions options) {
-    Decoder decoder(mSrcPath);
-    auto frames = decoder.getFrames();
-    std::sort(frames.begin(), frames.end());
+void VirtualFileSystemImpl_MCRAW::setMaxPrefetchFrames(int frames) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mMaxPrefetchFrames = (std::max)(0, frames);
+}
+
+void VirtualFileSystemImpl_MCRAW::loadClip() {
+    // Use the index from a previous mount if the clip hasn't changed since
+    if(mIndex && mIndex->load()) {
+        spdlog::info("Using index of {}", mSrcPath);
+
+        mFrames = mIndex->getFrames();
+        mMedFps = mIndex->getMedianFrameRate();
+        mAvgFps = mIndex->getAverageFrameRate();
+        mCameraConfig = std::make_shared<const CameraConfiguration>(CameraConfiguration::parse(mIndex->getContainerMetadata()));
+        mFirstFrameMetadata = CameraFrameMetadata::parse(mIndex->getFirstFrameMetadata());
+        mLastShadingMap = mFirstFrameMetadata.lensShadingMap;
+
+        if(auto baselineExposure = mIndex->getBaselineExposure()) {
+            std::promise<double> value;
+            value.set_value(*baselineExposure);
+
+            mBaselineExpValue = value.get_future().share();
+        }
 
-    if(frames.empty())
         return;
+    }
 
-    spdlog::debug("VirtualFileSystemImpl_MCRAW::init(options={})", optionsToString(options));
+    auto decoder = mDecoders->acquire();
 
-    // Clear everything
-    mFiles.clear();
+    mFrames = decoder->getFrames();
+    std::sort(mFrames.begin(), mFrames.end());
+
+    if(mFrames.empty())
+        return;
 
-    auto frameRateInfo = calculateFrameRate(frames);
+    auto frameRateInfo = calculateFrameRate(mFrames);
     mMedFps = frameRateInfo.medianFrameRate;
     mAvgFps = frameRateInfo.averageFrameRate;
 
-    bool applyCFRConversion = options & RENDER_OPT_FRAMERATE_CONVERSION;
+    // The first frame is representative of the rest of the clip
+    nlohmann::json metadata;
+    decoder->loadFrameMetadata(mFrames[0], metadata);
+
+    mCameraConfig = std::make_shared<const CameraConfiguration>(CameraConfiguration::parse(decoder->getContainerMetadata()));
+    mFirstFrameMetadata = CameraFrameMetadata::parse(metadata);
+    mLastShadingMap = mFirstFrameMetadata.lensShadingMap;
+
+    if(mIndex) {
+        mIndex->setClip(mFrames, mMedFps, mAvgFps, decoder->getContainerMetadata(), metadata);
+        mIndex->save();
+    }
+}
+
+void VirtualFileSystemImpl_MCRAW::loadAudio() {
+    if(mFrames.empty())
+        return;
+
+    // Use the samples a previous mount wrote out if they are all there
+    if(mIndex) {
+        if(auto track = mIndex->getAudioTrack()) {
+            const auto audioPath = mIndex->getAudioPath();
+            const uint64_t expectedSize = track->numFrames * track->numChannels * sizeof(int16_t);
+
+            boost::system::error_code ec;
+
+            if(track->numFrames == 0 || boost::filesystem::file_size(audioPath, ec) == expectedSize) {
+                mAudioTrack = *track;
+                mAudioPath = track->numFrames > 0 ? audioPath : std::string();
+                return;
+            }
+        }
+    }
+
+    auto decoder = mDecoders->acquire();
+
+    std::vector<AudioChunk> audioChunks;
+    decoder->loadAudio(audioChunks);
+
+    AudioTrack track{ decoder->numAudioChannels(), decoder->audioSampleRateHz(), 0 };
+
+    if(!audioChunks.empty() && track.numChannels > 0 && track.sampleRate > 0) {
+        const int64_t syncFrames = getAudioSyncFrames(mFrames[0], audioChunks[0].first, track.sampleRate);
+
+        // Lines the audio up with the video and hands over whole frames. Returns the number of frames
+        auto writeSamples = [&](const std::function<void(const int16_t*, size_t)>& write) {
+            uint64_t numFrames = 0;
+            uint64_t skipSamples = syncFrames > 0 ? syncFrames * track.numChannels : 0;
+
+            // Video starts before the audio, add silence
+            if(syncFrames < 0) {
+                const std::vector<int16_t> silence(-syncFrames * track.numChannels, 0);
+
+                write(silence.data(), silence.size());
+                numFrames += -syncFrames;
+            }
+
+            for(const auto& chunk : audioChunks) {
+                const size_t numSamples = chunk.second.size() - chunk.second.size() % track.numChannels;
+                const size_t skip = static_cast<size_t>((std::min)(skipSamples, static_cast<uint64_t>(numSamples)));
+
+                skipSamples -= skip;
+
+                write(chunk.second.data() + skip, numSamples - skip);
+                numFrames += (numSamples - skip) / track.numChannels;
+            }
+
+            return numFrames;
+        };
+
+        // Keep the samples next to the index, so they don't have to be in memory or decoded again
+        if(mIndex) {
+            const auto audioPath = mIndex->getAudioPath();
+            const auto tmpPath = audioPath + ".tmp";
+
+            std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+
+            track.numFrames = writeSamples([&file](const int16_t* samples, size_t numSamples) {
+                file.write(reinterpret_cast<const char*>(samples), static_cast<std::streamsize>(numSamples * sizeof(int16_t)));
+            });
+
+            file.close();
+
+            boost::system::error_code ec;
+
+            if(file)
+                boost::filesystem::rename(tmpPath, audioPath, ec);
+
+            if(file && !ec) {
+                mAudioPath = audioPath;
+            }
+            else {
+                spdlog::warn("Failed to write audio of {} to {}, keeping it in memory", mSrcPath, audioPath);
+                boost::filesystem::remove(tmpPath, ec);
+            }
+        }
+
+        if(mAudioPath.empty()) {
+            track.numFrames = writeSamples([this](const int16_t* samples, size_t numSamples) {
+                mAudioSamples.insert(mAudioSamples.end(), samples, samples + numSamples);
+            });
+        }
+    }
+
+    mAudioTrack = track;
+
+    // Clips without audio are remembered too, so they are not decoded again
+    if(mIndex && (track.numFrames == 0 || !mAudioPath.empty())) {
+        mIndex->setAudioTrack(track);
+        mIndex->save();
+    }
+}
+
+void VirtualFileSystemImpl_MCRAW::startBaselineExposureScan(const std::vector<Timestamp>& frames) {
+    // The baseline exposure is the lowest exposure across the whole clip. Reading the metadata of
+    // every frame takes a while on long clips, so it's split into chunks that run in parallel on
+    // the IO pool, each with its own decoder, and only waited on by frames that need it.
+    struct ScanState {
+        std::mutex mutex;
+        double value = std::numeric_limits<double>::max();
+        size_t remaining = 0;
+        std::promise<double> promise;
+    };
+
+    auto state = std::make_shared<ScanState>();
+    auto index = mIndex;
+    auto timestamps = std::make_shared<const std::vector<Timestamp>>(frames);
+
+    const size_t numThreads = (std::max)(static_cast<size_t>(1), static_cast<size_t>(mIoThreadPool.get_thread_count()));
+    const size_t numChunks = std::clamp(frames.size() / MIN_FRAMES_PER_SCAN_CHUNK, static_cast<size_t>(1), numThreads);
+    const size_t chunkSize = (frames.size() + numChunks - 1) / numChunks;
+
+    state->remaining = (frames.size() + chunkSize - 1) / chunkSize;
+    mBaselineExpValue = state->promise.get_future().share();
+
+    for(size_t begin = 0; begin < frames.size(); begin += chunkSize) {
+        const size_t end = (std::min)(begin + chunkSize, frames.size());
+
+        mIoThreadPool.detach_task([srcPath = mSrcPath, decoders = mDecoders, cancelled = mCancelBaselineScan, index, state, timestamps, begin, end]() {
+            double value = std::numeric_limits<double>::max();
+
+            try {
+                auto decoder = decoders->acquire();
+
+                for(auto i = begin; i < end && !*cancelled; ++i) {
+                    nlohmann::json metadata;
+                    decoder->loadFrameMetadata((*timestamps)[i], metadata);
+
+                    const auto& cameraFrameMetadata = CameraFrameMetadata::limitedParse(metadata);
+                    value = (std::min)(value, cameraFrameMetadata.iso * cameraFrameMetadata.exposureTime);
+                }
+            }
+            catch(std::runtime_error& e) {
+                spdlog::error("Failed to read frame metadata of {} (error: {})", srcPath, e.what());
+            }
+
+            std::unique_lock<std::mutex> lock(state->mutex);
+
+            state->value = (std::min)(state->value, value);
+            if(--state->remaining > 0)
+                return;
+
+            state->promise.set_value(state->value);
+            lock.unlock();
+
+            // Remember the result for the next mount, unless we gave up part way through
+            if(index && !*cancelled) {
+                index->setBaselineExposure(state->value);
+                index->save();
+            }
+        });
+    }
+}
+
+CameraFrameMetadata VirtualFileSystemImpl_MCRAW::parseFrameMetadata(const nlohmann::json& metadata) {
+    std::shared_ptr<const LensShadingMap> previousShadingMap;
 
-    if (applyCFRConversion && mCFRTarget.mode != CFRMode::Disabled) {
-        if (mCFRTarget.mode == CFRMode::PreferInteger) {
+    {
+        std::lock_guard<std::mutex> lock(mShadingMapMutex);
+        previousShadingMap = mLastShadingMap;
+    }
+
+    auto frameMetadata = CameraFrameMetadata::renderParse(metadata, previousShadingMap);
+
+    if(frameMetadata.lensShadingMap != previousShadingMap) {
+        std::lock_guard<std::mutex> lock(mShadingMapMutex);
+        mLastShadingMap = frameMetadata.lensShadingMap;
+    }
+
+    return frameMetadata;
+}
+
+float VirtualFileSystemImpl_MCRAW::getTargetFps(const RenderSettings& settings) const {
+    const bool applyCFRConversion = settings.options & RENDER_OPT_FRAMERATE_CONVERSION;
+    const auto& cfrTarget = settings.cfrTarget;
+
+    float fps = mFps;
+
+    if (applyCFRConversion && cfrTarget.mode != CFRMode::Disabled) {
+        if (cfrTarget.mode == CFRMode::PreferInteger) {
             if (mMedFps <=  23.0 || mMedFps >= 1000.0)
-                mFps = mMedFps;
+                fps = mMedFps;
             else if (mMedFps < 24.5)
-                mFps = 24.0f;
+                fps = 24.0f;
             else if (mMedFps < 26.0)
-                mFps = 25.0f;
+                fps = 25.0f;
             else if (mMedFps < 33.0)
-                mFps = 30.0f;
+                fps = 30.0f;
             else if (mMedFps < 49.0)
-                mFps = 48.0f;
+                fps = 48.0f;
             else if (mMedFps < 52.0)
-                mFps = 50.0f;
+                fps = 50.0f;
             else if (mMedFps > 56.0  && mMedFps < 63.0)
-                mFps = 60.0f;
+                fps = 60.0f;
             else if (mMedFps > 112.0 && mMedFps < 125.0)
-                mFps = 120.0f;
+                fps = 120.0f;
             else if (mMedFps > 224.0 && mMedFps < 250.0)
-                mFps = 240.0f;
+                fps = 240.0f;
             else if (mMedFps > 448.0 && mMedFps < 500.0)
-                mFps = 480.0f;
+                fps = 480.0f;
             else if (mMedFps > 896.0 && mMedFps < 1000.0)
-                mFps = 960.0f;
+                fps = 960.0f;
             else if (mMedFps >= 63.0)
-                mFps = 120.0f;
+                fps = 120.0f;
             else
-                mFps = 60.0f;
+                fps = 60.0f;
         }
-        else if (mCFRTarget.mode == CFRMode::PreferDropFrame) {
+        else if (cfrTarget.mode == CFRMode::PreferDropFrame) {
             if (mMedFps <=  23.0 || mMedFps >= 1000.0)
-                mFps = mMedFps;
+                fps = mMedFps;
             else if (mMedFps < 24.5)
-                mFps = 23.976f;
+                fps = 23.976f;
             else if (mMedFps < 26.0)
-                mFps = 25.0f;
+                fps = 25.0f;
             else if (mMedFps < 33.0)
-                mFps = 29.97f;
+                fps = 29.97f;
             else if (mMedFps < 49.0)
-                mFps = 47.952f;
+                fps = 47.952f;
             else if (mMedFps < 52.0)
-                mFps = 50.0f;
+                fps = 50.0f;
             else if (mMedFps > 56.0  && mMedFps < 63.0)
-                mFps = 59.94f;
+                fps = 59.94f;
             else if (mMedFps > 112.0 && mMedFps < 125.0)
-                mFps = 119.88f;
+                fps = 119.88f;
             else if (mMedFps > 224.0 && mMedFps < 250.0)
-                mFps = 240.0f;
+                fps = 240.0f;
             else if (mMedFps > 448.0 && mMedFps < 500.0)
-                mFps = 480.0f;
+                fps = 480.0f;
             else if (mMedFps > 896.0 && mMedFps < 1000.0)
-                mFps = 960.0f;
+                fps = 960.0f;
             else if (mMedFps >= 63.0)
-                mFps = 119.88f;
+                fps = 119.88f;
             else
-                mFps = 59.94f;
+                fps = 59.94f;
         }
-        else if (mCFRTarget.mode == CFRMode::MedianSlowMotion) {
+        else if (cfrTarget.mode == CFRMode::MedianSlowMotion) {
             // Use median frame rate for non real time playback
-            mFps = mMedFps;
+            fps = mMedFps;
         }
-        else if (mCFRTarget.mode == CFRMode::AverageTesting) {
+        else if (cfrTarget.mode == CFRMode::AverageTesting) {
             // legacy framerate target determination
-            mFps = mAvgFps;
+            fps = mAvgFps;
         }
-        else if (mCFRTarget.mode == CFRMode::Custom) {
+        else if (cfrTarget.mode == CFRMode::Custom) {
             // Custom framerate
-            mFps = mCFRTarget.customValue;
+            fps = cfrTarget.customValue;
         }
     } else {
         // No CFR conversion - use custom value if provided, otherwise use average
-        if (mCFRTarget.mode == CFRMode::Custom) {
-            mFps = mCFRTarget.customValue;
+        if (cfrTarget.mode == CFRMode::Custom) {
+            fps = cfrTarget.customValue;
         } else {
-            mFps = mAvgFps;
+            fps = mAvgFps;
         }
-    }       
+    }
 
-    // Calculate typical DNG size that we can use for all files
-    std::vector<uint8_t> data;
-    nlohmann::json metadata;
+    return fps;
+}
+
+DngLayout VirtualFileSystemImpl_MCRAW::getDngLayout(const RenderSettings& settings, float fps) const {
+    // Calculate typical DNG size that we can use for all files. This only needs the metadata
+    // of the first frame, not its pixels.
+    auto dngLayout = mIndex ? mIndex->getDngLayout(settings) : std::nullopt;
+    if(dngLayout)
+        return *dngLayout;
+
+    const auto layout = utils::getDngLayout(mFirstFrameMetadata, *mCameraConfig, fps, settings);
+
+    if(mIndex) {
+        mIndex->setDngLayout(settings, layout);
+        mIndex->save();
+    }
+
+    return layout;
+}
+
+void VirtualFileSystemImpl_MCRAW::updateAudioHeader() {
+    if(mAudioTrack.numFrames == 0)
+        return;
+
+    // Only the frame rate in the iXML chunk depends on the settings
+    const auto fpsFraction = utils::toFraction(mFps);
+    if(!mAudioHeader.empty() && fpsFraction == mAudioFpsFraction)
+        return;
+
+    mAudioHeader = getAudioHeader(
+        mAudioTrack.numChannels, mAudioTrack.sampleRate, fpsFraction.first, fpsFraction.second, mAudioTrack.numFrames);
+    mAudioFpsFraction = fpsFraction;
+}
+
+void VirtualFileSystemImpl_MCRAW::init(const RenderSettings& settings) {
+    const auto& frames = mFrames;
+    const auto options = settings.options;
+
+    if(frames.empty())
+        return;
+
+    spdlog::debug("VirtualFileSystemImpl_MCRAW::init(options={})", optionsToString(options));
+
+    // Clear everything
+    mFiles.clear();
+    mEntryIndex.clear();
+    mDirectories.clear();
+    mFirstFrameNumbers.assign(frames.size(), -1);
+
+    bool applyCFRConversion = options & RENDER_OPT_FRAMERATE_CONVERSION;
 
-    decoder.loadFrame(frames[0], data, metadata);
+    mFps = getTargetFps(settings);
 
-    auto cameraConfig = CameraConfiguration::parse(decoder.getContainerMetadata());
-    auto cameraFrameMetadata = CameraFrameMetadata::parse(metadata);
+    // Only scan for the baseline exposure once something needs it
+    if((options & RENDER_OPT_NORMALIZE_EXPOSURE) && !mBaselineExpValue.valid())
+        startBaselineExposureScan(frames);
 
     // Store frame information
-    mWidth = cameraFrameMetadata.width;
-    mHeight = cameraFrameMetadata.height;
+    mWidth = mFirstFrameMetadata.width;
+    mHeight = mFirstFrameMetadata.height;
     mTotalFrames = static_cast<int>(frames.size());
     mDroppedFrames = 0; // Will be calculated during frame processing
     mDuplicatedFrames = 0;	
 
-    RenderSettings settingsForInit(
-        options,
-        mDraftScale,
-        mCFRTarget,
-        mCropTarget,
-        mCameraModel,
-        mLevels,
-        mLogTransform,
-        mExposureCompensation,
-        mQuadBayerOption
-    );
-
-    auto dngData = utils::generateDng(
-        data,
-        cameraFrameMetadata,
-        cameraConfig,
-        mFps,
-        0,
-        mBaselineExpValue,
-        settingsForInit
-    );
+    const bool proxies = hasProxies(options);
 
-    mTypicalDngSize = dngData->size();
+    mDngLayout = getDngLayout(getRenderSettings(settings), mFps);
+    mProxyLayout = proxies ? getDngLayout(getRenderSettings(settings, true), mFps) : DngLayout{};
 
     // Generate file entries
+    std::vector<Entry> files;
     int lastPts = 0;
 
-    mFiles.reserve(frames.size()*2);
+    files.reserve(frames.size()*2);
 
 // Disable icon previews in Windows/MacOS
 #ifdef _WIN32
@@ -403,40 +779,26 @@ void VirtualFileSystemImpl_MCRAW::init(FileRenderOptions options) {
     desktopIni.size = DESKTOP_INI.size();
     desktopIni.name = "desktop.ini";
 
-    mFiles.emplace_back(desktopIni);
+    files.emplace_back(desktopIni);
 #endif
 
-    // Generate and add audio (TODO: We're loading all the audio into memory)
-    Entry audioEntry;
-
-    std::vector<AudioChunk> audioChunks;
-    decoder.loadAudio(audioChunks);
-
-    if(!audioChunks.empty()) {
-        auto fpsFraction = utils::toFraction(mFps);
-        AudioWriter audioWriter(mAudioFile, decoder.numAudioChannels(), decoder.audioSampleRateHz(), fpsFraction.first, fpsFraction.second);
-
-        // Sync the audio to the video
-        syncAudio(
-            frames[0],
-            audioChunks,
-            decoder.audioSampleRateHz(),
-            decoder.numAudioChannels());
+    // The samples are read when the file is, only the header is kept
+    updateAudioHeader();
 
-        for(auto& x : audioChunks)
-            audioWriter.write(x.second, x.second.size() / decoder.numAudioChannels());
-    }
+    if(mAudioTrack.numFrames > 0) {
+        Entry audioEntry;
 
-    if(!mAudioFile.empty()) {
         audioEntry.type = EntryType::FILE_ENTRY;
-        audioEntry.size = mAudioFile.size();
+        audioEntry.size = mAudioHeader.size() + mAudioTrack.numFrames * mAudioTrack.numChannels * sizeof(int16_t);
         audioEntry.name = "audio.wav";
 
-        mFiles.emplace_back(audioEntry);
+        files.emplace_back(audioEntry);
     }
 
     // Add video frames
-    for(auto& x : frames) {
+    for(size_t i = 0; i < frames.size(); ++i) {
+        const auto& x = frames[i];
+
         if(applyCFRConversion) {
             int pts = getFrameNumberFromTimestamp(x, frames[0], mFps);
 
@@ -446,177 +808,662 @@ void VirtualFileSystemImpl_MCRAW::init(FileRenderOptions options) {
             if (lastPts > 0 && lastPts == pts)
                 mDroppedFrames += 1;
 
+            if(lastPts < pts)
+                mFirstFrameNumbers[i] = lastPts;
+
             // Duplicate frames to account for dropped frames
             while(lastPts < pts) {
                 Entry entry;
 
                 // Add main entry
                 entry.type = EntryType::FILE_ENTRY;
-                entry.size = mTypicalDngSize;
+                entry.size = mDngLayout.size;
                 entry.name = constructFrameFilename(mBaseName + std::string("-"), lastPts, 6, "dng");     
-                entry.userData = x;
+                entry.userData = FrameRef{ x, static_cast<int64_t>(i) };
 
-                mFiles.emplace_back(entry);
+                files.emplace_back(entry);
                 ++lastPts;
             }
         } else {
             Entry entry;
 
+            mFirstFrameNumbers[i] = lastPts;
+
             // Add main entry
             entry.type = EntryType::FILE_ENTRY;
-            entry.size = mTypicalDngSize;
+            entry.size = mDngLayout.size;
             entry.name = constructFrameFilename(mBaseName + std::string("-"), lastPts, 6, "dng");     
-            entry.userData = x;
+            entry.userData = FrameRef{ x, static_cast<int64_t>(i) };
 
-            mFiles.emplace_back(entry);
+            files.emplace_back(entry);
             ++lastPts;
         }
     }
+
+    mNumFrameEntries = lastPts;
+
+    // The proxy of each frame goes under the same name in the proxy folder
+    if(proxies) {
+        Entry proxyFolder;
+
+        proxyFolder.type = EntryType::DIRECTORY_ENTRY;
+        proxyFolder.size = 0;
+        proxyFolder.name = PROXY_FOLDER;
+
+        const size_t numFiles = files.size();
+
+        files.emplace_back(proxyFolder);
+
+        for(size_t i = 0; i < numFiles; ++i) {
+            if(!std::holds_alternative<FrameRef>(files[i].userData))
+                continue;
+
+            Entry entry = files[i];
+
+            entry.pathParts = { PROXY_FOLDER };
+            entry.size = mProxyLayout.size;
+
+            files.emplace_back(std::move(entry));
+        }
+    }
+
+    // Keep the entries in the order they are listed in, so listings can be streamed
+    std::sort(files.begin(), files.end(), entryLess);
+
+    // Entries never change once they are made, lookups hand out references to them that stay
+    // valid when updateOptions() replaces the list
+    mFiles.reserve(files.size());
+
+    for(auto& entry : files)
+        mFiles.push_back(std::make_shared<const Entry>(std::move(entry)));
+
+    // Build path lookup index
+    mEntryIndex.reserve(mFiles.size());
+    mDirectories[""] = { 0, 0 };
+
+    for(size_t i = 0; i < mFiles.size(); ++i) {
+        const auto path = mFiles[i]->getFullPath();
+
+        mEntryIndex.emplace(path.generic_string(), i);
+
+        auto [directory, inserted] = mDirectories.try_emplace(path.parent_path().generic_string(), i, i);
+        directory->second.second = i + 1;
+    }
+
+    // Frames are contiguous after sorting since they all share the same prefix
+    const auto firstFrameName = constructFrameFilename(mBaseName + std::string("-"), 0, 6, "dng");
+
+    auto firstFrame = mEntryIndex.find(firstFrameName);
+    mFirstFrameEntry = firstFrame == mEntryIndex.end() ? 0 : firstFrame->second;
+
+    auto firstProxy = mEntryIndex.find(std::string(PROXY_FOLDER) + "/" + firstFrameName);
+    mFirstProxyEntry = firstProxy == mEntryIndex.end() ? 0 : firstProxy->second;
 }
 
-std::vector<Entry> VirtualFileSystemImpl_MCRAW::listFiles(const std::string& filter) const {
-    // TODO: Use filter
-    return mFiles;
+size_t VirtualFileSystemImpl_MCRAW::listFiles(
+    const std::string& directory, const std::string& filter, size_t offset, const ListVisitor& visitor) const
+{
+    std::shared_lock<std::shared_mutex> lock(mEntriesMutex);
+
+    auto it = mDirectories.find(normalizePath(directory));
+    if(it == mDirectories.end())
+        return 0;
+
+    const auto [begin, end] = it->second;
+    const bool matchAll = filter.empty() || filter == "*";
+
+    // Offsets count from the start of the folder
+    for(auto i = begin + offset; i < end; ++i) {
+        if(!matchAll && !matchesFilter(mFiles[i]->name, filter))
+            continue;
+
+        if(!visitor(*mFiles[i], i - begin + 1))
+            return i - begin;
+    }
+
+    return end - begin;
 }
 
-std::optional<Entry> VirtualFileSystemImpl_MCRAW::findEntry(const std::string& fullPath) const {
-    for(const auto& e : mFiles) {
-        if(boost::filesystem::path(fullPath).relative_path() == e.getFullPath())
-            return e;
+std::shared_ptr<const Entry> VirtualFileSystemImpl_MCRAW::findEntry(const std::string& fullPath) const {
+    std::shared_lock<std::shared_mutex> lock(mEntriesMutex);
+
+    auto it = mEntryIndex.find(normalizePath(fullPath));
+    if(it == mEntryIndex.end())
+        return nullptr;
+
+    return mFiles[it->second];
+}
+
+bool VirtualFileSystemImpl_MCRAW::isProxy(const Entry& entry) const {
+    return entry.pathParts.size() == 1 && entry.pathParts[0] == PROXY_FOLDER;
+}
+
+RenderSettings VirtualFileSystemImpl_MCRAW::getRenderSettings(const Entry& entry) const {
+    return getRenderSettings(*std::atomic_load(&mSettings), isProxy(entry));
+}
+
+RenderSettings VirtualFileSystemImpl_MCRAW::getRenderSettings(const RenderSettings& settings, bool proxy) const {
+    RenderSettings result = settings;
+
+    // The proxy folder doesn't change how frames look, leaving it out keeps their cache keys
+    // when it is turned on or off
+    result.options &= ~RENDER_OPT_PROXY_FOLDER;
+
+    if(proxy) {
+        result.options |= RENDER_OPT_DRAFT;
+        result.draftScale = settings.draftScale > 1 ? settings.draftScale : DEFAULT_PROXY_SCALE;
     }
 
-    return {};
+    return result;
 }
 
-size_t VirtualFileSystemImpl_MCRAW::generateFrame(
+CacheKey VirtualFileSystemImpl_MCRAW::getCacheKey(const Entry& entry, const RenderSettings& settings) const {
+    // Frames the frame rate conversion duplicates render to the same DNG, they are all cached
+    // and rendered as the first entry of the frame
+    std::shared_lock<std::shared_mutex> lock(mEntriesMutex);
+
+    if(const auto* frame = std::get_if<FrameRef>(&entry.userData)) {
+        const auto index = static_cast<size_t>(frame->index);
+
+        if(index < mFirstFrameNumbers.size() && mFirstFrameNumbers[index] >= 0) {
+            const size_t first = (isProxy(entry) ? mFirstProxyEntry : mFirstFrameEntry) + mFirstFrameNumbers[index];
+
+            if(first < mFiles.size())
+                return CacheKey{ mSrcPath, mSrcSize, mSrcModified, RenderSettings::Hash{}(settings), *mFiles[first] };
+        }
+    }
+
+    return CacheKey{ mSrcPath, mSrcSize, mSrcModified, RenderSettings::Hash{}(settings), entry };
+}
+
+void VirtualFileSystemImpl_MCRAW::renderFrame(
     const Entry& entry,
-    const size_t pos,
-    const size_t len,
-    void* dst,
-    std::function<void(size_t, int)> result,
-    bool async)
+    const CacheKey& key,
+    const RenderSettings& settings,
+    Priority priority,
+    FrameCallback onComplete,
+    std::function<bool()> isCancelled)
 {
-    using FrameData = std::tuple<size_t, CameraConfiguration, CameraFrameMetadata, std::shared_ptr<std::vector<uint8_t>>>;
+    using FrameData = std::pair<size_t, std::shared_ptr<const RawFrame>>;
 
-    // Try to get from cache first
-    auto cacheEntry = mCache.get(entry);
-    if(cacheEntry && pos < cacheEntry->size()) {
-        // Calculate length to copy
-        const size_t actualLen = (std::min)(len, cacheEntry->size() - pos);
+    std::shared_lock<std::shared_mutex> entriesLock(mEntriesMutex);
 
-        // Copy the data from cache
-        std::memcpy(dst, cacheEntry->data() + pos, actualLen);
+    const auto fps = mFps;
+    const auto baselineExpValue = mBaselineExpValue;
 
-        // Push entry to front
-        mCache.put(entry, cacheEntry);
+    entriesLock.unlock();
+    const auto options = settings.options;
 
-        return actualLen;
-    }
+    // Drop the frame if the prefetch was cancelled, or every reader waiting for it went away
+    auto shouldDrop = [this, key, onComplete, isCancelled]() {
+        if((!isCancelled || isCancelled()) && mCache.cancelLoad(key)) {
+            onComplete(nullptr);
+            return true;
+        }
+
+        return false;
+    };
+
+    // The reservation holds the frame's share of the render memory until the DNG is done
+    auto generateTask = [this, entry, key, settings, fps, baselineExpValue, options, onComplete, shouldDrop](
+        std::shared_ptr<FrameData> decodedFrame, std::shared_ptr<Scheduler::Reservation>)
+    {
+        std::shared_ptr<std::vector<char>> dngData;
+
+        // Checked again, this may be a while after the job started
+        if(shouldDrop())
+            return;
 
-    // Use IO thread pool to decode frame
-    auto frameDataFuture = mIoThreadPool.submit_task([entry, &srcPath = mSrcPath, &options = mOptions]() -> FrameData {
-        thread_local std::map<std::string, std::unique_ptr<Decoder>> decoders;
+        try {
+            const auto& [frameIndex, rawFrame] = *decodedFrame;
 
-        auto timestamp = std::get<Timestamp>(entry.userData);
+            spdlog::debug("Generating {}", entry.name);
 
-        spdlog::debug("Reading frame {} with options {}", timestamp, optionsToString(options));
+            // Wait for the baseline exposure scan only when we need it
+            const double baselineExp =
+                (options & RENDER_OPT_NORMALIZE_EXPOSURE) && baselineExpValue.valid() ? baselineExpValue.get() : 0.0;
 
-        if(decoders.find(srcPath) == decoders.end()) {
-            decoders[srcPath] = std::make_unique<Decoder>(srcPath);
+            dngData = utils::generateDng(
+                *rawFrame->data,
+                rawFrame->metadata,
+                *rawFrame->cameraConfiguration,
+                fps,
+                frameIndex,
+                baselineExp,
+                settings,
+                &mProcessingThreadPool,
+                &mBufferPool,
+                &mMetrics);
+
+            // Keyed by the settings it was rendered with, so still useful if the settings changed since
+            if(dngData)
+                mCache.put(key, dngData);
+            else
+                mCache.markLoadFailed(key);
         }
+        // Detached tasks must not throw, and readers waiting for the frame need an answer
+        catch(const std::exception& e) {
+            spdlog::error("Failed to generate DNG (error: {})", e.what());
+            mCache.markLoadFailed(key);
+            dngData = nullptr;
+        }
+        catch(...) {
+            spdlog::error("Failed to generate DNG");
+            mCache.markLoadFailed(key);
+            dngData = nullptr;
+        }
+
+        onComplete(dngData);
+    };
+
+    // The decoded frame and the DNG are each about the size of the file
+    const size_t frameMemory = 2 * entry.size;
+
+    // Use IO thread pool to decode frame, then hand over to the processing thread pool to generate the DNG.
+    // Decoded frames are kept, so the proxy of a frame and the frame under other settings skip decoding
+    auto readTask = [this, entry, key, decoders = mDecoders, cameraConfig = mCameraConfig, options, onComplete, generateTask](
+        std::shared_ptr<Scheduler::Reservation> reservation)
+    {
+        // Frames that were evicted from memory may still be on disk
+        std::shared_ptr<std::vector<char>> cachedData;
 
-        auto& decoder = decoders[srcPath];
-        auto data = std::make_shared<std::vector<uint8_t>>();
+        try {
+            if(auto diskCache = mCache.getDiskCache())
+                cachedData = diskCache->get(key);
+        }
+        catch(const std::exception& e) {
+            spdlog::warn("Failed to read {} from disk cache (error: {})", entry.name, e.what());
+        }
+
+        if(cachedData) {
+            spdlog::debug("Read {} from disk cache", entry.name);
 
-        nlohmann::json metadata;
-        auto allFrames = decoder->getFrames();
+            ++mMetrics.diskCacheHits;
 
-        // Find the frame (index)
-        auto it = std::find(allFrames.begin(), allFrames.end(), timestamp);
-        if(it == allFrames.end()) {
-            spdlog::error("Frame {} not found", timestamp);
-            throw std::runtime_error("Failed to find frame");
+            mCache.put(key, cachedData);
+            onComplete(cachedData);
+            return;
         }
 
-        decoder->loadFrame(timestamp, *data, metadata);
+        std::shared_ptr<FrameData> decodedFrame;
 
-        size_t frameIndex = std::distance(allFrames.begin(), it);
+        try {
+            const auto& frame = std::get<FrameRef>(entry.userData);
+            const auto timestamp = frame.timestamp;
 
-        return std::make_tuple(
-            frameIndex, CameraConfiguration::parse(decoder->getContainerMetadata()), CameraFrameMetadata::parse(metadata), std::move(data));
-    });
+            bool decoded = false;
+
+            auto decode = [&]() {
+                decoded = true;
+
+                spdlog::debug("Reading frame {} with options {}", timestamp, optionsToString(options));
+
+                auto decoder = decoders->acquire();
+                auto data = mFrameBuffers.getEmpty(mDecodedFrameSize.load(std::memory_order_relaxed));
+
+                nlohmann::json metadata;
+
+                {
+                    Measure m("loadFrame", &mMetrics.decode);
+
+                    decoder->loadFrame(timestamp, *data, metadata);
+                }
+
+                mDecodedFrameSize.store(data->size(), std::memory_order_relaxed);
+
+                return std::make_shared<const RawFrame>(RawFrame{ cameraConfig, parseFrameMetadata(metadata), std::move(data) });
+            };
+
+            decodedFrame = std::make_shared<FrameData>(
+                static_cast<size_t>(frame.index), mRawFrames.get(mSrcPath, timestamp, decode));
+
+            if(!decoded)
+                ++mMetrics.rawFrameHits;
+        }
+        catch(const std::exception& e) {
+            spdlog::error("Failed to read frame (error: {})", e.what());
+            mCache.markLoadFailed(key);
+            onComplete(nullptr);
+            return;
+        }
+        catch(...) {
+            spdlog::error("Failed to read frame");
+            mCache.markLoadFailed(key);
+            onComplete(nullptr);
+            return;
+        }
 
+        mProcessingThreadPool.detach_task([generateTask, decodedFrame, reservation]() {
+            generateTask(decodedFrame, reservation);
+        });
+    };
 
-    // Use processing thread pool to generate DNG
-    auto sharableFuture = frameDataFuture.share();
+    mFrameScheduler.submit(mSchedulerSession, CacheKey::Hash{}(key), priority, frameMemory, shouldDrop, readTask);
+}
+
+void VirtualFileSystemImpl_MCRAW::renderHeader(
+    const Entry& entry,
+    const CacheKey& key,
+    const RenderSettings& settings,
+    FrameCallback onComplete)
+{
+    std::shared_lock<std::shared_mutex> entriesLock(mEntriesMutex);
 
     const auto fps = mFps;
-    const auto draftScale = mDraftScale;
     const auto baselineExpValue = mBaselineExpValue;
-    const auto options = mOptions;
+    const auto cameraConfig = mCameraConfig;
 
-    auto generateTask = [this, &cache = mCache, entry, sharableFuture, fps, draftScale, baselineExpValue, options, pos, len, dst, result]() {
-        size_t readBytes = 0;
-        int errorCode = -1;
+    entriesLock.unlock();
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mPendingHeaders;
+    }
+
+    // Runs on the processing pool because it may wait for the baseline exposure scan, which uses the IO pool
+    mProcessingThreadPool.detach_task([this, entry, key, settings, fps, baselineExpValue, cameraConfig, decoders = mDecoders, onComplete]() {
+        std::shared_ptr<std::vector<char>> header;
 
         try {
-            auto decodedFrame = sharableFuture.get();
-            auto [frameIndex, containerMetadata, frameMetadata, frameData] = std::move(decodedFrame);
+            const auto& frame = std::get<FrameRef>(entry.userData);
 
-            spdlog::debug("Generating {}", entry.name);
+            spdlog::debug("Generating header of {}", entry.name);
+
+            nlohmann::json metadata;
+
+            decoders->acquire()->loadFrameMetadata(frame.timestamp, metadata);
+
+            const double baselineExp =
+                (settings.options & RENDER_OPT_NORMALIZE_EXPOSURE) && baselineExpValue.valid() ? baselineExpValue.get() : 0.0;
 
-            RenderSettings settings(
-                options,
-                draftScale,
-                mCFRTarget,
-                mCropTarget,
-                mCameraModel,
-                mLevels,
-                mLogTransform,
-                mExposureCompensation,
-                mQuadBayerOption
-            );
-
-            auto dngData = utils::generateDng(
-                *frameData,
-                frameMetadata,
-                containerMetadata,
+            DngLayout layout;
+
+            header = utils::generateDngHeader(
+                parseFrameMetadata(metadata),
+                *cameraConfig,
                 fps,
-                frameIndex,
-                baselineExpValue,
-                settings);
+                static_cast<int>(frame.index),
+                baselineExp,
+                settings,
+                layout);
+        }
+        catch(const std::exception& e) {
+            spdlog::error("Failed to generate DNG header (error: {})", e.what());
+            header = nullptr;
+        }
+        catch(...) {
+            spdlog::error("Failed to generate DNG header");
+            header = nullptr;
+        }
 
-            if(dngData && pos < dngData->size()) {
-                // Calculate length to copy
-                const size_t actualLen = std::min(len, dngData->size() - pos);
+        if(header)
+            mHeaderCache.put(key, header);
+        else
+            mHeaderCache.markLoadFailed(key);
 
-                std::memcpy(dst, dngData->data() + pos, actualLen);
+        onComplete(header);
 
-                readBytes = actualLen;
-                errorCode = 0;
-            }
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        --mPendingHeaders;
+        mPrefetchCondition.notify_all();
+    });
+}
+
+int VirtualFileSystemImpl_MCRAW::getPrefetchDepth(size_t frameSize) const {
+    if(frameSize == 0)
+        return 0;
 
-            // Add to cache
-            cache.put(entry, dngData);
+    // Leave at least half of the cache for the frames being read
+    const auto maxFrames = static_cast<int>(mCache.capacity() / 2 / frameSize);
+
+    return (std::min)(mMaxPrefetchFrames, maxFrames);
+}
+
+void VirtualFileSystemImpl_MCRAW::updatePrefetch(const Entry& entry) {
+    const int frameNumber = getFrameNumberFromFilename(entry.name);
+    if(frameNumber < 0)
+        return;
+
+    const bool proxy = isProxy(entry);
+    auto& state = proxy ? mProxyPrefetch : mFramePrefetch;
+
+    std::vector<std::shared_ptr<const Entry>> prefetchEntries;
+    uint64_t generation;
+    uint64_t stateGeneration;
+
+    {
+        std::shared_lock<std::shared_mutex> entriesLock(mEntriesMutex);
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        const int distance = frameNumber - state.lastFrameNumber;
+
+        // Readers often have a few frames in flight, ignore small reordering
+        if(distance <= 0 && distance > -SEQUENTIAL_READ_WINDOW)
+            return;
+
+        if(distance > 0 && distance <= SEQUENTIAL_READ_WINDOW) {
+            ++state.sequentialReads;
         }
-        catch(std::runtime_error& e) {
-            spdlog::error("Failed to generate DNG (error: {})", e.what());
-            cache.markLoadFailed(entry);
+        else {
+            // Reader jumped somewhere else, drop any queued prefetches
+            ++state.generation;
+
+            state.sequentialReads = 0;
+            state.prefetchEnd = frameNumber + 1;
+        }
+
+        state.lastFrameNumber = frameNumber;
+
+        if(state.sequentialReads < SEQUENTIAL_READS_BEFORE_PREFETCH)
+            return;
+
+        const int numFrames = static_cast<int>(mNumFrameEntries);
+        const int end = (std::min)(frameNumber + 1 + getPrefetchDepth(entry.size), numFrames);
+        const size_t firstEntry = proxy ? mFirstProxyEntry : mFirstFrameEntry;
+
+        for(int i = (std::max)(state.prefetchEnd, frameNumber + 1); i < end; ++i)
+            prefetchEntries.push_back(mFiles[firstEntry + i]);
+
+        state.prefetchEnd = (std::max)(state.prefetchEnd, end);
+        generation = mPrefetchGeneration;
+        stateGeneration = state.generation;
+    }
+
+    const auto settings = getRenderSettings(entry);
+
+    for(const auto& prefetchEntry : prefetchEntries) {
+        const auto key = getCacheKey(*prefetchEntry, settings);
+
+        // Skip frames that are already cached or being generated
+        if(!mCache.reserve(key))
+            continue;
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            ++mPendingPrefetches;
         }
 
+        spdlog::debug("Prefetching {}", prefetchEntry->name);
+
+        renderFrame(
+            *prefetchEntry,
+            key,
+            settings,
+            Priority::Prefetch,
+            [this](std::shared_ptr<std::vector<char>>) {
+                std::lock_guard<std::mutex> lock(mMutex);
+
+                --mPendingPrefetches;
+                mPrefetchCondition.notify_all();
+            },
+            [this, &state, generation, stateGeneration]() {
+                return mPrefetchGeneration != generation || state.generation != stateGeneration;
+            });
+    }
+}
+
+size_t VirtualFileSystemImpl_MCRAW::generateFrame(
+    const Entry& entry,
+    const size_t pos,
+    const size_t len,
+    void* dst,
+    std::function<void(size_t, int)> result,
+    bool async,
+    std::shared_ptr<CancellationToken> cancel)
+{
+    const auto settings = getRenderSettings(entry);
+    const auto key = getCacheKey(entry, settings);
+
+    // Thumbnailers and media scans only read the tags at the start of the file, which we can
+    // answer from the frame metadata without decoding the frame
+    std::shared_lock<std::shared_mutex> entriesLock(mEntriesMutex);
+
+    const auto layout = isProxy(entry) ? mProxyLayout : mDngLayout;
+
+    entriesLock.unlock();
+
+    if(layout.stripOffset > 0 && pos + len <= layout.stripOffset)
+        return generateHeader(entry, key, settings, pos, len, dst, result, async);
+
+    updatePrefetch(entry);
+
+    auto readPromise = std::make_shared<std::promise<size_t>>();
+    auto readFuture = readPromise->get_future();
+
+    const auto readStart = std::chrono::steady_clock::now();
+
+    // Every read of a frame that isn't ready waits for the same render
+    auto onLoaded = [this, pos, len, dst, result, readPromise, readStart, fileSize = entry.size](std::shared_ptr<std::vector<char>> dngData) {
+        size_t readBytes = 0;
+        int errorCode = -1;
+
+        if(dngData && pos < (std::max)(dngData->size(), fileSize)) {
+            readBytes = copyFrameData(*dngData, fileSize, pos, len, dst);
+            errorCode = 0;
+        }
+        else {
+            ++mMetrics.failedReads;
+        }
+
+        mMetrics.readWait.record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - readStart).count()));
+
         result(readBytes, errorCode);
+        readPromise->set_value(readBytes);
+    };
+
+    // Only the cache keeps the callback alive, the token forgets about it once it has been called
+    auto loadCallback = std::make_shared<LRUCache::LoadCallback>(std::move(onLoaded));
 
-        return readBytes;
+    bool startLoad = false;
+    uint64_t waitId = 0;
+
+    auto cacheEntry = mCache.get(
+        key, [loadCallback](std::shared_ptr<std::vector<char>> dngData) { (*loadCallback)(dngData); }, startLoad, &waitId);
+    if(cacheEntry) {
+        ++mMetrics.cacheHits;
+
+        return copyFrameData(*cacheEntry, entry.size, pos, len, dst);
+    }
+
+    // The cache calls onLoaded when the frame is put there
+    if(startLoad) {
+        ++mMetrics.cacheMisses;
+
+        renderFrame(entry, key, settings, Priority::Foreground, [](std::shared_ptr<std::vector<char>>) {});
+    }
+    else {
+        ++mMetrics.cacheWaits;
+
+        mFrameScheduler.prioritise(CacheKey::Hash{}(key));
+    }
+
+    // A reader that goes away gets an error straight away. The frame is only dropped once
+    // no one else is waiting for it
+    if(cancel) {
+        cancel->onCancel([cache = &mCache, metrics = &mMetrics, key, waitId, weakCallback = std::weak_ptr<LRUCache::LoadCallback>(loadCallback)]() {
+            auto callback = weakCallback.lock();
+
+            if(callback && cache->cancelWait(key, waitId)) {
+                ++metrics->cancelledWaits;
+                (*callback)(nullptr);
+            }
+        });
+    }
+
+    if(!async)
+        return readFuture.get();
+
+    return 0;
+}
+
+size_t VirtualFileSystemImpl_MCRAW::generateHeader(
+    const Entry& entry,
+    const CacheKey& key,
+    const RenderSettings& settings,
+    const size_t pos,
+    const size_t len,
+    void* dst,
+    std::function<void(size_t, int)> result,
+    bool async)
+{
+    auto readPromise = std::make_shared<std::promise<size_t>>();
+    auto readFuture = readPromise->get_future();
+
+    auto onLoaded = [pos, len, dst, result, readPromise](std::shared_ptr<std::vector<char>> header) {
+        size_t readBytes = 0;
+        int errorCode = -1;
+
+        if(header) {
+            readBytes = copyData(*header, pos, len, dst);
+            errorCode = 0;
+        }
+
+        result(readBytes, errorCode);
+        readPromise->set_value(readBytes);
     };
 
+    bool startLoad = false;
+
+    auto cacheEntry = mHeaderCache.get(key, onLoaded, startLoad);
+    if(cacheEntry)
+        return copyData(*cacheEntry, pos, len, dst);
+
+    if(startLoad)
+        renderHeader(entry, key, settings, [](std::shared_ptr<std::vector<char>>) {});
 
-    auto processFuture = mProcessingThreadPool.submit_task(generateTask);
     if(!async)
-        return processFuture.get();
+        return readFuture.get();
 
     return 0;
 }
 
+size_t VirtualFileSystemImpl_MCRAW::readAudioSamples(uint64_t pos, size_t len, char* dst) {
+    if(mAudioPath.empty()) {
+        const size_t size = mAudioSamples.size() * sizeof(int16_t);
+        if(pos >= size)
+            return 0;
+
+        const size_t actualLen = (std::min)(static_cast<uint64_t>(len), size - pos);
+
+        std::memcpy(dst, reinterpret_cast<const char*>(mAudioSamples.data()) + pos, actualLen);
+
+        return actualLen;
+    }
+
+    std::lock_guard<std::mutex> lock(mAudioMutex);
+
+    if(!mAudioStream.is_open())
+        mAudioStream.open(mAudioPath, std::ios::binary);
+
+    mAudioStream.clear();
+    mAudioStream.seekg(static_cast<std::streamoff>(pos));
+    mAudioStream.read(dst, static_cast<std::streamsize>(len));
+
+    return static_cast<size_t>(mAudioStream.gcount());
+}
+
 size_t VirtualFileSystemImpl_MCRAW::generateAudio(
     const Entry& entry,
     const size_t pos,
@@ -625,18 +1472,33 @@ size_t VirtualFileSystemImpl_MCRAW::generateAudio(
     std::function<void(size_t, int)> result,
     bool async)
 {
+    auto* out = static_cast<char*>(dst);
     size_t readBytes = 0;
 
-    if(pos < mAudioFile.size()) {
-        // Calculate length to copy
-        const size_t actualLen = (std::min)(len, mAudioFile.size() - pos);
+    // The header is built by init(), the samples follow it
+    std::shared_lock<std::shared_mutex> entriesLock(mEntriesMutex);
 
-        std::memcpy(dst, mAudioFile.data() + pos, actualLen);
+    const size_t headerSize = mAudioHeader.size();
 
-        readBytes = actualLen;
+    if(pos < headerSize) {
+        readBytes = (std::min)(len, headerSize - pos);
+        std::memcpy(out, mAudioHeader.data() + pos, readBytes);
+    }
+
+    entriesLock.unlock();
+
+    if(readBytes < len && pos + readBytes < entry.size) {
+        const size_t samplesLen = (std::min)(len - readBytes, entry.size - pos - readBytes);
+
+        readBytes += readAudioSamples(pos + readBytes - headerSize, samplesLen, out + readBytes);
+    }
+
+    // Always read synchronously, a failed read still has to be answered
+    if(readBytes == 0 && len > 0) {
+        spdlog::error("Failed to read {} at {}", entry.name, pos);
+        result(0, -1);
     }
 
-    // Always read synchronously for now
     return readBytes;
 }
 
@@ -646,7 +1508,32 @@ int VirtualFileSystemImpl_MCRAW::readFile(
     const size_t len,
     void* dst,
     std::function<void(size_t, int)> result,
-    bool async) {
+    bool async,
+    std::shared_ptr<CancellationToken> cancel) {
+
+    // Answers given later go through result, only count them there
+    auto countedResult = [this, result](size_t bytes, int errorCode) {
+        if(errorCode == 0)
+            mMetrics.bytesServed += bytes;
+
+        result(bytes, errorCode);
+    };
+
+    const int readBytes = readEntry(entry, pos, len, dst, async ? countedResult : result, async, cancel);
+    if(readBytes > 0)
+        mMetrics.bytesServed += static_cast<uint64_t>(readBytes);
+
+    return readBytes;
+}
+
+int VirtualFileSystemImpl_MCRAW::readEntry(
+    const Entry& entry,
+    const size_t pos,
+    const size_t len,
+    void* dst,
+    std::function<void(size_t, int)> result,
+    bool async,
+    std::shared_ptr<CancellationToken> cancel) {
 
     #ifdef _WIN32
         if(entry.name == "desktop.ini") {
@@ -662,28 +1549,60 @@ int VirtualFileSystemImpl_MCRAW::readFile(
         return generateAudio(entry, pos, len, dst, result, async);
     }
     else if(boost::ends_with(entry.name, "dng")) {
-        return generateFrame(entry, pos, len, dst, result, async);
+        return generateFrame(entry, pos, len, dst, result, async, cancel);
     }
 
     return -1;
 }
 
 void VirtualFileSystemImpl_MCRAW::updateOptions(const RenderSettings& settings) {
-    mDraftScale = settings.draftScale;
-    mOptions = settings.options;
-    mCFRTarget = settings.cfrTarget;
-    mCropTarget = settings.cropTarget;
-    mCameraModel = settings.cameraModel;
-    mLevels = settings.levels;
-    mLogTransform = settings.logTransform;
-    mExposureCompensation = settings.exposureCompensation;
-    mQuadBayerOption = settings.quadBayerOption;
-
-    mCache.clear();
-    init(settings.options);
+    // Reads carry on while this runs, they see either the old entries or the new ones
+    std::unique_lock<std::shared_mutex> lock(mEntriesMutex);
+
+    const auto previousOptions = std::atomic_load(&mSettings)->options;
+
+    std::atomic_store(&mSettings, std::make_shared<const RenderSettings>(settings));
+
+    // Stop prefetching with the old settings. Frames that are already cached stay there
+    // under their old settings, in case we switch back.
+    ++mPrefetchGeneration;
+
+    // Most options only change the pixels. When the frame rate and the size of the DNGs stay
+    // the same, so do the entries and readers can carry on with them
+    const bool sameFrames =
+        getTargetFps(settings) == mFps &&
+        (settings.options & RENDER_OPT_FRAMERATE_CONVERSION) == (previousOptions & RENDER_OPT_FRAMERATE_CONVERSION);
+
+    const bool proxies = hasProxies(settings.options);
+
+    const bool sameProxies =
+        proxies == hasProxies(previousOptions) &&
+        (!proxies || getDngLayout(getRenderSettings(settings, true), mFps) == mProxyLayout);
+
+    if(!mFrames.empty() && sameFrames && sameProxies && getDngLayout(getRenderSettings(settings), mFps) == mDngLayout) {
+        spdlog::debug("Keeping entries of {}, the layout is unchanged", mSrcPath);
+
+        if((settings.options & RENDER_OPT_NORMALIZE_EXPOSURE) && !mBaselineExpValue.valid())
+            startBaselineExposureScan(mFrames);
+
+        return;
+    }
+
+    init(settings);
+}
+
+MetricsSnapshot VirtualFileSystemImpl_MCRAW::getMetrics() const {
+    MetricsSnapshot snapshot;
+
+    snapshotMetrics(mMetrics, snapshot);
+    snapshot.cachedBytes = mCache.usage(mSrcPath);
+
+    return snapshot;
 }
 
 FileInfo VirtualFileSystemImpl_MCRAW::getFileInfo() const {
+    std::shared_lock<std::shared_mutex> lock(mEntriesMutex);
+
     return FileInfo{
         mMedFps,
         mAvgFps,
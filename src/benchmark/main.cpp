@@ -0,0 +1,548 @@
+// Headless benchmark of the frame generation pipeline. Mounts a clip in-process, without Qt or
+// a file system driver, and replays the access patterns we see from players, scanners and
+// NLEs for each combination of render options. Given a trace recorded by a mount (see
+// AccessTrace.h), replays that instead.
+//
+// usage: motioncam-fs-bench <file.mcraw> [--frames N] [--readers N] [--draft-scale N]
+//                           [--options FLAG,FLAG,...]... [--replay TRACE] [--replay-speed X] [--csv]
+
+#include "VirtualFileSystemImpl_MCRAW.h"
+#include "LRUCache.h"
+#include "RawFrameCache.h"
+#include "BufferPool.h"
+#include "Scheduler.h"
+#include "Metrics.h"
+#include "AccessTrace.h"
+
+#include <BS_thread_pool.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+using namespace motioncam;
+
+// Same budgets as the mounts of the app
+constexpr size_t CACHE_SIZE = 1024 * 1024 * 1024;
+constexpr size_t HEADER_CACHE_SIZE = 64 * 1024 * 1024;
+constexpr size_t RAW_FRAME_CACHE_SIZE = 512 * 1024 * 1024;
+constexpr size_t BUFFER_POOL_SIZE = 256 * 1024 * 1024;
+constexpr size_t FRAME_BUFFER_POOL_SIZE = 256 * 1024 * 1024;
+constexpr size_t RENDER_MEMORY = 512 * 1024 * 1024;
+
+constexpr size_t PLAYBACK_CHUNK_SIZE = 1024 * 1024;   // What players tend to ask for
+constexpr size_t CONCURRENT_CHUNK_SIZE = 128 * 1024;  // Largest read ProjFS and fuse-t pass on
+constexpr size_t HEADER_READ_SIZE = 4096;             // Thumbnailers and media scans
+
+constexpr int DEFAULT_FRAMES = 100;
+constexpr int DEFAULT_READERS = 4;
+constexpr int DEFAULT_DRAFT_SCALE = 2;
+constexpr unsigned int RANDOM_SEED = 1234;            // Same seeks on every run
+
+struct Arguments {
+    std::string path;
+    int frames = DEFAULT_FRAMES;
+    int readers = DEFAULT_READERS;
+    int draftScale = DEFAULT_DRAFT_SCALE;
+    std::vector<FileRenderOptions> options;  // Defaults when empty, or the options of the trace
+    std::string replayPath;
+    double replaySpeed = 1.0;                // 0 to replay as fast as possible
+    bool csv = false;
+};
+
+struct Result {
+    std::string options;
+    std::string pattern;
+    int frames = 0;
+    double fps = 0;
+    HistogramSummary latency;
+    size_t peakRssBytes = 0;
+    uint64_t failedReads = 0;
+};
+
+const std::vector<std::pair<std::string, FileRenderOptions>> OPTION_NAMES = {
+    { "NONE", RENDER_OPT_NONE },
+    { "DRAFT", RENDER_OPT_DRAFT },
+    { "VIGNETTE_CORRECTION", RENDER_OPT_APPLY_VIGNETTE_CORRECTION },
+    { "NORMALIZE_SHADING_MAP", RENDER_OPT_NORMALIZE_SHADING_MAP },
+    { "DEBUG_SHADING_MAP", RENDER_OPT_DEBUG_SHADING_MAP },
+    { "VIGNETTE_ONLY_COLOR", RENDER_OPT_VIGNETTE_ONLY_COLOR },
+    { "NORMALIZE_EXPOSURE", RENDER_OPT_NORMALIZE_EXPOSURE },
+    { "FRAMERATE_CONVERSION", RENDER_OPT_FRAMERATE_CONVERSION },
+    { "CROPPING", RENDER_OPT_CROPPING },
+    { "CAMMODEL_OVERRIDE", RENDER_OPT_CAMMODEL_OVERRIDE },
+    { "LOG_TRANSFORM", RENDER_OPT_LOG_TRANSFORM },
+    { "INTERPRET_AS_QUAD_BAYER", RENDER_OPT_INTERPRET_AS_QUAD_BAYER },
+    { "LOSSLESS_COMPRESSION", RENDER_OPT_LOSSLESS_COMPRESSION },
+    { "PROXY_FOLDER", RENDER_OPT_PROXY_FOLDER }
+};
+
+// The combinations that change how much work a frame takes, when none are given
+const std::vector<FileRenderOptions> DEFAULT_OPTIONS = {
+    RENDER_OPT_NONE,
+    RENDER_OPT_DRAFT,
+    RENDER_OPT_APPLY_VIGNETTE_CORRECTION,
+    RENDER_OPT_APPLY_VIGNETTE_CORRECTION | RENDER_OPT_NORMALIZE_SHADING_MAP,
+    RENDER_OPT_LOG_TRANSFORM,
+    RENDER_OPT_LOSSLESS_COMPRESSION,
+    RENDER_OPT_DRAFT | RENDER_OPT_LOSSLESS_COMPRESSION,
+    RENDER_OPT_APPLY_VIGNETTE_CORRECTION | RENDER_OPT_LOG_TRANSFORM | RENDER_OPT_LOSSLESS_COMPRESSION
+};
+
+FileRenderOptions parseOptions(const std::string& value) {
+    FileRenderOptions options = RENDER_OPT_NONE;
+
+    std::stringstream stream(value);
+    std::string name;
+
+    while(std::getline(stream, name, ',')) {
+        auto it = std::find_if(OPTION_NAMES.begin(), OPTION_NAMES.end(), [&name](const auto& option) {
+            return option.first == name;
+        });
+
+        if(it == OPTION_NAMES.end())
+            throw std::invalid_argument("Unknown render option " + name);
+
+        options |= it->second;
+    }
+
+    return options;
+}
+
+Arguments parseArguments(int argc, char* argv[]) {
+    Arguments args;
+
+    auto getValue = [&](int& i) -> std::string {
+        if(i + 1 >= argc)
+            throw std::invalid_argument(std::string("Missing value for ") + argv[i]);
+
+        return argv[++i];
+    };
+
+    for(int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+
+        if(arg == "--frames")
+            args.frames = std::stoi(getValue(i));
+        else if(arg == "--readers")
+            args.readers = std::max(1, std::stoi(getValue(i)));
+        else if(arg == "--draft-scale")
+            args.draftScale = std::max(1, std::stoi(getValue(i)));
+        else if(arg == "--options")
+            args.options.push_back(parseOptions(getValue(i)));
+        else if(arg == "--replay")
+            args.replayPath = getValue(i);
+        else if(arg == "--replay-speed")
+            args.replaySpeed = (std::max)(0.0, std::stod(getValue(i)));
+        else if(arg == "--csv")
+            args.csv = true;
+        else if(!arg.empty() && arg[0] == '-')
+            throw std::invalid_argument("Unknown argument " + arg);
+        else
+            args.path = arg;
+    }
+
+    if(args.path.empty())
+        throw std::invalid_argument("No clip given");
+
+    return args;
+}
+
+size_t getPeakRss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+
+    return 0;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);          // Bytes
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;   // Kilobytes
+#endif
+#endif
+}
+
+uint64_t elapsedUs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Reads [pos, pos + len) of the entry in chunks, blocking until every chunk is there
+bool readRange(IVirtualFileSystem& fs, const Entry& entry, size_t pos, size_t len, size_t chunkSize, std::vector<char>& buffer) {
+    buffer.resize(chunkSize);
+
+    const size_t end = (std::min)(entry.size, pos + len);
+
+    while(pos < end) {
+        const size_t readLen = (std::min)(chunkSize, end - pos);
+        const int result = fs.readFile(entry, pos, readLen, buffer.data(), [](size_t, int) {}, false);
+
+        if(result <= 0)
+            return false;
+
+        pos += static_cast<size_t>(result);
+    }
+
+    return true;
+}
+
+class Benchmark {
+public:
+    explicit Benchmark(const Arguments& args) :
+        mArgs(args),
+        mIoThreadPool(std::clamp(static_cast<int>(std::thread::hardware_concurrency()) / 4, 4, 16)),
+        mProcessingThreadPool((std::max)(1, static_cast<int>(std::thread::hardware_concurrency()))),
+        mFrameScheduler(mIoThreadPool, RENDER_MEMORY),
+        mBufferPool(BUFFER_POOL_SIZE),
+        mFrameBufferPool(FRAME_BUFFER_POOL_SIZE) {
+    }
+
+    std::vector<Result> run() {
+        std::vector<Result> results;
+
+        if(!mArgs.replayPath.empty()) {
+            replayTrace(results);
+            return results;
+        }
+
+        for(auto options : mArgs.options.empty() ? DEFAULT_OPTIONS : mArgs.options) {
+            const auto settings = getSettings(options, mArgs.draftScale);
+
+            // Every pattern starts from a cold cache and a fresh mount
+            runPattern(settings, "sequential", results, [this](auto& fs, auto& frames, auto& latency) {
+                return sequential(fs, frames, latency);
+            });
+
+            runPattern(settings, "random", results, [this](auto& fs, auto& frames, auto& latency) {
+                return random(fs, frames, latency);
+            });
+
+            runPattern(settings, "header", results, [this](auto& fs, auto& frames, auto& latency) {
+                return headers(fs, frames, latency);
+            });
+
+            runPattern(settings, "concurrent", results, [this](auto& fs, auto& frames, auto& latency) {
+                return concurrent(fs, frames, latency);
+            });
+        }
+
+        return results;
+    }
+
+private:
+    using Pattern = std::function<int(VirtualFileSystemImpl_MCRAW&, const std::vector<const Entry*>&, Histogram&)>;
+
+    static RenderSettings getSettings(FileRenderOptions options, int draftScale) {
+        RenderSettings settings;
+
+        settings.options = options;
+        settings.draftScale = draftScale;
+
+        return settings;
+    }
+
+    void runPattern(const RenderSettings& settings, const std::string& name, std::vector<Result>& results, const Pattern& pattern) {
+        LRUCache cache(CACHE_SIZE);
+        LRUCache headerCache(HEADER_CACHE_SIZE);
+        RawFrameCache rawFrameCache(RAW_FRAME_CACHE_SIZE);
+
+        Result result;
+
+        result.options = optionsToString(settings.options);
+        result.pattern = name;
+
+        {
+            const auto baseName = std::filesystem::path(mArgs.path).stem().string();
+
+            VirtualFileSystemImpl_MCRAW fs(
+                mIoThreadPool, mProcessingThreadPool, cache, headerCache, rawFrameCache, mBufferPool, mFrameBufferPool, mFrameScheduler, settings, mArgs.path, baseName);
+
+            auto frames = getFrames(fs);
+            Histogram latency;
+
+            const auto start = std::chrono::steady_clock::now();
+
+            result.frames = pattern(fs, frames, latency);
+
+            const double seconds = elapsedUs(start) / 1e6;
+
+            result.fps = seconds > 0 ? result.frames / seconds : 0;
+            result.latency = latency.summarise();
+            result.failedReads = fs.getMetrics().failedReads;
+        }
+
+        // Prefetches of the pattern are done once the mount is gone
+        result.peakRssBytes = getPeakRss();
+
+        // Progress, the table goes to stdout at the end
+        std::cerr << result.options << " " << result.pattern << ": " << result.fps << " fps\n";
+
+        results.push_back(std::move(result));
+    }
+
+    std::vector<const Entry*> getFrames(const VirtualFileSystemImpl_MCRAW& fs) const {
+        std::vector<const Entry*> frames;
+
+        fs.listFiles("", "*.dng", 0, [&frames](const Entry& entry, size_t) {
+            if(entry.type == FILE_ENTRY)
+                frames.push_back(&entry);
+            return true;
+        });
+
+        if(mArgs.frames > 0 && frames.size() > static_cast<size_t>(mArgs.frames))
+            frames.resize(mArgs.frames);
+
+        return frames;
+    }
+
+    // Playback, frame after frame in large reads
+    int sequential(VirtualFileSystemImpl_MCRAW& fs, const std::vector<const Entry*>& frames, Histogram& latency) {
+        std::vector<char> buffer;
+        int count = 0;
+
+        for(const auto* entry : frames) {
+            const auto start = std::chrono::steady_clock::now();
+
+            if(readRange(fs, *entry, 0, entry->size, PLAYBACK_CHUNK_SIZE, buffer))
+                ++count;
+
+            latency.record(elapsedUs(start));
+        }
+
+        return count;
+    }
+
+    // Scrubbing, whole frames in no particular order
+    int random(VirtualFileSystemImpl_MCRAW& fs, const std::vector<const Entry*>& frames, Histogram& latency) {
+        auto shuffled = frames;
+        std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(RANDOM_SEED));
+
+        return sequential(fs, shuffled, latency);
+    }
+
+    // Media scans, only the start of each file
+    int headers(VirtualFileSystemImpl_MCRAW& fs, const std::vector<const Entry*>& frames, Histogram& latency) {
+        std::vector<char> buffer;
+        int count = 0;
+
+        for(const auto* entry : frames) {
+            const auto start = std::chrono::steady_clock::now();
+
+            if(readRange(fs, *entry, 0, HEADER_READ_SIZE, HEADER_READ_SIZE, buffer))
+                ++count;
+
+            latency.record(elapsedUs(start));
+        }
+
+        return count;
+    }
+
+    // NLEs and hydration, several threads each working through whole frames in small reads
+    int concurrent(VirtualFileSystemImpl_MCRAW& fs, const std::vector<const Entry*>& frames, Histogram& latency) {
+        std::atomic<size_t> next(0);
+        std::atomic<int> count(0);
+        std::vector<std::thread> readers;
+
+        for(int i = 0; i < mArgs.readers; ++i) {
+            readers.emplace_back([&] {
+                std::vector<char> buffer;
+
+                for(size_t n = next++; n < frames.size(); n = next++) {
+                    const auto start = std::chrono::steady_clock::now();
+
+                    if(readRange(fs, *frames[n], 0, frames[n]->size, CONCURRENT_CHUNK_SIZE, buffer))
+                        ++count;
+
+                    latency.record(elapsedUs(start));
+                }
+            });
+        }
+
+        for(auto& reader : readers)
+            reader.join();
+
+        return count;
+    }
+
+    // Replays the trace under the options it was recorded with, unless others are given, next to
+    // what the trace itself measured. Frames are the DNGs read, latencies are per request
+    void replayTrace(std::vector<Result>& results) {
+        TraceReader reader(mArgs.replayPath);
+
+        std::vector<TraceRecord> records;
+        TraceRecord record;
+
+        while(reader.next(record))
+            records.push_back(record);
+
+        if(records.empty())
+            throw std::runtime_error("Trace is empty");
+
+        std::unordered_set<std::string> frames;
+        Histogram recordedLatency;
+        uint64_t endUs = 0;
+
+        for(const auto& r : records) {
+            if(r.op == TraceOp::Read && r.path.size() > 4 && r.path.compare(r.path.size() - 4, 4, ".dng") == 0)
+                frames.insert(r.path);
+
+            recordedLatency.record(r.latencyUs);
+            endUs = (std::max)(endUs, r.timeUs + r.latencyUs);
+        }
+
+        const auto seconds = (endUs - records.front().timeUs) / 1e6;
+
+        Result recorded;
+
+        recorded.options = optionsToString(reader.options());
+        recorded.pattern = "recorded";
+        recorded.frames = static_cast<int>(frames.size());
+        recorded.fps = seconds > 0 ? frames.size() / seconds : 0;
+        recorded.latency = recordedLatency.summarise();
+        recorded.failedReads = std::count_if(records.begin(), records.end(), [](const TraceRecord& r) {
+            return r.op == TraceOp::Read && r.result < 0;
+        });
+
+        results.push_back(std::move(recorded));
+
+        const int numFrames = static_cast<int>(frames.size());
+        auto replayed = [&](auto& fs, auto&, auto& latency) {
+            replay(fs, records, latency);
+            return numFrames;
+        };
+
+        if(mArgs.options.empty()) {
+            runPattern(getSettings(reader.options(), reader.draftScale()), "replay", results, replayed);
+        }
+        else {
+            for(auto options : mArgs.options)
+                runPattern(getSettings(options, mArgs.draftScale), "replay", results, replayed);
+        }
+    }
+
+    // Every thread of the trace gets a thread of its own that makes its requests at the times they were made
+    void replay(VirtualFileSystemImpl_MCRAW& fs, const std::vector<TraceRecord>& records, Histogram& latency) {
+        std::map<uint32_t, std::vector<const TraceRecord*>> threads;
+
+        for(const auto& r : records)
+            threads[r.thread].push_back(&r);
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto firstUs = records.front().timeUs;
+
+        std::vector<std::thread> replayers;
+
+        for(const auto& thread : threads) {
+            replayers.emplace_back([&, &requests = thread.second] {
+                std::vector<char> buffer;
+
+                for(const auto* r : requests) {
+                    if(mArgs.replaySpeed > 0) {
+                        const auto due = std::chrono::microseconds(static_cast<int64_t>((r->timeUs - firstUs) / mArgs.replaySpeed));
+                        std::this_thread::sleep_until(start + due);
+                    }
+
+                    const auto requestStart = std::chrono::steady_clock::now();
+                    const auto entry = fs.findEntry(r->path);
+
+                    if(entry && r->op == TraceOp::Read && r->offset < entry->size)
+                        readRange(fs, *entry, r->offset, r->length, (std::max)(r->length, 1u), buffer);
+
+                    latency.record(elapsedUs(requestStart));
+                }
+            });
+        }
+
+        for(auto& replayer : replayers)
+            replayer.join();
+    }
+
+private:
+    const Arguments& mArgs;
+    BS::thread_pool mIoThreadPool;
+    BS::thread_pool mProcessingThreadPool;
+    Scheduler mFrameScheduler;
+    BufferPool<char> mBufferPool;
+    BufferPool<uint8_t> mFrameBufferPool;
+};
+
+void printResults(const std::vector<Result>& results, bool csv) {
+    if(csv) {
+        std::cout << "options,pattern,frames,fps,p50Ms,p99Ms,maxMs,peakRssMB,failedReads\n";
+
+        for(const auto& r : results) {
+            std::cout << r.options << "," << r.pattern << "," << r.frames << "," << r.fps << ","
+                      << r.latency.p50Ms << "," << r.latency.p99Ms << "," << r.latency.maxMs << ","
+                      << r.peakRssBytes / (1024 * 1024) << "," << r.failedReads << "\n";
+        }
+
+        return;
+    }
+
+    std::printf("%-48s %-11s %7s %9s %9s %9s %10s %7s\n",
+                "Options", "Pattern", "Frames", "FPS", "p50 ms", "p99 ms", "Peak RSS", "Failed");
+
+    for(const auto& r : results) {
+        std::printf("%-48s %-11s %7d %9.1f %9.1f %9.1f %7zu MB %7llu\n",
+                    r.options.c_str(), r.pattern.c_str(), r.frames, r.fps, r.latency.p50Ms, r.latency.p99Ms,
+                    r.peakRssBytes / (1024 * 1024), static_cast<unsigned long long>(r.failedReads));
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    spdlog::set_level(spdlog::level::warn);
+
+    try {
+        const auto args = parseArguments(argc, argv);
+
+        Benchmark benchmark(args);
+        const auto results = benchmark.run();
+
+        printResults(results, args.csv);
+
+        // Any failed read is a regression, whatever the timings
+        const bool failed = std::any_of(results.begin(), results.end(), [](const Result& r) { return r.failedReads > 0; });
+
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    catch(std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n\n"
+                  << "usage: motioncam-fs-bench <file.mcraw> [--frames N] [--readers N] [--draft-scale N]\n"
+                  << "                          [--options FLAG,FLAG,...]... [--replay TRACE] [--replay-speed X] [--csv]\n";
+
+        return EXIT_FAILURE;
+    }
+}
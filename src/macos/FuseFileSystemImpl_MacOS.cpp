@@ -1,16 +1,28 @@
 #include "macos/FuseFileSystemImpl_MacOS.h"
 #include "VirtualFileSystemImpl_MCRAW.h"
 #include "LRUCache.h"
+#include "RawFrameCache.h"
+#include "BufferPool.h"
+#include "Scheduler.h"
+#include "CancellationToken.h"
+#include "AccessTrace.h"
 
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 #include <pwd.h>
 #include <unistd.h>
 
 #include <BS_thread_pool.hpp>
 #include <fuse_t/fuse_t.h>
+#include <fuse_t/fuse_lowlevel.h>
 #include <QDir>
 
 // Logging
@@ -23,10 +35,29 @@ namespace fs = boost::filesystem;
 namespace motioncam {
 
 constexpr auto CACHE_SIZE = 1024 * 1024 * 1024; // 1 GB cache size
-constexpr auto IO_THREADS = 4;
+constexpr auto HEADER_CACHE_SIZE = 64 * 1024 * 1024; // DNG headers are small, this holds a few thousand across all mounts
+constexpr auto RAW_FRAME_CACHE_SIZE = 512 * 1024 * 1024; // Decoded frames, so changing the options doesn't decode them again
+constexpr auto BUFFER_POOL_SIZE = 256 * 1024 * 1024; // Memory of released frames kept for new ones
+constexpr auto FRAME_BUFFER_POOL_SIZE = 256 * 1024 * 1024; // Memory of released decoded frames kept for new ones, across all mounts
+constexpr auto RENDER_MEMORY = 512 * 1024 * 1024; // Memory the frames being rendered may hold at once, across all mounts
+constexpr auto MIN_IO_THREADS = 4;
+constexpr auto MAX_IO_THREADS = 16;
+constexpr auto ROTATIONAL_IO_THREADS = 2;
 
 namespace {
 
+// Decoding mostly waits on reads, a fast drive keeps more threads busy than there are cores to spare
+int getDefaultIoThreads(StorageType storageType) {
+    if(storageType == StorageType::Rotational)
+        return ROTATIONAL_IO_THREADS;
+
+    return std::clamp(static_cast<int>(std::thread::hardware_concurrency()) / 4, MIN_IO_THREADS, MAX_IO_THREADS);
+}
+
+int getDefaultProcessingThreads() {
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
 std::string getLogDirectory() {
     std::string logPath;
 
@@ -79,51 +110,176 @@ void setupLogging() {
 
 //
 
+// Inode of the first file, FUSE_ROOT_ID is the mount point
+constexpr fuse_ino_t FIRST_FILE_INODE = FUSE_ROOT_ID + 1;
+
+// How long the kernel may keep attributes and names, updateOptions() invalidates them sooner
+constexpr double ATTR_TIMEOUT = 1.0;
+
 struct FuseContext {
     VirtualFileSystemImpl_MCRAW* fs;
     std::atomic_int nextFileHandle;
+    std::unique_ptr<TraceWriter> trace;  // Only when tracing is on
+
+    // Inodes are handed out by path, so they stay the same when updateOptions() replaces the entries
+    std::mutex inodeMutex;
+    std::unordered_map<std::string, fuse_ino_t> inodes;
+    std::vector<std::string> paths;     // Relative to the mount point
+
+    // Reads that have not been replied to yet. FUSE may still call the interrupt function of a
+    // read while it is being replied to, so it looks the token up here instead of being given it
+    std::mutex readMutex;
+    std::condition_variable readCondition;
+    int pendingReads = 0;
+    std::unordered_map<fuse_req_t, std::shared_ptr<CancellationToken>> readTokens;
+
+    fuse_ino_t getInode(const std::string& path) {
+        std::lock_guard<std::mutex> lock(inodeMutex);
+
+        auto it = inodes.find(path);
+        if(it != inodes.end())
+            return it->second;
+
+        const fuse_ino_t ino = FIRST_FILE_INODE + paths.size();
+
+        paths.push_back(path);
+        inodes[path] = ino;
+
+        return ino;
+    }
+
+    // Empty for the root, nullopt for inodes we never handed out
+    std::optional<std::string> getPath(fuse_ino_t ino) {
+        if(ino == FUSE_ROOT_ID)
+            return std::string();
+
+        std::lock_guard<std::mutex> lock(inodeMutex);
+
+        if(ino < FIRST_FILE_INODE || ino - FIRST_FILE_INODE >= paths.size())
+            return std::nullopt;
+
+        return paths[ino - FIRST_FILE_INODE];
+    }
+
+    std::vector<fuse_ino_t> getInodes() {
+        std::lock_guard<std::mutex> lock(inodeMutex);
+
+        std::vector<fuse_ino_t> result;
+        result.reserve(inodes.size());
+
+        for(const auto& [name, ino] : inodes)
+            result.push_back(ino);
+
+        return result;
+    }
+
+    std::shared_ptr<const Entry> findEntry(fuse_ino_t ino) {
+        const auto path = getPath(ino);
+        if(!path || path->empty())
+            return nullptr;
+
+        return fs->findEntry("/" + *path);
+    }
+
+    void beginRead(fuse_req_t req, std::shared_ptr<CancellationToken> cancel) {
+        std::lock_guard<std::mutex> lock(readMutex);
+
+        ++pendingReads;
+        readTokens[req] = std::move(cancel);
+    }
+
+    // Called just before replying, FUSE may reuse req for another request once it has been replied to
+    void detachRead(fuse_req_t req) {
+        std::lock_guard<std::mutex> lock(readMutex);
+        readTokens.erase(req);
+    }
+
+    void endRead() {
+        std::lock_guard<std::mutex> lock(readMutex);
+
+        if(--pendingReads == 0)
+            readCondition.notify_all();
+    }
+
+    void cancelRead(fuse_req_t req) {
+        std::shared_ptr<CancellationToken> cancel;
+
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+
+            auto it = readTokens.find(req);
+            if(it == readTokens.end())
+                return;
+
+            cancel = it->second;
+        }
+
+        cancel->cancel();
+    }
+
+    void waitForReads() {
+        std::unique_lock<std::mutex> lock(readMutex);
+        readCondition.wait(lock, [this] { return pendingReads == 0; });
+    }
 };
 
 class Session {
 public:
-    Session(const std::string& srcFile, const std::string& dstPath, VirtualFileSystemImpl_MCRAW* fs);
+    Session(
+        const std::string& srcFile,
+        const std::string& dstPath,
+        VirtualFileSystemImpl_MCRAW* fs,
+        std::unique_ptr<TraceWriter> trace);
     ~Session();
 
     void updateOptions(const RenderSettings& settings);
 
     FileInfo getFileInfo() const;
+    MetricsSnapshot getMetrics() const;
 
 private:
-    void init(VirtualFileSystemImpl_MCRAW* fs);
-
-    void fuseMain(struct fuse_chan* ch, struct fuse* fuse);
-
-    static void* fuseInit(struct fuse_conn_info* conn);
-    static void fuseDestroy(void* privateData);
-    static int fuseRelease(const char* path, struct fuse_file_info* fi);
-    static int fuseGetattr(const char* path, struct stat* stbuf);
-    static int fuseReaddir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi);
-    static int fuseOpen(const char* path, struct fuse_file_info* fi);
-    static int fuseRead(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi);
+    void init(VirtualFileSystemImpl_MCRAW* fs, std::unique_ptr<TraceWriter> trace);
+
+    void fuseMain(struct fuse_chan* ch, struct fuse_session* session, FuseContext* context);
+
+    // Low level callbacks reply to the request themselves, so reads can be answered from
+    // the processing threads once the frame is ready instead of blocking a FUSE thread
+    static void fuseInit(void* userData, struct fuse_conn_info* conn);
+    static void fuseDestroy(void* userData);
+    static void fuseLookup(fuse_req_t req, fuse_ino_t parent, const char* name);
+    static void fuseGetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+    static void fuseOpendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+    static void fuseReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi);
+    static void fuseReleasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+    static void fuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+    static void fuseRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi);
+    static void fuseRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+    static void fuseInterrupt(fuse_req_t req, void* data);
 
 private:
     std::string mSrcFile;
     std::string mDstPath;
     std::unique_ptr<std::thread> mThread;
     VirtualFileSystemImpl_MCRAW* mFs;
+    FuseContext* mContext;
     struct fuse_chan* mFuseCh;
-    struct fuse* mFuse;
+    struct fuse_session* mFuseSession;
 };
 
 
-Session::Session(const std::string& srcFile, const std::string& dstPath, VirtualFileSystemImpl_MCRAW* fs) :
+Session::Session(
+    const std::string& srcFile,
+    const std::string& dstPath,
+    VirtualFileSystemImpl_MCRAW* fs,
+    std::unique_ptr<TraceWriter> trace) :
     mSrcFile(srcFile),
     mDstPath(dstPath),
     mFs(fs),
+    mContext(nullptr),
     mFuseCh(nullptr),
-    mFuse(nullptr)
+    mFuseSession(nullptr)
 {
-    init(fs);
+    init(fs, std::move(trace));
 }
 
 Session::~Session() {
@@ -141,7 +297,8 @@ Session::~Session() {
     }
 
     mFuseCh = nullptr;
-    mFuse = nullptr;
+    mFuseSession = nullptr;
+    mContext = nullptr;
 
     if(mThread && mThread->joinable())
         mThread->join();
@@ -154,17 +311,20 @@ Session::~Session() {
     spdlog::debug("Exiting session for {}", mSrcFile);
 }
 
-void Session::init(VirtualFileSystemImpl_MCRAW* fs) {
+void Session::init(VirtualFileSystemImpl_MCRAW* fs, std::unique_ptr<TraceWriter> trace) {
     // FUSE operations structure
-    struct fuse_operations ops = {};
+    struct fuse_lowlevel_ops ops = {};
 
     ops.init = fuseInit;
     ops.destroy = fuseDestroy;
-    ops.release = fuseRelease;
+    ops.lookup = fuseLookup;
     ops.getattr = fuseGetattr;
+    ops.opendir = fuseOpendir;
     ops.readdir = fuseReaddir;
+    ops.releasedir = fuseReleasedir;
     ops.open = fuseOpen;
     ops.read = fuseRead;
+    ops.release = fuseRelease;
 
     struct fuse_args args = FUSE_ARGS_INIT(0, nullptr);
 
@@ -187,23 +347,30 @@ void Session::init(VirtualFileSystemImpl_MCRAW* fs) {
 
     context->fs = fs;
     context->nextFileHandle = 0;
+    context->trace = std::move(trace);
 
     struct fuse_chan* ch = fuse_mount(mDstPath.c_str(), &args);
-    struct fuse* fuse = fuse_new(ch, &args, &ops, sizeof(ops), context);
+    struct fuse_session* session = ch ? fuse_lowlevel_new(&args, &ops, sizeof(ops), context) : nullptr;
 
     // Clean up
     fuse_opt_free_args(&args);
 
-    if (fuse == nullptr) {
+    if (session == nullptr) {
+        if(ch)
+            fuse_unmount(mDstPath.c_str(), ch);
+
         delete context;
         throw std::runtime_error("Failed to create mount point (path: " + mDstPath + ")");
     }
 
+    fuse_session_add_chan(session, ch);
+
     mFuseCh = ch;
-    mFuse = fuse;
+    mFuseSession = session;
+    mContext = context;
 
     // Start fuse thread
-    mThread = std::make_unique<std::thread>(&Session::fuseMain, this, ch, fuse);
+    mThread = std::make_unique<std::thread>(&Session::fuseMain, this, ch, session, context);
 
 }
 
@@ -211,37 +378,77 @@ void Session::updateOptions(const RenderSettings& settings)
 {
     mFs->updateOptions(settings);
 
-    fuse_invalidate_path(mFuse, mDstPath.c_str());
+    if(!mFuseCh)
+        return;
+
+    // Sizes and the file list may have changed
+    fuse_lowlevel_notify_inval_inode(mFuseCh, FUSE_ROOT_ID, 0, 0);
+
+    for(auto ino : mContext->getInodes())
+        fuse_lowlevel_notify_inval_inode(mFuseCh, ino, 0, 0);
 }
 
 FileInfo Session::getFileInfo() const {
     return mFs->getFileInfo();
 }
 
-void Session::fuseMain(struct fuse_chan* ch, struct fuse* fuse) {
-    int res = fuse_loop_mt(fuse);
+MetricsSnapshot Session::getMetrics() const {
+    return mFs->getMetrics();
+}
+
+void Session::fuseMain(struct fuse_chan* ch, struct fuse_session* session, FuseContext* context) {
+    int res = fuse_session_loop_mt(session);
+
+    // Reads still being generated reply through the channel
+    context->waitForReads();
 
-    fuse_destroy(fuse);
+    fuse_session_remove_chan(ch);
+    fuse_session_destroy(session);
 
     spdlog::info("Fuse has exited with code {}", res);
 }
 
-FuseContext* fuseGetContext() {
-    auto context = fuse_get_context();
+FuseContext* fuseGetContext(fuse_req_t req) {
+    return reinterpret_cast<FuseContext*>(fuse_req_userdata(req));
+}
+
+void fillStat(const Entry& entry, fuse_ino_t ino, struct stat* stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+
+    stbuf->st_ino = ino;
+
+    if(entry.type == EntryType::DIRECTORY_ENTRY) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+        stbuf->st_size = 4096;
+    }
+    else {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = entry.size;
 
-    return reinterpret_cast<FuseContext*>(context->private_data);
+        stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+    }
 }
 
-void* Session::fuseInit(struct fuse_conn_info* conn) {
-    auto context = fuse_get_context();
+void fillRootStat(struct stat* stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+
+    stbuf->st_ino = FUSE_ROOT_ID;
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+}
 
-    return context->private_data;
+void Session::fuseInit(void* userData, struct fuse_conn_info* conn) {
 }
 
-void Session::fuseDestroy(void* privateData) {
+void Session::fuseDestroy(void* userData) {
     spdlog::debug("fuseDestroy() entering");
 
-    auto* context = reinterpret_cast<FuseContext*>(privateData);
+    auto* context = reinterpret_cast<FuseContext*>(userData);
 
     if(context->fs)
         delete context->fs;
@@ -254,124 +461,257 @@ void Session::fuseDestroy(void* privateData) {
     spdlog::debug("fuseDestroy() exiting");
 }
 
-int Session::fuseGetattr(const char* path, struct stat* stbuf) {
-    spdlog::debug("fuse_get_attr(path: {})", path);
+void Session::fuseLookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    spdlog::debug("fuse_lookup(parent: {}, name: {})", parent, name);
 
-    memset(stbuf, 0, sizeof(struct stat));
+    auto* context = fuseGetContext(req);
+    auto parentPath = context->getPath(parent);
+
+    if(!parentPath) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    const auto relativePath = parentPath->empty() ? std::string(name) : *parentPath + "/" + name;
+    const auto path = "/" + relativePath;
+
+    std::optional<TraceWriter::Event> traced;
+    if(context->trace)
+        traced = context->trace->begin(TraceOp::GetAttr, path);
+
+    auto entry = context->fs->findEntry(path);
+
+    if(!entry) {
+        fuse_reply_err(req, ENOENT);
 
-    auto* context = fuseGetContext();
-    std::string pathStr(path);
+        if(traced)
+            context->trace->end(*traced, -ENOENT);
+        return;
+    }
+
+    struct fuse_entry_param param = {};
+
+    param.ino = context->getInode(relativePath);
+    param.attr_timeout = ATTR_TIMEOUT;
+    param.entry_timeout = ATTR_TIMEOUT;
+
+    fillStat(*entry, param.ino, &param.attr);
+
+    fuse_reply_entry(req, &param);
+
+    if(traced)
+        context->trace->end(*traced, 0);
+}
+
+void Session::fuseGetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    spdlog::debug("fuse_get_attr(ino: {})", ino);
+
+    struct stat stbuf;
 
     // Root directory
-    if (pathStr == "/" || pathStr == "//") {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
+    if(ino == FUSE_ROOT_ID) {
+        fillRootStat(&stbuf);
+        fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+        return;
+    }
+
+    auto* context = fuseGetContext(req);
+    auto entry = context->findEntry(ino);
 
-        return 0;
+    if(!entry) {
+        fuse_reply_err(req, ENOENT);
+        return;
     }
-    else {
-        auto entry = context->fs->findEntry(pathStr);
 
-        if(!entry.has_value())
-            return -ENOENT;
+    std::optional<TraceWriter::Event> traced;
+    if(context->trace)
+        traced = context->trace->begin(TraceOp::GetAttr, "/" + entry->getFullPath().string());
 
-        if(entry->type == EntryType::DIRECTORY_ENTRY) {
-            stbuf->st_mode = S_IFDIR | 0755;
-            stbuf->st_nlink = 2;
-            stbuf->st_mtime = stbuf->st_ctime = time(NULL);
-            stbuf->st_size = 4096;
-        }
-        else if(entry->type == EntryType::FILE_ENTRY) {
-            stbuf->st_mode = S_IFREG | 0644;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = entry->size;
-
-            stbuf->st_mtime = stbuf->st_ctime = time(NULL);
-            stbuf->st_uid = getuid();
-            stbuf->st_gid = getgid();
-        }
+    fillStat(*entry, ino, &stbuf);
+
+    fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
 
-        return 0;
+    if(traced)
+        context->trace->end(*traced, 0);
+}
+
+void Session::fuseOpendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    if(ino != FUSE_ROOT_ID) {
+        auto entry = fuseGetContext(req)->findEntry(ino);
+
+        if(!entry || entry->type != EntryType::DIRECTORY_ENTRY) {
+            fuse_reply_err(req, entry ? ENOTDIR : ENOENT);
+            return;
+        }
     }
 
-    return -ENOENT;
+    fuse_reply_open(req, fi);
 }
 
-int Session::fuseReaddir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
-    spdlog::debug("fuse_read_dir(path: {})", path);
+void Session::fuseReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+    spdlog::debug("fuse_read_dir(ino: {}, offset: {})", ino, offset);
+
+    auto* context = fuseGetContext(req);
+    auto directory = context->getPath(ino);
+    auto directoryEntry = context->findEntry(ino);
 
-    auto* context = fuseGetContext();
-    std::string pathStr(path);
+    if(!directory || (ino != FUSE_ROOT_ID && (!directoryEntry || directoryEntry->type != EntryType::DIRECTORY_ENTRY))) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
 
-    if(pathStr == "//" || pathStr == "/") {
-        filler(buf, ".", nullptr, 0);
-        filler(buf, "..", nullptr, 0);
+    std::vector<char> buf(size);
+    size_t used = 0;
 
-        auto files = context->fs->listFiles("/");
-        for(auto& entry : files) {
-            filler(buf, entry.getFullPath().c_str(), nullptr, 0);
-        }
+    // Adds an entry if it fits, the offset is where the listing continues after it
+    auto add = [&](const char* name, const struct stat& stbuf, off_t nextOffset) {
+        const size_t entrySize = fuse_add_direntry(req, buf.data() + used, size - used, name, &stbuf, nextOffset);
+        if(entrySize > size - used)
+            return false;
+
+        used += entrySize;
+        return true;
+    };
+
+    // Offsets 1 and 2 are "." and "..", entries from the file system follow
+    constexpr off_t FirstEntryOffset = 2;
+
+    struct stat stbuf;
+
+    if(directoryEntry)
+        fillStat(*directoryEntry, ino, &stbuf);
+    else
+        fillRootStat(&stbuf);
 
-        return 0;
+    if(offset < 1 && !add(".", stbuf, 1)) {
+        fuse_reply_buf(req, buf.data(), used);
+        return;
     }
 
-    return -ENOENT;
+    // Folders are only ever one level down
+    fillRootStat(&stbuf);
+
+    if(offset < 2 && !add("..", stbuf, 2)) {
+        fuse_reply_buf(req, buf.data(), used);
+        return;
+    }
+
+    const size_t start = offset > FirstEntryOffset ? static_cast<size_t>(offset - FirstEntryOffset) : 0;
+
+    const auto prefix = directory->empty() ? std::string() : *directory + "/";
+
+    context->fs->listFiles(*directory, "", start, [&](const Entry& entry, size_t nextOffset) {
+        fillStat(entry, context->getInode(prefix + entry.name), &stbuf);
+
+        return add(entry.name.c_str(), stbuf, static_cast<off_t>(nextOffset) + FirstEntryOffset);
+    });
+
+    fuse_reply_buf(req, buf.data(), used);
 }
 
-int Session::fuseOpen(const char* path, struct fuse_file_info* fi) {
-    spdlog::debug("fuse_open(path: {})", path);
+void Session::fuseReleasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    fuse_reply_err(req, 0);
+}
 
-    auto* context = fuseGetContext();
-    std::string pathStr(path);
+void Session::fuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    spdlog::debug("fuse_open(ino: {})", ino);
 
-    auto entry = context->fs->findEntry(pathStr);
+    auto* context = fuseGetContext(req);
+    auto entry = context->findEntry(ino);
 
-    if(!entry.has_value())
-        return -ENOENT;
+    if(!entry) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
     // Only allow read access
-    if ((fi->flags & 3) != O_RDONLY)
-        return -EACCES;
-
+    if ((fi->flags & 3) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
 
     // Set file handle
     fi->fh = ++context->nextFileHandle;
 
-    return 0;
+    fuse_reply_open(req, fi);
 }
 
-int Session::fuseRead(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    spdlog::debug("fuse_read(path: {}, size: {}, offset: {})", path, size, offset);
+void Session::fuseRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+    spdlog::debug("fuse_read(ino: {}, size: {}, offset: {})", ino, size, offset);
+
+    auto* context = fuseGetContext(req);
+    auto entry = context->findEntry(ino);
+
+    if(!entry) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    // Nothing to generate past the end of the file
+    if(size == 0 || offset < 0 || static_cast<size_t>(offset) >= entry->size) {
+        fuse_reply_buf(req, nullptr, 0);
+        return;
+    }
+
+    auto buffer = std::make_shared<std::vector<char>>((std::min)(size, entry->size - static_cast<size_t>(offset)));
+
+    auto cancel = std::make_shared<CancellationToken>();
+
+    context->beginRead(req, cancel);
+
+    std::optional<TraceWriter::Event> traced;
+    if(context->trace)
+        traced = context->trace->begin(TraceOp::Read, "/" + entry->getFullPath().string(), offset, static_cast<uint32_t>(size));
+
+    auto reply = [req, buffer, context, cancel, traced](size_t readBytes, int error) {
+        context->detachRead(req);
+
+        if(error != 0)
+            fuse_reply_err(req, cancel->isCancelled() ? EINTR : EIO);
+        else
+            fuse_reply_buf(req, buffer->data(), readBytes);
 
-    auto* context = fuseGetContext();
-    std::string pathStr(path);
+        if(traced)
+            context->trace->end(*traced, error != 0 ? -1 : static_cast<int32_t>(readBytes));
 
-    auto entry = context->fs->findEntry(pathStr);
+        context->endRead();
+    };
 
-    if(!entry.has_value())
-        return -ENOENT;
+    // The kernel interrupts reads when the process that made them is killed or gives up waiting.
+    // Set before reading, a read that is already interrupted is cancelled straight away
+    fuse_req_interrupt_func(req, fuseInterrupt, context);
 
-    return context->fs->readFile(
-        entry.value(),
-        offset,
-        size,
-        buf,
-        [](auto a, auto b) {},
-        false
-        );
+    // Frames that are not ready reply from the processing threads, anything else is read straight away
+    const int result = context->fs->readFile(*entry, offset, buffer->size(), buffer->data(), reply, true, cancel);
+
+    if(result > 0)
+        reply(result, 0);
+    else if(result < 0)
+        reply(0, -1);
 }
 
-int Session::fuseRelease(const char* path, struct fuse_file_info* fi) {
-    return 0;
+void Session::fuseRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    fuse_reply_err(req, 0);
+}
+
+void Session::fuseInterrupt(fuse_req_t req, void* data) {
+    spdlog::debug("fuse_interrupt()");
+
+    static_cast<FuseContext*>(data)->cancelRead(req);
 }
 
 //
 
 FuseFileSystemImpl_MacOs::FuseFileSystemImpl_MacOs() :
     mNextMountId(0),
-    mIoThreadPool(std::make_unique<BS::thread_pool>(IO_THREADS)),
-    mProcessingThreadPool(std::make_unique<BS::thread_pool>()),
-    mCache(std::make_unique<LRUCache>(CACHE_SIZE))
+    mIoThreadPool(std::make_unique<BS::thread_pool>(getDefaultIoThreads(StorageType::SolidState))),
+    mProcessingThreadPool(std::make_unique<BS::thread_pool>(getDefaultProcessingThreads())),
+    mFrameScheduler(std::make_unique<Scheduler>(*mIoThreadPool, RENDER_MEMORY)),
+    mBufferPool(std::make_unique<BufferPool<char>>(BUFFER_POOL_SIZE)),
+    mFrameBufferPool(std::make_unique<BufferPool<uint8_t>>(FRAME_BUFFER_POOL_SIZE)),
+    mCache(std::make_unique<LRUCache>(CACHE_SIZE)),
+    mHeaderCache(std::make_unique<LRUCache>(HEADER_CACHE_SIZE)),
+    mRawFrameCache(std::make_unique<RawFrameCache>(RAW_FRAME_CACHE_SIZE))
 {
     setupLogging();
 }
@@ -410,8 +750,6 @@ MountId FuseFileSystemImpl_MacOs::mount(
     }
 
     if(boost::iequals(extension, ".mcraw")) {
-        auto mountId = mNextMountId++;
-
         void* stack_addr = nullptr;
         size_t stack_size = 0;
 
@@ -420,17 +758,27 @@ MountId FuseFileSystemImpl_MacOs::mount(
             fs::path dstPathObj(dstPath);
             std::string baseName = dstPathObj.filename().string();
 
+            // Keep the clip index next to the mount point
+            auto indexPath = dstPathObj.parent_path() / ("." + baseName + ".index");
+
             auto* fs =
                 new VirtualFileSystemImpl_MCRAW(
                     *mIoThreadPool,
                     *mProcessingThreadPool,
                     *mCache,
+                    *mHeaderCache,
+                    *mRawFrameCache,
+                    *mBufferPool,
+                    *mFrameBufferPool,
+                    *mFrameScheduler,
                     settings,
                     srcFile,
-                    baseName
+                    baseName,
+                    indexPath.string()
                 );
 
-            auto session = std::make_unique<Session>(srcFile, dstPath, fs);
+            auto session = std::make_unique<Session>(
+                srcFile, dstPath, fs, createTrace(baseName, settings.options, settings.draftScale));
 
             if(!session) {
                 spdlog::error("Failed to mount {} to {}", srcFile, dstPath);
@@ -438,15 +786,19 @@ MountId FuseFileSystemImpl_MacOs::mount(
                 throw std::runtime_error("Failed to session");
             }
 
+            // Scanning the clip is the slow part, only registering it needs the lock
+            std::lock_guard<std::mutex> lock(mMountMutex);
+
+            auto mountId = mNextMountId++;
             mMountedFiles[mountId] = std::move(session);
+
+            return mountId;
         }
         catch(std::runtime_error& e) {
             spdlog::error("Failed to mount {} to {} (error: {})", srcFile, dstPath, e.what());
 
             throw std::runtime_error(e.what());
         }
-
-        return mountId;
     }
 
     spdlog::error("Failed to mount {} to {}, invalid file format", srcFile, dstPath);
@@ -455,16 +807,29 @@ MountId FuseFileSystemImpl_MacOs::mount(
 }
 
 void FuseFileSystemImpl_MacOs::unmount(MountId mountId) {
-    auto it = mMountedFiles.find(mountId);
-    if(it != mMountedFiles.end()) {
+    std::unique_ptr<Session> session;
+
+    {
+        std::lock_guard<std::mutex> lock(mMountMutex);
+
+        auto it = mMountedFiles.find(mountId);
+        if(it == mMountedFiles.end())
+            return;
+
+        session = std::move(it->second);
         mMountedFiles.erase(it);
     }
+
+    // Stopping the session waits for its reads, don't hold up other mounts meanwhile
+    session.reset();
 }
 
 void FuseFileSystemImpl_MacOs::updateOptions(
     MountId mountId,
     const RenderSettings& settings)
 {
+    std::lock_guard<std::mutex> lock(mMountMutex);
+
     auto it = mMountedFiles.find(mountId);
     if(it != mMountedFiles.end()) {
         it->second->updateOptions(settings);
@@ -472,6 +837,8 @@ void FuseFileSystemImpl_MacOs::updateOptions(
 }
 
 std::optional<FileInfo> FuseFileSystemImpl_MacOs::getFileInfo(MountId mountId) {
+    std::lock_guard<std::mutex> lock(mMountMutex);
+
     auto it = mMountedFiles.find(mountId);
     if(it != mMountedFiles.end()) {
         return it->second->getFileInfo();
@@ -479,4 +846,89 @@ std::optional<FileInfo> FuseFileSystemImpl_MacOs::getFileInfo(MountId mountId) {
     return std::nullopt;
 }
 
+std::optional<MetricsSnapshot> FuseFileSystemImpl_MacOs::getMetrics(MountId mountId) {
+    std::optional<MetricsSnapshot> snapshot;
+
+    {
+        std::lock_guard<std::mutex> lock(mMountMutex);
+
+        auto it = mMountedFiles.find(mountId);
+        if(it == mMountedFiles.end())
+            return std::nullopt;
+
+        snapshot = it->second->getMetrics();
+    }
+
+    snapshot->cacheEvictions = mCache->evictions();
+    snapshot->cacheEvictedBytes = mCache->evictedBytes();
+    snapshot->cacheSize = mCache->size();
+    snapshot->cacheCapacity = mCache->capacity();
+    snapshot->rawFrameCacheSize = mRawFrameCache->size();
+    snapshot->rawFrameCacheCapacity = mRawFrameCache->capacity();
+    snapshot->ioTasksQueued = mIoThreadPool->get_tasks_queued();
+    snapshot->ioTasksRunning = mIoThreadPool->get_tasks_running();
+    snapshot->processingTasksQueued = mProcessingThreadPool->get_tasks_queued();
+    snapshot->processingTasksRunning = mProcessingThreadPool->get_tasks_running();
+
+    return snapshot;
+}
+
+void FuseFileSystemImpl_MacOs::setDiskCache(const std::string& path, size_t maxSize) {
+    if(path.empty() || maxSize == 0) {
+        mCache->setDiskCache(nullptr);
+        return;
+    }
+
+    auto diskCache = mCache->getDiskCache();
+    if(diskCache && diskCache->path() == path && diskCache->capacity() == maxSize)
+        return;
+
+    spdlog::info("Using disk cache {} ({} bytes)", path, maxSize);
+
+    mCache->setDiskCache(std::make_shared<DiskCache>(path, maxSize, *mIoThreadPool, mBufferPool.get()));
+}
+
+void FuseFileSystemImpl_MacOs::setCacheSize(size_t maxSize) {
+    if(maxSize == 0)
+        maxSize = CACHE_SIZE;
+
+    spdlog::info("Setting cache size to {} bytes", maxSize);
+
+    mCache->setCapacity(maxSize);
+}
+
+void FuseFileSystemImpl_MacOs::setRawFrameCacheSize(size_t maxSize) {
+    if(maxSize == 0)
+        maxSize = RAW_FRAME_CACHE_SIZE;
+
+    spdlog::info("Setting decoded frame cache size to {} bytes", maxSize);
+
+    mRawFrameCache->setCapacity(maxSize);
+}
+
+void FuseFileSystemImpl_MacOs::setThreadPoolSizes(int ioThreads, int processingThreads, StorageType storageType) {
+    const auto numIoThreads = ioThreads > 0 ? ioThreads : getDefaultIoThreads(storageType);
+    const auto numProcessingThreads = processingThreads > 0 ? processingThreads : getDefaultProcessingThreads();
+
+    // Resetting a pool waits for the tasks that are running, so leave it alone if the size is the same
+    if(mIoThreadPool->get_thread_count() != static_cast<BS::concurrency_t>(numIoThreads)) {
+        spdlog::info("Using {} IO threads", numIoThreads);
+        mIoThreadPool->reset(numIoThreads);
+    }
+
+    if(mProcessingThreadPool->get_thread_count() != static_cast<BS::concurrency_t>(numProcessingThreads)) {
+        spdlog::info("Using {} processing threads", numProcessingThreads);
+        mProcessingThreadPool->reset(numProcessingThreads);
+    }
+}
+
+// Reads are answered from the cache every time, FUSE doesn't keep the files anywhere to hydrate
+bool FuseFileSystemImpl_MacOs::setPreHydrate(MountId, bool) {
+    return false;
+}
+
+std::optional<HydrationProgress> FuseFileSystemImpl_MacOs::getHydrationProgress(MountId) {
+    return std::nullopt;
+}
+
 } // namespace motioncam
@@ -11,18 +11,130 @@
 #include <QFileDialog>
 #include <QSettings>
 #include <QDir>
+#include <QStandardPaths>
 #include <algorithm>
 #include <QTimer>
+#include <QLabel>
+#include <QFile>
 
 #ifdef _WIN32
 #include "win/FuseFileSystemImpl_Win.h"
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
 #elif __APPLE__
 #include "macos/FuseFileSystemImpl_MacOS.h"
+
+#include <sys/sysctl.h>
 #endif
 
 namespace {
     constexpr auto PACKAGE_NAME = "com.motioncam";
     constexpr auto APP_NAME = "MotionCam FS";
+    constexpr auto DEFAULT_DISK_CACHE_SIZE_GB = 32;
+    constexpr auto MAX_CACHE_PERCENT_OF_RAM = 90.0;
+
+    // Clips scanned at the same time when several are dropped at once
+    constexpr auto MAX_PARALLEL_MOUNTS = 4;
+
+    constexpr auto STATS_INTERVAL_MS = 1000;
+
+    QString getInfoText(const motioncam::FileInfo& info) {
+        return QString("Median / Average / Target FPS: %1 / %2 -> %3 | Framecount: %4 | Dropped: -%5 | Duplicated: +%6 | Resolution: %7x%8")
+            .arg(QString::number(info.medFps, 'f', 2))
+            .arg(QString::number(info.avgFps, 'f', 2))
+            .arg(QString::number(info.fps, 'f', 2))
+            .arg(info.totalFrames)
+            .arg(info.droppedFrames)
+            .arg(info.duplicatedFrames)
+            .arg(info.width)
+            .arg(info.height);
+    }
+
+    QString getStatsText(const motioncam::MetricsSnapshot& stats, double bytesPerSecond) {
+        const auto lookups = stats.cacheHits + stats.cacheMisses + stats.cacheWaits;
+        const double hitRate = lookups > 0 ? 100.0 * stats.cacheHits / lookups : 0.0;
+
+        return QString("Cache: %1% hits, %2 MB | Decode / Process / Encode / DNG: %3 / %4 / %5 / %6 ms | "
+                       "Wait p95: %7 ms | %8 MB/s | IO: %9+%10 | Processing: %11+%12")
+            .arg(QString::number(hitRate, 'f', 0))
+            .arg(stats.cachedBytes / (1024 * 1024))
+            .arg(QString::number(stats.decode.meanMs, 'f', 1))
+            .arg(QString::number(stats.preprocess.meanMs, 'f', 1))
+            .arg(QString::number(stats.encode.meanMs, 'f', 1))
+            .arg(QString::number(stats.generateDng.meanMs, 'f', 1))
+            .arg(QString::number(stats.readWait.p95Ms, 'f', 1))
+            .arg(QString::number(bytesPerSecond / (1024 * 1024), 'f', 1))
+            .arg(stats.ioTasksRunning)
+            .arg(stats.ioTasksQueued)
+            .arg(stats.processingTasksRunning)
+            .arg(stats.processingTasksQueued);
+    }
+
+    QString getHydrationText(const motioncam::HydrationProgress& progress, double bytesPerSecond) {
+        const auto rate = progress.running
+            ? QString(", %1 MB/s").arg(QString::number(bytesPerSecond / (1024 * 1024), 'f', 1))
+            : QString();
+
+        return QString(" | Hydrated: %1 / %2%3")
+            .arg(progress.hydratedFiles)
+            .arg(progress.totalFiles)
+            .arg(rate);
+    }
+
+    size_t getPhysicalMemory() {
+#ifdef _WIN32
+        MEMORYSTATUSEX status;
+        status.dwLength = sizeof(status);
+
+        return GlobalMemoryStatusEx(&status) ? static_cast<size_t>(status.ullTotalPhys) : 0;
+#elif __APPLE__
+        uint64_t memSize = 0;
+        size_t len = sizeof(memSize);
+
+        return sysctlbyname("hw.memsize", &memSize, &len, nullptr, 0) == 0 ? static_cast<size_t>(memSize) : 0;
+#else
+        return 0;
+#endif
+    }
+
+    // Accepts "Default", "<n> MB", "<n> GB" or "<n>% of RAM", returns 0 for the default size
+    size_t parseCacheSize(const QString& text) {
+        auto value = text.trimmed();
+        bool ok = false;
+
+        if(value.endsWith("% of RAM", Qt::CaseInsensitive)) {
+            auto percent = value.chopped(8).trimmed().toDouble(&ok);
+            if(!ok || percent <= 0)
+                return 0;
+
+            return static_cast<size_t>(getPhysicalMemory() * std::min(percent, MAX_CACHE_PERCENT_OF_RAM) / 100.0);
+        }
+
+        double unit = 1024.0 * 1024.0;
+
+        if(value.endsWith("GB", Qt::CaseInsensitive)) {
+            unit *= 1024.0;
+            value.chop(2);
+        }
+        else if(value.endsWith("MB", Qt::CaseInsensitive)) {
+            value.chop(2);
+        }
+
+        auto amount = value.trimmed().toDouble(&ok);
+
+        return ok && amount > 0 ? static_cast<size_t>(amount * unit) : 0;
+    }
+
+    // Accepts "Auto" or a number of threads, returns 0 for auto
+    int parseThreadCount(const QString& text) {
+        bool ok = false;
+        auto count = text.trimmed().toInt(&ok);
+
+        return ok && count > 0 ? count : 0;
+    }
 
     motioncam::FileRenderOptions getRenderOptions(Ui::MainWindow& ui) {
         motioncam::FileRenderOptions options = motioncam::RENDER_OPT_NONE;
@@ -60,6 +172,12 @@ namespace {
         if(ui.quadBayerCheckBox->checkState() == Qt::CheckState::Checked)
             options |= motioncam::RENDER_OPT_INTERPRET_AS_QUAD_BAYER;
 
+        if(ui.proxyFolderCheckBox->checkState() == Qt::CheckState::Checked)
+            options |= motioncam::RENDER_OPT_PROXY_FOLDER;
+
+        if(ui.losslessCompressionCheckBox->checkState() == Qt::CheckState::Checked)
+            options |= motioncam::RENDER_OPT_LOSSLESS_COMPRESSION;
+
         return options;
     }
 }
@@ -67,10 +185,17 @@ namespace {
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
+    , mDiskCacheSizeGb(DEFAULT_DISK_CACHE_SIZE_GB)
     , mDraftQuality(1)
 {
     ui->setupUi(this);
 
+    mMountThreadPool.setMaxThreadCount(MAX_PARALLEL_MOUNTS);
+
+    auto* statsTimer = new QTimer(this);
+    connect(statsTimer, &QTimer::timeout, this, &MainWindow::updateStatsLabels);
+    statsTimer->start(STATS_INTERVAL_MS);
+
 #ifdef _WIN32
     mFuseFilesystem = std::make_unique<motioncam::FuseFileSystemImpl_Win>();
 #elif __APPLE__
@@ -95,6 +220,8 @@ MainWindow::MainWindow(QWidget *parent)
     connect(ui->camModelOverrideCheckBox, &QCheckBox::checkStateChanged, this, &MainWindow::onRenderSettingsChanged);
     connect(ui->logTransformCheckBox, &QCheckBox::checkStateChanged, this, &MainWindow::onRenderSettingsChanged);
     connect(ui->quadBayerCheckBox, &QCheckBox::checkStateChanged, this, &MainWindow::onRenderSettingsChanged);
+    connect(ui->losslessCompressionCheckBox, &QCheckBox::checkStateChanged, this, &MainWindow::onRenderSettingsChanged);
+    connect(ui->proxyFolderCheckBox, &QCheckBox::checkStateChanged, this, &MainWindow::onRenderSettingsChanged);
     
     connect(ui->draftQuality, &QComboBox::currentIndexChanged, this, &MainWindow::onDraftModeQualityChanged);
     connect(ui->cfrTarget, &QComboBox::currentTextChanged, this, [this](const QString& text) {
@@ -121,10 +248,19 @@ MainWindow::MainWindow(QWidget *parent)
     });
 
     connect(ui->changeCacheBtn, &QPushButton::clicked, this, &MainWindow::onSetCacheFolder);
+    connect(ui->diskCacheCheckBox, &QCheckBox::checkStateChanged, this, &MainWindow::updateDiskCache);
+    connect(ui->cacheSizeComboBox, &QComboBox::currentTextChanged, this, &MainWindow::updatePerformanceSettings);
+    connect(ui->rawFrameCacheSizeComboBox, &QComboBox::currentTextChanged, this, &MainWindow::updatePerformanceSettings);
+    connect(ui->storageTypeComboBox, &QComboBox::currentTextChanged, this, &MainWindow::updatePerformanceSettings);
+    connect(ui->ioThreadsComboBox, &QComboBox::currentTextChanged, this, &MainWindow::updatePerformanceSettings);
+    connect(ui->processingThreadsComboBox, &QComboBox::currentTextChanged, this, &MainWindow::updatePerformanceSettings);
     connect(ui->defaultBtn, &QPushButton::clicked, this, &MainWindow::onSetDefaultSettings);
 }
 
 MainWindow::~MainWindow() {
+    // Mounts that finish now are not added to the list, they are saved as pending
+    mMountThreadPool.waitForDone();
+
     saveSettings();
 
     delete ui;
@@ -143,7 +279,16 @@ void MainWindow::saveSettings() {
     settings.setValue("camModelOverrideEnabled", ui->camModelOverrideCheckBox->checkState() == Qt::CheckState::Checked);
     settings.setValue("logTransformEnabled", ui->logTransformCheckBox->checkState() == Qt::CheckState::Checked);
     settings.setValue("interpretAsQBEnabled", ui->quadBayerCheckBox->checkState() == Qt::CheckState::Checked);
+    settings.setValue("losslessCompression", ui->losslessCompressionCheckBox->checkState() == Qt::CheckState::Checked);
+    settings.setValue("proxyFolder", ui->proxyFolderCheckBox->checkState() == Qt::CheckState::Checked);
     settings.setValue("cachePath", mCacheRootFolder);
+    settings.setValue("diskCacheEnabled", ui->diskCacheCheckBox->checkState() == Qt::CheckState::Checked);
+    settings.setValue("diskCacheSizeGb", mDiskCacheSizeGb);
+    settings.setValue("cacheSize", ui->cacheSizeComboBox->currentText());
+    settings.setValue("rawFrameCacheSize", ui->rawFrameCacheSizeComboBox->currentText());
+    settings.setValue("storageType", ui->storageTypeComboBox->currentText());
+    settings.setValue("ioThreads", ui->ioThreadsComboBox->currentText());
+    settings.setValue("processingThreads", ui->processingThreadsComboBox->currentText());
     settings.setValue("draftQuality", mDraftQuality);
     settings.setValue("cfrTarget", ui->cfrTarget->currentText());
     settings.setValue("cropTarget", ui->cropTargetComboBox->currentText());
@@ -161,6 +306,11 @@ void MainWindow::saveSettings() {
         settings.setValue("srcFile", mMountedFiles[i].srcFile);
     }
 
+    for (auto i = 0; i < mPendingMounts.size(); ++i) {
+        settings.setArrayIndex(mMountedFiles.size() + i);
+        settings.setValue("srcFile", mPendingMounts[i]);
+    }
+
     settings.endArray();
 }
 
@@ -203,7 +353,17 @@ void MainWindow::restoreSettings() {
     ui->quadBayerCheckBox->setCheckState(
         settings.value("interpretAsQBEnabled").toBool() ? Qt::CheckState::Checked : Qt::CheckState::Unchecked);
 
+    ui->losslessCompressionCheckBox->setCheckState(
+        settings.value("losslessCompression").toBool() ? Qt::CheckState::Checked : Qt::CheckState::Unchecked);
+
+    ui->proxyFolderCheckBox->setCheckState(
+        settings.value("proxyFolder").toBool() ? Qt::CheckState::Checked : Qt::CheckState::Unchecked);
+
+    ui->diskCacheCheckBox->setCheckState(
+        settings.value("diskCacheEnabled").toBool() ? Qt::CheckState::Checked : Qt::CheckState::Unchecked);
+
     mCacheRootFolder = settings.value("cachePath").toString();    
+    mDiskCacheSizeGb = std::max(1, settings.value("diskCacheSizeGb", DEFAULT_DISK_CACHE_SIZE_GB).toInt());
     mDraftQuality = std::max(1, settings.value("draftQuality").toInt());
     mCFRTarget = (!settings.contains("cfrTarget") ? "Prefer Drop Frame" : settings.value("cfrTarget").toString().toStdString());
     mExposureCompensation = (!settings.contains("exposureCompensation") ? "0ev" : settings.value("exposureCompensation").toString().toStdString());
@@ -227,7 +387,15 @@ void MainWindow::restoreSettings() {
     ui->camModelOverrideComboBox->setCurrentText(QString::fromStdString(mCameraModel));
     ui->levelsComboBox->setCurrentText(QString::fromStdString(mLevels));  
     ui->logTransformComboBox->setCurrentText(QString::fromStdString(mLogTransform));  
+    ui->cacheSizeComboBox->setCurrentText(settings.value("cacheSize", "Default").toString());
+    ui->rawFrameCacheSizeComboBox->setCurrentText(settings.value("rawFrameCacheSize", "Default").toString());
+    ui->storageTypeComboBox->setCurrentText(settings.value("storageType", "SSD / NVMe").toString());
+    ui->ioThreadsComboBox->setCurrentText(settings.value("ioThreads", "Auto").toString());
+    ui->processingThreadsComboBox->setCurrentText(settings.value("processingThreads", "Auto").toString());
   
+    updateDiskCache();
+    updatePerformanceSettings();
+
     // Restore mounted files
     auto size = settings.beginReadArray("mountedFiles");
     for (int i = 0; i < size; ++i) {
@@ -292,26 +460,18 @@ void MainWindow::mountFile(const QString& filePath) {
     QFileInfo fileInfo(filePath);
     auto fileName = fileInfo.fileName();
     auto dstPath = (mCacheRootFolder.isEmpty() ? fileInfo.path() : mCacheRootFolder) + "/" + fileInfo.baseName();
-    motioncam::MountId mountId;
-
-    try {
-        motioncam::RenderSettings settings(
-            getRenderOptions(*ui),
-            mDraftQuality,
-            mCFRTarget,
-            mCropTarget,
-            mCameraModel,
-            mLevels,
-            mLogTransform,
-            mExposureCompensation,
-            mQuadBayerOption
-        );
-        mountId = mFuseFilesystem->mount(settings, filePath.toStdString(), dstPath.toStdString());
-    }
-    catch(std::runtime_error& e) {
-        QMessageBox::critical(this, "Error", QString("There was an error mounting the file. (error: %1)").arg(e.what()));
-        return;
-    }
+
+    motioncam::RenderSettings settings(
+        getRenderOptions(*ui),
+        mDraftQuality,
+        mCFRTarget,
+        mCropTarget,
+        mCameraModel,
+        mLevels,
+        mLogTransform,
+        mExposureCompensation,
+        mQuadBayerOption
+    );
 
     // Get the scroll area's content widget and its layout
     auto* scrollContent = ui->dragAndDropScrollArea->widget();
@@ -320,9 +480,9 @@ void MainWindow::mountFile(const QString& filePath) {
     // Create a widget to hold a filename label and buttons
     auto* fileWidget = new QWidget(scrollContent);
 
-    fileWidget->setFixedHeight(140);        //168 for 2 lines of metrics
+    fileWidget->setFixedHeight(168);
     fileWidget->setProperty("filePath", filePath);
-    fileWidget->setProperty("mountId", mountId);
+    fileWidget->setProperty("mountId", motioncam::InvalidMountId);
     fileWidget->setProperty("mountPath", dstPath);
 
     auto* fileLayout = new QVBoxLayout(fileWidget);
@@ -335,28 +495,18 @@ void MainWindow::mountFile(const QString& filePath) {
     fileLabel->setStyleSheet("font-weight: bold; font-size: 12pt;");
     fileLayout->addWidget(fileLabel);
 
-    // Get file information from the FUSE filesystem
-    auto fileInfoOpt = mFuseFilesystem->getFileInfo(mountId);
-    if (fileInfoOpt.has_value()) {
-        auto info = fileInfoOpt.value();
-
-        // Create info label with FPS, Total Frames/Dropped, and Resolution 
-        auto infoText = QString("Median / Average / Target FPS: %1 / %2 -> %3 | Framecount: %4 | Dropped: -%5 | Duplicated: +%6 | Resolution: %7x%8")
-                                .arg(QString::number(info.medFps, 'f', 2))
-                                .arg(QString::number(info.avgFps, 'f', 2))
-                                .arg(QString::number(info.fps, 'f', 2))
-                                .arg(info.totalFrames)
-                                .arg(info.droppedFrames)
-                                .arg(info.duplicatedFrames)
-                                .arg(info.width)
-                                .arg(info.height);
-
-        auto* infoLabel = new QLabel(infoText, fileWidget);
-        infoLabel->setStyleSheet("font-size: 9pt; color: #888888;");
-        infoLabel->setProperty("infoLabel", true); // <-- Add this line
-        infoLabel->setProperty("mountId", QVariant(mountId)); // <-- Add this line for consistency
-        fileLayout->addWidget(infoLabel);
-    }
+    // Shows the progress of the mount until the clip is scanned, then its FPS, frames and resolution
+    auto* infoLabel = new QLabel("Waiting to mount...", fileWidget);
+    infoLabel->setStyleSheet("font-size: 9pt; color: #888888;");
+    infoLabel->setProperty("infoLabel", true);
+    infoLabel->setProperty("mountId", QVariant(motioncam::InvalidMountId));
+    fileLayout->addWidget(infoLabel);
+
+    // Live counters, filled in by updateStatsLabels() once the clip is mounted
+    auto* statsLabel = new QLabel(fileWidget);
+    statsLabel->setStyleSheet("font-size: 9pt; color: #888888;");
+    statsLabel->setProperty("statsLabel", true);
+    fileLayout->addWidget(statsLabel);
 
     // Create and add the source folder label
     auto* sourceLabel = new QLabel(QString("Source: %1").arg(fileInfo.path()), fileWidget);
@@ -392,6 +542,21 @@ void MainWindow::mountFile(const QString& filePath) {
     removeButton->setIcon(QIcon(":/assets/remove_btn.png"));
     buttonLayout->addWidget(removeButton);
 
+    // Create and add the export stats button
+    auto* statsButton = new QPushButton("Stats", fileWidget);
+    statsButton->setFixedSize(buttonWidth, buttonHeight);
+    statsButton->setToolTip("Export performance counters as JSON or CSV");
+    buttonLayout->addWidget(statsButton);
+
+#ifdef _WIN32
+    // Writes every frame to disk ahead of time, for conform and render jobs
+    auto* hydrateButton = new QPushButton("Pre-hydrate", fileWidget);
+    hydrateButton->setFixedSize(buttonWidth, buttonHeight);
+    hydrateButton->setCheckable(true);
+    hydrateButton->setToolTip("Write every frame to disk in the background, pausing while applications read from the mount");
+    buttonLayout->addWidget(hydrateButton);
+#endif
+
     // Add stretch to push buttons to the left
     buttonLayout->addStretch();
 
@@ -399,7 +564,7 @@ void MainWindow::mountFile(const QString& filePath) {
     fileLayout->addLayout(buttonLayout);
 
     // Add separator if there are already mounted files
-    if (!mMountedFiles.empty()) {
+    if (!mMountedFiles.empty() || !mPendingMounts.empty()) {
         auto* separator = new QFrame(scrollContent);
 
         separator->setFrameShape(QFrame::HLine);
@@ -428,6 +593,85 @@ void MainWindow::mountFile(const QString& filePath) {
         removeFile(fileWidget);
     });
 
+    connect(statsButton, &QPushButton::clicked, this, [this, fileWidget] {
+        exportStats(fileWidget);
+    });
+
+#ifdef _WIN32
+    connect(hydrateButton, &QPushButton::toggled, this, [this, fileWidget, hydrateButton](bool checked) {
+        bool ok = false;
+        auto mountId = fileWidget->property("mountId").toInt(&ok);
+
+        if (ok && !mFuseFilesystem->setPreHydrate(mountId, checked)) {
+            hydrateButton->setChecked(false);
+            hydrateButton->setEnabled(false);
+        }
+    });
+#endif
+
+    // Nothing to open or unmount until the clip is mounted, which also keeps the
+    // widget around for the mount to report back to
+    openButton->setEnabled(false);
+    playButton->setEnabled(false);
+    removeButton->setEnabled(false);
+    statsButton->setEnabled(false);
+#ifdef _WIN32
+    hydrateButton->setEnabled(false);
+#endif
+
+    mPendingMounts.append(filePath);
+
+    // Scanning a clip can take a while, so it happens on the mount pool and the window
+    // hears back through queued calls. Calls queued after the window is gone are dropped.
+    auto* fuseFilesystem = mFuseFilesystem.get();
+
+    mMountThreadPool.start([this, fuseFilesystem, settings, filePath, dstPath, fileWidget, infoLabel]() {
+        QMetaObject::invokeMethod(this, [infoLabel] { infoLabel->setText("Mounting..."); }, Qt::QueuedConnection);
+
+        auto mountId = motioncam::InvalidMountId;
+        QString error;
+
+        try {
+            mountId = fuseFilesystem->mount(settings, filePath.toStdString(), dstPath.toStdString());
+        }
+        catch(std::runtime_error& e) {
+            error = e.what();
+        }
+
+        QMetaObject::invokeMethod(this, [this, fileWidget, filePath, mountId, error] {
+            onFileMounted(fileWidget, filePath, mountId, error);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void MainWindow::onFileMounted(QWidget* fileWidget, const QString& filePath, motioncam::MountId mountId, const QString& error) {
+    mPendingMounts.removeOne(filePath);
+
+    if(mountId == motioncam::InvalidMountId) {
+        removeFile(fileWidget);
+
+        QMessageBox::critical(this, "Error", QString("There was an error mounting the file. (error: %1)").arg(error));
+        return;
+    }
+
+    fileWidget->setProperty("mountId", mountId);
+
+    for (auto* label : fileWidget->findChildren<QLabel*>()) {
+        if (!label->property("infoLabel").toBool())
+            continue;
+
+        auto fileInfoOpt = mFuseFilesystem->getFileInfo(mountId);
+        if (fileInfoOpt.has_value())
+            label->setText(getInfoText(fileInfoOpt.value()));
+        else
+            label->hide();
+
+        label->setProperty("mountId", QVariant(mountId));
+    }
+
+    for (auto* button : fileWidget->findChildren<QPushButton*>())
+        button->setEnabled(true);
+
     mMountedFiles.append(
         motioncam::MountedFile(mountId, filePath));
 }
@@ -504,7 +748,7 @@ void MainWindow::removeFile(QWidget* fileWidget) {
     }
 
     // If all files are removed, show the drag-drop label again
-    if (mMountedFiles.empty()) {
+    if (mMountedFiles.empty() && mPendingMounts.empty()) {
         ui->dragAndDropLabel->show();
     }
 }
@@ -519,6 +763,12 @@ void MainWindow::updateUi() {
         ui->quadBayerComboBox->setEnabled(true);
     }
 
+    // Proxies are scaled by the draft quality, a draft mount doesn't get them
+    ui->proxyFolderCheckBox->setEnabled(ui->draftModeCheckBox->checkState() != Qt::CheckState::Checked);
+
+    if(ui->proxyFolderCheckBox->checkState() == Qt::CheckState::Checked)
+        ui->draftQuality->setEnabled(true);
+
     if(ui->cropEnableCheckBox->checkState() == Qt::CheckState::Checked)
         ui->cropTargetComboBox->setEnabled(true);
     else
@@ -609,23 +859,97 @@ void MainWindow::updateFpsLabels() {
                 // Get the updated fps value
                 auto fileInfoOpt = mFuseFilesystem->getFileInfo(mountId);
                 if (fileInfoOpt.has_value()) {
-                    auto info = fileInfoOpt.value();
-                    auto infoText = QString("Median / Average / Target FPS: %1 / %2 -> %3 | Framecount: %4 | Dropped: -%5 | Duplicated: +%6 | Resolution: %7x%8")
-                                .arg(QString::number(info.medFps, 'f', 2))
-                                .arg(QString::number(info.avgFps, 'f', 2))
-                                .arg(QString::number(info.fps, 'f', 2))
-                                .arg(info.totalFrames)
-                                .arg(info.droppedFrames)
-                                .arg(info.duplicatedFrames)
-                                .arg(info.width)
-                                .arg(info.height);
-                    label->setText(infoText);
+                    label->setText(getInfoText(fileInfoOpt.value()));
                 }
             }
         }
     }
 }
 
+void MainWindow::updateStatsLabels() {
+    auto* scrollContent = ui->dragAndDropScrollArea->widget();
+    if (!scrollContent) {
+        return;
+    }
+
+    for (auto* label : scrollContent->findChildren<QLabel*>()) {
+        if (!label->property("statsLabel").toBool())
+            continue;
+
+        // Only set once the clip is mounted
+        bool ok = false;
+        auto mountId = label->parentWidget()->property("mountId").toInt(&ok);
+        if (!ok)
+            continue;
+
+        auto statsOpt = mFuseFilesystem->getMetrics(mountId);
+        if (!statsOpt.has_value())
+            continue;
+
+        const auto& stats = statsOpt.value();
+
+        // Throughput since the last update
+        double bytesPerSecond = 0;
+        auto lastTimeMs = label->property("lastTimeMs").toLongLong();
+
+        if (lastTimeMs > 0 && stats.timeMs > lastTimeMs) {
+            auto lastBytes = label->property("lastBytes").toULongLong();
+            bytesPerSecond = (stats.bytesServed - lastBytes) * 1000.0 / (stats.timeMs - lastTimeMs);
+        }
+
+        auto text = getStatsText(stats, bytesPerSecond);
+
+        // Only once pre-hydration has been started, on file systems that have it
+        auto hydrationOpt = mFuseFilesystem->getHydrationProgress(mountId);
+        if (hydrationOpt.has_value() && hydrationOpt->totalFiles > 0) {
+            double hydrationBytesPerSecond = 0;
+
+            if (lastTimeMs > 0 && stats.timeMs > lastTimeMs) {
+                auto lastHydratedBytes = label->property("lastHydratedBytes").toULongLong();
+                hydrationBytesPerSecond = (hydrationOpt->bytesWritten - lastHydratedBytes) * 1000.0 / (stats.timeMs - lastTimeMs);
+            }
+
+            label->setProperty("lastHydratedBytes", QVariant::fromValue<qulonglong>(hydrationOpt->bytesWritten));
+
+            text += getHydrationText(hydrationOpt.value(), hydrationBytesPerSecond);
+        }
+
+        label->setProperty("lastTimeMs", QVariant::fromValue<qlonglong>(stats.timeMs));
+        label->setProperty("lastBytes", QVariant::fromValue<qulonglong>(stats.bytesServed));
+
+        label->setText(text);
+    }
+}
+
+void MainWindow::exportStats(QWidget* fileWidget) {
+    bool ok = false;
+    auto mountId = fileWidget->property("mountId").toInt(&ok);
+    if (!ok)
+        return;
+
+    auto statsOpt = mFuseFilesystem->getMetrics(mountId);
+    if (!statsOpt.has_value())
+        return;
+
+    QString selectedFilter;
+    auto path = QFileDialog::getSaveFileName(
+        this, tr("Export Stats"), QString(), tr("JSON (*.json);;CSV (*.csv)"), &selectedFilter);
+
+    if (path.isEmpty())
+        return;
+
+    const bool csv = path.endsWith(".csv", Qt::CaseInsensitive) || selectedFilter.startsWith("CSV");
+    const auto data = csv ? motioncam::metricsToCsv(statsOpt.value()) : motioncam::metricsToJson(statsOpt.value());
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        QMessageBox::critical(this, "Error", QString("Failed to write %1").arg(path));
+        return;
+    }
+
+    file.write(data.data(), static_cast<qint64>(data.size()));
+}
+
 void MainWindow::onRenderSettingsChanged(const Qt::CheckState &checkState) {
     auto it = mMountedFiles.begin();
     motioncam::RenderSettings settings(
@@ -716,6 +1040,34 @@ void MainWindow::onSetCacheFolder(bool checked) {
         ui->cacheFolderLabel->setText(mCacheRootFolder);
         ui->cacheFolderLabel->setStyleSheet("color: white; font-weight: bold; font-family: monospace;");
     }
+
+    updateDiskCache();
+}
+
+void MainWindow::updatePerformanceSettings() {
+    auto storageType = ui->storageTypeComboBox->currentIndex() == 1 ?
+        motioncam::StorageType::Rotational : motioncam::StorageType::SolidState;
+
+    mFuseFilesystem->setCacheSize(parseCacheSize(ui->cacheSizeComboBox->currentText()));
+    mFuseFilesystem->setRawFrameCacheSize(parseCacheSize(ui->rawFrameCacheSizeComboBox->currentText()));
+    mFuseFilesystem->setThreadPoolSizes(
+        parseThreadCount(ui->ioThreadsComboBox->currentText()),
+        parseThreadCount(ui->processingThreadsComboBox->currentText()),
+        storageType);
+}
+
+void MainWindow::updateDiskCache() {
+    if(ui->diskCacheCheckBox->checkState() != Qt::CheckState::Checked) {
+        mFuseFilesystem->setDiskCache("", 0);
+        return;
+    }
+
+    // Without an output folder the DNGs live next to each source file, keep the frames in the user cache instead
+    auto rootFolder = mCacheRootFolder.isEmpty() ?
+        QStandardPaths::writableLocation(QStandardPaths::CacheLocation) : mCacheRootFolder;
+
+    mFuseFilesystem->setDiskCache(
+        QDir(rootFolder).filePath(".dngcache").toStdString(), static_cast<size_t>(mDiskCacheSizeGb) * 1024 * 1024 * 1024);
 }
 
 void MainWindow::onSetDefaultSettings(bool checked) {
@@ -730,6 +1082,8 @@ void MainWindow::onSetDefaultSettings(bool checked) {
     ui->camModelOverrideCheckBox->setCheckState(Qt::CheckState::Checked);
     ui->logTransformCheckBox->setCheckState(Qt::CheckState::Checked);
     ui->quadBayerCheckBox->setCheckState(Qt::CheckState::Unchecked);
+    ui->losslessCompressionCheckBox->setCheckState(Qt::CheckState::Unchecked);
+    ui->proxyFolderCheckBox->setCheckState(Qt::CheckState::Unchecked);
 
     mDraftQuality = 1;
     mCFRTarget = "Prefer Drop Frame";
@@ -0,0 +1,118 @@
+// Checks that every SIMD version of bitpacking::pack() the CPU supports writes the same bytes
+// as packScalar(), for every depth and for rows that do and don't fill whole SIMD steps.
+// Exits with 1 if any output differs.
+
+#include "BitPacking.h"
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace {
+
+using namespace motioncam;
+using namespace motioncam::bitpacking;
+
+constexpr unsigned short DEPTHS[] = { 2, 4, 6, 8, 10, 12, 14, 16 };
+
+// Around the 8 and 16 pixel SIMD steps and the 2 and 4 pixel groups, plus a few long rows
+constexpr uint32_t WIDTHS[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 12, 15, 16, 17, 24, 31, 32, 33, 63, 64, 65, 100, 257, 1023, 4000 };
+constexpr uint32_t HEIGHTS[] = { 1, 2, 7 };
+
+// Bytes after the packed ones, the SIMD versions store 16 bytes at a time and must not touch them
+constexpr size_t GUARD_SIZE = 64;
+constexpr uint8_t GUARD_VALUE = 0xCD;
+
+constexpr uint32_t RANDOM_SEED = 1234;
+
+const char* getName(SimdLevel level) {
+    switch(level) {
+    case SimdLevel::SSE41:  return "SSE4.1";
+    case SimdLevel::AVX2:   return "AVX2";
+    case SimdLevel::NEON:   return "NEON";
+    default:                return "none";
+    }
+}
+
+// Every version that runs on this CPU, SSE4.1 comes with AVX2
+std::vector<SimdLevel> getLevels() {
+    std::vector<SimdLevel> levels = { SimdLevel::None };
+
+    switch(getSimdLevel()) {
+    case SimdLevel::AVX2:
+        levels.push_back(SimdLevel::SSE41);
+        levels.push_back(SimdLevel::AVX2);
+        break;
+    case SimdLevel::SSE41:
+        levels.push_back(SimdLevel::SSE41);
+        break;
+    case SimdLevel::NEON:
+        levels.push_back(SimdLevel::NEON);
+        break;
+    default:
+        break;
+    }
+
+    return levels;
+}
+
+bool check(SimdLevel level, unsigned short bits, uint32_t width, uint32_t height, std::mt19937& rng) {
+    const auto [groupPixels, groupBytes] = getPackedGroup(bits);
+
+    // The packers take rows padded to whole groups, and pixels no wider than the depth
+    const uint32_t stride = (width + groupPixels - 1) / groupPixels * groupPixels;
+    const size_t packedSize = static_cast<size_t>(stride) / groupPixels * groupBytes * height;
+    const uint32_t valueMask = bits < 16 ? (1u << bits) - 1 : 0xFFFF;
+
+    std::vector<uint16_t> src(static_cast<size_t>(stride) * height);
+    for(auto& value : src)
+        value = static_cast<uint16_t>(rng() & valueMask);
+
+    std::vector<uint8_t> expected(packedSize + GUARD_SIZE, GUARD_VALUE);
+    std::vector<uint8_t> actual(packedSize + GUARD_SIZE, GUARD_VALUE);
+
+    packScalar(src.data(), expected.data(), width, height, bits);
+    pack(src.data(), actual.data(), width, height, bits, level);
+
+    for(size_t i = 0; i < actual.size(); ++i) {
+        if(actual[i] != expected[i]) {
+            std::cerr
+                << "FAIL " << getName(level) << " " << bits << " bit " << width << "x" << height
+                << ": byte " << i << " of " << packedSize << " is " << static_cast<int>(actual[i])
+                << ", expected " << static_cast<int>(expected[i]) << "\n";
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+} // namespace
+
+int main() {
+    std::mt19937 rng(RANDOM_SEED);
+
+    int failures = 0;
+    int checks = 0;
+
+    for(auto level : getLevels()) {
+        for(auto bits : DEPTHS) {
+            for(auto width : WIDTHS) {
+                for(auto height : HEIGHTS) {
+                    if(!check(level, bits, width, height, rng))
+                        ++failures;
+
+                    ++checks;
+                }
+            }
+        }
+
+        std::cerr << "Checked " << getName(level) << "\n";
+    }
+
+    std::cerr << checks - failures << " of " << checks << " checks passed\n";
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,497 @@
+// Checks that DNGs made of lj92::encodeTile() tiles behind a header from lj92::getTiledDngHeader()
+// decode back to the pixels they were made from, for every depth and for images that don't fill
+// whole tiles. The decoder here follows the lossless JPEG spec, not the encoder. Exits with 1 if
+// any pixel or tag differs.
+
+#include "LosslessJpeg.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace motioncam;
+
+constexpr unsigned short DEPTHS[] = { 2, 4, 6, 8, 10, 12, 14, 16 };
+
+// Odd widths and heights leave part of the last tiles outside the image
+constexpr uint32_t WIDTHS[] = { 1, 2, 3, 15, 16, 17, 37, 64 };
+constexpr uint32_t HEIGHTS[] = { 1, 5, 16, 21 };
+constexpr uint32_t TILE_SIZES[] = { 16, 32 };
+
+constexpr uint32_t RANDOM_SEED = 1234;
+
+constexpr uint16_t TAG_IMAGE_WIDTH = 256;
+constexpr uint16_t TAG_IMAGE_LENGTH = 257;
+constexpr uint16_t TAG_COMPRESSION = 259;
+constexpr uint16_t TAG_STRIP_OFFSETS = 273;
+constexpr uint16_t TAG_ROWS_PER_STRIP = 278;
+constexpr uint16_t TAG_STRIP_BYTE_COUNTS = 279;
+constexpr uint16_t TAG_TILE_WIDTH = 322;
+constexpr uint16_t TAG_TILE_LENGTH = 323;
+constexpr uint16_t TAG_TILE_OFFSETS = 324;
+constexpr uint16_t TAG_TILE_BYTE_COUNTS = 325;
+constexpr uint16_t TYPE_SHORT = 3;
+constexpr uint16_t TYPE_LONG = 4;
+
+enum class Pattern {
+    Noise,      // Every difference category
+    Gradient,   // Small differences
+    Steps       // The largest differences there are, between neighbours of the same colour
+};
+
+const char* getName(Pattern pattern) {
+    switch(pattern) {
+    case Pattern::Noise:    return "noise";
+    case Pattern::Gradient: return "gradient";
+    default:                return "steps";
+    }
+}
+
+std::vector<uint16_t> getImage(Pattern pattern, uint32_t width, uint32_t height, unsigned short bits, std::mt19937& rng) {
+    const uint32_t maxValue = (1u << bits) - 1;
+
+    std::vector<uint16_t> image(static_cast<size_t>(width) * height);
+
+    for(uint32_t y = 0; y < height; ++y) {
+        for(uint32_t x = 0; x < width; ++x) {
+            uint32_t value;
+
+            if(pattern == Pattern::Noise)
+                value = rng() & maxValue;
+            else if(pattern == Pattern::Gradient)
+                value = (x * 7 + y * 3) & maxValue;
+            else
+                value = ((x / 2 + y) & 1) ? maxValue : 0;
+
+            image[static_cast<size_t>(y) * width + x] = static_cast<uint16_t>(value);
+        }
+    }
+
+    return image;
+}
+
+uint16_t readU16(const std::vector<char>& data, size_t pos) {
+    if(pos + 2 > data.size())
+        throw std::runtime_error("read past the end of the DNG");
+
+    return static_cast<uint16_t>(static_cast<uint8_t>(data[pos]) | (static_cast<uint8_t>(data[pos + 1]) << 8));
+}
+
+uint32_t readU32(const std::vector<char>& data, size_t pos) {
+    return readU16(data, pos) | (static_cast<uint32_t>(readU16(data, pos + 2)) << 16);
+}
+
+void writeEntry(std::vector<char>& data, size_t pos, uint16_t tag, uint16_t type, uint32_t value) {
+    const uint8_t entry[12] = {
+        static_cast<uint8_t>(tag), static_cast<uint8_t>(tag >> 8),
+        static_cast<uint8_t>(type), static_cast<uint8_t>(type >> 8),
+        1, 0, 0, 0,
+        static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 24) };
+
+    std::copy(entry, entry + 12, data.begin() + pos);
+}
+
+// A little endian header with a single strip, like the ones getDngHeader() makes
+std::vector<char> getStripHeader(uint32_t width, uint32_t height) {
+    constexpr uint16_t NUM_ENTRIES = 6;
+    constexpr size_t IFD_OFFSET = 8;
+
+    std::vector<char> header(IFD_OFFSET + 2 + NUM_ENTRIES * 12 + 4, 0);
+    const size_t size = header.size();
+
+    header[0] = 'I';
+    header[1] = 'I';
+    header[2] = 42;
+    header[4] = static_cast<char>(IFD_OFFSET);
+    header[IFD_OFFSET] = NUM_ENTRIES;
+
+    writeEntry(header, IFD_OFFSET + 2 + 0 * 12, TAG_IMAGE_WIDTH, TYPE_LONG, width);
+    writeEntry(header, IFD_OFFSET + 2 + 1 * 12, TAG_IMAGE_LENGTH, TYPE_LONG, height);
+    writeEntry(header, IFD_OFFSET + 2 + 2 * 12, TAG_COMPRESSION, TYPE_SHORT, 1);
+    writeEntry(header, IFD_OFFSET + 2 + 3 * 12, TAG_STRIP_OFFSETS, TYPE_LONG, static_cast<uint32_t>(size));
+    writeEntry(header, IFD_OFFSET + 2 + 4 * 12, TAG_ROWS_PER_STRIP, TYPE_LONG, height);
+    writeEntry(header, IFD_OFFSET + 2 + 5 * 12, TAG_STRIP_BYTE_COUNTS, TYPE_LONG, width * height * 2);
+
+    return header;
+}
+
+struct IfdEntry {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    size_t valuePos;
+};
+
+std::vector<IfdEntry> readIfd(const std::vector<char>& dng) {
+    const uint32_t ifdOffset = readU32(dng, 4);
+    const uint16_t numEntries = readU16(dng, ifdOffset);
+
+    std::vector<IfdEntry> entries;
+
+    for(uint16_t i = 0; i < numEntries; ++i) {
+        const size_t pos = ifdOffset + 2 + i * 12;
+        entries.push_back({ readU16(dng, pos), readU16(dng, pos + 2), readU32(dng, pos + 4), pos + 8 });
+    }
+
+    if(readU32(dng, ifdOffset + 2 + numEntries * 12) != 0)
+        throw std::runtime_error("the image IFD links to another one");
+
+    return entries;
+}
+
+const IfdEntry* findEntry(const std::vector<IfdEntry>& entries, uint16_t tag) {
+    for(const auto& entry : entries) {
+        if(entry.tag == tag)
+            return &entry;
+    }
+
+    return nullptr;
+}
+
+uint32_t readValue(const std::vector<char>& dng, const IfdEntry& entry) {
+    return entry.type == TYPE_SHORT ? readU16(dng, entry.valuePos) : readU32(dng, entry.valuePos);
+}
+
+// Longs of an entry, stored in the entry when there is one
+std::vector<uint32_t> readLongs(const std::vector<char>& dng, const IfdEntry& entry) {
+    if(entry.type != TYPE_LONG)
+        throw std::runtime_error("tile entry is not a LONG");
+
+    const size_t pos = entry.count == 1 ? entry.valuePos : readU32(dng, entry.valuePos);
+
+    std::vector<uint32_t> values;
+    for(uint32_t i = 0; i < entry.count; ++i)
+        values.push_back(readU32(dng, pos + i * 4));
+
+    return values;
+}
+
+class BitReader {
+public:
+    BitReader(const uint8_t* data, size_t size) : mData(data), mSize(size), mPos(0), mBuffer(0), mBits(0) {
+    }
+
+    uint32_t read(int numBits) {
+        while(mBits < numBits) {
+            if(mPos >= mSize)
+                throw std::runtime_error("entropy coded data ends early");
+
+            uint8_t byte = mData[mPos++];
+
+            // Stuffed zero after 0xFF
+            if(byte == 0xFF) {
+                if(mPos >= mSize || mData[mPos] != 0)
+                    throw std::runtime_error("marker inside the entropy coded data");
+
+                ++mPos;
+            }
+
+            mBuffer = (mBuffer << 8) | byte;
+            mBits += 8;
+        }
+
+        mBits -= numBits;
+
+        return static_cast<uint32_t>(mBuffer >> mBits) & ((1u << numBits) - 1);
+    }
+
+    // Only the padding ones of the last byte may be left
+    bool atEnd() const {
+        return mPos == mSize && (mBits == 0 || (mBuffer & ((1u << mBits) - 1)) == (1u << mBits) - 1);
+    }
+
+private:
+    const uint8_t* mData;
+    size_t mSize;
+    size_t mPos;
+    uint64_t mBuffer;
+    int mBits;
+};
+
+struct HuffmanDecoder {
+    std::vector<uint8_t> counts = std::vector<uint8_t>(17, 0);
+    std::vector<uint8_t> symbols;
+
+    // Codes are assigned in order of length (annex C of the JPEG spec)
+    int decode(BitReader& reader) const {
+        int code = 0;
+        int first = 0;
+        int index = 0;
+
+        for(int length = 1; length <= 16; ++length) {
+            code = (code << 1) | static_cast<int>(reader.read(1));
+
+            if(code - first < counts[length])
+                return symbols[index + code - first];
+
+            index += counts[length];
+            first = (first + counts[length]) << 1;
+        }
+
+        throw std::runtime_error("invalid Huffman code");
+    }
+};
+
+// Decodes a lossless JPEG of two interleaved components, the way DNG stores CFA tiles
+std::vector<uint16_t> decodeTile(const uint8_t* data, size_t size, uint32_t& outWidth, uint32_t& outHeight, int& outBits) {
+    size_t pos = 0;
+
+    auto readByte = [&]() -> uint8_t {
+        if(pos >= size)
+            throw std::runtime_error("JPEG ends early");
+
+        return data[pos++];
+    };
+
+    auto readU16 = [&]() {
+        const uint32_t high = readByte();
+        return (high << 8) | readByte();
+    };
+
+    if(readByte() != 0xFF || readByte() != 0xD8)
+        throw std::runtime_error("no SOI marker");
+
+    HuffmanDecoder table;
+    std::optional<int> bits;
+    uint32_t width = 0;
+    uint32_t height = 0;
+
+    for(;;) {
+        if(readByte() != 0xFF)
+            throw std::runtime_error("expected a marker");
+
+        const uint8_t marker = readByte();
+        // The length counts its own two bytes
+        const size_t segmentStart = pos;
+        const size_t segmentEnd = segmentStart + readU16();
+
+        if(marker == 0xC4) {
+            if(readByte() != 0x00)
+                throw std::runtime_error("expected DC table 0");
+
+            size_t numSymbols = 0;
+            for(int length = 1; length <= 16; ++length)
+                numSymbols += table.counts[length] = readByte();
+
+            for(size_t i = 0; i < numSymbols; ++i)
+                table.symbols.push_back(readByte());
+        }
+        else if(marker == 0xC3) {
+            bits = readByte();
+            height = readU16();
+            width = readU16() * 2;
+
+            if(readByte() != 2)
+                throw std::runtime_error("expected two components");
+
+            // Both have no subsampling
+            pos += 2 * 3;
+        }
+        else if(marker == 0xDA) {
+            if(readByte() != 2)
+                throw std::runtime_error("expected two components in the scan");
+
+            pos += 4;
+
+            if(readByte() != 1)
+                throw std::runtime_error("expected predictor 1");
+
+            pos = segmentEnd;
+            break;
+        }
+        else {
+            throw std::runtime_error("unexpected marker " + std::to_string(marker));
+        }
+
+        if(pos != segmentEnd)
+            throw std::runtime_error("segment " + std::to_string(marker) + " has the wrong length");
+    }
+
+    if(!bits || table.symbols.empty() || size < pos + 2 || data[size - 2] != 0xFF || data[size - 1] != 0xD9)
+        throw std::runtime_error("incomplete JPEG");
+
+    BitReader reader(data + pos, size - 2 - pos);
+    std::vector<uint16_t> pixels(static_cast<size_t>(width) * height);
+
+    for(uint32_t y = 0; y < height; ++y) {
+        for(uint32_t x = 0; x < width; ++x) {
+            const int category = table.decode(reader);
+
+            int diff = 0;
+
+            if(category == 16) {
+                diff = 32768;
+            }
+            else if(category > 0) {
+                diff = static_cast<int>(reader.read(category));
+
+                if(diff < (1 << (category - 1)))
+                    diff -= (1 << category) - 1;
+            }
+
+            int predicted;
+
+            if(x >= 2)
+                predicted = pixels[static_cast<size_t>(y) * width + x - 2];
+            else if(y > 0)
+                predicted = pixels[static_cast<size_t>(y - 1) * width + x];
+            else
+                predicted = 1 << (*bits - 1);
+
+            pixels[static_cast<size_t>(y) * width + x] = static_cast<uint16_t>(predicted + diff);
+        }
+    }
+
+    if(!reader.atEnd())
+        throw std::runtime_error("data after the last pixel");
+
+    outWidth = width;
+    outHeight = height;
+    outBits = *bits;
+
+    return pixels;
+}
+
+// Encodes the image the way generateDng() does, then decodes the DNG that makes
+void checkRoundTrip(Pattern pattern, unsigned short bits, uint32_t width, uint32_t height, uint32_t tileSize, std::mt19937& rng) {
+    // Rows stride apart, like the padded rows generateDng() encodes from
+    const size_t stride = width + 3;
+
+    const auto image = getImage(pattern, width, height, bits, rng);
+
+    std::vector<uint16_t> pixels(stride * height, 0xFFFF);
+    for(uint32_t y = 0; y < height; ++y)
+        std::copy(image.begin() + y * width, image.begin() + (y + 1) * width, pixels.begin() + y * stride);
+
+    const uint32_t tilesAcross = (width + tileSize - 1) / tileSize;
+    const uint32_t tilesDown = (height + tileSize - 1) / tileSize;
+
+    std::vector<std::vector<uint8_t>> tiles(static_cast<size_t>(tilesAcross) * tilesDown);
+    std::vector<size_t> tileSizes;
+
+    for(size_t i = 0; i < tiles.size(); ++i) {
+        const uint32_t x = static_cast<uint32_t>(i % tilesAcross) * tileSize;
+        const uint32_t y = static_cast<uint32_t>(i / tilesAcross) * tileSize;
+
+        lj92::encodeTile(
+            pixels.data() + y * stride + x, stride, std::min(tileSize, width - x), std::min(tileSize, height - y), tileSize, tileSize, bits, tiles[i]);
+
+        tileSizes.push_back(tiles[i].size());
+    }
+
+    auto dng = *lj92::getTiledDngHeader(getStripHeader(width, height), tileSize, tileSize, tileSizes);
+
+    for(const auto& tile : tiles)
+        dng.insert(dng.end(), tile.begin(), tile.end());
+
+    const auto entries = readIfd(dng);
+
+    for(size_t i = 1; i < entries.size(); ++i) {
+        if(entries[i - 1].tag >= entries[i].tag)
+            throw std::runtime_error("IFD entries out of order");
+    }
+
+    for(auto tag : { TAG_STRIP_OFFSETS, TAG_ROWS_PER_STRIP, TAG_STRIP_BYTE_COUNTS }) {
+        if(findEntry(entries, tag))
+            throw std::runtime_error("strip tag " + std::to_string(tag) + " left in the IFD");
+    }
+
+    for(auto tag : { TAG_IMAGE_WIDTH, TAG_IMAGE_LENGTH, TAG_COMPRESSION, TAG_TILE_WIDTH, TAG_TILE_LENGTH, TAG_TILE_OFFSETS, TAG_TILE_BYTE_COUNTS }) {
+        if(!findEntry(entries, tag))
+            throw std::runtime_error("tag " + std::to_string(tag) + " missing from the IFD");
+    }
+
+    if(readValue(dng, *findEntry(entries, TAG_IMAGE_WIDTH)) != width || readValue(dng, *findEntry(entries, TAG_IMAGE_LENGTH)) != height)
+        throw std::runtime_error("image size changed");
+
+    if(readValue(dng, *findEntry(entries, TAG_COMPRESSION)) != 7)
+        throw std::runtime_error("compression is not lossless JPEG");
+
+    if(readValue(dng, *findEntry(entries, TAG_TILE_WIDTH)) != tileSize || readValue(dng, *findEntry(entries, TAG_TILE_LENGTH)) != tileSize)
+        throw std::runtime_error("wrong tile size");
+
+    const auto offsets = readLongs(dng, *findEntry(entries, TAG_TILE_OFFSETS));
+    const auto byteCounts = readLongs(dng, *findEntry(entries, TAG_TILE_BYTE_COUNTS));
+
+    if(offsets.size() != tiles.size() || byteCounts.size() != tiles.size())
+        throw std::runtime_error("wrong number of tiles");
+
+    if(static_cast<size_t>(offsets.back()) + byteCounts.back() != dng.size())
+        throw std::runtime_error("the last tile doesn't end the file");
+
+    for(size_t i = 0; i < tiles.size(); ++i) {
+        const uint32_t tileX = static_cast<uint32_t>(i % tilesAcross) * tileSize;
+        const uint32_t tileY = static_cast<uint32_t>(i / tilesAcross) * tileSize;
+
+        if(static_cast<size_t>(offsets[i]) + byteCounts[i] > dng.size())
+            throw std::runtime_error("tile " + std::to_string(i) + " is past the end of the file");
+
+        uint32_t decodedWidth = 0;
+        uint32_t decodedHeight = 0;
+        int decodedBits = 0;
+
+        const auto decoded = decodeTile(
+            reinterpret_cast<const uint8_t*>(dng.data()) + offsets[i], byteCounts[i], decodedWidth, decodedHeight, decodedBits);
+
+        if(decodedWidth != tileSize || decodedHeight != tileSize || decodedBits != bits)
+            throw std::runtime_error("tile " + std::to_string(i) + " has the wrong size or depth");
+
+        // Readers ignore the part of the tile outside the image
+        for(uint32_t y = 0; y < std::min(tileSize, height - tileY); ++y) {
+            for(uint32_t x = 0; x < std::min(tileSize, width - tileX); ++x) {
+                const uint16_t expected = image[static_cast<size_t>(tileY + y) * width + tileX + x];
+                const uint16_t actual = decoded[static_cast<size_t>(y) * tileSize + x];
+
+                if(actual != expected) {
+                    throw std::runtime_error(
+                        "tile " + std::to_string(i) + " pixel " + std::to_string(x) + "," + std::to_string(y) +
+                        " is " + std::to_string(actual) + ", expected " + std::to_string(expected));
+                }
+            }
+        }
+    }
+}
+
+} // namespace
+
+int main() {
+    std::mt19937 rng(RANDOM_SEED);
+
+    int failures = 0;
+    int checks = 0;
+
+    for(auto pattern : { Pattern::Noise, Pattern::Gradient, Pattern::Steps }) {
+        for(auto bits : DEPTHS) {
+            for(auto tileSize : TILE_SIZES) {
+                for(auto width : WIDTHS) {
+                    for(auto height : HEIGHTS) {
+                        try {
+                            checkRoundTrip(pattern, bits, width, height, tileSize, rng);
+                        }
+                        catch(const std::exception& e) {
+                            std::cerr
+                                << "FAIL " << getName(pattern) << " " << bits << " bit " << width << "x" << height
+                                << " in " << tileSize << " pixel tiles: " << e.what() << "\n";
+
+                            ++failures;
+                        }
+
+                        ++checks;
+                    }
+                }
+            }
+        }
+    }
+
+    std::cerr << checks - failures << " of " << checks << " checks passed\n";
+
+    return failures == 0 ? 0 : 1;
+}
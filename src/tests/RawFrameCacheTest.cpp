@@ -0,0 +1,79 @@
+// Checks that a RawFrameCache without capacity runs loads side by side rather than one at a
+// time, and keeps nothing. Exits with 1 if it doesn't.
+
+#include "RawFrameCache.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+using namespace motioncam;
+
+// How long a load waits for the other one to start, they'd wait forever if they didn't overlap
+constexpr auto OVERLAP_TIMEOUT = std::chrono::seconds(5);
+
+constexpr size_t FRAME_SIZE = 1024;
+
+bool checkLoadsOverlap(int64_t firstTimestamp, int64_t secondTimestamp) {
+    RawFrameCache cache(0);
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    int loading = 0;
+    bool overlapped[2] = { false, false };
+
+    auto load = [&](int n) {
+        return [&, n]() {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            ++loading;
+            condition.notify_all();
+
+            overlapped[n] = condition.wait_for(lock, OVERLAP_TIMEOUT, [&] { return loading == 2; });
+
+            auto frame = std::make_shared<RawFrame>();
+            frame->data = std::make_shared<std::vector<uint8_t>>(FRAME_SIZE);
+
+            return std::shared_ptr<const RawFrame>(frame);
+        };
+    };
+
+    std::thread first([&] { cache.get("clip.mcraw", firstTimestamp, load(0)); });
+    std::thread second([&] { cache.get("clip.mcraw", secondTimestamp, load(1)); });
+
+    first.join();
+    second.join();
+
+    if(!overlapped[0] || !overlapped[1]) {
+        std::cerr << "FAIL loads of " << firstTimestamp << " and " << secondTimestamp << " ran one after the other\n";
+        return false;
+    }
+
+    if(cache.size() != 0) {
+        std::cerr << "FAIL cache without capacity holds " << cache.size() << " bytes\n";
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace
+
+int main() {
+    int failures = 0;
+
+    // Different frames, and the same frame, which isn't shared when nothing is kept
+    if(!checkLoadsOverlap(1000, 2000))
+        ++failures;
+
+    if(!checkLoadsOverlap(1000, 1000))
+        ++failures;
+
+    std::cerr << (failures == 0 ? "All checks passed\n" : "Some checks failed\n");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -4,11 +4,24 @@
 
 #include "VirtualFileSystemImpl_MCRAW.h"
 #include "LRUCache.h"
-
+#include "RawFrameCache.h"
+#include "BufferPool.h"
+#include "Scheduler.h"
+#include "CancellationToken.h"
+#include "AccessTrace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <ntstatus.h>
 #include <mutex>
+#include <functional>
 #include <filesystem>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 #include <shlobj.h>
 
 #include <boost/filesystem.hpp>
@@ -30,10 +43,33 @@ namespace lcv = boost::locale::conv;
 namespace motioncam {
 
 constexpr auto CACHE_SIZE = 128 * 1024 * 1024; // Small cache size as we write the files to disk
-constexpr auto IO_THREADS = 4;
+constexpr auto HEADER_CACHE_SIZE = 64 * 1024 * 1024; // DNG headers are small, this holds a few thousand across all mounts
+constexpr auto RAW_FRAME_CACHE_SIZE = 512 * 1024 * 1024; // Decoded frames, so changing the options doesn't decode them again
+constexpr auto BUFFER_POOL_SIZE = 256 * 1024 * 1024; // Memory of released frames kept for new ones
+constexpr auto FRAME_BUFFER_POOL_SIZE = 256 * 1024 * 1024; // Memory of released decoded frames kept for new ones, across all mounts
+constexpr auto RENDER_MEMORY = 512 * 1024 * 1024; // Memory the frames being rendered may hold at once, across all mounts
+constexpr auto MIN_IO_THREADS = 4;
+constexpr auto MAX_IO_THREADS = 16;
+constexpr auto ROTATIONAL_IO_THREADS = 2;
+constexpr auto WRITE_BUFFER_POOL_SIZE = 128 * 1024 * 1024; // Aligned buffers of finished reads kept for the next ones, per mount
+constexpr auto MIN_POOLED_WRITE_BUFFER = 1024 * 1024; // Smaller reads are cheap to allocate for
+constexpr auto MAX_HYDRATION_THREADS = 8;
+constexpr auto HYDRATION_BACKOFF_MS = 1000; // Hydration waits until applications have not read for this long
 
 namespace {
 
+    // Decoding mostly waits on reads, a fast drive keeps more threads busy than there are cores to spare
+    int getDefaultIoThreads(StorageType storageType) {
+        if(storageType == StorageType::Rotational)
+            return ROTATIONAL_IO_THREADS;
+
+        return std::clamp(static_cast<int>(std::thread::hardware_concurrency()) / 4, MIN_IO_THREADS, MAX_IO_THREADS);
+    }
+
+    int getDefaultProcessingThreads() {
+        return (std::max)(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
     inline std::wstring fromUTF8(const std::string& s)
     {
         return lcv::utf_to_utf<wchar_t>(s);
@@ -49,6 +85,65 @@ namespace {
         return lcv::utf_to_utf<char>(std::wstring(ws == nullptr ? L"" : ws));
     }
 
+    int64_t getSteadyTimeMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Buffers handed to ProjFS have to be aligned for non-cached IO. Reads of a mount are nearly
+    // all a whole frame, so the buffers of finished reads are kept for the next ones instead of
+    // ProjFS allocating them every time
+    class AlignedBufferPool {
+    public:
+        explicit AlignedBufferPool(size_t maxBytes) : mMaxBytes(maxBytes), mBytes(0) {}
+
+        ~AlignedBufferPool() {
+            for(auto& [size, buffer] : mBuffers)
+                PrjFreeAlignedBuffer(buffer);
+        }
+
+        AlignedBufferPool(const AlignedBufferPool&) = delete;
+        AlignedBufferPool& operator=(const AlignedBufferPool&) = delete;
+
+        void* get(PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT instance, size_t size) {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+
+                auto it = mBuffers.find(size);
+                if(it != mBuffers.end()) {
+                    void* buffer = it->second;
+
+                    mBuffers.erase(it);
+                    mBytes -= size;
+
+                    return buffer;
+                }
+            }
+
+            return PrjAllocateAlignedBuffer(instance, size);
+        }
+
+        void release(void* buffer, size_t size) {
+            if(size >= MIN_POOLED_WRITE_BUFFER) {
+                std::lock_guard<std::mutex> lock(mMutex);
+
+                if(mBytes + size <= mMaxBytes) {
+                    mBuffers.emplace(size, buffer);
+                    mBytes += size;
+                    return;
+                }
+            }
+
+            PrjFreeAlignedBuffer(buffer);
+        }
+
+    private:
+        const size_t mMaxBytes;
+        size_t mBytes;
+        std::unordered_multimap<size_t, void*> mBuffers; // By size
+        std::mutex mMutex;
+    };
+
     void updatePlaceHolder(PRJ_PLACEHOLDER_INFO& placeholderInfo, const Entry& entry, const FileRenderOptions options, int draftScale) {
         placeholderInfo.FileBasicInfo.IsDirectory = entry.type == EntryType::DIRECTORY_ENTRY;
         placeholderInfo.FileBasicInfo.FileSize = entry.size;
@@ -79,12 +174,18 @@ namespace {
 
 class Session : public VirtualizationInstance {
 public:
-    Session(const std::string& dstPath, std::unique_ptr<VirtualFileSystemImpl_MCRAW> fs);
+    Session(
+        const std::string& dstPath,
+        std::unique_ptr<VirtualFileSystemImpl_MCRAW> fs,
+        std::unique_ptr<TraceWriter> trace);
     ~Session();
 
 public:
     void updateOptions(const RenderSettings& settings);
     FileInfo getFileInfo() const;
+    MetricsSnapshot getMetrics() const;
+    void setPreHydrate(bool enabled);
+    HydrationProgress getHydrationProgress() const;
 
 protected:
     HRESULT StartDirEnum(_In_ const PRJ_CALLBACK_DATA* CallbackData, _In_ const GUID* EnumerationId) override;
@@ -108,19 +209,59 @@ protected:
         _In_opt_ PCWSTR DestinationFileName,
         _Inout_ PRJ_NOTIFICATION_PARAMETERS* NotificationParameters) override;
 
+    void CancelCommand(_In_ const PRJ_CALLBACK_DATA* CallbackData) override;
+
+private:
+    // Walks the folders of the mount, parents before what is in them
+    void walk(const std::string& directory, const std::function<void(const Entry&)>& visit) const;
+
+    void startHydration();
+    void stopHydration();
+    void hydrate();
+    bool hydrateFile(const std::string& path);
+
 private:
     FileRenderOptions mOptions;
     int mDraftScale;
     std::mutex mOpLock;
-    std::unique_ptr<VirtualFileSystemImpl_MCRAW> mFs;
+    AlignedBufferPool mWriteBuffers;      // Outlives the reads of mFs, which hold its buffers
+    std::unique_ptr<TraceWriter> mTrace;  // Only when tracing is on, outlives the reads of mFs
+    std::unique_ptr<VirtualFileSystemImpl_MCRAW> mFs;   // Reset first in ~Session(), see there
     std::map<GUID, std::unique_ptr<DirInfo>, GUIDComparer> mActiveEnumSessions;
+    std::mutex mPendingReadsLock;
+    std::unordered_map<INT32, std::shared_ptr<CancellationToken>> mPendingReads; // By command id
+
+    // Pre-hydration reads the files back through the mount on threads of its own. They block
+    // until the frame is rendered, which would starve the pools that render it
+    mutable std::mutex mHydrationLock;
+    std::condition_variable mHydrationCondition;
+    std::vector<std::thread> mHydrationThreads;
+    std::vector<std::string> mHydrationQueue;
+    size_t mNextHydration;
+    bool mPreHydrate;
+    bool mStopHydration;
+    std::atomic<int> mActiveHydrationThreads;
+    std::atomic<size_t> mHydratedFiles;
+    std::atomic<uint64_t> mHydratedBytes;
+    std::atomic<int64_t> mLastForegroundRead;   // Steady clock ms of the last read by an application
 };
 
 Session::Session(
     const std::string& dstPath,
-    std::unique_ptr<VirtualFileSystemImpl_MCRAW> fs) : mFs(std::move(fs))
+    std::unique_ptr<VirtualFileSystemImpl_MCRAW> fs,
+    std::unique_ptr<TraceWriter> trace) :
+    mWriteBuffers(WRITE_BUFFER_POOL_SIZE),
+    mTrace(std::move(trace)),
+    mFs(std::move(fs)),
+    mNextHydration(0),
+    mPreHydrate(false),
+    mStopHydration(false),
+    mActiveHydrationThreads(0),
+    mHydratedFiles(0),
+    mHydratedBytes(0),
+    mLastForegroundRead(0)
 {
-    SetOptionalMethods(OptionalMethods::Notify);
+    SetOptionalMethods(OptionalMethods::Notify | OptionalMethods::CancelCommand);
 
     // Specify the notifications that we want ProjFS to send to us.  Everywhere under the virtualization
     // root we want ProjFS to tell us when files have been opened, when they're about to be renamed,
@@ -156,16 +297,48 @@ Session::Session(
 }
 
 Session::~Session() {
+    // Hydration reads need the mount until they are answered
+    stopHydration();
     Stop();
+
+    // Destroying the mount waits for the renders in flight, whose callbacks still use the read
+    // and hydration state declared after it. Destroy it while that state is alive
+    mFs.reset();
+}
+
+void Session::walk(const std::string& directory, const std::function<void(const Entry&)>& visit) const {
+    std::vector<std::string> directories;
+
+    // The listing holds the entries locked, go into the folders once it is done
+    mFs->listFiles(directory, "", 0, [&](const Entry& e, size_t) {
+        visit(e);
+
+        if(e.type == EntryType::DIRECTORY_ENTRY)
+            directories.push_back(e.getFullPath().string());
+
+        return true;
+    });
+
+    for(const auto& subdirectory : directories)
+        walk(subdirectory, visit);
 }
 
 void Session::updateOptions(const RenderSettings& settings) {
+    // The files go back to placeholders, hydration starts over once they are updated
+    stopHydration();
+
+    // Entries may go away with the options, e.g. the proxy folder
+    std::vector<std::string> previousPaths;
+
+    walk("", [&](const Entry& e) {
+        previousPaths.push_back(e.getFullPath().string());
+    });
+
     mOptions = settings.options;
     mDraftScale = settings.draftScale;
     mFs->updateOptions(settings);
 
     // We need to clear out the cache
-    auto files = mFs->listFiles();
     HRESULT hr = S_OK;
 
     PRJ_UPDATE_FAILURE_CAUSES failureReason;
@@ -176,13 +349,24 @@ void Session::updateOptions(const RenderSettings& settings) {
         PRJ_UPDATE_ALLOW_DIRTY_DATA     |
         PRJ_UPDATE_ALLOW_READ_ONLY;
 
-    for(auto& e : files) {
-        if(e.type != EntryType::FILE_ENTRY)
+    // Files before the folders they are in
+    for(auto it = previousPaths.rbegin(); it != previousPaths.rend(); ++it) {
+        if(mFs->findEntry(*it))
             continue;
 
-        auto fullPath = e.getFullPath().string();
+        hr = PrjDeleteFile(_instanceHandle, fromUTF8(*it).c_str(), updateFlags, &failureReason);
+
+        // Placeholders that were never created are not found, which is fine
+        if(FAILED(hr) && hr != HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) && hr != HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND))
+            spdlog::error("Failed to remove {} (error: 0x{:08x}, reason: {})",
+                          *it, static_cast<unsigned int>(hr), static_cast<unsigned int>(failureReason));
+    }
 
-        // hr = PrjDeleteFile(_instanceHandle, fromUTF8(fullPath).c_str(), updateFlags, &failureReason);
+    walk("", [&](const Entry& e) {
+        if(e.type != EntryType::FILE_ENTRY)
+            return;
+
+        auto fullPath = e.getFullPath().string();
 
         // Only DNG items need to be updated with options changes
         if(boost::ends_with(e.name, "dng")) {
@@ -195,7 +379,7 @@ void Session::updateOptions(const RenderSettings& settings) {
                 fromUTF8(fullPath).c_str(),
                 &placeholderInfo,
                 sizeof(placeholderInfo),
-                PRJ_UPDATE_ALLOW_DIRTY_METADATA | PRJ_UPDATE_ALLOW_DIRTY_DATA | PRJ_UPDATE_ALLOW_READ_ONLY,
+                updateFlags,
                 &failureReason
             );
 
@@ -204,13 +388,143 @@ void Session::updateOptions(const RenderSettings& settings) {
                 spdlog::error("Failed to refresh cache entry {} (error: 0x{:08x}, reason: {})",
                               fullPath, static_cast<unsigned int>(hr), static_cast<unsigned int>(failureReason));
         }
+    });
+
+    if(mPreHydrate)
+        startHydration();
+}
+
+void Session::setPreHydrate(bool enabled) {
+    if(enabled == mPreHydrate)
+        return;
+
+    mPreHydrate = enabled;
+
+    if(enabled)
+        startHydration();
+    else
+        stopHydration();
+}
+
+HydrationProgress Session::getHydrationProgress() const {
+    std::lock_guard<std::mutex> lock(mHydrationLock);
+
+    return HydrationProgress{ mHydratedFiles, mHydrationQueue.size(), mHydratedBytes, mActiveHydrationThreads > 0 };
+}
+
+void Session::startHydration() {
+    std::vector<std::string> paths;
+
+    walk("", [&](const Entry& e) {
+        if(e.type == EntryType::FILE_ENTRY)
+            paths.push_back(e.getFullPath().string());
+    });
+
+    // Enough files in flight to keep the scheduler busy, it decides how many render at once
+    const int numThreads = std::clamp(static_cast<int>(std::thread::hardware_concurrency()) / 2, 1, MAX_HYDRATION_THREADS);
+
+    spdlog::info("Hydrating {} files of {} with {} threads", paths.size(), toUTF8(_rootPath), numThreads);
+
+    {
+        std::lock_guard<std::mutex> lock(mHydrationLock);
+
+        mHydrationQueue = std::move(paths);
+        mNextHydration = 0;
+        mStopHydration = false;
+        mHydratedFiles = 0;
+    }
+
+    mActiveHydrationThreads = numThreads;
+
+    for(int i = 0; i < numThreads; ++i)
+        mHydrationThreads.emplace_back([this] { hydrate(); });
+}
+
+void Session::stopHydration() {
+    {
+        std::lock_guard<std::mutex> lock(mHydrationLock);
+        mStopHydration = true;
     }
+
+    mHydrationCondition.notify_all();
+
+    // Reads in flight finish first
+    for(auto& thread : mHydrationThreads)
+        thread.join();
+
+    mHydrationThreads.clear();
+}
+
+void Session::hydrate() {
+    for(;;) {
+        std::string path;
+
+        {
+            std::unique_lock<std::mutex> lock(mHydrationLock);
+
+            // Applications reading from the mount go first, wait until they have been quiet for a while
+            for(;;) {
+                if(mStopHydration || mNextHydration >= mHydrationQueue.size()) {
+                    if(--mActiveHydrationThreads == 0 && !mStopHydration)
+                        spdlog::info("Hydrated {} of {} files of {}", mHydratedFiles.load(), mHydrationQueue.size(), toUTF8(_rootPath));
+
+                    return;
+                }
+
+                const auto quietMs = getSteadyTimeMs() - mLastForegroundRead;
+                if(quietMs >= HYDRATION_BACKOFF_MS)
+                    break;
+
+                mHydrationCondition.wait_for(lock, std::chrono::milliseconds(HYDRATION_BACKOFF_MS - quietMs));
+            }
+
+            path = mHydrationQueue[mNextHydration++];
+        }
+
+        if(hydrateFile(path))
+            ++mHydratedFiles;
+    }
+}
+
+bool Session::hydrateFile(const std::string& path) {
+    const auto fullPath = _rootPath + L"\\" + fromUTF8(path);
+
+    // Files an application has read already are on disk
+    PRJ_FILE_STATE state;
+
+    if(SUCCEEDED(PrjGetOnDiskFileState(fullPath.c_str(), &state)) &&
+       (state & (PRJ_FILE_STATE_HYDRATED_PLACEHOLDER | PRJ_FILE_STATE_FULL)))
+        return true;
+
+    HANDLE file = CreateFileW(
+        fullPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    if(file == INVALID_HANDLE_VALUE) {
+        spdlog::error("Failed to open {} for hydration (error: {})", path, GetLastError());
+        return false;
+    }
+
+    // ProjFS asks for the whole file on the first read, so reading a byte writes all of it to disk
+    char byte;
+    DWORD readBytes = 0;
+
+    const bool success = ReadFile(file, &byte, 1, &readBytes, nullptr);
+    if(!success)
+        spdlog::error("Failed to hydrate {} (error: {})", path, GetLastError());
+
+    CloseHandle(file);
+
+    return success;
 }
 
 FileInfo Session::getFileInfo() const {
     return mFs->getFileInfo();
 }
 
+MetricsSnapshot Session::getMetrics() const {
+    return mFs->getMetrics();
+}
+
 HRESULT Session::StartDirEnum(_In_ const PRJ_CALLBACK_DATA* CallbackData, _In_ const GUID* EnumerationId) {
     spdlog::debug("StartDirEnum(): Path [{}] triggered by [{}]",
         toUTF8(CallbackData->FilePathName),
@@ -270,37 +584,33 @@ HRESULT Session::GetDirEnum(
         dirInfo->Reset();
     }
 
-    if (!dirInfo->EntriesFilled())
+    if (!dirInfo->HasSearchExpression())
     {
-        // Fill the directory info structure
-        auto files = mFs->listFiles(toUTF8(SearchExpression));
-
-        for(auto& x : files) {
-            if(x.type == EntryType::DIRECTORY_ENTRY)
-                dirInfo->FillDirEntry(fromUTF8(x.name).c_str());
-            else if(x.type == EntryType::FILE_ENTRY)
-                dirInfo->FillFileEntry(fromUTF8(x.name).c_str(), x.size);
-        }
-
-        // This will ensure the entries in the DirInfo are sorted the way the file system expects.
-        dirInfo->SortEntriesAndMarkFilled();
+        dirInfo->SetSearchExpression(SearchExpression);
     }
 
-    // Return our directory entries to ProjFS.
-    while (dirInfo->CurrentIsValid())
-    {
-        // ProjFS allocates a fixed size buffer then invokes this callback.  The callback needs to
-        // call PrjFillDirEntryBuffer to fill as many entries as possible until the buffer is full.
-        auto basicInfo = dirInfo->CurrentBasicInfo();
+    // Return our directory entries to ProjFS. The file system lists them already sorted the way
+    // ProjFS expects, so we stream them from where the previous callback stopped.
+    auto nextOffset = mFs->listFiles(toUTF8(CallbackData->FilePathName), "", dirInfo->NextOffset(), [&](const Entry& entry, size_t) {
+        if(entry.type != EntryType::FILE_ENTRY && entry.type != EntryType::DIRECTORY_ENTRY)
+            return true;
 
-        if (PrjFillDirEntryBuffer(dirInfo->CurrentFileName(), &basicInfo, DirEntryBufferHandle) != S_OK)
-            break;
+        auto fileName = dirInfo->ConvertFileName(entry.name);
 
-        // Only move the current entry cursor after the entry was successfully filled, so that we
-        // can start from the correct index in the next GetDirEnum callback for this enumeration
-        // session.
-        dirInfo->MoveNext();
-    }
+        if(!dirInfo->Matches(fileName))
+            return true;
+
+        PRJ_FILE_BASIC_INFO basicInfo = { 0 };
+
+        basicInfo.IsDirectory = entry.type == EntryType::DIRECTORY_ENTRY;
+        basicInfo.FileSize = basicInfo.IsDirectory ? 0 : static_cast<INT64>(entry.size);
+
+        // ProjFS allocates a fixed size buffer then invokes this callback.  We fill as many entries
+        // as possible until the buffer is full, the rest are returned in the next callback.
+        return PrjFillDirEntryBuffer(fileName, &basicInfo, DirEntryBufferHandle) == S_OK;
+    });
+
+    dirInfo->SetNextOffset(nextOffset);
 
     return hr;
 }
@@ -315,19 +625,24 @@ HRESULT Session::GetPlaceholderInfo(_In_ const PRJ_CALLBACK_DATA* CallbackData)
     bool isKey;
     INT64 valSize = 0;
 
-    auto optionalEntry = mFs->findEntry(filename);
-    if(!optionalEntry.has_value()) {
+    std::optional<TraceWriter::Event> traced;
+    if(mTrace)
+        traced = mTrace->begin(TraceOp::GetAttr, filename);
+
+    auto entry = mFs->findEntry(filename);
+    if(!entry) {
         spdlog::error("GetPlaceholderInfo(file: {}): return 0x{:08x}",
             filename, static_cast<unsigned int>(ERROR_FILE_NOT_FOUND));
 
+        if(traced)
+            mTrace->end(*traced, -1);
+
         return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
     }
 
-    auto entry = optionalEntry.value();
-
     PRJ_PLACEHOLDER_INFO placeholderInfo = {};
 
-    updatePlaceHolder(placeholderInfo, entry, mOptions, mDraftScale);
+    updatePlaceHolder(placeholderInfo, *entry, mOptions, mDraftScale);
 
     // Create the on-disk placeholder.
     HRESULT hr = WritePlaceholderInfo(
@@ -336,6 +651,9 @@ HRESULT Session::GetPlaceholderInfo(_In_ const PRJ_CALLBACK_DATA* CallbackData)
     if(FAILED(hr))
         spdlog::error("GetPlaceholderInfo(): return 0x{:08x}", static_cast<unsigned int>(hr));
 
+    if(traced)
+        mTrace->end(*traced, FAILED(hr) ? -1 : 0);
+
     return hr;
 }
 
@@ -370,10 +688,15 @@ HRESULT Session::GetFileData(_In_ const PRJ_CALLBACK_DATA* callbackData, _In_ UI
     auto dataStramId = callbackData->DataStreamId;
     auto fileName = toUTF8(callbackData->FilePathName);
 
-    // Allocate a buffer that adheres to the machine's memory alignment.  We have to do this in case
+    // Reads that don't come from our own hydration hold it up for a while
+    const bool hydrating = callbackData->TriggeringProcessId == GetCurrentProcessId();
+    if(!hydrating)
+        mLastForegroundRead = getSteadyTimeMs();
+
+    // Get a buffer that adheres to the machine's memory alignment.  We have to do this in case
     // the caller who caused this callback to be invoked is performing non-cached I/O.  For more
     // details, see the topic "Providing File Data" in the ProjFS documentation.
-    void* writeBuffer = PrjAllocateAlignedBuffer(_instanceHandle, length);
+    void* writeBuffer = mWriteBuffers.get(_instanceHandle, length);
     if (writeBuffer == nullptr)
     {
         spdlog::error("GetFileData(): Could not allocate write buffer");
@@ -381,9 +704,37 @@ HRESULT Session::GetFileData(_In_ const PRJ_CALLBACK_DATA* callbackData, _In_ UI
         return E_OUTOFMEMORY;
     }
 
-    auto completeTransaction = [this, writeBuffer, byteOffset, length, fileName, commandId, dataStramId](size_t readBytes, int error, bool isAsync) {
+    // Lets ProjFS cancel the read if the process that issued it goes away
+    auto cancel = std::make_shared<CancellationToken>();
+
+    {
+        std::lock_guard<std::mutex> guard(mPendingReadsLock);
+        mPendingReads[commandId] = cancel;
+    }
+
+    std::optional<TraceWriter::Event> traced;
+    if(mTrace)
+        traced = mTrace->begin(TraceOp::Read, fileName, byteOffset, length);
+
+    auto completeTransaction = [this, writeBuffer, byteOffset, length, fileName, commandId, dataStramId, cancel, traced, hydrating](size_t readBytes, int error, bool isAsync) {
         HRESULT hr = S_OK;
 
+        {
+            std::lock_guard<std::mutex> guard(mPendingReadsLock);
+            mPendingReads.erase(commandId);
+        }
+
+        // ProjFS has already completed a cancelled command
+        if(cancel->isCancelled()) {
+            spdlog::debug("GetFileData(): Read of [{}] was cancelled", fileName);
+
+            if(traced)
+                mTrace->end(*traced, -1);
+
+            mWriteBuffers.release(writeBuffer, length);
+            return;
+        }
+
         if(readBytes == length) {
             hr = WriteFileData(&dataStramId, reinterpret_cast<PVOID>(writeBuffer), byteOffset, length);
         }
@@ -398,13 +749,19 @@ HRESULT Session::GetFileData(_In_ const PRJ_CALLBACK_DATA* callbackData, _In_ UI
             // issued the file read, and the target file will remain an empty placeholder.
             spdlog::error("GetFileData(): failed to write file for [%s]: 0x{:08x}", fileName, static_cast<unsigned int>(hr));
         }
+        else if(hydrating) {
+            mHydratedBytes += length;
+        }
 
-        // Free the memory-aligned buffer we allocated.
-        PrjFreeAlignedBuffer(writeBuffer);
+        // Return the memory-aligned buffer for the next read.
+        mWriteBuffers.release(writeBuffer, length);
 
         if(FAILED(hr))
             spdlog::error("GetFileData(): Return 0x{:08x}", static_cast<unsigned int>(hr));
 
+        if(traced)
+            mTrace->end(*traced, FAILED(hr) ? -1 : static_cast<int32_t>(readBytes));
+
         if(isAsync)
             PrjCompleteCommand(_instanceHandle, commandId, hr, nullptr);
     };
@@ -418,7 +775,8 @@ HRESULT Session::GetFileData(_In_ const PRJ_CALLBACK_DATA* callbackData, _In_ UI
         length,
         writeBuffer,
         asyncCompleteTransaction,
-        true);
+        true,
+        cancel);
 
     if(result > 0) {
         completeTransaction(result, 0, false);
@@ -428,6 +786,24 @@ HRESULT Session::GetFileData(_In_ const PRJ_CALLBACK_DATA* callbackData, _In_ UI
         return HRESULT_FROM_WIN32(ERROR_IO_PENDING);
 }
 
+void Session::CancelCommand(_In_ const PRJ_CALLBACK_DATA* callbackData) {
+    std::shared_ptr<CancellationToken> cancel;
+
+    {
+        std::lock_guard<std::mutex> guard(mPendingReadsLock);
+
+        auto it = mPendingReads.find(callbackData->CommandId);
+        if(it == mPendingReads.end())
+            return;
+
+        cancel = it->second;
+    }
+
+    spdlog::debug("CancelCommand(): Cancelling command {}", callbackData->CommandId);
+
+    cancel->cancel();
+}
+
 HRESULT Session::Notify(
     _In_ const PRJ_CALLBACK_DATA* CallbackData,
     _In_ BOOLEAN IsDirectory,
@@ -540,13 +916,26 @@ void setupLogging() {
 
 FuseFileSystemImpl_Win::FuseFileSystemImpl_Win() :
     mNextMountId(0),
-    mIoThreadPool(std::make_unique<BS::thread_pool>(IO_THREADS)),
-    mProcessingThreadPool(std::make_unique<BS::thread_pool>()),
-    mCache(std::make_unique<LRUCache>(CACHE_SIZE))
+    mIoThreadPool(std::make_unique<BS::thread_pool>(getDefaultIoThreads(StorageType::SolidState))),
+    mProcessingThreadPool(std::make_unique<BS::thread_pool>(getDefaultProcessingThreads())),
+    mFrameScheduler(std::make_unique<Scheduler>(*mIoThreadPool, RENDER_MEMORY)),
+    mBufferPool(std::make_unique<BufferPool<char>>(BUFFER_POOL_SIZE)),
+    mFrameBufferPool(std::make_unique<BufferPool<uint8_t>>(FRAME_BUFFER_POOL_SIZE)),
+    mCache(std::make_unique<LRUCache>(CACHE_SIZE)),
+    mHeaderCache(std::make_unique<LRUCache>(HEADER_CACHE_SIZE)),
+    mRawFrameCache(std::make_unique<RawFrameCache>(RAW_FRAME_CACHE_SIZE))
 {
     setupLogging();
 }
 
+FuseFileSystemImpl_Win::~FuseFileSystemImpl_Win() {
+    // Sessions use the pools, the scheduler and the cache, so they go first
+    mMountedFiles.clear();
+
+    mIoThreadPool->wait();
+    mProcessingThreadPool->wait();
+}
+
 MountId FuseFileSystemImpl_Win::mount(const RenderSettings& settings, const std::string& srcFile, const std::string& dstPath) {
     fs::path srcPath(srcFile);
     std::string extension = srcPath.extension().string();
@@ -554,30 +943,55 @@ MountId FuseFileSystemImpl_Win::mount(const RenderSettings& settings, const std:
     spdlog::debug("Mounting file {} to {}", srcFile, dstPath);
 
     if(boost::iequals(extension, ".mcraw")) {
-        auto mountId = mNextMountId++;
-
         try {
             // Extract base name from destination path
             fs::path dstPathObj(dstPath);
             std::string baseName = dstPathObj.filename().string();
-            auto fs = std::make_unique<VirtualFileSystemImpl_MCRAW>(*mIoThreadPool, *mProcessingThreadPool, *mCache, settings, srcFile, baseName);
-            mMountedFiles[mountId] = std::make_unique<Session>(dstPath, std::move(fs));
+            // Keep the clip index next to the virtualization root
+            auto indexPath = dstPathObj.parent_path() / ("." + baseName + ".index");
+            auto fs = std::make_unique<VirtualFileSystemImpl_MCRAW>(
+                *mIoThreadPool, *mProcessingThreadPool, *mCache, *mHeaderCache, *mRawFrameCache, *mBufferPool, *mFrameBufferPool, *mFrameScheduler, settings, srcFile, baseName, indexPath.string());
+            auto session = std::make_unique<Session>(
+                dstPath, std::move(fs), createTrace(baseName, settings.options, settings.draftScale));
+
+            // Scanning the clip is the slow part, only registering it needs the lock
+            std::lock_guard<std::mutex> lock(mMountMutex);
+
+            auto mountId = mNextMountId++;
+            mMountedFiles[mountId] = std::move(session);
+
+            return mountId;
         }
         catch(std::runtime_error& e) {
             spdlog::error("Failed to mount {} to {} (error: {})", srcFile, dstPath, e.what());
             throw std::runtime_error(e.what());
         }
-        return mountId;
     }
     spdlog::error("Failed to mount {} to {}, invalid file format", srcFile, dstPath);
     throw std::runtime_error("Invalid format");
 }
 
 void FuseFileSystemImpl_Win::unmount(MountId mountId) {
-    mMountedFiles.erase(mountId);
+    std::unique_ptr<VirtualizationInstance> session;
+
+    {
+        std::lock_guard<std::mutex> lock(mMountMutex);
+
+        auto it = mMountedFiles.find(mountId);
+        if(it == mMountedFiles.end())
+            return;
+
+        session = std::move(it->second);
+        mMountedFiles.erase(it);
+    }
+
+    // Stopping the session waits for its reads, don't hold up other mounts meanwhile
+    session.reset();
 }
 
 void FuseFileSystemImpl_Win::updateOptions(MountId mountId, const RenderSettings& settings) {
+    std::lock_guard<std::mutex> lock(mMountMutex);
+
     auto it = mMountedFiles.find(mountId);
     if(it == mMountedFiles.end())
         return;
@@ -585,6 +999,8 @@ void FuseFileSystemImpl_Win::updateOptions(MountId mountId, const RenderSettings
 }
 
 std::optional<FileInfo> FuseFileSystemImpl_Win::getFileInfo(MountId mountId) {
+    std::lock_guard<std::mutex> lock(mMountMutex);
+
     auto it = mMountedFiles.find(mountId);
     if(it != mMountedFiles.end()) {
         return dynamic_cast<Session*>(it->second.get())->getFileInfo();
@@ -592,4 +1008,102 @@ std::optional<FileInfo> FuseFileSystemImpl_Win::getFileInfo(MountId mountId) {
     return std::nullopt;
 }
 
+std::optional<MetricsSnapshot> FuseFileSystemImpl_Win::getMetrics(MountId mountId) {
+    std::optional<MetricsSnapshot> snapshot;
+
+    {
+        std::lock_guard<std::mutex> lock(mMountMutex);
+
+        auto it = mMountedFiles.find(mountId);
+        if(it == mMountedFiles.end())
+            return std::nullopt;
+
+        snapshot = dynamic_cast<Session*>(it->second.get())->getMetrics();
+    }
+
+    snapshot->cacheEvictions = mCache->evictions();
+    snapshot->cacheEvictedBytes = mCache->evictedBytes();
+    snapshot->cacheSize = mCache->size();
+    snapshot->cacheCapacity = mCache->capacity();
+    snapshot->rawFrameCacheSize = mRawFrameCache->size();
+    snapshot->rawFrameCacheCapacity = mRawFrameCache->capacity();
+    snapshot->ioTasksQueued = mIoThreadPool->get_tasks_queued();
+    snapshot->ioTasksRunning = mIoThreadPool->get_tasks_running();
+    snapshot->processingTasksQueued = mProcessingThreadPool->get_tasks_queued();
+    snapshot->processingTasksRunning = mProcessingThreadPool->get_tasks_running();
+
+    return snapshot;
+}
+
+bool FuseFileSystemImpl_Win::setPreHydrate(MountId mountId, bool enabled) {
+    std::lock_guard<std::mutex> lock(mMountMutex);
+
+    auto it = mMountedFiles.find(mountId);
+    if(it == mMountedFiles.end())
+        return false;
+
+    dynamic_cast<Session*>(it->second.get())->setPreHydrate(enabled);
+
+    return true;
+}
+
+std::optional<HydrationProgress> FuseFileSystemImpl_Win::getHydrationProgress(MountId mountId) {
+    std::lock_guard<std::mutex> lock(mMountMutex);
+
+    auto it = mMountedFiles.find(mountId);
+    if(it == mMountedFiles.end())
+        return std::nullopt;
+
+    return dynamic_cast<Session*>(it->second.get())->getHydrationProgress();
+}
+
+void FuseFileSystemImpl_Win::setDiskCache(const std::string& path, size_t maxSize) {
+    if(path.empty() || maxSize == 0) {
+        mCache->setDiskCache(nullptr);
+        return;
+    }
+
+    auto diskCache = mCache->getDiskCache();
+    if(diskCache && diskCache->path() == path && diskCache->capacity() == maxSize)
+        return;
+
+    spdlog::info("Using disk cache {} ({} bytes)", path, maxSize);
+
+    mCache->setDiskCache(std::make_shared<DiskCache>(path, maxSize, *mIoThreadPool, mBufferPool.get()));
+}
+
+void FuseFileSystemImpl_Win::setCacheSize(size_t maxSize) {
+    if(maxSize == 0)
+        maxSize = CACHE_SIZE;
+
+    spdlog::info("Setting cache size to {} bytes", maxSize);
+
+    mCache->setCapacity(maxSize);
+}
+
+void FuseFileSystemImpl_Win::setRawFrameCacheSize(size_t maxSize) {
+    if(maxSize == 0)
+        maxSize = RAW_FRAME_CACHE_SIZE;
+
+    spdlog::info("Setting decoded frame cache size to {} bytes", maxSize);
+
+    mRawFrameCache->setCapacity(maxSize);
+}
+
+void FuseFileSystemImpl_Win::setThreadPoolSizes(int ioThreads, int processingThreads, StorageType storageType) {
+    const auto numIoThreads = ioThreads > 0 ? ioThreads : getDefaultIoThreads(storageType);
+    const auto numProcessingThreads = processingThreads > 0 ? processingThreads : getDefaultProcessingThreads();
+
+    // Resetting a pool waits for the tasks that are running, so leave it alone if the size is the same
+    if(mIoThreadPool->get_thread_count() != static_cast<BS::concurrency_t>(numIoThreads)) {
+        spdlog::info("Using {} IO threads", numIoThreads);
+        mIoThreadPool->reset(numIoThreads);
+    }
+
+    if(mProcessingThreadPool->get_thread_count() != static_cast<BS::concurrency_t>(numProcessingThreads)) {
+        spdlog::info("Using {} processing threads", numProcessingThreads);
+        mProcessingThreadPool->reset(numProcessingThreads);
+    }
+}
+
 }
\ No newline at end of file
@@ -1,93 +1,64 @@
 #include "win/dirInfo.h"
 
-#include <algorithm>
-
 using namespace motioncam;
 
-// A comparison routine for std::sort that wraps PrjFileNameCompare() so that we can sort our DirInfo
-// the same way the file system would.
-bool FileNameLessThan(DirEntry entry1, DirEntry entry2)
-{
-    return PrjFileNameCompare(entry1.FileName.c_str(), entry2.FileName.c_str()) < 0;
-}
-
 DirInfo::DirInfo(PCWSTR FilePathName) :
     _filePathName(FilePathName),
-    _currIndex(0),
-    _entriesFilled(false)
+    _hasSearchExpression(false),
+    _nextOffset(0)
 {}
 
 void DirInfo::Reset()
 {
-    _currIndex = 0;
-    _entriesFilled = false;
-    _entries.clear();
-}
-
-bool DirInfo::EntriesFilled()
-{
-    return _entriesFilled;
-}
-
-bool DirInfo::CurrentIsValid()
-{
-    return _currIndex < _entries.size();
+    _nextOffset = 0;
+    _hasSearchExpression = false;
+    _searchExpression.clear();
 }
 
-PRJ_FILE_BASIC_INFO DirInfo::CurrentBasicInfo()
+void DirInfo::SetSearchExpression(PCWSTR SearchExpression)
 {
-    PRJ_FILE_BASIC_INFO basicInfo = { 0 };
-    basicInfo.IsDirectory = _entries[_currIndex].IsDirectory;
-    basicInfo.FileSize = _entries[_currIndex].FileSize;
-
-    return basicInfo;
+    _searchExpression = SearchExpression == nullptr ? L"" : SearchExpression;
+    _hasSearchExpression = true;
 }
 
-PCWSTR DirInfo::CurrentFileName()
+bool DirInfo::HasSearchExpression()
 {
-    return _entries[_currIndex].FileName.c_str();
+    return _hasSearchExpression;
 }
 
-bool DirInfo::MoveNext()
+bool DirInfo::Matches(PCWSTR FileName)
 {
-    _currIndex++;
-
-    if (_currIndex >= _entries.size())
+    if (_searchExpression.empty() || _searchExpression == L"*")
     {
-        return false;
+        return true;
     }
-    return true;
+
+    return PrjFileNameMatch(FileName, _searchExpression.c_str());
 }
 
-void DirInfo::FillDirEntry(LPCWSTR DirName)
+size_t DirInfo::NextOffset()
 {
-    FillItemEntry(DirName, 0, true);
+    return _nextOffset;
 }
 
-void DirInfo::FillFileEntry(LPCWSTR FileName, INT64 FileSize)
+void DirInfo::SetNextOffset(size_t Offset)
 {
-    FillItemEntry(FileName, FileSize, false);
+    _nextOffset = Offset;
 }
 
-void DirInfo::FillItemEntry(LPCWSTR FileName, INT64 FileSize, bool IsDirectory)
+PCWSTR DirInfo::ConvertFileName(const std::string& FileName)
 {
-    DirEntry entry;
-    auto nameLen = wcslen(FileName);
-    if (nameLen > MAX_PATH)
+    const auto srcLen = static_cast<int>(FileName.size());
+    const auto dstLen = MultiByteToWideChar(CP_UTF8, 0, FileName.data(), srcLen, nullptr, 0);
+
+    // Only grows, so after the first few entries this no longer allocates
+    if (_nameBuffer.size() < static_cast<size_t>(dstLen) + 1)
     {
-        return;
+        _nameBuffer.resize(static_cast<size_t>(dstLen) + 1);
     }
 
-    entry.FileName = FileName;
-    entry.IsDirectory = IsDirectory;
-    entry.FileSize = FileSize;
-
-    _entries.push_back(entry);
-}
-
-void DirInfo::SortEntriesAndMarkFilled()
-{
-    _entriesFilled = true;
+    MultiByteToWideChar(CP_UTF8, 0, FileName.data(), srcLen, _nameBuffer.data(), dstLen);
+    _nameBuffer[dstLen] = L'\0';
 
-    std::sort(_entries.begin(), _entries.end(), FileNameLessThan);
+    return _nameBuffer.data();
 }